@@ -25,6 +25,7 @@
 #include "connectome/connectome.h"
 
 #include "dwi/tractography/file.h"
+#include "dwi/tractography/indexed_file.h"
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/weights.h"
 #include "dwi/tractography/connectome/extract.h"
@@ -107,11 +108,52 @@ void usage ()
 
 
 
+// If the tracks can be accessed at random, only those streamlines to be
+//   written to at least one output file are read; the remainder are passed
+//   to the writer as empty streamlines, as they would be by the selectors
+template <class StreamlineType, class NodesType>
+void extract (ReaderInterface<float>& reader, const IndexedReader<float>* indexed_reader,
+              const std::vector<NodesType>& assignments, WriterExtraction& writer, ProgressBar& progress)
+{
+  StreamlineType tck;
+  if (indexed_reader) {
+    const size_t count = std::min (indexed_reader->size(), assignments.size());
+    for (size_t index = 0; index != count; ++index) {
+      tck.set_nodes (assignments[index]);
+      if (writer.select (tck.get_nodes()))
+        indexed_reader->load (index, tck);
+      else
+        tck.clear();
+      writer (tck);
+      ++progress;
+    }
+  } else {
+    while (reader (tck)) {
+      tck.set_nodes (assignments[tck.index]);
+      writer (tck);
+      ++progress;
+    }
+  }
+}
+
+
+
+
 void run ()
 {
 
+  // Uncompressed track files are memory-mapped, so that the streamlines
+  //   can be accessed at random
   Tractography::Properties properties;
-  Tractography::Reader<float> reader (argument[0], properties);
+  std::unique_ptr<ReaderInterface<float>> reader_ptr;
+  IndexedReader<float>* indexed_reader = nullptr;
+  if (is_compressed_tracks (argument[0])) {
+    reader_ptr.reset (new Tractography::Reader<float> (argument[0], properties));
+  } else {
+    indexed_reader = new IndexedReader<float> (argument[0], properties);
+    reader_ptr.reset (indexed_reader);
+  }
+  ReaderInterface<float>& reader (*reader_ptr);
 
   std::vector< std::vector<node_t> > assignments_lists;
   assignments_lists.reserve (to<size_t>(properties["count"]));
@@ -319,21 +361,10 @@ void run ()
     }
 
     ProgressBar progress ("Extracting tracks from connectome", count);
-    if (assignments_pairs.size()) {
-      Tractography::Connectome::Streamline_nodepair tck;
-      while (reader (tck)) {
-        tck.set_nodes (assignments_pairs[tck.index]);
-        writer (tck);
-        ++progress;
-      }
-    } else {
-      Tractography::Connectome::Streamline_nodelist tck;
-      while (reader (tck)) {
-        tck.set_nodes (assignments_lists[tck.index]);
-        writer (tck);
-        ++progress;
-      }
-    }
+    if (assignments_pairs.size())
+      extract<Tractography::Connectome::Streamline_nodepair> (reader, indexed_reader, assignments_pairs, writer, progress);
+    else
+      extract<Tractography::Connectome::Streamline_nodelist> (reader, indexed_reader, assignments_lists, writer, progress);
 
   }
 
@@ -100,40 +100,45 @@ void usage ()
 
 
 
+// process one slice at a time, each row of voxels as a batch, so that each
+// voxel is initialised from the final state of its neighbour in the previous row:
 class CSD_Processor
 {
   public:
-    CSD_Processor (const DWI::SDeconv::CSD::Shared& shared, Image<bool>& mask) :
-      sdeconv (shared),
+    CSD_Processor (const DWI::SDeconv::CSD::Shared& shared, Image<float>& dwi, Image<float>& fod, Image<bool>& mask) :
+      batch (shared, dwi.size(0)),
       data (shared.dwis.size()),
+      dwi (dwi),
+      fod (fod),
       mask (mask) { }
 
 
-    void operator () (Image<float>& dwi, Image<float>& fod) {
-      if (!load_data (dwi)) {
-        for (auto l = Loop (3) (fod); l; ++l)
-          fod.value() = 0.0;
-        return;
+    void operator () (const Iterator& pos) {
+      assign_pos_of (pos, 0, 3).to (dwi, fod);
+      for (dwi.index(1) = 0; dwi.index(1) < dwi.size(1); ++dwi.index(1)) {
+        for (dwi.index(0) = 0; dwi.index(0) < dwi.size(0); ++dwi.index(0)) {
+          if (load_data (dwi))
+            batch.set (dwi.index(0), data);
+          else
+            batch.clear (dwi.index(0));
+        }
+
+        if (batch.run()) {
+          for (size_t n = 0; n < batch.size(); ++n)
+            if (!batch.has_converged (n))
+              INFO ("voxel [ " + str (n) + " " + str (dwi.index(1)) + " " + str (dwi.index(2)) +
+                  " ] did not reach full convergence");
+        }
+
+        write_back();
       }
-
-      sdeconv.set (data);
-
-      size_t n;
-      for (n = 0; n < sdeconv.shared.niter; n++)
-        if (sdeconv.iterate())
-          break;
-
-      if (sdeconv.shared.niter && n >= sdeconv.shared.niter)
-        INFO ("voxel [ " + str (dwi.index(0)) + " " + str (dwi.index(1)) + " " + str (dwi.index(2)) +
-            " ] did not reach full convergence");
-
-      write_back (fod);
     }
 
 
   private:
-    DWI::SDeconv::CSD sdeconv;
+    DWI::SDeconv::CSD::Batch batch;
     Eigen::VectorXd data;
+    Image<float> dwi, fod;
     Image<bool> mask;
 
 
@@ -144,8 +149,8 @@ class CSD_Processor
           return false;
       }
 
-      for (size_t n = 0; n < sdeconv.shared.dwis.size(); n++) {
-        dwi.index(3) = sdeconv.shared.dwis[n];
+      for (size_t n = 0; n < batch.shared.dwis.size(); n++) {
+        dwi.index(3) = batch.shared.dwis[n];
         data[n] = dwi.value();
         if (!std::isfinite (data[n]))
           return false;
@@ -157,9 +162,19 @@ class CSD_Processor
     }
 
 
-    void write_back (Image<float>& fod) {
-      for (auto l = Loop (3) (fod); l; ++l)
-        fod.value() = sdeconv.FOD() [fod.index(3)];
+    void write_back () {
+      fod.index(1) = dwi.index(1);
+      for (fod.index(0) = 0; fod.index(0) < fod.size(0); ++fod.index(0)) {
+        if (batch.is_set (fod.index(0))) {
+          const auto& F = batch.FOD (fod.index(0));
+          for (auto l = Loop (3) (fod); l; ++l)
+            fod.value() = F[fod.index(3)];
+        }
+        else {
+          for (auto l = Loop (3) (fod); l; ++l)
+            fod.value() = 0.0;
+        }
+      }
     }
 
 };
@@ -167,49 +182,127 @@ class CSD_Processor
 
 
 
+// the number of ICLS iterations per voxel, gathered over all threads:
+class IterationSummary
+{
+  public:
+    IterationSummary (size_t max_niter) : max_niter (max_niter), counts (max_niter+2, 0) { }
+
+    void add (const std::vector<size_t>& thread_counts) {
+      std::lock_guard<std::mutex> lock (mutex);
+      for (size_t n = 0; n < counts.size(); ++n)
+        counts[n] += thread_counts[n];
+    }
+
+    void report () const {
+      size_t num_voxels = 0, total = 0, max = 0;
+      for (size_t n = 0; n < counts.size(); ++n) {
+        num_voxels += counts[n];
+        total += n * counts[n];
+        if (counts[n])
+          max = n;
+      }
+      if (!num_voxels)
+        return;
+      const size_t not_converged = counts[max_niter] + counts[max_niter+1];
+      CONSOLE ("ICLS iterations per voxel: mean " + str (default_type (total) / num_voxels, 3) + ", maximum " + str (max)
+          + (not_converged ? ("; " + str (not_converged) + " of " + str (num_voxels) + " voxels did not reach full convergence") : std::string()));
+      std::string histogram;
+      for (size_t n = 0; n <= max; ++n)
+        if (counts[n])
+          histogram += " " + str (n) + ":" + str (counts[n]);
+      INFO ("ICLS iteration counts (iterations:voxels):" + histogram);
+    }
+
+    const size_t max_niter;
+
+  private:
+    std::vector<size_t> counts;
+    std::mutex mutex;
+};
+
+
+
+// process one slice at a time, each row of voxels as a batch, so that each
+// voxel is initialised from the final active set of its neighbour in the previous row:
 class MSMT_Processor
 {
   public:
-    MSMT_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared, Image<bool>& mask_image, std::vector< Image<float> > odf_images) :
-        sdeconv (shared),
+    MSMT_Processor (const DWI::SDeconv::MSMT_CSD::Shared& shared, Image<float>& dwi_image, Image<bool>& mask_image, std::vector< Image<float> > odf_images, IterationSummary& summary) :
+        batch (shared, dwi_image.size(0)),
+        dwi_image (dwi_image),
         mask_image (mask_image),
         odf_images (odf_images),
         dwi_data (shared.grad.rows()),
-        output_data (shared.problem.H.cols()) { }
+        summary (summary),
+        counts (summary.max_niter+2, 0) { }
+
+    MSMT_Processor (const MSMT_Processor& that) :
+        batch (that.batch),
+        dwi_image (that.dwi_image),
+        mask_image (that.mask_image),
+        odf_images (that.odf_images),
+        dwi_data (that.dwi_data),
+        summary (that.summary),
+        counts (summary.max_niter+2, 0) { }
+
+    ~MSMT_Processor () {
+      summary.add (counts);
+    }
 
 
-    void operator() (Image<float>& dwi_image)
+    void operator() (const Iterator& pos)
     {
-      if (mask_image.valid()) {
-        assign_pos_of (dwi_image, 0, 3).to (mask_image);
-        if (!mask_image.value())
-          return;
-      }
-
-      for (auto l = Loop (3) (dwi_image); l; ++l)
-        dwi_data[dwi_image.index(3)] = dwi_image.value();
-
-      sdeconv (dwi_data, output_data);
-      if (sdeconv.niter >= sdeconv.shared.problem.max_niter) {
-        INFO ("voxel [ " + str (dwi_image.index(0)) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
-            " ] did not reach full convergence");
-      }
-
-      size_t j = 0;
-      for (size_t i = 0; i < odf_images.size(); ++i) {
-        assign_pos_of (dwi_image, 0, 3).to (odf_images[i]);
-        for (auto l = Loop(3)(odf_images[i]); l; ++l)
-          odf_images[i].value() = output_data[j++];
+      assign_pos_of (pos, 0, 3).to (dwi_image);
+      for (dwi_image.index(1) = 0; dwi_image.index(1) < dwi_image.size(1); ++dwi_image.index(1)) {
+        for (dwi_image.index(0) = 0; dwi_image.index(0) < dwi_image.size(0); ++dwi_image.index(0)) {
+          if (mask_image.valid()) {
+            assign_pos_of (dwi_image, 0, 3).to (mask_image);
+            if (!mask_image.value()) {
+              batch.clear (dwi_image.index(0));
+              continue;
+            }
+          }
+
+          for (auto l = Loop (3) (dwi_image); l; ++l)
+            dwi_data[dwi_image.index(3)] = dwi_image.value();
+          batch.set (dwi_image.index(0), dwi_data);
+        }
+
+        batch.run();
+
+        for (size_t n = 0; n < batch.size(); ++n) {
+          if (!batch.is_set (n))
+            continue;
+
+          const size_t niter = batch.num_iterations (n);
+          ++counts[std::min (niter, counts.size()-1)];
+          if (niter >= batch.shared.problem.max_niter) {
+            INFO ("voxel [ " + str (n) + " " + str (dwi_image.index(1)) + " " + str (dwi_image.index(2)) +
+                " ] did not reach full convergence");
+          }
+
+          const auto& output_data = batch.output (n);
+          size_t j = 0;
+          for (size_t i = 0; i < odf_images.size(); ++i) {
+            assign_pos_of (dwi_image, 1, 3).to (odf_images[i]);
+            odf_images[i].index(0) = n;
+            for (auto l = Loop(3)(odf_images[i]); l; ++l)
+              odf_images[i].value() = output_data[j++];
+          }
+        }
       }
     }
 
 
   private:
-    DWI::SDeconv::MSMT_CSD sdeconv;
+    DWI::SDeconv::MSMT_CSD::Batch batch;
+    Image<float> dwi_image;
     Image<bool> mask_image;
     std::vector< Image<float> > odf_images;
     Eigen::VectorXd dwi_data;
-    Eigen::VectorXd output_data;
+    IterationSummary& summary;
+    std::vector<size_t> counts;
 };
 
 
@@ -254,10 +347,10 @@ void run ()
     header_out.size(3) = shared.nSH();
     auto fod = Image<float>::create (argument[3], header_out);
 
-    CSD_Processor processor (shared, mask);
     auto dwi = header_in.get_image<float>().with_direct_io (3);
-    ThreadedLoop ("performing constrained spherical deconvolution", dwi, 0, 3)
-        .run (processor, dwi, fod);
+    CSD_Processor processor (shared, dwi, fod, mask);
+    ThreadedLoop ("performing constrained spherical deconvolution", dwi, std::vector<size_t> (1, 2), { 0, 1 })
+        .run_outer (processor);
 
   } else if (algorithm == 1) {
 
@@ -289,10 +382,14 @@ void run ()
       odfs.push_back (Image<float> (Image<float>::create (odf_paths[i], header_out)));
     }
 
-    MSMT_Processor processor (shared, mask, odfs);
-    auto dwi = header_in.get_image<float>().with_direct_io (3);
-    ThreadedLoop ("performing multi-shell, multi-tissue CSD", dwi, 0, 3)
-        .run (processor, dwi);
+    IterationSummary summary (shared.problem.max_niter);
+    {
+      auto dwi = header_in.get_image<float>().with_direct_io (3);
+      MSMT_Processor processor (shared, dwi, mask, odfs, summary);
+      ThreadedLoop ("performing multi-shell, multi-tissue CSD", dwi, std::vector<size_t> (1, 2), { 0, 1 })
+          .run_outer (processor);
+    }
+    summary.report();
 
   } else {
     assert (0);
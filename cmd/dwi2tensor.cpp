@@ -62,6 +62,7 @@ void usage ()
   + Argument ("integer").type_integer (0, 10)
   + Option ("predicted_signal", "the predicted dwi image.")
   + Argument ("image").type_image_out()
+  + Option ("single", "perform the fit in single precision. This is faster, at the cost of a small loss of accuracy.")
   + DWI::GradImportOptions();
   
   AUTHOR = "Ben Jeurissen (ben.jeurissen@uantwerpen.be)";
@@ -72,108 +73,179 @@ void usage ()
 
 }
 
-template <class MASKType, class B0Type, class DKTType, class PredictType>
+// quantities derived from the b-matrix, shared by all threads:
+template <typename ComputeType>
+class Shared
+{
+  public:
+    typedef Eigen::Matrix<ComputeType,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+    typedef Eigen::Matrix<ComputeType,Eigen::Dynamic,1> vector_type;
+
+    Shared (const Eigen::MatrixXd& bmatrix, int maxit) :
+      maxit (maxit),
+      scale (bmatrix.colwise().norm().cwiseInverse().transpose().cast<ComputeType>())
+    {
+      // normalise the columns of the b-matrix, so that the normal equations
+      // remain well-conditioned (the kurtosis terms scale with b^2):
+      const Eigen::MatrixXd bs = bmatrix * scale.template cast<double>().asDiagonal();
+      b = bs.cast<ComputeType>();
+
+      // the ordinary least-squares fit is the same for all voxels:
+      ols = (bs.transpose() * bs).llt().solve (bs.transpose()).cast<ComputeType>();
+
+      // the products of all pairs of columns of the b-matrix, from which
+      // the weighted normal equations for any number of voxels can be
+      // formed in a single matrix product:
+      const ssize_t P = bs.cols();
+      Eigen::MatrixXd products (bs.rows(), P*(P+1)/2);
+      for (ssize_t j = 0, n = 0; j < P; ++j)
+        for (ssize_t i = j; i < P; ++i, ++n)
+          products.col(n) = bs.col(i).cwiseProduct (bs.col(j));
+      outer = products.cast<ComputeType>();
+    }
+
+    const int maxit;
+    const vector_type scale;
+    matrix_type b, ols, outer;
+};
+
+
+
+// fit a whole row of voxels at a time, so that most of the work is
+// performed as matrix products and vectorised exp() / log() over the batch:
+template <typename ComputeType>
 class Processor
 {
   public:
-    Processor (const Eigen::MatrixXd& b, const int iter, MASKType* mask_image, B0Type* b0_image, DKTType* dkt_image, PredictType* predict_image) :
+    typedef typename Shared<ComputeType>::matrix_type matrix_type;
+
+    Processor (const Shared<ComputeType>& shared, Image<value_type>& dwi_image, Image<value_type>& dt_image,
+        Image<bool>& mask_image, Image<value_type>& b0_image, Image<value_type>& dkt_image, Image<value_type>& predict_image) :
+      shared (shared),
+      dwi_image (dwi_image),
+      dt_image (dt_image),
       mask_image (mask_image),
       b0_image (b0_image),
       dkt_image (dkt_image),
       predict_image (predict_image),
-      dwi(b.rows()),
-      p(b.cols()),
-      w(b.rows()),
-      work(b.cols(),b.cols()),
-      llt(work.rows()),
-      b(b),
-      maxit(iter) { }
-
-    template <class DWIType, class DTType>
-      void operator() (DWIType& dwi_image, DTType& dt_image)
-      {
-        if (mask_image) {
-          assign_pos_of (dwi_image, 0, 3).to (*mask_image);
-          if (!mask_image->value())
-            return;
+      voxels (dwi_image.size(0)),
+      signals (shared.b.rows(), dwi_image.size(0)),
+      weights (shared.b.rows(), dwi_image.size(0)),
+      params (shared.b.cols(), dwi_image.size(0)),
+      rhs (shared.b.cols(), dwi_image.size(0)),
+      normal (shared.outer.cols(), dwi_image.size(0)),
+      work (shared.b.cols(), shared.b.cols()),
+      llt (shared.b.cols()) { }
+
+    void operator() (const Iterator& pos)
+    {
+      assign_pos_of (pos, 1, 3).to (dwi_image);
+
+      // gather the log-signals of all voxels in this row within the mask:
+      size_t num = 0;
+      for (dwi_image.index(0) = 0; dwi_image.index(0) < dwi_image.size(0); ++dwi_image.index(0)) {
+        if (mask_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (mask_image);
+          if (!mask_image.value())
+            continue;
         }
-        
+        auto dwi = signals.col (num);
         for (auto l = Loop (3) (dwi_image); l; ++l)
           dwi[dwi_image.index(3)] = dwi_image.value();
-        
-        double small_intensity = 1.0e-6 * dwi.maxCoeff(); 
-        for (int i = 0; i < dwi.rows(); i++) {
-          if (dwi[i] < small_intensity)
-            dwi[i] = small_intensity;
-          dwi[i] = std::log (dwi[i]);
-        }
-        
-        work.setZero();
-        work.selfadjointView<Eigen::Lower>().rankUpdate (b.transpose());
-        p = llt.compute (work.selfadjointView<Eigen::Lower>()).solve(b.transpose()*dwi);
-        for (int it = 0; it < maxit; it++) {
-          w = (b*p).array().exp();
-          work.setZero();
-          work.selfadjointView<Eigen::Lower>().rankUpdate (b.transpose()*w.asDiagonal());
-          p = llt.compute (work.selfadjointView<Eigen::Lower>()).solve(b.transpose()*w.asDiagonal()*w.asDiagonal()*dwi);
-        }
-        
-        if (b0_image) {
-          assign_pos_of (dwi_image, 0, 3).to (*b0_image);
-          b0_image->value() = exp(p[6]);
+        dwi = dwi.cwiseMax (ComputeType (1.0e-6) * dwi.maxCoeff());
+        voxels[num++] = dwi_image.index(0);
+      }
+      if (!num)
+        return;
+
+      auto S = signals.leftCols (num);
+      auto W = weights.leftCols (num);
+      auto P = params.leftCols (num);
+      S.array() = S.array().log();
+
+      P.noalias() = shared.ols * S;
+      for (int it = 0; it < shared.maxit; it++) {
+        // squared weights, given by the predicted signal:
+        W.noalias() = shared.b * P;
+        W.array() = (ComputeType (2.0) * W.array()).exp();
+        normal.leftCols (num).noalias() = shared.outer.transpose() * W;
+        W.array() *= S.array();
+        rhs.leftCols (num).noalias() = shared.b.transpose() * W;
+        for (size_t n = 0; n < num; ++n) {
+          for (ssize_t j = 0, k = 0; j < work.cols(); ++j)
+            for (ssize_t i = j; i < work.rows(); ++i, ++k)
+              work(i,j) = normal(k,n);
+          P.col(n) = llt.compute (work).solve (rhs.col(n));
         }
-        
-        for (auto l = Loop(3)(dt_image); l; ++l) {
+      }
+
+      if (predict_image.valid()) {
+        W.noalias() = shared.b * P;
+        W.array() = W.array().exp();
+      }
+      P = shared.scale.asDiagonal() * P;
+
+      for (size_t n = 0; n < num; ++n) {
+        dwi_image.index(0) = voxels[n];
+        const auto p = P.col(n);
+
+        assign_pos_of (dwi_image, 0, 3).to (dt_image);
+        for (auto l = Loop(3)(dt_image); l; ++l)
           dt_image.value() = p[dt_image.index(3)];
+
+        if (b0_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (b0_image);
+          b0_image.value() = std::exp (p[6]);
         }
-        
-        if (dkt_image) {
-          assign_pos_of (dwi_image, 0, 3).to (*dkt_image);
+
+        if (dkt_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (dkt_image);
           double adc_sq = (p[0]+p[1]+p[2])*(p[0]+p[1]+p[2])/9.0;
-          for (auto l = Loop(3)(*dkt_image); l; ++l) {
-            dkt_image->value() = p[dkt_image->index(3)+7]/adc_sq;
-          }
+          for (auto l = Loop(3)(dkt_image); l; ++l)
+            dkt_image.value() = p[dkt_image.index(3)+7]/adc_sq;
         }
-        
-        if (predict_image) {
-          assign_pos_of (dwi_image, 0, 3).to (*predict_image);
-          dwi = (b*p).array().exp();
-          for (auto l = Loop(3)(*predict_image); l; ++l) {
-            predict_image->value() = dwi[predict_image->index(3)];
-          }
+
+        if (predict_image.valid()) {
+          assign_pos_of (dwi_image, 0, 3).to (predict_image);
+          for (auto l = Loop(3)(predict_image); l; ++l)
+            predict_image.value() = W(predict_image.index(3), n);
         }
-        
       }
+    }
 
   private:
-    copy_ptr<MASKType> mask_image;
-    copy_ptr<B0Type> b0_image;
-    copy_ptr<DKTType> dkt_image;
-    copy_ptr<PredictType> predict_image;
-    Eigen::VectorXd dwi;
-    Eigen::VectorXd p;
-    Eigen::VectorXd w;
-    Eigen::MatrixXd work;
-    Eigen::LLT<Eigen::MatrixXd> llt;
-    const Eigen::MatrixXd& b;
-    const int maxit;
+    const Shared<ComputeType>& shared;
+    Image<value_type> dwi_image, dt_image;
+    Image<bool> mask_image;
+    Image<value_type> b0_image, dkt_image, predict_image;
+    std::vector<ssize_t> voxels;
+    matrix_type signals, weights, params, rhs, normal, work;
+    Eigen::LLT<matrix_type> llt;
 };
 
-template <class MASKType, class B0Type, class DKTType, class PredictType> 
-inline Processor<MASKType, B0Type, DKTType, PredictType> processor (const Eigen::MatrixXd& b, const int& iter, MASKType* mask_image, B0Type* b0_image, DKTType* dkt_image, PredictType* predict_image) {
-  return { b, iter, mask_image, b0_image, dkt_image, predict_image };
+
+
+template <typename ComputeType>
+void fit (const Eigen::MatrixXd& b, int iter, Image<value_type>& dwi, Image<value_type>& dt,
+    Image<bool>& mask, Image<value_type>& b0, Image<value_type>& dkt, Image<value_type>& predict)
+{
+  Shared<ComputeType> shared (b, iter);
+  Processor<ComputeType> processor (shared, dwi, dt, mask, b0, dkt, predict);
+  ThreadedLoop ("computing tensors", dwi, { 1, 2 }, { 0 }).run_outer (processor);
 }
 
+
+
 void run ()
 {
-  auto dwi = Header::open (argument[0]).get_image<value_type>();
+  auto dwi = Header::open (argument[0]).get_image<value_type>().with_direct_io (3);
   auto grad = DWI::get_valid_DW_scheme (dwi);
   
-  Image<bool>* mask = nullptr;
+  Image<bool> mask;
   auto opt = get_options ("mask");
   if (opt.size()) {
-    mask = new Image<bool> (Image<bool>::open (opt[0][0]));
-    check_dimensions (dwi, *mask, 0, 3);
+    mask = Image<bool>::open (opt[0][0]);
+    check_dimensions (dwi, mask, 0, 3);
   }
   
   auto iter = get_option_value ("iter", DEFAULT_NITER);
@@ -182,32 +254,33 @@ void run ()
   header.datatype() = DataType::Float32;
   header.ndim() = 4;
   
-  Image<value_type>* predict = nullptr;
+  Image<value_type> predict;
   opt = get_options ("predicted_signal");
-  if (opt.size()) {
-    predict = new Image<value_type> (Image<value_type>::create (opt[0][0], header));
-  }
+  if (opt.size())
+    predict = Image<value_type>::create (opt[0][0], header);
   
   header.size(3) = 6;
   auto dt = Image<value_type>::create (argument[1], header);
 
-  Image<value_type>* b0 = nullptr;
+  Image<value_type> b0;
   opt = get_options ("b0");
   if (opt.size()) {
     header.ndim() = 3;
-    b0 = new Image<value_type> (Image<value_type>::create (opt[0][0], header));
+    b0 = Image<value_type>::create (opt[0][0], header);
   }
 
-  Image<value_type>* dkt = nullptr;
+  Image<value_type> dkt;
   opt = get_options ("dkt");
   if (opt.size()) {
     header.ndim() = 4;
     header.size(3) = 15;
-    dkt = new Image<value_type> (Image<value_type>::create (opt[0][0], header));
+    dkt = Image<value_type>::create (opt[0][0], header);
   }
   
   Eigen::MatrixXd b = -DWI::grad2bmatrix<double> (grad, opt.size()>0);
 
-  ThreadedLoop("computing tensors", dwi, 0, 3).run (processor (b, iter, mask, b0, dkt, predict), dwi, dt);
+  if (get_options ("single").size())
+    fit<float> (b, iter, dwi, dt, mask, b0, dkt, predict);
+  else
+    fit<double> (b, iter, dwi, dt, mask, b0, dkt, predict);
 }
-
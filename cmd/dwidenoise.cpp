@@ -16,11 +16,19 @@
 
 #include "command.h"
 #include "image.h"
+#include "math/inverse_iteration.h"
+#include "math/lanczos.h"
+#include "math/rng.h"
 #include <Eigen/Dense>
 #include <Eigen/Eigenvalues>
 
 #define DEFAULT_SIZE 5
 
+// the number of Lanczos steps performed before the first, and between
+// subsequent, checks for convergence:
+#define LANCZOS_INITIAL_STEPS 16
+#define LANCZOS_STEPS 8
+
 using namespace MR;
 using namespace App;
 
@@ -78,7 +86,14 @@ void usage ()
     +   Argument ("window").type_sequence_int ()
 
     + Option ("noise", "the output noise map.")
-    +   Argument ("level").type_image_out();
+    +   Argument ("level").type_image_out()
+
+    + Option ("lanczos", "use a truncated Lanczos decomposition in place of the full eigen-decomposition. "
+                         "Only the eigenvalues above the Marchenko-Pastur threshold are resolved, starting from the largest, "
+                         "each to within the relative tolerance specified (e.g. 1e-3). This can be faster for large windows "
+                         "and numbers of volumes, where most eigenvalues lie below the threshold; otherwise, the default "
+                         "solver is usually faster.")
+    +   Argument ("tolerance").type_float (0.0, 1.0);
 
 }
 
@@ -86,41 +101,112 @@ void usage ()
 typedef float value_type;
 
 
+// The window is moved along the x-axis one voxel at a time, so that only the
+// incoming plane of voxels needs to be loaded, and (when there are no more
+// volumes than voxels in the window) only its contribution to the Gram matrix
+// needs to be computed. The columns of X are arranged as one contiguous block
+// per plane, with each plane stored in the slot given by its x coordinate
+// modulo the window size, so that the outgoing plane is simply overwritten.
 template <class ImageType>
 class DenoisingFunctor
 {
   public:
-  DenoisingFunctor (ImageType& dwi, std::vector<int> extent, Image<bool>& mask, ImageType& noise)
-    : extent {{extent[0]/2, extent[1]/2, extent[2]/2}},
+  DenoisingFunctor (ImageType& dwi, ImageType& out, std::vector<int> extent, Image<bool>& mask, ImageType& noise, double lanczos_tolerance)
+    : dwi (dwi),
+      out (out),
+      extent {{extent[0]/2, extent[1]/2, extent[2]/2}},
+      size {{extent[0], extent[1], extent[2]}},
+      plane (extent[1]*extent[2]),
       m (dwi.size(3)),
       n (extent[0]*extent[1]*extent[2]),
       r ((m<n) ? m : n),
-      X (m,n), 
-      pos {{0, 0, 0}}, 
+      X (m,n),
+      XtX (r,r),
       mask (mask),
-      noise (noise)
-  { }
+      noise (noise),
+      lanczos_tolerance (lanczos_tolerance),
+      lanczos (r)
+  {
+    if (m <= n) {
+      gram = Eigen::MatrixXd::Zero (m,m);
+      plane_gram.assign (size[0], Eigen::MatrixXf::Zero (m,m));
+    }
+    if (lanczos_tolerance > 0.0) {
+      // same starting vector for all voxels, so that the output is reproducible:
+      Math::RNG rng (0);
+      std::normal_distribution<float> normal;
+      start.resize (r);
+      for (ssize_t i = 0; i < r; ++i)
+        start[i] = normal (rng);
+    }
+  }
   
-  void operator () (ImageType& dwi, ImageType& out)
+  void operator () (const Iterator& pos)
   {
-    if (mask.valid()) {
-      assign_pos_of (dwi).to (mask);
-      if (!mask.value())
-        return;
+    assign_pos_of (pos, 1, 3).to (dwi);
+    bool loaded = false;
+    for (dwi.index(0) = 0; dwi.index(0) < dwi.size(0); ++dwi.index(0)) {
+      if (mask.valid()) {
+        assign_pos_of (dwi, 0, 3).to (mask);
+        if (!mask.value()) {
+          loaded = false;
+          continue;
+        }
+      }
+
+      if (loaded)
+        slide_window();
+      else
+        load_window();
+      loaded = true;
+
+      denoise();
     }
+  }
+
 
-    // Load data in local window
-    load_data (dwi);
+  void denoise ()
+  {
+    const ssize_t centre = slot (dwi.index(0)) * plane + plane/2;
 
-    // Compute Eigendecomposition:
-    Eigen::MatrixXf XtX (r,r);
     if (m <= n)
-      XtX.template triangularView<Eigen::Lower>() = X * X.transpose();
-    else 
-      XtX.template triangularView<Eigen::Lower>() = X.transpose() * X;
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig (XtX);
+      XtX.template triangularView<Eigen::Lower>() = gram.cast<float>();
+
+    // find the Marchenko-Pastur threshold, and the eigenvectors above it:
+    Eigen::MatrixXf U;
+    const ssize_t cutoff_p = lanczos_tolerance > 0.0 ? truncated_decomposition (U) : full_decomposition (U);
+
+    // recombine data using only eigenvectors above threshold:
+    Eigen::VectorXf result = X.col (centre);
+    if (cutoff_p > 0) {
+      if (m <= n)
+        result = U * (U.transpose() * X.col (centre));
+      else
+        result = X * (U * U.row (centre).transpose());
+    }
+
+    // Store output
+    assign_pos_of (dwi, 0, 3).to (out);
+    for (auto l = Loop (3) (out); l; ++l)
+      out.value() = result[out.index(3)];
+
+    // store noise map if requested:
+    if (noise.valid()) {
+      assign_pos_of (dwi, 0, 3).to (noise);
+      noise.value() = value_type (std::sqrt(sigma2));
+    }
+  }
+  
+  
+  // only the eigenvectors above the threshold are needed: these are obtained
+  // from the tridiagonal form by inverse iteration, which is much faster
+  // than computing all eigenvectors:
+  ssize_t full_decomposition (Eigen::MatrixXf& U)
+  {
+    tridiagonal.compute (XtX);
+    eig.computeFromTridiagonal (tridiagonal.diagonal(), tridiagonal.subDiagonal(), Eigen::EigenvaluesOnly);
     // eigenvalues provide squared singular values:
-    Eigen::VectorXf s = eig.eigenvalues();
+    const Eigen::VectorXf& s = eig.eigenvalues();
    
     // Marchenko-Pastur optimal threshold
     const double lam_r = s[0] / n;
@@ -142,38 +228,111 @@ class DenoisingFunctor
     }
 
     if (cutoff_p > 0) {
-      // recombine data using only eigenvectors above threshold:
-      s.head (cutoff_p).setZero();
-      s.tail (r-cutoff_p).setOnes();
-      if (m <= n) 
-        X.col (n/2) = eig.eigenvectors() * s.asDiagonal() * eig.eigenvectors().adjoint() * X.col(n/2);
-      else 
-        X.col (n/2) = X * eig.eigenvectors() * s.asDiagonal() * eig.eigenvectors().adjoint().col(n/2);
+      U = Math::tridiagonal_eigenvectors (tridiagonal.diagonal(), tridiagonal.subDiagonal(), s.tail (r-cutoff_p)).cast<float>();
+      U.applyOnTheLeft (tridiagonal.matrixQ());
+    }
+    return cutoff_p;
+  }
+
+
+  // as above, but only resolving the eigenvalues from the largest down to
+  // the threshold: the threshold is the largest p for which sigsq2 < sigsq1,
+  // and the cumulative sum of the eigenvalues up to p can be obtained from
+  // the trace and the eigenvalues above p:
+  ssize_t truncated_decomposition (Eigen::MatrixXf& U)
+  {
+    const double trace = XtX.diagonal().template cast<double>().sum();
+    lanczos.init (start);
+    ssize_t steps = LANCZOS_INITIAL_STEPS;
+    while (true) {
+      lanczos.step (XtX, steps);
+      lanczos.solve();
+      steps = LANCZOS_STEPS;
+
+      const auto& s = lanczos.eigenvalues();
+      const ssize_t k = lanczos.size();
+      const double lam_r = s[0] / n;
+      double cabove = 0.0;
+      for (ssize_t i = k-1; i >= 0; --i) {
+        if (lanczos.residual (i) > lanczos_tolerance * s[i])
+          break;
+        const ssize_t p = r-k+i;
+        double lam = s[i] / n;
+        double clam = trace / n - cabove;
+        double gam = double(m-r+p+1) / double(n);
+        double sigsq1 = clam / (p+1) / std::max (gam, 1.0);
+        double sigsq2 = (lam - lam_r) / 4 / std::sqrt(gam);
+        if (sigsq2 < sigsq1) {
+          // the smallest eigenvalue must also be resolved to the same accuracy:
+          if (lanczos.residual (0) > lanczos_tolerance * s[i])
+            break;
+          sigma2 = sigsq1;
+          U = lanczos.eigenvectors (i+1, k-i-1);
+          return p+1;
+        }
+        cabove += lam;
+      }
+
+      // no faster than the full decomposition beyond this point, e.g. in
+      // rank-deficient windows at the edge of the image:
+      if (2*k >= r)
+        return full_decomposition (U);
     }
+  }
 
-    // Store output
-    assign_pos_of(dwi).to(out);
-    for (auto l = Loop (3) (out); l; ++l)
-      out.value() = X(out.index(3), n/2);
 
-    // store noise map if requested:
-    if (noise.valid()) {
-      assign_pos_of(dwi).to(noise);
-      noise.value() = value_type (std::sqrt(sigma2));
+  // load all planes of the window centred on the current voxel:
+  void load_window ()
+  {
+    for (ssize_t x = dwi.index(0)-extent[0]; x <= dwi.index(0)+extent[0]; ++x)
+      load_plane (x);
+
+    if (m <= n) {
+      gram.setZero();
+      for (ssize_t x = 0; x < size[0]; ++x) {
+        plane_gram[x].template triangularView<Eigen::Lower>() = X.middleCols (x*plane, plane) * X.middleCols (x*plane, plane).transpose();
+        gram += plane_gram[x].template cast<double>();
+      }
     }
+    else
+      XtX.template triangularView<Eigen::Lower>() = X.transpose() * X;
   }
-  
-  
-  void load_data (ImageType& dwi)
+
+
+  // replace the outgoing plane with the incoming one, after a step of one voxel along x:
+  void slide_window ()
+  {
+    const ssize_t x = dwi.index(0) + extent[0];
+    const ssize_t first = slot (x) * plane;
+    load_plane (x);
+
+    if (m <= n) {
+      // the contribution of each plane is computed in single precision exactly once,
+      // and accumulated in double precision, so that errors do not build up:
+      auto& P = plane_gram[slot (x)];
+      gram -= P.template cast<double>();
+      P.template triangularView<Eigen::Lower>() = X.middleCols (first, plane) * X.middleCols (first, plane).transpose();
+      gram += P.template cast<double>();
+    }
+    else {
+      XtX.middleCols (first, plane) = X.transpose() * X.middleCols (first, plane);
+      XtX.middleRows (first, plane) = XtX.middleCols (first, plane).transpose();
+    }
+  }
+
+
+  // load the voxels of the plane at position x into its slot in X:
+  void load_plane (ssize_t x)
   {
-    pos[0] = dwi.index(0); pos[1] = dwi.index(1); pos[2] = dwi.index(2);
-    X.setZero();
-    ssize_t k = 0;
+    const ssize_t pos[3] = { dwi.index(0), dwi.index(1), dwi.index(2) };
+    ssize_t k = slot (x) * plane;
+    dwi.index(0) = x;
     for (dwi.index(2) = pos[2]-extent[2]; dwi.index(2) <= pos[2]+extent[2]; ++dwi.index(2))
-      for (dwi.index(1) = pos[1]-extent[1]; dwi.index(1) <= pos[1]+extent[1]; ++dwi.index(1))
-        for (dwi.index(0) = pos[0]-extent[0]; dwi.index(0) <= pos[0]+extent[0]; ++dwi.index(0), ++k)
-          if (! is_out_of_bounds(dwi))
-            X.col(k) = dwi.row(3).template cast<float>();
+      for (dwi.index(1) = pos[1]-extent[1]; dwi.index(1) <= pos[1]+extent[1]; ++dwi.index(1), ++k)
+        if (! is_out_of_bounds (dwi))
+          X.col(k) = dwi.row(3).template cast<float>();
+        else
+          X.col(k).setZero();
     // reset image position
     dwi.index(0) = pos[0];
     dwi.index(1) = pos[1];
@@ -181,14 +340,22 @@ class DenoisingFunctor
   }
   
 private:
-  const std::array<ssize_t, 3> extent;
-  const ssize_t m, n, r;
-  Eigen::MatrixXf X;
-  std::array<ssize_t, 3> pos;
+  ImageType dwi, out;
+  const std::array<ssize_t, 3> extent, size;
+  const ssize_t plane, m, n, r;
+  Eigen::MatrixXf X, XtX;
+  Eigen::MatrixXd gram;
+  std::vector<Eigen::MatrixXf> plane_gram;
   double sigma2;
   Image<bool> mask;
   ImageType noise;
-  
+  Eigen::Tridiagonalization<Eigen::MatrixXf> tridiagonal;
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig;
+  const double lanczos_tolerance;
+  Math::Lanczos<float> lanczos;
+  Eigen::VectorXf start;
+
+  ssize_t slot (ssize_t x) const { return ((x % size[0]) + size[0]) % size[0]; }
 };
 
 
@@ -228,9 +395,11 @@ void run ()
     noise = Image<value_type>::create (opt[0][0], header);
   }
 
-  DenoisingFunctor< Image<value_type> > func (dwi_in, extent, mask, noise);
-  ThreadedLoop ("running MP-PCA denoising", dwi_in, 0, 3)
-    .run (func, dwi_in, dwi_out);
+  const double lanczos_tolerance = get_option_value ("lanczos", 0.0);
+
+  DenoisingFunctor< Image<value_type> > func (dwi_in, dwi_out, extent, mask, noise, lanczos_tolerance);
+  ThreadedLoop ("running MP-PCA denoising", dwi_in, { 1, 2 }, { 0 })
+    .run_outer (func);
 }
 
 
@@ -113,6 +113,22 @@ void usage ()
   + Option ("smooth", "smooth the fixel value along the fibre tracts using a Gaussian kernel with the supplied FWHM (default: " + str(DEFAULT_SMOOTHING_STD, 2) + "mm)")
   + Argument ("FWHM").type_float (0.0, 200.0)
 
+  + Option ("connectivity_cache", "cache the fixel-fixel connectivity computed from the tracks in the file specified. "
+                                  "If this file already exists, the connectivity is loaded from it instead, and the "
+                                  "tracks are not read. The cache records the template (its number of fixels and a hash of its "
+                                  "voxel grid, fixel layout and fixel directions), the resolved path and timestamp of the "
+                                  "tracks file, and the angular threshold; an error is raised if any of these differ.")
+  + Argument ("path").type_text()
+
+  + Option ("out_of_core", "store the matrix of subject data in a temporary memory-mapped file rather than in RAM. "
+                           "This allows the analysis of cohorts for which the data would not otherwise fit in "
+                           "memory; results are identical to those obtained with the data held in RAM.")
+
+  + Option ("memory_budget", "the maximum amount of memory (in MB) to use for the intermediate statistics "
+                             "computed by all threads during permutation testing. By default, each thread "
+                             "processes up to " + str(Stats::PermTest::max_permutation_block_size) + " permutations at once.")
+  + Argument ("size").type_integer (1)
+
   + Option ("nonstationary", "do adjustment for non-stationarity")
 
   + Option ("nperms_nonstationary", "the number of permutations used when precomputing the empirical statistic image for nonstationary correction (Default: " + str(DEFAULT_PERMUTATIONS_NONSTATIONARITY) + ")")
@@ -141,6 +157,62 @@ void write_fixel_output (const std::string& filename,
 
 
 
+// FNV-1a hash of the template fixels (voxel grid, transform, per-voxel fixel
+// indices and fixel directions), used to tie a connectivity cache to its template:
+std::string template_hash (const Header& header, Image<int32_t>& fixel_index_image, const std::vector<Eigen::Vector3f>& directions)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  auto update = [&] (const void* data, size_t nbytes) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*> (data);
+    for (size_t n = 0; n != nbytes; ++n) {
+      hash ^= p[n];
+      hash *= 1099511628211ULL;
+    }
+  };
+  for (size_t axis = 0; axis != 3; ++axis) {
+    const int64_t size = header.size (axis);
+    update (&size, sizeof (size));
+  }
+  const auto& T = header.transform();
+  for (ssize_t r = 0; r != 3; ++r)
+    for (ssize_t c = 0; c != 4; ++c) {
+      const float value = T (r, c);
+      update (&value, sizeof (value));
+    }
+  for (auto i = Loop (fixel_index_image, 0, 3) (fixel_index_image); i; ++i) {
+    for (fixel_index_image.index(3) = 0; fixel_index_image.index(3) != 2; ++fixel_index_image.index(3)) {
+      const int32_t value = fixel_index_image.value();
+      update (&value, sizeof (value));
+    }
+  }
+  for (const auto& dir : directions)
+    update (dir.data(), 3 * sizeof (float));
+
+  std::ostringstream stream;
+  stream << std::hex << std::setw (16) << std::setfill ('0') << hash;
+  return stream.str();
+}
+
+
+
+// absolute path with symbolic links resolved, so that the same tracks file
+// is recognised however it was specified on the command line:
+std::string canonical_path (const std::string& path)
+{
+#ifdef MRTRIX_WINDOWS
+  char* resolved = _fullpath (nullptr, path.c_str(), 0);
+#else
+  char* resolved = realpath (path.c_str(), nullptr);
+#endif
+  if (!resolved)
+    return path;
+  std::string result (resolved);
+  free (resolved);
+  return result;
+}
+
+
+
 void run() {
 
   auto opt = get_options ("negative");
@@ -160,6 +232,7 @@ void run() {
   bool do_nonstationary_adjustment = get_options ("nonstationary").size();
 
   int nperms_nonstationary = get_option_value ("nperms_nonstationary", DEFAULT_PERMUTATIONS_NONSTATIONARITY);
+  const size_t memory_budget = size_t (get_option_value ("memory_budget", 0)) << 20;
   
   // Read filenames
   std::vector<std::string> filenames;
@@ -223,37 +296,69 @@ void run() {
   CONSOLE ("number of fixels: " + str(num_fixels));
 
   // Compute fixel-fixel connectivity
-  std::vector<std::map<int32_t, Stats::CFE::connectivity> > connectivity_matrix (num_fixels);
-  std::vector<uint16_t> fixel_TDI (num_fixels, 0.0);
+  Stats::CFE::ConnectivityMatrix connectivity_matrix;
+  std::vector<uint32_t> fixel_TDI;
   std::string track_filename = argument[4];
   std::string output_prefix = argument[5];
+  std::string cache_path;
+  opt = get_options ("connectivity_cache");
+  if (opt.size())
+    cache_path = std::string (opt[0][0]);
+
+  // the parameters that the cached connectivity depends on:
   DWI::Tractography::Properties properties;
   DWI::Tractography::Reader<value_type> track_file (track_filename, properties);
-  // Read in tracts, and compute whole-brain fixel-fixel connectivity
-  const size_t num_tracks = properties["count"].empty() ? 0 : to<int> (properties["count"]);
-  if (!num_tracks)
-    throw Exception ("no tracks found in input file");
-  if (num_tracks < 1000000)
-    WARN ("more than 1 million tracks should be used to ensure robust fixel-fixel connectivity");
-  {
-    typedef DWI::Tractography::Mapping::SetVoxelDir SetVoxelDir;
-    DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity");
-    DWI::Tractography::Mapping::TrackMapperBase mapper (input_header);
-    mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (input_header, properties, 0.333f));
-    mapper.set_use_precise_mapping (true);
-    Stats::CFE::TrackProcessor tract_processor (fixel_index_image, directions, fixel_TDI, connectivity_matrix, angular_threshold);
-    Thread::run_queue (
-        loader,
-        Thread::batch (DWI::Tractography::Streamline<float>()),
-        mapper,
-        Thread::batch (SetVoxelDir()),
-        tract_processor);
+  std::map<std::string, std::string> cache_keyval;
+  cache_keyval["template"] = str (num_fixels) + " fixels, hash " + template_hash (input_header, fixel_index_image, directions);
+  cache_keyval["tracks"] = canonical_path (track_filename);
+  cache_keyval["tracks timestamp"] = properties["timestamp"];
+  cache_keyval["angular threshold"] = str (angular_threshold);
+
+  if (cache_path.size() && Path::exists (cache_path)) {
+    track_file.close();
+    std::map<std::string, std::string> keyval;
+    connectivity_matrix.load (cache_path, fixel_TDI, keyval);
+    if (connectivity_matrix.size() != num_fixels)
+      throw Exception ("fixel connectivity cache \"" + cache_path + "\" does not match number of fixels in template");
+    for (const auto& entry : cache_keyval) {
+      if (keyval[entry.first] != entry.second)
+        throw Exception ("fixel connectivity cache \"" + cache_path + "\" was computed using a different " + entry.first
+                         + " (\"" + keyval[entry.first] + "\" instead of \"" + entry.second + "\"); delete it to recompute the connectivity");
+    }
+    INFO ("fixel-fixel connectivity loaded from cache \"" + cache_path + "\"");
+  }
+  else {
+    // Read in tracts, and compute whole-brain fixel-fixel connectivity
+    const size_t num_tracks = properties["count"].empty() ? 0 : to<int> (properties["count"]);
+    if (!num_tracks)
+      throw Exception ("no tracks found in input file");
+    if (num_tracks < 1000000)
+      WARN ("more than 1 million tracks should be used to ensure robust fixel-fixel connectivity");
+    Stats::CFE::ConnectivityBuilder builder (num_fixels);
+    {
+      typedef DWI::Tractography::Mapping::SetVoxelDir SetVoxelDir;
+      DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity");
+      DWI::Tractography::Mapping::TrackMapperBase mapper (input_header);
+      mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (input_header, properties, 0.333f));
+      mapper.set_use_precise_mapping (true);
+      Stats::CFE::TrackProcessor tract_processor (fixel_index_image, directions, builder, angular_threshold);
+      Thread::run_queue (
+          loader,
+          Thread::batch (DWI::Tractography::Streamline<float>()),
+          Thread::multi (mapper),
+          Thread::batch (SetVoxelDir()),
+          Thread::multi (tract_processor));
+    }
+    track_file.close();
+    builder.finalise (connectivity_matrix, fixel_TDI);
+
+    if (cache_path.size())
+      connectivity_matrix.save (cache_path, fixel_TDI, cache_keyval);
   }
-  track_file.close();
 
 
   // Normalise connectivity matrix and threshold, pre-compute fixel-fixel weights for smoothing.
-  std::vector<std::map<int32_t, value_type> > smoothing_weights (num_fixels);
+  Stats::CFE::ConnectivityMatrix smoothing_weights (num_fixels);
   bool do_smoothing = false;
   const value_type gaussian_const2 = 2.0 * smooth_std_dev * smooth_std_dev;
   value_type gaussian_const1 = 1.0;
@@ -263,47 +368,59 @@ void run() {
   }
   {
     ProgressBar progress ("normalising and thresholding fixel-fixel connectivity matrix", num_fixels);
-    for (unsigned int fixel = 0; fixel < num_fixels; ++fixel) {
-      auto it = connectivity_matrix[fixel].begin();
-      while (it != connectivity_matrix[fixel].end()) {
-        value_type connectivity = it->second.value / value_type (fixel_TDI[fixel]);
-        if (connectivity < connectivity_threshold)  {
-          connectivity_matrix[fixel].erase (it++);
-        } else {
+    Stats::CFE::ConnectivityMatrix normalised (num_fixels);
+    for (uint32_t fixel = 0; fixel < num_fixels; ++fixel) {
+      // Make sure the fixel is fully connected to itself giving it a smoothing weight of 1
+      // (unless it is already connected to itself from the tracks)
+      bool self_connected = false, self_smoothed = false;
+      auto add_self = [&] () {
+        if (!self_connected)
+          normalised.push_back (fixel, 1.0);
+        if (!self_smoothed)
+          smoothing_weights.push_back (fixel, gaussian_const1);
+        self_connected = self_smoothed = true;
+      };
+      for (uint64_t n = connectivity_matrix.offsets[fixel]; n < connectivity_matrix.offsets[fixel+1]; ++n) {
+        const uint32_t other = connectivity_matrix.columns[n];
+        if (other > fixel)
+          add_self();
+        value_type connectivity = connectivity_matrix.values[n] / value_type (fixel_TDI[fixel]);
+        if (connectivity >= connectivity_threshold)  {
           if (do_smoothing) {
-            value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[it->first][0]) +
-                                             Math::pow2 (positions[fixel][1] - positions[it->first][1]) +
-                                             Math::pow2 (positions[fixel][2] - positions[it->first][2]));
+            value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[other][0]) +
+                                             Math::pow2 (positions[fixel][1] - positions[other][1]) +
+                                             Math::pow2 (positions[fixel][2] - positions[other][2]));
             value_type smoothing_weight = connectivity * gaussian_const1 * std::exp (-std::pow (distance, 2) / gaussian_const2);
-            if (smoothing_weight > connectivity_threshold)
-              smoothing_weights[fixel].insert (std::pair<int32_t, value_type> (it->first, smoothing_weight));
+            if (smoothing_weight > connectivity_threshold) {
+              smoothing_weights.push_back (other, smoothing_weight);
+              self_smoothed = self_smoothed || other == fixel;
+            }
           }
           // Here we pre-exponentiate each connectivity value by C
-          it->second.value = std::pow (connectivity, cfe_c);
-          ++it;
+          normalised.push_back (other, std::pow (connectivity, cfe_c));
+          self_connected = self_connected || other == fixel;
         }
       }
-      // Make sure the fixel is fully connected to itself giving it a smoothing weight of 1
-      Stats::CFE::connectivity self_connectivity;
-      self_connectivity.value = 1.0;
-      connectivity_matrix[fixel].insert (std::pair<int32_t, Stats::CFE::connectivity> (fixel, self_connectivity));
-      smoothing_weights[fixel].insert (std::pair<int32_t, value_type> (fixel, gaussian_const1));
+      add_self();
+      normalised.next_row();
+      smoothing_weights.next_row();
       progress++;
     }
+    std::swap (connectivity_matrix, normalised);
   }
 
   // Normalise smoothing weights
   for (size_t fixel = 0; fixel < num_fixels; ++fixel) {
     value_type sum = 0.0;
-    for (auto it = smoothing_weights[fixel].begin(); it != smoothing_weights[fixel].end(); ++it)
-      sum += it->second;
+    for (uint64_t n = smoothing_weights.offsets[fixel]; n < smoothing_weights.offsets[fixel+1]; ++n)
+      sum += smoothing_weights.values[n];
     value_type norm_factor = 1.0 / sum;
-    for (auto it = smoothing_weights[fixel].begin(); it != smoothing_weights[fixel].end(); ++it)
-      it->second *= norm_factor;
+    for (uint64_t n = smoothing_weights.offsets[fixel]; n < smoothing_weights.offsets[fixel+1]; ++n)
+      smoothing_weights.values[n] *= norm_factor;
   }
 
   // Load input data
-  Eigen::Matrix<value_type, Eigen::Dynamic, Eigen::Dynamic> data (num_fixels, filenames.size());
+  Math::Stats::MeasurementMatrix data (num_fixels, filenames.size(), get_options ("out_of_core").size());
   {
     ProgressBar progress ("loading input images", filenames.size());
     for (size_t subject = 0; subject < filenames.size(); subject++) {
@@ -337,9 +454,8 @@ void run() {
       // Smooth the data
       for (size_t fixel = 0; fixel < num_fixels; ++fixel) {
         value_type value = 0.0;
-        std::map<int32_t, value_type>::const_iterator it = smoothing_weights[fixel].begin();
-        for (; it != smoothing_weights[fixel].end(); ++it)
-          value += temp_fixel_data[it->first] * it->second;
+        for (uint64_t n = smoothing_weights.offsets[fixel]; n < smoothing_weights.offsets[fixel+1]; ++n)
+          value += temp_fixel_data[smoothing_weights.columns[n]] * smoothing_weights.values[n];
         data (fixel, subject) = value;
       }
       progress++;
@@ -379,7 +495,7 @@ void run() {
   // If performing non-stationarity adjustment we need to pre-compute the empirical CFE statistic
   if (do_nonstationary_adjustment) {
     empirical_cfe_statistic.reset(new std::vector<double> (num_fixels, 0.0));
-    Stats::PermTest::precompute_empirical_stat (glm_ttest, cfe_integrator, nperms_nonstationary, *empirical_cfe_statistic);
+    Stats::PermTest::precompute_empirical_stat (glm_ttest, cfe_integrator, nperms_nonstationary, *empirical_cfe_statistic, memory_budget);
     output_header.keyval()["nonstationary adjustment"] = str(true);
     write_fixel_output (output_prefix + "cfe_empirical.msf", *empirical_cfe_statistic, output_header, mask_fixel_image, fixel_index_image);
   } else {
@@ -416,7 +532,7 @@ void run() {
     Stats::PermTest::run_permutations (glm_ttest, cfe_integrator, num_perms, empirical_cfe_statistic,
                                        cfe_output, cfe_output_neg,
                                        perm_distribution, perm_distribution_neg,
-                                       uncorrected_pvalues, uncorrected_pvalues_neg);
+                                       uncorrected_pvalues, uncorrected_pvalues_neg, memory_budget);
 
     ProgressBar progress ("outputting final results");
     save_matrix (perm_distribution, output_prefix + "perm_dist.txt");
@@ -139,6 +139,14 @@ OPTIONS
 typedef float real_type;
 typedef cfloat complex_type;
 
+typedef Eigen::Array<real_type, Eigen::Dynamic, 1> real_array;
+typedef Eigen::Map<real_array> RealMap;
+typedef Eigen::Map<const real_array> ConstRealMap;
+
+// number of voxels processed in a single pass through the expression: small
+// enough that all intermediate results remain in L1 cache
+constexpr size_t tile_size = 256;
+
 
 /**********************************************************************
   STACK FRAMEWORK:
@@ -148,61 +156,13 @@ typedef cfloat complex_type;
 class Evaluator;
 
 
-class Chunk : public std::vector<complex_type> {
-  public:
-    complex_type value;
-};
-
-
-class ThreadLocalStorageItem {
-  public:
-    Chunk chunk;
-    copy_ptr<Image<complex_type>> image;
-};
-
-class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem> {
-  public:
-
-      void load (Chunk& chunk, Image<complex_type>& image) {
-        for (size_t n = 0; n < image.ndim(); ++n)
-          if (image.size(n) > 1)
-            image.index(n) = iter->index(n);
-
-        size_t n = 0;
-        for (size_t y = 0; y < size[1]; ++y) {
-          if (axes[1] < image.ndim()) if (image.size (axes[1]) > 1) image.index(axes[1]) = y;
-          for (size_t x = 0; x < size[0]; ++x) {
-            if (axes[0] < image.ndim()) if (image.size (axes[0]) > 1) image.index(axes[0]) = x;
-            chunk[n++] = image.value();
-          }
-        }
-      }
-
-    Chunk& next () {
-      ThreadLocalStorageItem& item ((*this)[current++]);
-      if (item.image) load (item.chunk, *item.image);
-      return item.chunk;
-    }
-
-    void reset (const Iterator& current_position) { current = 0; iter = &current_position; }
-
-    const Iterator* iter;
-    std::vector<size_t> axes, size;
-
-  private:
-    size_t current;
-};
-
-
-
-
 class LoadedImage
 {
   public:
-    LoadedImage (std::shared_ptr<Image<complex_type>>& i, const bool c) :
-        image (i),
+    LoadedImage (std::shared_ptr<Header>& h, const bool c) :
+        header (h),
         image_is_complex (c) { }
-    std::shared_ptr<Image<complex_type>> image;
+    std::shared_ptr<Header> header;
     bool image_is_complex;
 };
 
@@ -225,17 +185,17 @@ class StackEntry {
       auto search = image_list.find (arg);
       if (search != image_list.end()) {
         DEBUG (std::string ("image \"") + arg + "\" already loaded - re-using exising image");
-        image = search->second.image;
+        header = search->second.header;
         image_is_complex = search->second.image_is_complex;
       }
       else {
         try {
-          auto header = Header::open (arg);
-          image_is_complex = header.datatype().is_complex();
-          image.reset (new Image<complex_type> (header.get_image<complex_type>()));
-          image_list.insert (std::make_pair (arg, LoadedImage (image, image_is_complex)));
+          header.reset (new Header (Header::open (arg)));
+          image_is_complex = header->datatype().is_complex();
+          image_list.insert (std::make_pair (arg, LoadedImage (header, image_is_complex)));
         }
         catch (Exception) {
+          header.reset();
           std::string a = lowercase (arg);
           if      (a ==  "nan")  { value =  std::numeric_limits<real_type>::quiet_NaN(); }
           else if (a == "-nan")  { value = -std::numeric_limits<real_type>::quiet_NaN(); }
@@ -251,17 +211,16 @@ class StackEntry {
 
     const char* arg;
     std::shared_ptr<Evaluator> evaluator;
-    std::shared_ptr<Image<complex_type>> image;
+    std::shared_ptr<Header> header;
     copy_ptr<Math::RNG> rng;
     complex_type value;
     bool rng_gausssian;
     bool image_is_complex;
 
     bool is_complex () const;
+    bool is_constant () const { return !(evaluator || header || rng); }
 
     static std::map<std::string, LoadedImage> image_list;
-
-    Chunk& evaluate (ThreadLocalStorage& storage) const;
 };
 
 std::map<std::string, LoadedImage> StackEntry::image_list;
@@ -274,39 +233,36 @@ class Evaluator
       id (name),
       format (format_string),
       ZtoR (complex_maps_to_real),
-      RtoZ (real_maps_to_complex) { }
+      RtoZ (real_maps_to_complex),
+      complex_operands (false) { }
     virtual ~Evaluator() { }
     const std::string id;
     const char* format;
     bool ZtoR, RtoZ;
     std::vector<StackEntry> operands;
+    bool complex_operands;
 
-    Chunk& evaluate (ThreadLocalStorage& storage) const {
-      Chunk& in1 (operands[0].evaluate (storage));
-      if (num_args() == 1) return evaluate (in1);
-      Chunk& in2 (operands[1].evaluate (storage));
-      if (num_args() == 2) return evaluate (in1, in2);
-      Chunk& in3 (operands[2].evaluate (storage));
-      return evaluate (in1, in2, in3);
-    }
-    virtual Chunk& evaluate (Chunk& in) const { throw Exception ("operation \"" + id + "\" not supported!"); return in; }
-    virtual Chunk& evaluate (Chunk& a, Chunk& b) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
-    virtual Chunk& evaluate (Chunk& a, Chunk& b, Chunk& c) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
+    //! evaluate the operation over \a count voxels, from one input array per operand
+    virtual void evaluate (real_type* out, const real_type* const* in, size_t count) const = 0;
+    virtual void evaluate (complex_type* out, const complex_type* const* in, size_t count) const = 0;
 
     virtual bool is_complex () const {
-      for (size_t n = 0; n < operands.size(); ++n) 
-        if (operands[n].is_complex())  
-          return !ZtoR;
-      return RtoZ;
+      return complex_operands ? !ZtoR : RtoZ;
     }
     size_t num_args () const { return operands.size(); }
 
+  protected:
+    void set_operands_complex () {
+      for (const auto& operand : operands)
+        if (operand.is_complex())
+          complex_operands = true;
+    }
 };
 
 
 
 inline bool StackEntry::is_complex () const {
-  if (image) return image_is_complex;
+  if (header) return image_is_complex;
   if (evaluator) return evaluator->is_complex();
   if (rng) return false;
   return value.imag() != 0.0;
@@ -314,24 +270,18 @@ inline bool StackEntry::is_complex () const {
 
 
 
-inline Chunk& StackEntry::evaluate (ThreadLocalStorage& storage) const
+// whether any part of the expression requires complex arithmetic:
+inline bool requires_complex (const StackEntry& entry)
 {
-  if (evaluator) return evaluator->evaluate (storage);
-  if (rng) {
-    Chunk& chunk = storage.next();
-    if (rng_gausssian) {
-      std::normal_distribution<real_type> dis (0.0, 1.0);
-      for (size_t n = 0; n < chunk.size(); ++n)
-        chunk[n] = dis (*rng);
-    }
-    else {
-      std::uniform_real_distribution<real_type> dis (0.0, 1.0);
-      for (size_t n = 0; n < chunk.size(); ++n)
-        chunk[n] = dis (*rng);
-    }
-    return chunk;
+  if (entry.evaluator) {
+    if (entry.evaluator->complex_operands || entry.evaluator->RtoZ)
+      return true;
+    for (const auto& operand : entry.evaluator->operands)
+      if (requires_complex (operand))
+        return true;
+    return false;
   }
-  return storage.next();
+  return entry.is_complex();
 }
 
 
@@ -362,8 +312,8 @@ inline void replace (std::string& orig, size_t n, const std::string& value)
 // later:
 std::string operation_string (const StackEntry& entry) 
 {
-  if (entry.image)
-    return entry.image->name();
+  if (entry.header)
+    return entry.header->name();
   else if (entry.rng)
     return entry.rng_gausssian ? "randn()" : "rand()";
   else if (entry.evaluator) {
@@ -379,6 +329,43 @@ std::string operation_string (const StackEntry& entry)
 
 
 
+// operations can provide a vectorised form V() operating on whole Eigen
+// arrays, which is used in preference to the per-voxel form R() when
+// evaluating purely real expressions:
+template <class Operation>
+inline auto apply_real (const Operation& op, RealMap& out, const ConstRealMap& a, int) -> decltype (op.V (out, a), void()) { op.V (out, a); }
+
+template <class Operation>
+inline void apply_real (const Operation& op, RealMap& out, const ConstRealMap& a, long)
+{
+  for (ssize_t n = 0; n < out.size(); ++n)
+    out[n] = op.R (a[n]).real();
+}
+
+template <class Operation>
+inline auto apply_real (const Operation& op, RealMap& out, const ConstRealMap& a, const ConstRealMap& b, int) -> decltype (op.V (out, a, b), void()) { op.V (out, a, b); }
+
+template <class Operation>
+inline void apply_real (const Operation& op, RealMap& out, const ConstRealMap& a, const ConstRealMap& b, long)
+{
+  for (ssize_t n = 0; n < out.size(); ++n)
+    out[n] = op.R (a[n], b[n]).real();
+}
+
+template <class Operation>
+inline auto apply_real (const Operation& op, RealMap& out, const ConstRealMap& a, const ConstRealMap& b, const ConstRealMap& c, int) -> decltype (op.V (out, a, b, c), void()) { op.V (out, a, b, c); }
+
+template <class Operation>
+inline void apply_real (const Operation& op, RealMap& out, const ConstRealMap& a, const ConstRealMap& b, const ConstRealMap& c, long)
+{
+  for (ssize_t n = 0; n < out.size(); ++n)
+    out[n] = op.R (a[n], b[n], c[n]).real();
+}
+
+
+
+
+
 template <class Operation>
 class UnaryEvaluator : public Evaluator 
 {
@@ -387,19 +374,23 @@ class UnaryEvaluator : public Evaluator
       Evaluator (name, operation.format, operation.ZtoR, operation.RtoZ), 
       op (operation) { 
         operands.push_back (operand);
+        set_operands_complex();
       }
 
     Operation op;
 
-    virtual Chunk& evaluate (Chunk& in) const { 
-      if (operands[0].is_complex()) 
-        for (size_t n = 0; n < in.size(); ++n)
-          in[n] = op.Z (in[n]);
-      else 
-        for (size_t n = 0; n < in.size(); ++n)
-          in[n] = op.R (in[n].real());
+    virtual void evaluate (real_type* out, const real_type* const* in, size_t count) const {
+      RealMap result (out, count);
+      apply_real (op, result, ConstRealMap (in[0], count), 0);
+    }
 
-      return in; 
+    virtual void evaluate (complex_type* out, const complex_type* const* in, size_t count) const {
+      if (complex_operands)
+        for (size_t n = 0; n < count; ++n)
+          out[n] = op.Z (in[0][n]);
+      else 
+        for (size_t n = 0; n < count; ++n)
+          out[n] = op.R (in[0][n].real());
     }
 };
 
@@ -417,25 +408,23 @@ class BinaryEvaluator : public Evaluator
       op (operation) { 
         operands.push_back (operand1);
         operands.push_back (operand2);
+        set_operands_complex();
       }
 
     Operation op;
 
-    virtual Chunk& evaluate (Chunk& a, Chunk& b) const {
-      Chunk& out (a.size() ? a : b);
-      if (operands[0].is_complex() || operands[1].is_complex()) {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.Z (
-              a.size() ? a[n] : a.value, 
-              b.size() ? b[n] : b.value );
-      }
-      else {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.R (
-              a.size() ? a[n].real() : a.value.real(), 
-              b.size() ? b[n].real() : b.value.real() );
-      }
-      return out;
+    virtual void evaluate (real_type* out, const real_type* const* in, size_t count) const {
+      RealMap result (out, count);
+      apply_real (op, result, ConstRealMap (in[0], count), ConstRealMap (in[1], count), 0);
+    }
+
+    virtual void evaluate (complex_type* out, const complex_type* const* in, size_t count) const {
+      if (complex_operands)
+        for (size_t n = 0; n < count; ++n)
+          out[n] = op.Z (in[0][n], in[1][n]);
+      else
+        for (size_t n = 0; n < count; ++n)
+          out[n] = op.R (in[0][n].real(), in[1][n].real());
     }
 
 };
@@ -452,27 +441,23 @@ class TernaryEvaluator : public Evaluator
         operands.push_back (operand1);
         operands.push_back (operand2);
         operands.push_back (operand3);
+        set_operands_complex();
       }
 
     Operation op;
 
-    virtual Chunk& evaluate (Chunk& a, Chunk& b, Chunk& c) const {
-      Chunk& out (a.size() ? a : (b.size() ? b : c));
-      if (operands[0].is_complex() || operands[1].is_complex() || operands[2].is_complex()) {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.Z (
-              a.size() ? a[n] : a.value,
-              b.size() ? b[n] : b.value,
-              c.size() ? c[n] : c.value );
-      }
-      else {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.R (
-              a.size() ? a[n].real() : a.value.real(), 
-              b.size() ? b[n].real() : b.value.real(), 
-              c.size() ? c[n].real() : c.value.real() );
-      }
-      return out;
+    virtual void evaluate (real_type* out, const real_type* const* in, size_t count) const {
+      RealMap result (out, count);
+      apply_real (op, result, ConstRealMap (in[0], count), ConstRealMap (in[1], count), ConstRealMap (in[2], count), 0);
+    }
+
+    virtual void evaluate (complex_type* out, const complex_type* const* in, size_t count) const {
+      if (complex_operands)
+        for (size_t n = 0; n < count; ++n)
+          out[n] = op.Z (in[0][n], in[1][n], in[2][n]);
+      else
+        for (size_t n = 0; n < count; ++n)
+          out[n] = op.R (in[0][n].real(), in[1][n].real(), in[2][n].real());
     }
 
 };
@@ -488,7 +473,7 @@ void unary_operation (const std::string& operation_name, std::vector<StackEntry>
     throw Exception ("no operand in stack for operation \"" + operation_name + "\"!");
   StackEntry& a (stack[stack.size()-1]);
   a.load();
-  if (a.evaluator || a.image || a.rng) {
+  if (!a.is_constant()) {
     StackEntry entry (new UnaryEvaluator<Operation> (operation_name, operation, a));
     stack.back() = entry;
   }
@@ -515,7 +500,7 @@ void binary_operation (const std::string& operation_name, std::vector<StackEntry
   StackEntry& b (stack[stack.size()-1]);
   a.load();
   b.load();
-  if (a.evaluator || a.image || a.rng || b.evaluator || b.image || b.rng) {
+  if (!a.is_constant() || !b.is_constant()) {
     StackEntry entry (new BinaryEvaluator<Operation> (operation_name, operation, a, b));
     stack.pop_back();
     stack.back() = entry;
@@ -542,7 +527,7 @@ void ternary_operation (const std::string& operation_name, std::vector<StackEntr
   a.load();
   b.load();
   c.load();
-  if (a.evaluator || a.image || a.rng || b.evaluator || b.image || b.rng || c.evaluator || c.image || c.rng) {
+  if (!a.is_constant() || !b.is_constant() || !c.is_constant()) {
     StackEntry entry (new TernaryEvaluator<Operation> (operation_name, operation, a, b, c));
     stack.pop_back();
     stack.pop_back();
@@ -561,6 +546,77 @@ void ternary_operation (const std::string& operation_name, std::vector<StackEntr
 
 
 
+/**********************************************************************
+   COMPILATION OF EXPRESSION INTO FLAT PROGRAM:
+ **********************************************************************/
+
+
+// the expression tree is flattened into a sequence of instructions, each
+// operating on a tile of voxels held in a 'register'. Registers are recycled
+// as soon as their contents have been consumed, so that the number of
+// registers required is only the depth of the expression, and the whole
+// expression is evaluated in a single pass over each tile:
+class Instruction {
+  public:
+    const Evaluator* evaluator; // if null, load the source instead
+    size_t source;
+    size_t out;
+    std::vector<size_t> in;
+};
+
+
+class Program {
+  public:
+    Program (const StackEntry& top_of_stack) :
+      num_registers (0) {
+        result = compile (top_of_stack);
+      }
+
+    std::vector<Instruction> instructions;
+    std::vector<const StackEntry*> sources;
+    std::vector<std::pair<size_t, complex_type>> constants;
+    size_t num_registers, result;
+
+  private:
+    std::vector<size_t> free_registers;
+
+    size_t allocate () {
+      if (free_registers.empty())
+        return num_registers++;
+      size_t reg = free_registers.back();
+      free_registers.pop_back();
+      return reg;
+    }
+
+    size_t compile (const StackEntry& entry) {
+      if (entry.is_constant()) {
+        constants.push_back (std::make_pair (num_registers, entry.value));
+        return num_registers++;
+      }
+
+      Instruction instruction;
+      instruction.evaluator = entry.evaluator.get();
+      if (instruction.evaluator) {
+        for (const auto& operand : entry.evaluator->operands)
+          instruction.in.push_back (compile (operand));
+        for (size_t n = 0; n < instruction.in.size(); ++n)
+          if (!entry.evaluator->operands[n].is_constant())
+            free_registers.push_back (instruction.in[n]);
+      }
+      else {
+        instruction.source = sources.size();
+        sources.push_back (&entry);
+      }
+      instruction.out = allocate();
+      instructions.push_back (instruction);
+      return instruction.out;
+    }
+};
+
+
+
+
+
 /**********************************************************************
    MULTI-THREADED RUNNING OF OPERATIONS:
  **********************************************************************/
@@ -574,22 +630,22 @@ void get_header (const StackEntry& entry, Header& header)
     return;
   }
 
-  if (!entry.image) 
+  if (!entry.header)
     return;
 
   if (header.ndim() == 0) {
-    header = *entry.image;
+    header = *entry.header;
     return;
   }
 
-  if (header.ndim() < entry.image->ndim()) 
-    header.ndim() = entry.image->ndim();
-  for (size_t n = 0; n < std::min<size_t> (header.ndim(), entry.image->ndim()); ++n) {
-    if (header.size(n) > 1 && entry.image->size(n) > 1 && header.size(n) != entry.image->size(n))
+  if (header.ndim() < entry.header->ndim())
+    header.ndim() = entry.header->ndim();
+  for (size_t n = 0; n < std::min<size_t> (header.ndim(), entry.header->ndim()); ++n) {
+    if (header.size(n) > 1 && entry.header->size(n) > 1 && header.size(n) != entry.header->size(n))
       throw Exception ("dimensions of input images do not match - aborting");
-    header.size(n) = std::max (header.size(n), entry.image->size(n));
+    header.size(n) = std::max (header.size(n), entry.header->size(n));
     if (!std::isfinite (header.spacing(n))) 
-      header.spacing(n) = entry.image->spacing(n);
+      header.spacing(n) = entry.header->spacing(n);
   }
 
 }
@@ -597,63 +653,132 @@ void get_header (const StackEntry& entry, Header& header)
 
 
 
+inline real_type as_value_type (real_type*, complex_type value) { return value.real(); }
+inline complex_type as_value_type (complex_type*, complex_type value) { return value; }
+
+
+template <typename ValueType>
+class Source {
+  public:
+    Source () : rng_gaussian (false) { }
+    copy_ptr<Image<ValueType>> image;
+    copy_ptr<Math::RNG> rng;
+    bool rng_gaussian;
+};
 
 
+template <typename ValueType>
 class ThreadFunctor {
   public:
     ThreadFunctor (
-        const std::vector<size_t>& inner_axes,
-        const StackEntry& top_of_stack, 
-        Image<complex_type>& output_image) :
-      top_entry (top_of_stack),
+        const Program& compiled_program,
+        const std::vector<Source<ValueType>>& program_sources,
+        Image<ValueType>& output_image,
+        size_t inner_axis) :
+      program (compiled_program),
+      sources (program_sources),
       image (output_image),
-      loop (Loop (inner_axes)) {
-        storage.axes = loop.axes;
-        storage.size.push_back (image.size(storage.axes[0]));
-        storage.size.push_back (image.size(storage.axes[1]));
-        chunk_size = image.size (storage.axes[0]) * image.size (storage.axes[1]);
-        allocate_storage (top_entry);
+      axis (inner_axis),
+      registers (program.num_registers * tile_size) {
+        for (const auto& constant : program.constants)
+          std::fill_n (reg (constant.first), tile_size, as_value_type (reg (0), constant.second));
       }
 
-    void allocate_storage (const StackEntry& entry) {
-      if (entry.evaluator) {
-        for (size_t n = 0; n < entry.evaluator->operands.size(); ++n)
-          allocate_storage (entry.evaluator->operands[n]);
-        return;
+
+    void operator() (const Iterator& iter) {
+      assign_pos_of (iter).to (image);
+      for (auto& source : sources) {
+        if (source.image) {
+          auto& in (*source.image);
+          for (size_t n = 0; n < in.ndim(); ++n)
+            if (n != axis && in.size(n) > 1)
+              in.index(n) = iter.index(n);
+        }
       }
 
-      storage.push_back (ThreadLocalStorageItem());
-      if (entry.image) {
-        storage.back().image.reset (new Image<complex_type> (*entry.image));
-        storage.back().chunk.resize (chunk_size);
+      const size_t size = image.size (axis);
+      for (size_t start = 0; start < size; start += tile_size) {
+        const size_t count = std::min (tile_size, size - start);
+        for (const auto& instruction : program.instructions) {
+          if (instruction.evaluator) {
+            const ValueType* in[3];
+            for (size_t n = 0; n < instruction.in.size(); ++n)
+              in[n] = reg (instruction.in[n]);
+            instruction.evaluator->evaluate (reg (instruction.out), in, count);
+          }
+          else
+            load (sources[instruction.source], reg (instruction.out), start, count);
+        }
+        image.index (axis) = start;
+        image.set_values (axis, reg (program.result), count);
+      }
+    }
+
+
+    void load (Source<ValueType>& source, ValueType* values, size_t start, size_t count) {
+      if (source.rng) {
+        if (source.rng_gaussian) {
+          std::normal_distribution<real_type> dis (0.0, 1.0);
+          for (size_t n = 0; n < count; ++n)
+            values[n] = dis (*source.rng);
+        }
+        else {
+          std::uniform_real_distribution<real_type> dis (0.0, 1.0);
+          for (size_t n = 0; n < count; ++n)
+            values[n] = dis (*source.rng);
+        }
         return;
       }
-      else if (entry.rng) {
-        storage.back().chunk.resize (chunk_size);
+
+      auto& in (*source.image);
+      if (axis < in.ndim() && in.size (axis) > 1) {
+        in.index (axis) = start;
+        in.get_values (axis, values, count);
       }
-      else storage.back().chunk.value = entry.value;
+      else
+        std::fill_n (values, count, ValueType (in.value()));
     }
 
 
-    void operator() (const Iterator& iter) {
-      storage.reset (iter);
-      assign_pos_of (iter).to (image);
+    ValueType* reg (size_t n) { return registers.data() + n * tile_size; }
 
-      Chunk& chunk = top_entry.evaluate (storage);
+    const Program& program;
+    std::vector<Source<ValueType>> sources;
+    Image<ValueType> image;
+    const size_t axis;
+    std::vector<ValueType> registers;
+};
 
-      auto value = chunk.cbegin();
-      for (auto l = loop (image); l; ++l) 
-        image.value() = *(value++);
-    }
 
 
 
-    const StackEntry& top_entry;
-    Image<complex_type> image;
-    decltype (Loop (std::vector<size_t>())) loop;
-    ThreadLocalStorage storage;
-    size_t chunk_size;
-};
+template <typename ValueType>
+void run_program (const StackEntry& top_of_stack, const std::string& output_name, const Header& header)
+{
+  Program program (top_of_stack);
+
+  // each input image is opened once, and shared by all its occurrences in the expression:
+  std::map<const Header*, Image<ValueType>> images;
+  std::vector<Source<ValueType>> sources (program.sources.size());
+  for (size_t n = 0; n < sources.size(); ++n) {
+    const StackEntry& entry (*program.sources[n]);
+    if (entry.header) {
+      auto image = images.find (entry.header.get());
+      if (image == images.end())
+        image = images.insert (std::make_pair (entry.header.get(), entry.header->get_image<ValueType>())).first;
+      sources[n].image.reset (new Image<ValueType> (image->second));
+    }
+    else {
+      sources[n].rng = entry.rng;
+      sources[n].rng_gaussian = entry.rng_gausssian;
+    }
+  }
+
+  auto output = Header::create (output_name, header).get_image<ValueType>();
+
+  auto loop = ThreadedLoop ("computing: " + operation_string (top_of_stack), output, 0, output.ndim(), 1);
+  loop.run_outer (ThreadFunctor<ValueType> (program, sources, output, loop.inner_axes[0]));
+}
 
 
 
@@ -670,7 +795,7 @@ void run_operations (const std::vector<StackEntry>& stack)
       throw Exception ("too many operands left on stack!");
 
     assert (!stack[0].evaluator);
-    assert (!stack[0].image);
+    assert (!stack[0].header);
 
     print (str (stack[0].value) + "\n");
     return;
@@ -692,12 +817,11 @@ void run_operations (const std::vector<StackEntry>& stack)
   }
   else header.datatype() = DataType::from_command_line (DataType::Float32);
 
-  auto output = Header::create (stack[1].arg, header).get_image<complex_type>();
-
-  auto loop = ThreadedLoop ("computing: " + operation_string(stack[0]), output, 0, output.ndim(), 2);
-
-  ThreadFunctor functor (loop.inner_axes, stack[0], output);
-  loop.run_outer (functor);
+  // purely real expressions are evaluated entirely in real arithmetic:
+  if (requires_complex (stack[0]))
+    run_program<complex_type> (stack[0], stack[1].arg, header);
+  else
+    run_program<real_type> (stack[0], stack[1].arg, header);
 }
 
 
@@ -756,6 +880,7 @@ class OpAbs : public OpUnary {
     OpAbs () : OpUnary ("|%1|", true) { }
     complex_type R (real_type v) const { return std::abs (v); }
     complex_type Z (complex_type v) const { return std::abs (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.abs(); }
 };
 
 class OpNeg : public OpUnary {
@@ -763,6 +888,7 @@ class OpNeg : public OpUnary {
     OpNeg () : OpUnary ("-%1") { }
     complex_type R (real_type v) const { return -v; }
     complex_type Z (complex_type v) const { return -v; }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = -a; }
 };
 
 class OpSqrt : public OpUnary {
@@ -770,6 +896,7 @@ class OpSqrt : public OpUnary {
     OpSqrt () : OpUnary ("sqrt (%1)") { } 
     complex_type R (real_type v) const { return std::sqrt (v); }
     complex_type Z (complex_type v) const { return std::sqrt (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.sqrt(); }
 };
 
 class OpExp : public OpUnary {
@@ -777,6 +904,7 @@ class OpExp : public OpUnary {
     OpExp () : OpUnary ("exp (%1)") { }
     complex_type R (real_type v) const { return std::exp (v); }
     complex_type Z (complex_type v) const { return std::exp (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.exp(); }
 };
 
 class OpLog : public OpUnary {
@@ -784,6 +912,7 @@ class OpLog : public OpUnary {
     OpLog () : OpUnary ("log (%1)") { }
     complex_type R (real_type v) const { return std::log (v); }
     complex_type Z (complex_type v) const { return std::log (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.log(); }
 };
 
 class OpLog10 : public OpUnary {
@@ -791,6 +920,7 @@ class OpLog10 : public OpUnary {
     OpLog10 () : OpUnary ("log10 (%1)") { }
     complex_type R (real_type v) const { return std::log10 (v); }
     complex_type Z (complex_type v) const { return std::log10 (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.log10(); }
 };
 
 class OpCos : public OpUnary {
@@ -798,6 +928,7 @@ class OpCos : public OpUnary {
     OpCos () : OpUnary ("cos (%1)") { } 
     complex_type R (real_type v) const { return std::cos (v); }
     complex_type Z (complex_type v) const { return std::cos (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.cos(); }
 };
 
 class OpSin : public OpUnary {
@@ -805,6 +936,7 @@ class OpSin : public OpUnary {
     OpSin () : OpUnary ("sin (%1)") { } 
     complex_type R (real_type v) const { return std::sin (v); }
     complex_type Z (complex_type v) const { return std::sin (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.sin(); }
 };
 
 class OpTan : public OpUnary {
@@ -812,6 +944,7 @@ class OpTan : public OpUnary {
     OpTan () : OpUnary ("tan (%1)") { }
     complex_type R (real_type v) const { return std::tan (v); }
     complex_type Z (complex_type v) const { return std::tan (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.tan(); }
 };
 
 class OpCosh : public OpUnary {
@@ -833,24 +966,28 @@ class OpTanh : public OpUnary {
     OpTanh () : OpUnary ("tanh (%1)") { } 
     complex_type R (real_type v) const { return std::tanh (v); }
     complex_type Z (complex_type v) const { return std::tanh (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.tanh(); }
 };
 
 class OpAcos : public OpUnary {
   public:
     OpAcos () : OpUnary ("acos (%1)") { }
     complex_type R (real_type v) const { return std::acos (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.acos(); }
 };
 
 class OpAsin : public OpUnary {
   public:
     OpAsin () : OpUnary ("asin (%1)") { } 
     complex_type R (real_type v) const { return std::asin (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.asin(); }
 };
 
 class OpAtan : public OpUnary {
   public:
     OpAtan () : OpUnary ("atan (%1)") { }
     complex_type R (real_type v) const { return std::atan (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.atan(); }
 };
 
 class OpAcosh : public OpUnary {
@@ -876,18 +1013,21 @@ class OpRound : public OpUnary {
   public:
     OpRound () : OpUnary ("round (%1)") { } 
     complex_type R (real_type v) const { return std::round (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.round(); }
 };
 
 class OpCeil : public OpUnary {
   public:
     OpCeil () : OpUnary ("ceil (%1)") { } 
     complex_type R (real_type v) const { return std::ceil (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.ceil(); }
 };
 
 class OpFloor : public OpUnary {
   public:
     OpFloor () : OpUnary ("floor (%1)") { }
     complex_type R (real_type v) const { return std::floor (v); }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.floor(); }
 };
 
 class OpReal : public OpUnary {
@@ -919,6 +1059,7 @@ class OpIsNaN : public OpUnary {
     OpIsNaN () : OpUnary ("isnan (%1)", true, false) { }
     complex_type R (real_type v) const { return std::isnan (v) != 0; }
     complex_type Z (complex_type v) const { return std::isnan (v.real()) != 0 || std::isnan (v.imag()) != 0; }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.isNaN().template cast<real_type>(); }
 };
 
 class OpIsInf : public OpUnary {
@@ -926,6 +1067,7 @@ class OpIsInf : public OpUnary {
     OpIsInf () : OpUnary ("isinf (%1)", true, false) { }
     complex_type R (real_type v) const { return std::isinf (v) != 0; }
     complex_type Z (complex_type v) const { return std::isinf (v.real()) != 0 || std::isinf (v.imag()) != 0; }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.isInf().template cast<real_type>(); }
 };
 
 class OpFinite : public OpUnary {
@@ -933,6 +1075,7 @@ class OpFinite : public OpUnary {
     OpFinite () : OpUnary ("finite (%1)", true, false) { }
     complex_type R (real_type v) const { return std::isfinite (v) != 0; }
     complex_type Z (complex_type v) const { return std::isfinite (v.real()) != 0|| std::isfinite (v.imag()) != 0; }
+    template <class Out, class In> void V (Out& out, const In& a) const { out = a.isFinite().template cast<real_type>(); }
 };
 
 
@@ -945,6 +1088,7 @@ class OpAdd : public OpBinary {
     OpAdd () : OpBinary ("(%1 + %2)") { } 
     complex_type R (real_type a, real_type b) const { return a+b; }
     complex_type Z (complex_type a, complex_type b) const { return a+b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a + b; }
 };
 
 class OpSubtract : public OpBinary {
@@ -952,6 +1096,7 @@ class OpSubtract : public OpBinary {
     OpSubtract () : OpBinary ("(%1 - %2)") { } 
     complex_type R (real_type a, real_type b) const { return a-b; }
     complex_type Z (complex_type a, complex_type b) const { return a-b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a - b; }
 };
 
 class OpMultiply : public OpBinary {
@@ -959,6 +1104,7 @@ class OpMultiply : public OpBinary {
     OpMultiply () : OpBinary ("(%1 * %2)") { }
     complex_type R (real_type a, real_type b) const { return a*b; }
     complex_type Z (complex_type a, complex_type b) const { return a*b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a * b; }
 };
 
 class OpDivide : public OpBinary {
@@ -966,6 +1112,7 @@ class OpDivide : public OpBinary {
     OpDivide () : OpBinary ("(%1 / %2)") { } 
     complex_type R (real_type a, real_type b) const { return a/b; }
     complex_type Z (complex_type a, complex_type b) const { return a/b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a / b; }
 };
 
 class OpPow : public OpBinary {
@@ -973,42 +1120,49 @@ class OpPow : public OpBinary {
     OpPow () : OpBinary ("%1^%2") { }
     complex_type R (real_type a, real_type b) const { return std::pow (a, b); }
     complex_type Z (complex_type a, complex_type b) const { return std::pow (a, b); }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a.pow (b); }
 };
 
 class OpMin : public OpBinary {
   public:
     OpMin () : OpBinary ("min (%1, %2)") { }
     complex_type R (real_type a, real_type b) const { return std::min (a, b); }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a.min (b); }
 };
 
 class OpMax : public OpBinary {
   public:
     OpMax () : OpBinary ("max (%1, %2)") { } 
     complex_type R (real_type a, real_type b) const { return std::max (a, b); }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = a.max (b); }
 };
 
 class OpLessThan : public OpBinary {
   public:
     OpLessThan () : OpBinary ("(%1 < %2)") { }
     complex_type R (real_type a, real_type b) const { return a < b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = (a < b).template cast<real_type>(); }
 };
 
 class OpGreaterThan : public OpBinary {
   public:
     OpGreaterThan () : OpBinary ("(%1 > %2)") { } 
     complex_type R (real_type a, real_type b) const { return a > b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = (a > b).template cast<real_type>(); }
 };
 
 class OpLessThanOrEqual : public OpBinary {
   public:
     OpLessThanOrEqual () : OpBinary ("(%1 <= %2)") { }
     complex_type R (real_type a, real_type b) const { return a <= b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = (a <= b).template cast<real_type>(); }
 };
 
 class OpGreaterThanOrEqual : public OpBinary {
   public:
     OpGreaterThanOrEqual () : OpBinary ("(%1 >= %2)") { } 
     complex_type R (real_type a, real_type b) const { return a >= b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = (a >= b).template cast<real_type>(); }
 };
 
 class OpEqual : public OpBinary {
@@ -1016,6 +1170,7 @@ class OpEqual : public OpBinary {
     OpEqual () : OpBinary ("(%1 == %2)", true) { }
     complex_type R (real_type a, real_type b) const { return a == b; }
     complex_type Z (complex_type a, complex_type b) const { return a == b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = (a == b).template cast<real_type>(); }
 };
 
 class OpNotEqual : public OpBinary {
@@ -1023,6 +1178,7 @@ class OpNotEqual : public OpBinary {
     OpNotEqual () : OpBinary ("(%1 != %2)", true) { }
     complex_type R (real_type a, real_type b) const { return a != b; }
     complex_type Z (complex_type a, complex_type b) const { return a != b; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b) const { out = (a != b).template cast<real_type>(); }
 };
 
 class OpComplex : public OpBinary {
@@ -1046,6 +1202,7 @@ class OpIf : public OpTernary {
     OpIf () : OpTernary ("(%1 ? %2 : %3)") { }
     complex_type R (real_type a, real_type b, real_type c) const { return a ? b : c; }
     complex_type Z (complex_type a, complex_type b, complex_type c) const { return a.real() ? b : c; }
+    template <class Out, class In> void V (Out& out, const In& a, const In& b, const In& c) const { out = (a != real_type (0.0)).select (b, c); }
 };
 
 
@@ -93,6 +93,15 @@ void usage ()
 
   + Option ("connectivity", "use 26-voxel-neighbourhood connectivity (Default: 6)")
 
+  + Option ("out_of_core", "store the matrix of subject data in a temporary memory-mapped file rather than in RAM. "
+                           "This allows the analysis of cohorts for which the data would not otherwise fit in "
+                           "memory; results are identical to those obtained with the data held in RAM.")
+
+  + Option ("memory_budget", "the maximum amount of memory (in MB) to use for the intermediate statistics "
+                             "computed by all threads during permutation testing. By default, each thread "
+                             "processes up to " + str(Stats::PermTest::max_permutation_block_size) + " permutations at once.")
+  +   Argument ("size").type_integer (1)
+
   + Option ("nonstationary", "perform non-stationarity correction (currently only implemented with tfce)")
 
   + Option ("nperms_nonstationary", "the number of permutations used when precomputing the empirical statistic image for nonstationary correction (Default: " + str(DEFAULT_PERMUTATIONS_NONSTATIONARITY) + ")")
@@ -129,6 +138,7 @@ void run() {
   
   bool do_26_connectivity = get_options("connectivity").size();
   bool do_nonstationary_adjustment = get_options ("nonstationary").size();
+  const size_t memory_budget = size_t (get_option_value ("memory_budget", 0)) << 20;
 
   // Read filenames
   std::vector<std::string> subjects;
@@ -205,7 +215,7 @@ void run() {
   const size_t num_vox = mask_indices.size();
 
   // Load images
-  Eigen::Matrix<value_type, Eigen::Dynamic, Eigen::Dynamic> data (num_vox, subjects.size());
+  Math::Stats::MeasurementMatrix data (num_vox, subjects.size(), get_options ("out_of_core").size());
   {
     ProgressBar progress("loading images", subjects.size());
     for (size_t subject = 0; subject < subjects.size(); subject++) {
@@ -262,13 +272,13 @@ void run() {
       Stats::PermTest::run_permutations (glm, cluster_size_test, num_perms, empirical_tfce_statistic,
                                          default_cluster_output, default_cluster_output_neg,
                                          perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+                                         uncorrected_pvalue, uncorrected_pvalue_neg, memory_budget);
     // TFCE
     } else {
       Stats::TFCE::Enhancer tfce_integrator (connector, tfce_dh, tfce_E, tfce_H);
       if (do_nonstationary_adjustment) {
         empirical_tfce_statistic.reset (new std::vector<double> (num_vox, 0.0));
-        Stats::PermTest::precompute_empirical_stat (glm, tfce_integrator, nperms_nonstationary, *empirical_tfce_statistic);
+        Stats::PermTest::precompute_empirical_stat (glm, tfce_integrator, nperms_nonstationary, *empirical_tfce_statistic, memory_budget);
       }
 
       Stats::PermTest::precompute_default_permutation (glm, tfce_integrator, empirical_tfce_statistic,
@@ -277,7 +287,7 @@ void run() {
       Stats::PermTest::run_permutations (glm, tfce_integrator, num_perms, empirical_tfce_statistic,
                                          default_cluster_output, default_cluster_output_neg,
                                          perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+                                         uncorrected_pvalue, uncorrected_pvalue_neg, memory_budget);
     }
 
     save_matrix (perm_distribution, prefix + "perm_dist.txt");
@@ -98,7 +98,11 @@ const OptionGroup SmoothOption = OptionGroup ("Options for smooth filter")
   + Option ("extent", "specify the extent (width) of kernel size in voxels. "
             "This can be specified either as a single value to be used for all axes, "
             "or as a comma-separated list of the extent for each axis. "
-            "The default extent is 2 * ceil(2.5 * stdev / voxel_size) - 1.")
+            "The default extent is 2 * ceil(2.5 * stdev / voxel_size) - 1. "
+            "If not specified, axes along which the stdev exceeds a threshold (SmoothRecursiveThreshold "
+            "config file entry; default 3 voxels) are instead smoothed using a recursive approximation "
+            "to the Gaussian, which is much faster for wide kernels, but differs slightly from direct "
+            "convolution (typically by less than 0.1% of the image intensity).")
   + Argument ("voxels").type_sequence_int();
 
 
@@ -285,14 +285,31 @@ class ImageKernel : public ImageKernelBase {
         template <class ImageType> 
           void operator() (ImageType& out) const { out.value() = Operation(); } 
     };
-    class ProcessFunctor { 
-      public: 
-        template <class ImageType1, class ImageType2>
-          void operator() (ImageType1& out, ImageType2& in) const { 
-            Operation op = out.value(); 
-            op (in.value()); 
-            out.value() = op;
-          } 
+    // process a whole row of the input image at a time, so that the data
+    // can be fetched and converted from the datatype on file in bulk:
+    class ProcessRowFunctor {
+      public:
+        ProcessRowFunctor (const Image<Operation>& image, const Image<value_type>& in,
+                           const std::vector<size_t>& outer_axes, size_t axis) :
+          image (image), in (in), outer_axes (outer_axes), axis (axis), values (image.size (axis)) { }
+
+        void operator() (const Iterator& pos) {
+          assign_pos_of (pos, outer_axes).to (image, in);
+          in.index (axis) = 0;
+          in.get_values (axis, values.data(), values.size());
+          for (auto l = Loop (axis) (image); l; ++l) {
+            Operation op = image.value();
+            op (values[image.index (axis)]);
+            image.value() = op;
+          }
+        }
+
+      protected:
+        Image<Operation> image;
+        Image<value_type> in;
+        const std::vector<size_t>& outer_axes;
+        const size_t axis;
+        std::vector<value_type> values;
     };
     class ResultFunctor {
       public: 
@@ -317,7 +334,8 @@ class ImageKernel : public ImageKernelBase {
     void process (Header& header_in)
     {
       auto in = header_in.get_image<value_type>();
-      ThreadedLoop (image).run (ProcessFunctor(), image, in);
+      auto loop = ThreadedLoop (image);
+      loop.run_outer (ProcessRowFunctor (image, in, loop.outer_loop.axes, loop.inner_axes[0]));
     }
 
   protected:
@@ -109,7 +109,8 @@ typedef double value_type;
 
 
 
-void run ()
+template <typename WarpValueType>
+void run_registration ()
 {
 
   Image<value_type> im1_image = Image<value_type>::open (argument[0]).with_direct_io (Stride::contiguous_along_axis (3));
@@ -289,6 +290,14 @@ void run ()
     rigid_registration.set_gradient_descent_repetitions (parse_ints (opt[0][0]));
   }
 
+  opt = get_options ("rigid_sampling");
+  if (opt.size ()) {
+    if (!do_rigid)
+      throw Exception ("the rigid sampling strategy was input when no rigid registration is requested");
+    rigid_registration.set_sampling (Registration::LinearSamplingType ((int) opt[0][0]), get_option_value ("rigid_sampling.density", 0.1));
+  } else if (get_options ("rigid_sampling.density").size ())
+    throw Exception ("-rigid_sampling.density requires -rigid_sampling to be set");
+
   opt = get_options ("rigid_loop_density");
   if (opt.size ()) {
     if (!do_rigid)
@@ -438,6 +447,14 @@ void run ()
     affine_registration.set_gradient_descent_repetitions (parse_ints (opt[0][0]));
   }
 
+  opt = get_options ("affine_sampling");
+  if (opt.size ()) {
+    if (!do_affine)
+      throw Exception ("the affine sampling strategy was input when no affine registration is requested");
+    affine_registration.set_sampling (Registration::LinearSamplingType ((int) opt[0][0]), get_option_value ("affine_sampling.density", 0.1));
+  } else if (get_options ("affine_sampling.density").size ())
+    throw Exception ("-affine_sampling.density requires -affine_sampling to be set");
+
   opt = get_options ("affine_loop_density");
   if (opt.size ()) {
     if (!do_affine)
@@ -530,7 +547,7 @@ void run ()
     Registration::parse_general_init_options (affine_registration);
 
   // ****** NON-LINEAR REGISTRATION OPTIONS *******
-  Registration::NonLinear nl_registration;
+  Registration::NonLinear<WarpValueType> nl_registration;
   opt = get_options ("nl_warp");
   std::string warp1_filename;
   std::string warp2_filename;
@@ -623,6 +640,9 @@ void run ()
     nl_registration.set_init_grad_step (opt[0][0]);
   }
 
+  if (get_options ("nl_float").size() && !do_nonlinear)
+    throw Exception ("the -nl_float option has been set when no non-linear registration is requested");
+
   opt = get_options ("nl_lmax");
   std::vector<int> nl_lmax;
   if (opt.size ()) {
@@ -836,7 +856,7 @@ void run ()
       Header deform_header (im1_transformed);
       deform_header.ndim() = 4;
       deform_header.size(3) = 3;
-      Image<default_type> deform_field = Image<default_type>::scratch (deform_header);
+      Image<WarpValueType> deform_field = Image<WarpValueType>::scratch (deform_header);
       Registration::Warp::compute_full_deformation (nl_registration.get_im2_to_mid_linear().inverse(),
                                                     *(nl_registration.get_mid_to_im2()),
                                                     *(nl_registration.get_im1_to_mid()),
@@ -878,7 +898,7 @@ void run ()
       if (midway_header.ndim() == 4)
         midway_header.size(3) = im1_image.size(3);
 
-      Image<default_type> im1_deform_field = Image<default_type>::scratch (*(nl_registration.get_im1_to_mid()));
+      Image<WarpValueType> im1_deform_field = Image<WarpValueType>::scratch (*(nl_registration.get_im1_to_mid()));
       Registration::Warp::compose_linear_deformation (nl_registration.get_im1_to_mid_linear(), *(nl_registration.get_im1_to_mid()), im1_deform_field);
 
       auto im1_midway = Image<default_type>::create (im1_midway_transformed_path, midway_header).with_direct_io();
@@ -887,7 +907,7 @@ void run ()
         Registration::Transform::reorient_warp ("reorienting FODs", im1_midway, im1_deform_field,
                                                 Math::SH::spherical2cartesian (DWI::Directions::electrostatic_repulsion_300()).transpose());
 
-      Image<default_type> im2_deform_field = Image<default_type>::scratch (*(nl_registration.get_im2_to_mid()));
+      Image<WarpValueType> im2_deform_field = Image<WarpValueType>::scratch (*(nl_registration.get_im2_to_mid()));
       Registration::Warp::compose_linear_deformation (nl_registration.get_im2_to_mid_linear(), *(nl_registration.get_im2_to_mid()), im2_deform_field);
       auto im2_midway = Image<default_type>::create (im2_midway_transformed_path, midway_header).with_direct_io();
       Filter::warp<Interp::Cubic> (im2_image, im2_midway, im2_deform_field, 0.0);
@@ -905,3 +925,13 @@ void run ()
   if (get_options ("affine_log").size() or get_options ("rigid_log").size())
     linear_logstream.close();
 }
+
+
+
+void run ()
+{
+  if (get_options ("nl_float").size())
+    run_registration<float>();
+  else
+    run_registration<default_type>();
+}
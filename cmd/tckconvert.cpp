@@ -34,7 +34,7 @@ void usage ()
   DESCRIPTION
   + "Convert between different track file formats."
 
-  + "The program currently supports MRtrix .tck files (input/output), "
+  + "The program currently supports MRtrix .tck and compressed .tckz files (input/output), "
     "ascii text files (input/output), and VTK polydata files (output only).";
 
   ARGUMENTS
@@ -196,7 +196,7 @@ void run ()
     // Reader
     Properties properties;
     std::unique_ptr<ReaderInterface<float> > reader;
-    if (has_suffix(argument[0], ".tck")) {
+    if (Path::has_suffix (argument[0], {".tck", ".tckz"})) {
         reader.reset( new Reader<float>(argument[0], properties) );
     }
     else if (has_suffix(argument[0], ".txt")) {
@@ -209,7 +209,7 @@ void run ()
     
     // Writer
     std::unique_ptr<WriterInterface<float> > writer;
-    if (has_suffix(argument[1], ".tck")) {
+    if (Path::has_suffix (argument[1], {".tck", ".tckz"})) {
         writer.reset( new Writer<float>(argument[1], properties) );
     }
     else if (has_suffix(argument[1], ".vtk")) {
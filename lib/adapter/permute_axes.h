@@ -64,6 +64,26 @@ next_axis:
         auto index (size_t axis) -> decltype(Helper::index(*this, axis)) { return { *this, axis }; }
         void move_index (size_t axis, ssize_t increment) { parent().index (axes_[axis]) += increment; }
 
+        //! bulk access to a run of values, if supported by the parent image
+        template <class ParentType = ImageType>
+          auto get_values (size_t axis, value_type* values, size_t count) const
+          -> decltype (std::declval<const ParentType&>().get_values (axis, values, count)) {
+            if (axes_[axis] >= 0)
+              return parent().get_values (axes_[axis], values, count);
+            assert (count <= 1);
+            if (count)
+              values[0] = parent().value();
+          }
+        template <class ParentType = ImageType>
+          auto set_values (size_t axis, const value_type* values, size_t count)
+          -> decltype (std::declval<ParentType&>().set_values (axis, values, count)) {
+            if (axes_[axis] >= 0)
+              return parent().set_values (axes_[axis], values, count);
+            assert (count <= 1);
+            if (count)
+              parent().value() = values[0];
+          }
+
       private:
         const std::vector<int> axes_;
 
@@ -31,6 +31,84 @@ namespace MR
         }
     };
 
+
+
+    // check whether an image type provides bulk access to runs of values
+    // via get_values() / set_values():
+    template <class ImageType>
+      struct __has_row_access {
+        template <class T> static auto test (T* image) -> decltype (
+            image->get_values (size_t(0), (typename T::value_type*) nullptr, size_t(0)),
+            image->set_values (size_t(0), (const typename T::value_type*) nullptr, size_t(0)),
+            std::true_type());
+        template <class T> static std::false_type test (...);
+        static constexpr bool value = decltype (test<ImageType> (nullptr))::value &&
+          !std::is_same<typename ImageType::value_type, bool>::value;
+      };
+
+    template <class InputImageType, class OutputImageType>
+      struct __can_copy_rows {
+        static constexpr bool value = __has_row_access<InputImageType>::value && __has_row_access<OutputImageType>::value;
+      };
+
+
+
+    // copy whole rows along the innermost axis at a time, so that any
+    // conversion to / from the datatype on file is performed in bulk:
+    template <class InputImageType, class OutputImageType>
+      struct __copy_row_func {
+        __copy_row_func (const InputImageType& in, const OutputImageType& out,
+                         const std::vector<size_t>& outer_axes, const std::vector<size_t>& inner_axes) :
+          in (in), out (out), outer_axes (outer_axes),
+          axis (inner_axes[0]), loop (Loop (std::vector<size_t> (inner_axes.begin()+1, inner_axes.end()))),
+          in_values (in.size (axis)), out_values (in.size (axis)) { }
+
+        void operator() (const Iterator& pos) {
+          assign_pos_of (pos, outer_axes).to (in, out);
+          in.index (axis) = out.index (axis) = 0;
+          if (loop.axes.empty())
+            copy_row();
+          else
+            for (auto i = loop (in, out); i; ++i)
+              copy_row();
+        }
+
+        FORCE_INLINE void copy_row () {
+          in.get_values (axis, in_values.data(), in_values.size());
+          for (size_t n = 0; n < in_values.size(); ++n)
+            out_values[n] = in_values[n];
+          out.set_values (axis, out_values.data(), out_values.size());
+        }
+
+        InputImageType in;
+        OutputImageType out;
+        const std::vector<size_t>& outer_axes;
+        const size_t axis;
+        decltype (Loop (std::vector<size_t>())) loop;
+        std::vector<typename InputImageType::value_type> in_values;
+        std::vector<typename OutputImageType::value_type> out_values;
+      };
+
+
+
+    template <class LoopType, class InputImageType, class OutputImageType>
+      inline typename std::enable_if<!__can_copy_rows<InputImageType,OutputImageType>::value, void>::type
+      __run_copy (LoopType&& loop, InputImageType& source, OutputImageType& destination)
+      {
+        loop.run (__copy_func(), source, destination);
+      }
+
+    template <class LoopType, class InputImageType, class OutputImageType>
+      inline typename std::enable_if<__can_copy_rows<InputImageType,OutputImageType>::value, void>::type
+      __run_copy (LoopType&& loop, InputImageType& source, OutputImageType& destination)
+      {
+        if (loop.inner_axes.empty()) {
+          loop.run (__copy_func(), source, destination);
+          return;
+        }
+        loop.run_outer (__copy_row_func<InputImageType,OutputImageType> (source, destination, loop.outer_loop.axes, loop.inner_axes));
+      }
+
   }
 
   //! \endcond
@@ -45,8 +123,7 @@ namespace MR
         const std::vector<size_t>& axes,
         size_t num_axes_in_thread = 1) 
     {
-      ThreadedLoop (source, axes, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (source, axes, num_axes_in_thread), source, destination);
     }
 
   template <class InputImageType, class OutputImageType>
@@ -57,8 +134,7 @@ namespace MR
         size_t to_axis = std::numeric_limits<size_t>::max(),
         size_t num_axes_in_thread = 1)
     {
-      ThreadedLoop (source, from_axis, to_axis, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (source, from_axis, to_axis, num_axes_in_thread), source, destination);
     }
 
 
@@ -72,8 +148,7 @@ namespace MR
         const std::vector<size_t>& axes,
         size_t num_axes_in_thread = 1)
     {
-      ThreadedLoop (message, source, axes, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (message, source, axes, num_axes_in_thread), source, destination);
     }
 
   template <class InputImageType, class OutputImageType>
@@ -85,8 +160,7 @@ namespace MR
         size_t to_axis = std::numeric_limits<size_t>::max(), 
         size_t num_axes_in_thread = 1)
     {
-      ThreadedLoop (message, source, from_axis, to_axis, num_axes_in_thread)
-        .run (__copy_func(), source, destination);
+      __run_copy (ThreadedLoop (message, source, from_axis, to_axis, num_axes_in_thread), source, destination);
     }
 
 
@@ -213,6 +213,38 @@ namespace MR
 
 
 
+    void MMap::prefetch (int64_t offset, int64_t size) const
+    {
+#ifndef MRTRIX_WINDOWS
+      if (!addr || offset >= msize || size <= 0)
+        return;
+      size = std::min (size, msize - offset);
+      // madvise() requires a page-aligned address - addr itself is page-aligned:
+      const int64_t page_size = sysconf (_SC_PAGESIZE);
+      const int64_t begin = ((start + offset) / page_size) * page_size;
+      madvise (addr + begin, start + offset + size - begin, MADV_WILLNEED);
+#endif
+    }
+
+
+
+
+    void MMap::flush_async () const
+    {
+#ifndef MRTRIX_WINDOWS
+      if (!addr || !readwrite)
+        return;
+# ifdef __linux__
+      sync_file_range (fd, start, msize, SYNC_FILE_RANGE_WRITE);
+# else
+      msync (addr, start + msize, MS_ASYNC);
+# endif
+#endif
+    }
+
+
+
+
     bool MMap::changed () const
     {
       assert (fd >= 0);
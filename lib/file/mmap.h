@@ -71,8 +71,22 @@ namespace MR
         bool is_read_write () const {
           return readwrite;
         }
+        //! true if the file is memory-mapped, false if held in a RAM buffer
+        bool is_mapped () const {
+          return addr;
+        }
         bool changed () const;
 
+        //! advise the OS that the \a size bytes at \a offset will be needed soon
+        /*! this initiates reading of the corresponding data from file, without
+         * waiting for it to complete. It has no effect if the file is held in
+         * a RAM buffer. */
+        void prefetch (int64_t offset, int64_t size) const;
+        //! initiate write-back of any modified data to file
+        /*! this does not wait for the write-back to complete, and has no
+         * effect if the file is not memory-mapped with read-write access. */
+        void flush_async () const;
+
         friend std::ostream& operator<< (std::ostream& stream, const MMap& m) {
           stream << "File::MMap { " << m.name() << " [" << m.fd << "], size: "
                  << m.size() << ", mapped " << (m.readwrite ? "RW" : "RO")
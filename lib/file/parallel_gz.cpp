@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <zlib.h>
+
+#include "file/parallel_gz.h"
+#include "raw.h"
+#include "thread.h"
+
+namespace MR
+{
+  namespace File
+  {
+    namespace ParallelGZ
+    {
+
+      namespace
+      {
+
+        // each member consists of a fixed-size gzip header (with FEXTRA set,
+        // holding a single 'MR' subfield with the compressed member size),
+        // raw deflate data, and the standard CRC32 / ISIZE trailer:
+        constexpr size_t header_size = 20;
+        constexpr size_t trailer_size = 8;
+
+
+
+        void write_header (uint8_t* header, uint32_t member_size)
+        {
+          const uint8_t fixed[] = {
+            0x1f, 0x8b,   // magic number
+            0x08,         // compression method: deflate
+            0x04,         // flags: FEXTRA
+            0, 0, 0, 0,   // modification time: not available
+            0,            // extra flags
+            0xff,         // operating system: unknown
+            8, 0,         // XLEN: size of extra field
+            'M', 'R',     // subfield ID
+            4, 0          // subfield length
+          };
+          memcpy (header, fixed, sizeof (fixed));
+          Raw::store_LE<uint32_t> (member_size, header + sizeof (fixed));
+        }
+
+
+
+        // returns the compressed size of the member at the start of
+        // \a data, or zero if it was not written by write():
+        size_t member_size (const uint8_t* data, int64_t available)
+        {
+          if (available < int64_t (header_size + trailer_size))
+            return 0;
+          uint8_t expected[header_size];
+          write_header (expected, 0);
+          if (memcmp (data, expected, header_size - 4))
+            return 0;
+          const size_t size = Raw::fetch_LE<uint32_t> (data + header_size - 4);
+          if (size < header_size + trailer_size || int64_t (size) > available)
+            return 0;
+          return size;
+        }
+
+
+
+        void compress (const uint8_t* data, size_t size, std::vector<uint8_t>& member)
+        {
+          z_stream stream;
+          memset (&stream, 0, sizeof (stream));
+          if (deflateInit2 (&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw Exception ("error initialising gzip compression");
+
+          member.resize (header_size + deflateBound (&stream, size) + trailer_size);
+          stream.next_in = const_cast<Bytef*> (data);
+          stream.avail_in = size;
+          stream.next_out = member.data() + header_size;
+          stream.avail_out = member.size() - header_size - trailer_size;
+          const int status = deflate (&stream, Z_FINISH);
+          deflateEnd (&stream);
+          if (status != Z_STREAM_END)
+            throw Exception ("error compressing data for gzip file");
+
+          const size_t total = header_size + stream.total_out + trailer_size;
+          write_header (member.data(), total);
+          Raw::store_LE<uint32_t> (crc32 (crc32 (0, NULL, 0), data, size), member.data() + total - trailer_size);
+          Raw::store_LE<uint32_t> (size, member.data() + total - 4);
+          member.resize (total);
+        }
+
+
+
+        void decompress (const std::string& filename, const uint8_t* member, size_t size, uint8_t* data, size_t data_size)
+        {
+          z_stream stream;
+          memset (&stream, 0, sizeof (stream));
+          if (inflateInit2 (&stream, -MAX_WBITS) != Z_OK)
+            throw Exception ("error initialising gzip decompression");
+
+          stream.next_in = const_cast<Bytef*> (member + header_size);
+          stream.avail_in = size - header_size - trailer_size;
+          stream.next_out = data;
+          stream.avail_out = data_size;
+          const int status = inflate (&stream, Z_FINISH);
+          inflateEnd (&stream);
+          if (status != Z_STREAM_END || stream.total_out != data_size)
+            throw Exception ("error uncompressing file \"" + filename + "\" - file may be corrupt");
+          if (crc32 (crc32 (0, NULL, 0), data, data_size) != Raw::fetch_LE<uint32_t> (member + size - trailer_size))
+            throw Exception ("CRC error uncompressing file \"" + filename + "\" - file may be corrupt");
+        }
+
+
+
+        size_t num_threads (size_t num_jobs)
+        {
+          return std::max<size_t> (1, std::min (Thread::number_of_threads(), num_jobs));
+        }
+
+      }
+
+
+
+
+
+      void write (File::OFStream& out, const uint8_t* data, size_t size, const std::function<void()>& progress)
+      {
+        const size_t nblocks = std::max<size_t> (1, num_blocks (size));
+        // compress a few blocks per thread at a time, and write them out in order:
+        const size_t batch_size = std::min (nblocks, 2 * num_threads (nblocks));
+        std::vector<std::vector<uint8_t>> members (batch_size);
+
+        for (size_t first = 0; first < nblocks; first += batch_size) {
+          const size_t last = std::min (first + batch_size, nblocks);
+          std::atomic<size_t> next (first);
+
+          struct {
+            const uint8_t* data;
+            size_t size, first, last;
+            std::atomic<size_t>& next;
+            std::vector<std::vector<uint8_t>>& members;
+            void execute () {
+              size_t n;
+              while ((n = next++) < last) {
+                const size_t offset = n * block_size;
+                compress (data + offset, std::min (block_size, size - offset), members[n-first]);
+              }
+            }
+          } compressor = { data, size, first, last, next, members };
+
+          const size_t nthreads = num_threads (last - first);
+          if (nthreads > 1) {
+            auto threads = Thread::run (Thread::multi (compressor, nthreads), "gzip compression");
+            threads.wait();
+          }
+          else
+            compressor.execute();
+
+          for (size_t n = first; n < last; ++n) {
+            out.write (reinterpret_cast<const char*> (members[n-first].data()), members[n-first].size());
+            if (progress)
+              progress();
+          }
+        }
+      }
+
+
+
+
+
+      Reader::Reader (const std::string& filename) :
+        filename (filename),
+        mmap ((File::Entry (filename)))
+      {
+        const uint8_t* file = mmap.address();
+        int64_t pos = 0, data_offset = 0;
+        while (pos < mmap.size()) {
+          const size_t member = member_size (file + pos, mmap.size() - pos);
+          if (!member) {
+            members.clear();
+            return;
+          }
+          const int64_t data_size = Raw::fetch_LE<uint32_t> (file + pos + member - 4);
+          members.push_back ({ pos, int64_t (member), data_offset, data_size });
+          pos += member;
+          data_offset += data_size;
+        }
+      }
+
+
+
+      void Reader::read (int64_t offset, uint8_t* data, size_t size) const
+      {
+        if (offset + int64_t (size) > this->size())
+          throw Exception ("unexpected end of file in \"" + filename + "\"");
+
+        // first member that ends beyond the start of the requested range:
+        auto member = std::upper_bound (members.begin(), members.end(), offset,
+            [] (int64_t value, const Member& m) { return value < m.data_offset + m.data_size; });
+        std::vector<uint8_t> buffer;
+        for (; member != members.end() && member->data_offset < offset + int64_t (size); ++member) {
+          const int64_t begin = std::max (offset, member->data_offset);
+          const int64_t end = std::min (offset + int64_t (size), member->data_offset + member->data_size);
+          if (begin == member->data_offset && end == member->data_offset + member->data_size)
+            decompress (filename, mmap.address() + member->start, member->size, data + (begin - offset), member->data_size);
+          else {
+            // member only partially overlaps the requested range:
+            buffer.resize (member->data_size);
+            decompress (filename, mmap.address() + member->start, member->size, buffer.data(), member->data_size);
+            memcpy (data + (begin - offset), buffer.data() + (begin - member->data_offset), end - begin);
+          }
+        }
+      }
+
+
+
+      void Reader::read_parallel (int64_t offset, uint8_t* data, size_t size, const std::function<void()>& progress) const
+      {
+        if (offset + int64_t (size) > this->size())
+          throw Exception ("unexpected end of file in \"" + filename + "\"");
+
+        // split the requested range at the member boundaries:
+        std::vector<std::pair<int64_t,int64_t>> ranges;
+        for (const auto& member : members) {
+          const int64_t begin = std::max (offset, member.data_offset);
+          const int64_t end = std::min (offset + int64_t (size), member.data_offset + member.data_size);
+          if (begin < end)
+            ranges.push_back ({ begin, end });
+        }
+
+        std::atomic<size_t> next (0);
+        std::mutex mutex;
+        struct {
+          const Reader& reader;
+          int64_t offset;
+          uint8_t* data;
+          const std::vector<std::pair<int64_t,int64_t>>& ranges;
+          std::atomic<size_t>& next;
+          std::mutex& mutex;
+          const std::function<void()>& progress;
+          void execute () {
+            size_t n;
+            while ((n = next++) < ranges.size()) {
+              reader.read (ranges[n].first, data + (ranges[n].first - offset), ranges[n].second - ranges[n].first);
+              if (progress) {
+                std::lock_guard<std::mutex> lock (mutex);
+                progress();
+              }
+            }
+          }
+        } decompressor = { *this, offset, data, ranges, next, mutex, progress };
+
+        const size_t nthreads = num_threads (ranges.size());
+        if (nthreads > 1) {
+          auto threads = Thread::run (Thread::multi (decompressor, nthreads), "gzip decompression");
+          threads.wait();
+        }
+        else
+          decompressor.execute();
+      }
+
+
+    }
+  }
+}
+
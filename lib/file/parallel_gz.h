@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __file_parallel_gz_h__
+#define __file_parallel_gz_h__
+
+#include <functional>
+
+#include "types.h"
+#include "file/ofstream.h"
+#include "file/mmap.h"
+
+namespace MR
+{
+  namespace File
+  {
+
+    //! block-parallel compression & decompression of gzip files
+    /*! Data are compressed in independent blocks of block_size bytes, using
+     * all available threads, each written out as a separate member of a
+     * multi-member gzip stream. Such streams are fully standards-compliant,
+     * and can be read by any gzip decoder (including zlib's gzread(), as
+     * used by File::GZ).
+     *
+     * The gzip header of each member carries an extra field (subfield ID
+     * 'MR') holding the compressed size of the member, which allows the
+     * members to be located without decompressing them, and hence
+     * decompressed in parallel. Files not written in this way (i.e. without
+     * this extra field) are not handled by Reader, and should be decoded
+     * serially using File::GZ instead. */
+    namespace ParallelGZ
+    {
+
+      //! the amount of uncompressed data in each gzip member
+      constexpr size_t block_size = 4194304;
+
+      //! the number of blocks needed to hold \a size bytes
+      inline size_t num_blocks (size_t size) { return (size + block_size - 1) / block_size; }
+
+      //! compress the \a size bytes at \a data, appending the resulting gzip members to \a out
+      /*! \a progress (if set) is invoked once per block written. */
+      void write (File::OFStream& out, const uint8_t* data, size_t size,
+          const std::function<void()>& progress = std::function<void()>());
+
+      //! random access to the contents of a file written by write()
+      /*! On construction, the file is memory-mapped and the headers of its
+       * gzip members are scanned to locate them (without decompressing any
+       * data); read() then only decompresses those members that overlap the
+       * requested range. If the file was not written by write(), valid()
+       * returns \c false, and the file should be decompressed serially
+       * using File::GZ instead. */
+      class Reader
+      {
+        public:
+          Reader (const std::string& filename);
+
+          //! whether the file was written by write(), and can hence be read by this class
+          bool valid () const { return members.size(); }
+          //! the total size of the uncompressed data
+          int64_t size () const { return members.size() ? members.back().data_offset + members.back().data_size : 0; }
+
+          //! decompress \a size bytes starting at uncompressed \a offset into \a data
+          /*! this is safe to call concurrently from multiple threads. */
+          void read (int64_t offset, uint8_t* data, size_t size) const;
+
+          //! as read(), but decompressing different members concurrently using all available threads
+          /*! \a progress (if set) is invoked once per member decompressed,
+           * from one thread at a time. */
+          void read_parallel (int64_t offset, uint8_t* data, size_t size,
+              const std::function<void()>& progress = std::function<void()>()) const;
+
+        protected:
+          class Member { public: int64_t start, size, data_offset, data_size; };
+
+          const std::string filename;
+          File::MMap mmap;
+          std::vector<Member> members;
+      };
+
+    }
+
+  }
+}
+
+#endif
+
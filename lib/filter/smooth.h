@@ -20,13 +20,120 @@
 #include "image.h"
 #include "algo/copy.h"
 #include "algo/threaded_copy.h"
+#include "algo/threaded_loop.h"
 #include "adapter/gaussian1D.h"
+#include "file/config.h"
 #include "filter/base.h"
 
 namespace MR
 {
   namespace Filter
   {
+
+    //! \cond skip
+    namespace {
+
+      // Recursive (IIR) approximation to Gaussian smoothing along a single
+      // axis, after Young & van Vliet (Signal Processing, 1995). Each line is
+      // filtered in place, and all volumes at a given position are processed
+      // together. Non-finite values are ignored, and the result is normalised
+      // by the filtered weights, which mimics the renormalised kernel used by
+      // Adapter::Gaussian1D near the image boundaries. The line is padded with
+      // zeros so that the anti-causal pass starts from the decayed tail of the
+      // causal pass, rather than from zero at the last voxel.
+      template <class ImageType>
+        class RecursiveGaussian1D {
+          public:
+            RecursiveGaussian1D (const ImageType& image, default_type stdev_in_voxels, size_t axis, bool zero_boundary) :
+                image (image),
+                axis (axis),
+                zero_boundary (zero_boundary),
+                nvols (image.ndim() > 3 ? voxel_count (image, 3) : 1),
+                padded_size (image.size (axis) + std::ceil (4.0 * stdev_in_voxels) + 3),
+                values (padded_size * nvols),
+                weights (padded_size) {
+              const default_type sigma = stdev_in_voxels;
+              const default_type q = sigma >= 2.5 ?
+                0.98711 * sigma - 0.96330 :
+                3.97156 - 4.14554 * std::sqrt (1.0 - 0.26891 * sigma);
+              const default_type b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+              b[0] = (2.44413*q + 2.85619*q*q + 1.26661*q*q*q) / b0;
+              b[1] = -(1.4281*q*q + 1.26661*q*q*q) / b0;
+              b[2] = 0.422205*q*q*q / b0;
+              B = 1.0 - (b[0] + b[1] + b[2]);
+            }
+
+            void operator() (const Iterator& pos) {
+              assign_pos_of (pos).to (image);
+              const ssize_t n = image.size (axis);
+
+              // gather line, with all volumes contiguous for each position:
+              for (image.index(axis) = 0; image.index(axis) < n; ++image.index(axis)) {
+                bool finite = true;
+                for (size_t v = 0; v < nvols; ++v) {
+                  set_volume (v);
+                  const default_type val = image.value();
+                  finite = finite && std::isfinite (val);
+                  values[image.index(axis)*nvols + v] = val;
+                }
+                weights[image.index(axis)] = finite ? 1.0 : 0.0;
+                if (!finite)
+                  for (size_t v = 0; v < nvols; ++v)
+                    values[image.index(axis)*nvols + v] = 0.0;
+              }
+
+              std::fill (values.begin() + n*nvols, values.end(), 0.0);
+              std::fill (weights.begin() + n, weights.end(), 0.0);
+              filter (weights.data(), 1);
+              for (size_t v = 0; v < nvols; ++v)
+                filter (values.data() + v, nvols);
+
+              for (image.index(axis) = 0; image.index(axis) < n; ++image.index(axis)) {
+                const ssize_t i = image.index(axis);
+                const bool at_boundary = zero_boundary && (i == 0 || i == n-1);
+                for (size_t v = 0; v < nvols; ++v) {
+                  set_volume (v);
+                  image.value() = at_boundary ? 0.0 : values[i*nvols + v] / weights[i];
+                }
+              }
+            }
+
+          protected:
+            ImageType image;
+            const size_t axis;
+            const bool zero_boundary;
+            const size_t nvols;
+            const ssize_t padded_size;
+            std::vector<default_type> values, weights;
+            default_type b[3], B;
+
+            void set_volume (size_t v) {
+              for (size_t a = 3; a < image.ndim(); ++a) {
+                image.index(a) = v % image.size(a);
+                v /= image.size(a);
+              }
+            }
+
+            // causal then anti-causal pass over the padded line:
+            void filter (default_type* data, size_t stride) const {
+              default_type w1 = 0.0, w2 = 0.0, w3 = 0.0;
+              for (ssize_t i = 0; i < padded_size; ++i) {
+                default_type& x = data[i*stride];
+                x = B*x + b[0]*w1 + b[1]*w2 + b[2]*w3;
+                w3 = w2; w2 = w1; w1 = x;
+              }
+              w1 = w2 = w3 = 0.0;
+              for (ssize_t i = padded_size-1; i >= 0; --i) {
+                default_type& x = data[i*stride];
+                x = B*x + b[0]*w1 + b[1]*w2 + b[2]*w3;
+                w3 = w2; w2 = w1; w1 = x;
+              }
+            }
+        };
+
+    }
+    //! \endcond
+
     /** \addtogroup Filters
     @{ */
 
@@ -41,6 +148,18 @@ namespace MR
      * smooth_filter (input, output);
      *
      * \endcode
+     *
+     * Unless an explicit kernel extent has been set, axes along which the
+     * standard deviation exceeds SmoothRecursiveThreshold voxels are smoothed
+     * using a recursive (IIR) approximation to the Gaussian, the cost of which
+     * does not depend on the width of the kernel. Otherwise, the image is
+     * convolved directly with a truncated Gaussian kernel.
+     *
+     * \note the two approaches do not give identical results: the recursive
+     * filter only approximates the Gaussian, while the direct kernel is
+     * truncated at 2.5 standard deviations. The difference is typically
+     * less than 0.1% of the image intensity. Setting an explicit extent
+     * using set_extent() ensures that direct convolution is used.
      */
     class Smooth : public Base
     {
@@ -51,7 +170,8 @@ namespace MR
             Base (in),
             extent (3, 0),
             stdev (3, 0.0),
-            zero_boundary (false)
+            zero_boundary (false),
+            recursive_threshold (get_recursive_threshold())
         {
           for (int i = 0; i < 3; i++)
             stdev[i] = in.spacing(i);
@@ -62,7 +182,9 @@ namespace MR
         Smooth (const HeaderType& in, const std::vector<default_type>& stdev_in):
             Base (in),
             extent (3, 0),
-            stdev (3, 0.0)
+            stdev (3, 0.0),
+            zero_boundary (false),
+            recursive_threshold (get_recursive_threshold())
         {
           set_stdev (stdev_in);
           datatype() = DataType::Float32;
@@ -134,7 +256,18 @@ namespace MR
           }
 
           for (size_t dim = 0; dim < 3; dim++) {
-            if (stdev[dim] > 0) {
+            if (stdev[dim] > 0 && !extent[dim] && stdev[dim] / input.spacing(dim) > std::max (recursive_threshold, 0.5)) {
+              // smooth in place, one line at a time:
+              std::vector<size_t> outer_axes;
+              for (size_t axis = 0; axis < 3; ++axis)
+                if (axis != dim)
+                  outer_axes.push_back (axis);
+              RecursiveGaussian1D<Image<ValueType>> gaussian (*in, stdev[dim] / input.spacing(dim), dim, zero_boundary);
+              ThreadedLoop (*in, outer_axes, std::vector<size_t> (1, dim)).run_outer (gaussian);
+              if (progress)
+                ++(*progress);
+            }
+            else if (stdev[dim] > 0) {
               out = std::make_shared<Image<ValueType> > (Image<ValueType>::scratch (input));
               Adapter::Gaussian1D<Image<ValueType> > gaussian (*in, stdev[dim], dim, extent[dim], zero_boundary);
               threaded_copy (gaussian, *out, 0, input.ndim(), 2);
@@ -150,6 +283,22 @@ namespace MR
         std::vector<int> extent;
         std::vector<default_type> stdev;
         bool zero_boundary;
+        const default_type recursive_threshold;
+
+        static default_type get_recursive_threshold () {
+          //CONF option: SmoothRecursiveThreshold
+          //CONF default: 3.0
+          //CONF The Gaussian standard deviation (in voxels) above which
+          //CONF image smoothing uses a recursive filter rather than direct
+          //CONF convolution. This affects all commands that smooth images
+          //CONF (e.g. mrfilter, mrregister): the recursive filter is much
+          //CONF faster for wide kernels, but its results differ slightly
+          //CONF (typically by less than 0.1% of the image intensity). Set to
+          //CONF a large value to always use direct convolution, as in
+          //CONF previous versions.
+          static const default_type threshold = File::Config::get_float ("SmoothRecursiveThreshold", 3.0);
+          return threshold;
+        }
     };
     //! @}
   }
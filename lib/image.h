@@ -103,6 +103,29 @@ namespace MR
                    (address(), size (axis), Eigen::InnerStride<> (stride (axis)));
         }
 
+        //! get a run of \a count values along \a axis, starting from the current location
+        /*! The values are converted from the datatype on file in a single
+         * call, which is much faster than repeated calls to value() for
+         * images not using direct IO. The current location is not modified. */
+        FORCE_INLINE void get_values (size_t axis, ValueType* values, size_t count) const {
+          assert (index (axis) + ssize_t (count) <= size (axis));
+          if (data_pointer) {
+            for (size_t n = 0; n < count; ++n)
+              values[n] = Raw::fetch_native<ValueType> (data_pointer, data_offset + n*stride (axis));
+          }
+          else buffer->get_values (data_offset, stride (axis), values, count);
+        }
+        //! set a run of \a count values along \a axis, starting from the current location
+        /*! \sa get_values() */
+        FORCE_INLINE void set_values (size_t axis, const ValueType* values, size_t count) {
+          assert (index (axis) + ssize_t (count) <= size (axis));
+          if (data_pointer) {
+            for (size_t n = 0; n < count; ++n)
+              Raw::store_native<ValueType> (values[n], data_pointer, data_offset + n*stride (axis));
+          }
+          else buffer->set_values (data_offset, stride (axis), values, count);
+        }
+
         //! use for debugging
         friend std::ostream& operator<< (std::ostream& stream, const Image& V) {
           stream << "\"" << V.name() << "\", datatype " << DataType::from<Image::value_type>().specifier() << ", index [ ";
@@ -140,6 +163,11 @@ namespace MR
          * optional \a with_strides argument is used to additionally enforce
          * preloading if the strides aren't compatible with those specified. 
          *
+         * Compressed images are otherwise decompressed directly into a
+         * single buffer. If preloading is needed, the decompressed data are
+         * held in RAM alongside the preloaded copy, doubling the memory
+         * required.
+         *
          * Example:
          * \code
          * auto image = Header::open (argument[0]).get_image().with_direct_io();
@@ -230,7 +258,8 @@ namespace MR
         Buffer& operator= (const Buffer&) = delete;
         Buffer& operator= (Buffer&&) = default;
         Buffer (const Buffer& b) : 
-          Header (b), fetch_func (b.fetch_func), store_func (b.store_func) { }
+          Header (b), fetch_func (b.fetch_func), store_func (b.store_func),
+          fetch_row_func (b.fetch_row_func), store_row_func (b.store_row_func) { }
 
 
         FORCE_INLINE ValueType get_value (size_t offset) const {
@@ -243,6 +272,24 @@ namespace MR
           store_func (val, io->segment (nseg), offset - nseg*io->segment_size(), intensity_offset(), intensity_scale());
         }
 
+        void get_values (size_t offset, ssize_t stride, ValueType* values, size_t count) const {
+          const ssize_t nseg = offset / io->segment_size();
+          if (count && in_segment (offset + (count-1)*stride, nseg))
+            fetch_row_func (values, io->segment (nseg), offset - nseg*io->segment_size(), stride, count, intensity_offset(), intensity_scale());
+          else
+            for (size_t n = 0; n < count; ++n)
+              values[n] = get_value (offset + n*stride);
+        }
+
+        void set_values (size_t offset, ssize_t stride, const ValueType* values, size_t count) const {
+          const ssize_t nseg = offset / io->segment_size();
+          if (count && in_segment (offset + (count-1)*stride, nseg))
+            store_row_func (values, io->segment (nseg), offset - nseg*io->segment_size(), stride, count, intensity_offset(), intensity_scale());
+          else
+            for (size_t n = 0; n < count; ++n)
+              set_value (offset + n*stride, values[n]);
+        }
+
         std::unique_ptr<uint8_t[]> data_buffer;
         void* get_data_pointer ();
 
@@ -251,9 +298,16 @@ namespace MR
       protected:
         std::function<ValueType(const void*,size_t,default_type,default_type)> fetch_func;
         std::function<void(ValueType,void*,size_t,default_type,default_type)> store_func;
+        FetchRowFunc<ValueType> fetch_row_func;
+        StoreRowFunc<ValueType> store_row_func;
 
         void set_fetch_store_functions () {
           __set_fetch_store_functions (fetch_func, store_func, datatype());
+          __set_fetch_store_row_functions (fetch_row_func, store_row_func, datatype());
+        }
+
+        FORCE_INLINE bool in_segment (size_t offset, ssize_t nseg) const {
+          return ssize_t (offset / io->segment_size()) == nseg;
         }
     };
 
@@ -298,6 +352,15 @@ namespace MR
         FORCE_INLINE value_type value () const { return Raw::fetch_native<ValueType> (data, offset); } 
         FORCE_INLINE auto value () -> decltype (Helper::value (*this)) { return { *this }; }
         FORCE_INLINE void set_value (ValueType val) { Raw::store_native<ValueType> (val, data, offset); }
+
+        FORCE_INLINE void get_values (size_t axis, ValueType* values, size_t count) const {
+          for (size_t n = 0; n < count; ++n)
+            values[n] = Raw::fetch_native<ValueType> (data, offset + n*stride (axis));
+        }
+        FORCE_INLINE void set_values (size_t axis, const ValueType* values, size_t count) {
+          for (size_t n = 0; n < count; ++n)
+            Raw::store_native<ValueType> (values[n], data, offset + n*stride (axis));
+        }
       };
 
   }
@@ -422,8 +485,14 @@ namespace MR
       else 
         with_strides = Stride::get (*this); 
 
-      if (!preload) 
-        return std::move (*this);
+      if (!preload) {
+        // data split into segments only to defer loading them (e.g.
+        // compressed images) are loaded into a single segment instead:
+        buffer->get_io()->make_contiguous();
+        if (buffer->get_io()->nsegments() == 1)
+          return Image (buffer, with_strides);
+        preload = true;
+      }
 
       // do the preload:
 
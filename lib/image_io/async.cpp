@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include <limits>
+#include <chrono>
+
+#ifndef MRTRIX_WINDOWS
+# include <unistd.h>
+#endif
+
+#include "image_io/async.h"
+#include "file/config.h"
+#include "thread.h"
+
+// the amount of data requested from the OS in one go when reading ahead:
+#define ASYNC_IO_SLAB_SIZE 16777216
+// the interval between successive write-backs of modified data:
+#define ASYNC_IO_FLUSH_INTERVAL_MS 1000
+
+namespace MR
+{
+  namespace ImageIO
+  {
+
+    namespace
+    {
+      int64_t page_size ()
+      {
+#ifdef MRTRIX_WINDOWS
+        return 4096;
+#else
+        return sysconf (_SC_PAGESIZE);
+#endif
+      }
+
+      // never read ahead more than half the physical RAM, to avoid evicting
+      // data that has already been read but not yet processed:
+      int64_t read_ahead_budget ()
+      {
+#ifdef MRTRIX_WINDOWS
+        return std::numeric_limits<int64_t>::max();
+#else
+        return int64_t (sysconf (_SC_PHYS_PAGES)) * page_size() / 2;
+#endif
+      }
+    }
+
+
+
+    //CONF option: ImageAsyncIO
+    //CONF default: 1 (true)
+    //CONF Whether to read the contents of image files into RAM in a
+    //CONF background thread while they are being processed, and to initiate
+    //CONF write-back of modified image data during processing rather than
+    //CONF when the image is closed. This allows file access and processing
+    //CONF to overlap, which can substantially reduce run times for images
+    //CONF residing on networked or otherwise slow storage.
+    bool Async::enabled (int64_t size)
+    {
+      return size >= ASYNC_IO_SLAB_SIZE && File::Config::get_bool ("ImageAsyncIO", true);
+    }
+
+
+
+    Async::Async (const std::vector<std::shared_ptr<File::MMap>>& mmaps, bool read_ahead, bool write_behind) :
+      mmaps (mmaps),
+      read_ahead (read_ahead),
+      write_behind (write_behind),
+      stop (false)
+    {
+      start();
+    }
+
+
+
+    Async::Async (const std::vector<File::Entry>& files) :
+      files (files),
+      read_ahead (true),
+      write_behind (false),
+      stop (false)
+    {
+      start();
+    }
+
+
+
+    Async::~Async ()
+    {
+      if (!thread.joinable())
+        return;
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        stop = true;
+      }
+      stop_requested.notify_all();
+      thread.join();
+      Thread::__Backend::unregister_thread();
+    }
+
+
+
+    void Async::start ()
+    {
+      Thread::__Backend::register_thread();
+      try {
+        thread = std::thread (&Async::execute, this);
+      }
+      catch (...) {
+        DEBUG ("unable to launch asynchronous IO thread - continuing without it");
+        Thread::__Backend::unregister_thread();
+      }
+    }
+
+
+
+    void Async::execute ()
+    {
+      // this is only ever an optimisation: any failure simply ends it
+      try {
+        if (read_ahead) {
+          int64_t budget = read_ahead_budget();
+          for (const auto& mmap : mmaps)
+            if (!read (*mmap, budget))
+              break;
+          for (const auto& entry : files) {
+            if (stopped())
+              break;
+            File::MMap mmap (entry);
+            if (!read (mmap, budget))
+              break;
+          }
+        }
+
+        if (write_behind) {
+          std::unique_lock<std::mutex> lock (mutex);
+          while (!stop_requested.wait_for (lock, std::chrono::milliseconds (ASYNC_IO_FLUSH_INTERVAL_MS), [this] { return stop; }))
+            for (const auto& mmap : mmaps)
+              mmap->flush_async();
+        }
+      }
+      catch (...) { }
+    }
+
+
+
+    // page in the contents of the file one slab at a time, requesting
+    // the next slab from the OS while the current one is being read.
+    // Returns false if reading ahead should not continue:
+    bool Async::read (const File::MMap& mmap, int64_t& budget)
+    {
+      if (!mmap.is_mapped())
+        return true;
+
+      const int64_t page = page_size();
+      const volatile uint8_t* data = mmap.address();
+      mmap.prefetch (0, ASYNC_IO_SLAB_SIZE);
+      for (int64_t offset = 0; offset < mmap.size(); offset += ASYNC_IO_SLAB_SIZE) {
+        if (budget <= 0 || stopped())
+          return false;
+        mmap.prefetch (offset + ASYNC_IO_SLAB_SIZE, ASYNC_IO_SLAB_SIZE);
+        const int64_t end = std::min<int64_t> (offset + ASYNC_IO_SLAB_SIZE, mmap.size());
+        for (int64_t n = offset; n < end; n += page)
+          (void) data[n];
+        budget -= end - offset;
+      }
+      return true;
+    }
+
+
+
+    bool Async::stopped ()
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      return stop;
+    }
+
+
+  }
+}
+
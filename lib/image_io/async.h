@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __image_io_async_h__
+#define __image_io_async_h__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "memory.h"
+#include "file/entry.h"
+#include "file/mmap.h"
+
+namespace MR
+{
+  namespace ImageIO
+  {
+
+    //! background read-ahead and write-behind of image data
+    /*! This runs a single background thread, which reads the contents of
+     * the image files into RAM in slabs, in file order (which is the order
+     * in which loops over the image will typically access them), while the
+     * processing threads get on with their work. For images memory-mapped
+     * with read-write access, it then periodically initiates write-back of
+     * any modified data, so that this happens during processing rather than
+     * all at once when the image is closed.
+     *
+     * None of this affects the contents of the image: the background thread
+     * only ever reads from the files, and any failure is silently ignored.
+     * The thread is stopped when the object is destroyed.
+     *
+     * This can be disabled using the ImageAsyncIO config file entry. */
+    class Async
+    {
+      public:
+        //! read ahead and/or write behind the memory-mapped files in \a mmaps
+        Async (const std::vector<std::shared_ptr<File::MMap>>& mmaps, bool read_ahead, bool write_behind);
+        //! read ahead the files in \a files, which will shortly be read sequentially
+        Async (const std::vector<File::Entry>& files);
+        ~Async ();
+
+        //! whether asynchronous IO should be used for an image of \a size bytes
+        static bool enabled (int64_t size);
+
+      protected:
+        std::vector<std::shared_ptr<File::MMap>> mmaps;
+        std::vector<File::Entry> files;
+        const bool read_ahead, write_behind;
+        std::mutex mutex;
+        std::condition_variable stop_requested;
+        bool stop;
+        std::thread thread;
+
+        void start ();
+        void execute ();
+        bool read (const File::MMap& mmap, int64_t& budget);
+        bool stopped ();
+    };
+
+  }
+}
+
+#endif
+
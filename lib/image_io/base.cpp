@@ -33,6 +33,8 @@ namespace MR
 
     bool Base::is_file_backed () const { return true; }
 
+    void Base::load_segment (size_t) const { assert (0); }
+
     void Base::open (const Header& header, size_t buffer_size)
     {
       if (addresses.size())
@@ -52,6 +54,7 @@ namespace MR
       unload (header);
       DEBUG ("image \"" + header.name() + "\" unloaded");
       addresses.clear();
+      segment_loaded.reset();
     }
 
 
@@ -17,6 +17,7 @@
 #define __image_io_base_h__
 
 #include <vector>
+#include <atomic>
 #include <stdint.h>
 #include <unistd.h>
 #include <cassert>
@@ -74,6 +75,8 @@ namespace MR
 
         uint8_t* segment (size_t n) const {
           assert (n < addresses.size());
+          if (segment_loaded && !segment_loaded[n].load (std::memory_order_acquire))
+            load_segment (n);
           return addresses[n].get();
         }
         size_t nsegments () const {
@@ -84,6 +87,14 @@ namespace MR
           return segsize;
         }
 
+        //! hold the data in a single segment, if possible
+        /*! This is used by Image::with_direct_io() to access the data
+         * directly without copying them, for handlers that only split the
+         * data into segments to defer loading them. Other handlers are left
+         * unchanged. This must not be invoked while the data are being
+         * accessed. */
+        virtual void make_contiguous () { }
+
         std::vector<File::Entry> files;
 
         void merge (const Base& B) {
@@ -104,6 +115,12 @@ namespace MR
         std::vector<std::unique_ptr<uint8_t[]>> addresses;
         bool is_new, writable;
 
+        // only set by handlers that defer reading the contents of each
+        // segment until it is first accessed, in which case load_segment()
+        // must fill segment n and then set segment_loaded[n]:
+        std::unique_ptr<std::atomic<bool>[]> segment_loaded;
+        virtual void load_segment (size_t n) const;
+
         void check () const {
           assert (addresses.size());
         }
@@ -53,6 +53,8 @@ namespace MR
 
     void Default::unload (const Header& header)
     {
+      async.reset();
+
       if (mmaps.empty() && addresses.size()) {
         assert (addresses[0].get());
 
@@ -83,6 +85,9 @@ namespace MR
         mmaps[n].reset (new File::MMap (files[n], writable, !is_new, bytes_per_segment));
         addresses[n].reset (mmaps[n]->address());
       }
+
+      if (mmaps[0]->is_mapped() && Async::enabled (files.size() * bytes_per_segment))
+        async.reset (new Async (mmaps, !is_new, writable));
     }
 
 
@@ -99,10 +104,13 @@ namespace MR
 
       if (is_new) memset (addresses[0].get(), 0, files.size() * bytes_per_segment);
       else {
+        if (Async::enabled (files.size() * bytes_per_segment))
+          async.reset (new Async (files));
         for (size_t n = 0; n < files.size(); n++) {
           File::MMap file (files[n], false, false, bytes_per_segment);
           memcpy (addresses[0].get() + n*bytes_per_segment, file.address(), bytes_per_segment);
         }
+        async.reset();
       }
 
       if (addresses.size() > 1)
@@ -18,6 +18,7 @@
 
 #include "types.h"
 #include "image_io/base.h"
+#include "image_io/async.h"
 #include "file/mmap.h"
 
 namespace MR
@@ -37,6 +38,7 @@ namespace MR
       protected:
         std::vector<std::shared_ptr<File::MMap> > mmaps;
         int64_t bytes_per_segment;
+        std::unique_ptr<Async> async;
 
         virtual void load (const Header&, size_t);
         virtual void unload (const Header&);
@@ -134,6 +134,79 @@ namespace MR
       }
 
 
+
+
+    // byte order policies for the bulk functions:
+
+    struct Native {
+      static constexpr bool needs_swap = false;
+      template <typename DiskType> static FORCE_INLINE DiskType fetch (const void* data, size_t i) { return Raw::fetch<DiskType> (data, i); }
+      template <typename DiskType> static FORCE_INLINE void store (DiskType val, void* data, size_t i) { Raw::store<DiskType> (val, data, i); }
+    };
+
+    struct LE {
+      static constexpr bool needs_swap = MRTRIX_IS_BIG_ENDIAN;
+      template <typename DiskType> static FORCE_INLINE DiskType fetch (const void* data, size_t i) { return Raw::fetch_LE<DiskType> (data, i); }
+      template <typename DiskType> static FORCE_INLINE void store (DiskType val, void* data, size_t i) { Raw::store_LE<DiskType> (val, data, i); }
+    };
+
+    struct BE {
+      static constexpr bool needs_swap = !MRTRIX_IS_BIG_ENDIAN;
+      template <typename DiskType> static FORCE_INLINE DiskType fetch (const void* data, size_t i) { return Raw::fetch_BE<DiskType> (data, i); }
+      template <typename DiskType> static FORCE_INLINE void store (DiskType val, void* data, size_t i) { Raw::store_BE<DiskType> (val, data, i); }
+    };
+
+
+
+    // conversion of real values to floating-point can be vectorised using Eigen:
+    template <typename RAMType, typename DiskType>
+      struct vectorisable_fetch {
+        static constexpr bool value = std::is_floating_point<RAMType>::value && std::is_arithmetic<DiskType>::value && !std::is_same<DiskType,bool>::value;
+      };
+
+    template <typename RAMType, typename DiskType, class ByteOrderType>
+      inline typename std::enable_if<!vectorisable_fetch<RAMType,DiskType>::value, void>::type
+      __fetch_row_impl (RAMType* values, const void* data, size_t i, ssize_t stride, size_t count, default_type offset, default_type scale) {
+        for (size_t n = 0; n < count; ++n, i += stride)
+          values[n] = round_func<RAMType> (scale_from_storage (ByteOrderType::template fetch<DiskType> (data, i), offset, scale));
+      }
+
+    template <typename RAMType, typename DiskType, class ByteOrderType>
+      inline typename std::enable_if<vectorisable_fetch<RAMType,DiskType>::value, void>::type
+      __fetch_row_impl (RAMType* values, const void* data, size_t i, ssize_t stride, size_t count, default_type offset, default_type scale) {
+        if (stride != 1) {
+          for (size_t n = 0; n < count; ++n, i += stride)
+            values[n] = round_func<RAMType> (scale_from_storage (ByteOrderType::template fetch<DiskType> (data, i), offset, scale));
+          return;
+        }
+        // process in chunks small enough to byte-swap into a buffer on the stack:
+        constexpr size_t chunk_size = 256;
+        DiskType buffer[chunk_size];
+        for (size_t n = 0; n < count; n += chunk_size) {
+          const size_t num = std::min (chunk_size, count - n);
+          const DiskType* in = reinterpret_cast<const DiskType*> (data) + i + n;
+          if (ByteOrderType::needs_swap) {
+            for (size_t k = 0; k < num; ++k)
+              buffer[k] = ByteOrder::swap (in[k]);
+            in = buffer;
+          }
+          Eigen::Map<Eigen::Array<RAMType,Eigen::Dynamic,1>> (values + n, num) =
+            (offset + scale * Eigen::Map<const Eigen::Array<DiskType,Eigen::Dynamic,1>> (in, num).template cast<default_type>()).template cast<RAMType>();
+        }
+      }
+
+    template <typename RAMType, typename DiskType, class ByteOrderType>
+      void __fetch_row (RAMType* values, const void* data, size_t i, ssize_t stride, size_t count, default_type offset, default_type scale) {
+        __fetch_row_impl<RAMType,DiskType,ByteOrderType> (values, data, i, stride, count, offset, scale);
+      }
+
+    template <typename RAMType, typename DiskType, class ByteOrderType>
+      void __store_row (const RAMType* values, void* data, size_t i, ssize_t stride, size_t count, default_type offset, default_type scale) {
+        for (size_t n = 0; n < count; ++n, i += stride)
+          ByteOrderType::template store<DiskType> (round_func<DiskType> (scale_to_storage (values[n], offset, scale)), data, i);
+      }
+
+
   }
 
 
@@ -244,6 +317,50 @@ namespace MR
       }
     }
 
+
+
+
+  template <typename ValueType>
+    typename std::enable_if<is_data_type<ValueType>::value, void>::type __set_fetch_store_row_functions (
+        FetchRowFunc<ValueType>& fetch_row_func,
+        StoreRowFunc<ValueType>& store_row_func,
+        DataType datatype) {
+
+      switch (datatype()) {
+#define __SET_ROW_FUNCTIONS(type, DiskType, ByteOrderType) \
+        case DataType::type: \
+          fetch_row_func = __fetch_row<ValueType,DiskType,ByteOrderType>; \
+          store_row_func = __store_row<ValueType,DiskType,ByteOrderType>; \
+          return
+        __SET_ROW_FUNCTIONS (Bit, bool, Native);
+        __SET_ROW_FUNCTIONS (Int8, int8_t, Native);
+        __SET_ROW_FUNCTIONS (UInt8, uint8_t, Native);
+        __SET_ROW_FUNCTIONS (Int16LE, int16_t, LE);
+        __SET_ROW_FUNCTIONS (UInt16LE, uint16_t, LE);
+        __SET_ROW_FUNCTIONS (Int16BE, int16_t, BE);
+        __SET_ROW_FUNCTIONS (UInt16BE, uint16_t, BE);
+        __SET_ROW_FUNCTIONS (Int32LE, int32_t, LE);
+        __SET_ROW_FUNCTIONS (UInt32LE, uint32_t, LE);
+        __SET_ROW_FUNCTIONS (Int32BE, int32_t, BE);
+        __SET_ROW_FUNCTIONS (UInt32BE, uint32_t, BE);
+        __SET_ROW_FUNCTIONS (Int64LE, int64_t, LE);
+        __SET_ROW_FUNCTIONS (UInt64LE, uint64_t, LE);
+        __SET_ROW_FUNCTIONS (Int64BE, int64_t, BE);
+        __SET_ROW_FUNCTIONS (UInt64BE, uint64_t, BE);
+        __SET_ROW_FUNCTIONS (Float32LE, float, LE);
+        __SET_ROW_FUNCTIONS (Float32BE, float, BE);
+        __SET_ROW_FUNCTIONS (Float64LE, double, LE);
+        __SET_ROW_FUNCTIONS (Float64BE, double, BE);
+        __SET_ROW_FUNCTIONS (CFloat32LE, cfloat, LE);
+        __SET_ROW_FUNCTIONS (CFloat32BE, cfloat, BE);
+        __SET_ROW_FUNCTIONS (CFloat64LE, cdouble, LE);
+        __SET_ROW_FUNCTIONS (CFloat64BE, cdouble, BE);
+#undef __SET_ROW_FUNCTIONS
+        default:
+          throw Exception ("invalid data type in image header");
+      }
+    }
+
 #undef MRTRIX_EXTERN
 #define MRTRIX_EXTERN
   __DEFINE_FETCH_STORE_FUNCTIONS;
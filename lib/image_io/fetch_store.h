@@ -38,13 +38,41 @@ namespace MR
         DataType datatype);
 
 
+  //! functions to convert a whole run of values to/from storage in one call
+  /*! These convert the \a count values located at offsets \a i, \a i +
+   * \a stride, \a i + 2 \a stride, ... from \a data, applying the intensity
+   * \a offset and \a scale as for the per-voxel fetch & store functions. The
+   * functions are selected once for the datatype of the image, avoiding the
+   * overhead of a type-erased call for every voxel. */
+  template <typename ValueType>
+    using FetchRowFunc = void (*) (ValueType* values, const void* data, size_t i, ssize_t stride, size_t count, default_type offset, default_type scale);
+  template <typename ValueType>
+    using StoreRowFunc = void (*) (const ValueType* values, void* data, size_t i, ssize_t stride, size_t count, default_type offset, default_type scale);
+
+  template <typename ValueType>
+    typename std::enable_if<!is_data_type<ValueType>::value, void>::type __set_fetch_store_row_functions (
+        FetchRowFunc<ValueType>& /*fetch_row_func*/,
+        StoreRowFunc<ValueType>& /*store_row_func*/,
+        DataType /*datatype*/) { }
+
+  template <typename ValueType>
+    typename std::enable_if<is_data_type<ValueType>::value, void>::type __set_fetch_store_row_functions (
+        FetchRowFunc<ValueType>& fetch_row_func,
+        StoreRowFunc<ValueType>& store_row_func,
+        DataType datatype);
+
+
   // define fetch/store methods for all types using C++11 extern templates, 
   // to avoid massive recompile times...
 #define __DEFINE_FETCH_STORE_FUNCTION_FOR_TYPE(ValueType) \
   MRTRIX_EXTERN template void __set_fetch_store_functions<ValueType> ( \
       std::function<ValueType(const void*,size_t,default_type,default_type)>& fetch_func, \
         std::function<void(ValueType,void*,size_t,default_type,default_type)>& store_func, \
-        DataType datatype) 
+        DataType datatype); \
+  MRTRIX_EXTERN template void __set_fetch_store_row_functions<ValueType> ( \
+      FetchRowFunc<ValueType>& fetch_row_func, \
+      StoreRowFunc<ValueType>& store_row_func, \
+      DataType datatype) 
 
 #define __DEFINE_FETCH_STORE_FUNCTIONS \
   __DEFINE_FETCH_STORE_FUNCTION_FOR_TYPE(bool); \
@@ -19,15 +19,26 @@
 #include "progressbar.h"
 #include "header.h"
 #include "image_io/gz.h"
+#include "image_io/async.h"
 #include "file/gz.h"
-
-#define BYTES_PER_ZCALL 524288
+#include "file/ofstream.h"
+#include "file/config.h"
+#include "file/parallel_gz.h"
+#include "thread.h"
 
 namespace MR
 {
   namespace ImageIO
   {
 
+    //CONF option: ImageDeferredDecompression
+    //CONF default: 1 (true)
+    //CONF Whether to only decompress those parts of a compressed image
+    //CONF (.mif.gz or .nii.gz) that are actually accessed, rather than the
+    //CONF whole image up front. This only applies to images opened
+    //CONF read-only, that were themselves written by MRtrix3. Disabling this
+    //CONF can speed up processing that accesses the entire image, since
+    //CONF the data can then be accessed directly in RAM.
     void GZ::load (const Header& header, size_t)
     {
       if (files.empty())
@@ -39,6 +50,28 @@ namespace MR
         throw Exception ("image \"" + header.name() + "\" is larger than maximum accessible memory");
 
       DEBUG ("loading image \"" + header.name() + "\"...");
+
+      if (!is_new && !writable && files.size() == 1 && bytes_per_segment > int64_t (File::ParallelGZ::block_size) &&
+          File::Config::get_bool ("ImageDeferredDecompression", true)) {
+        std::unique_ptr<Deferred> state (new Deferred (files[0].name));
+        if (state->reader.valid()) {
+          // split the image into segments of one block each, to be
+          // decompressed only when first accessed:
+          const size_t num_segments = File::ParallelGZ::num_blocks (bytes_per_segment);
+          addresses.resize (num_segments);
+          segment_loaded.reset (new std::atomic<bool> [num_segments]);
+          for (size_t n = 0; n < num_segments; ++n) {
+            addresses[n].reset (new uint8_t [std::min<int64_t> (File::ParallelGZ::block_size, bytes_per_segment - n*File::ParallelGZ::block_size)]);
+            segment_loaded[n] = false;
+          }
+          state->loading.assign (num_segments, false);
+          deferred = std::move (state);
+          segsize = 8 * File::ParallelGZ::block_size / header.datatype().bits();
+          DEBUG ("image \"" + header.name() + "\" will be decompressed on access, in " + str(num_segments) + " segments");
+          return;
+        }
+      }
+
       addresses.resize (header.datatype().bits() == 1 && files.size() > 1 ? files.size() : 1);
       addresses[0].reset (new uint8_t [files.size() * bytes_per_segment]);
       if (!addresses[0])
@@ -48,19 +81,32 @@ namespace MR
         memset (addresses[0].get(), 0, files.size() * bytes_per_segment);
       else {
         ProgressBar progress ("uncompressing image \"" + header.name() + "\"",
-            files.size() * bytes_per_segment / BYTES_PER_ZCALL);
+            files.size() * File::ParallelGZ::num_blocks (bytes_per_segment));
+        // read the compressed data ahead of the decompression:
+        std::unique_ptr<Async> read_ahead;
+        if (Async::enabled (files.size() * bytes_per_segment)) {
+          std::vector<File::Entry> compressed_files;
+          for (const auto& file : files)
+            compressed_files.push_back (File::Entry (file.name));
+          read_ahead.reset (new Async (compressed_files));
+        }
         for (size_t n = 0; n < files.size(); n++) {
+          uint8_t* address = addresses[0].get() + n*bytes_per_segment;
+          File::ParallelGZ::Reader reader (files[n].name);
+          if (reader.valid()) {
+            reader.read_parallel (files[n].start, address, bytes_per_segment, [&] { ++progress; });
+            continue;
+          }
+
+          // not written by File::ParallelGZ - fall back to serial decompression:
           File::GZ zf (files[n].name, "rb");
           zf.seek (files[n].start);
-          uint8_t* address = addresses[0].get() + n*bytes_per_segment;
-          uint8_t* last = address + bytes_per_segment - BYTES_PER_ZCALL;
-          while (address < last) {
-            zf.read (reinterpret_cast<char*> (address), BYTES_PER_ZCALL);
-            address += BYTES_PER_ZCALL;
+          for (int64_t offset = 0; offset < bytes_per_segment; offset += File::ParallelGZ::block_size) {
+            const size_t size = std::min<int64_t> (File::ParallelGZ::block_size, bytes_per_segment - offset);
+            if (zf.read (reinterpret_cast<char*> (address + offset), size) != int (size))
+              throw Exception ("unexpected end of file in \"" + files[n].name + "\"");
             ++progress;
           }
-          last += BYTES_PER_ZCALL;
-          zf.read (reinterpret_cast<char*> (address), last - address);
         }
       }
 
@@ -81,24 +127,80 @@ namespace MR
 
         if (writable) {
           ProgressBar progress ("compressing image \"" + header.name() + "\"",
-              files.size() * bytes_per_segment / BYTES_PER_ZCALL);
+              files.size() * File::ParallelGZ::num_blocks (bytes_per_segment));
           for (size_t n = 0; n < files.size(); n++) {
             assert (files[n].start == int64_t (lead_in_size));
-            File::GZ zf (files[n].name, "wb");
+            File::OFStream out (files[n].name, std::ios::out | std::ios::binary | std::ios::trunc);
             if (lead_in)
-              zf.write (reinterpret_cast<const char*> (lead_in.get()), lead_in_size);
-            uint8_t* address = addresses[0].get() + n*bytes_per_segment;
-            uint8_t* last = address + bytes_per_segment - BYTES_PER_ZCALL;
-            while (address < last) {
-              zf.write (reinterpret_cast<const char*> (address), BYTES_PER_ZCALL);
-              address += BYTES_PER_ZCALL;
-              ++progress;
-            }
-            last += BYTES_PER_ZCALL;
-            zf.write (reinterpret_cast<const char*> (address), last - address);
+              File::ParallelGZ::write (out, lead_in.get(), lead_in_size);
+            File::ParallelGZ::write (out, addresses[0].get() + n*bytes_per_segment, bytes_per_segment, [&] { ++progress; });
+            if (!out.good())
+              throw Exception ("error writing to file \"" + files[n].name + "\": " + strerror (errno));
+          }
+        }
+
+      }
+      deferred.reset();
+    }
+
+
+
+    void GZ::make_contiguous ()
+    {
+      if (!deferred)
+        return;
+
+      // decompress the whole image straight into a single buffer, rather
+      // than copying it from the segments, so that it is only held once:
+      std::unique_ptr<uint8_t[]> data (new uint8_t [bytes_per_segment]);
+      {
+        ProgressBar progress ("uncompressing image \"" + files[0].name + "\"", File::ParallelGZ::num_blocks (bytes_per_segment));
+        deferred->reader.read_parallel (files[0].start, data.get(), bytes_per_segment, [&] { ++progress; });
+      }
+      addresses.clear();
+      addresses.push_back (std::move (data));
+      segment_loaded.reset();
+      deferred.reset();
+      segsize = std::numeric_limits<size_t>::max();
+    }
+
+
+
+    void GZ::load_segment (size_t n) const
+    {
+      assert (deferred);
+      std::unique_lock<std::mutex> lock (deferred->mutex);
+      while (!segment_loaded[n].load (std::memory_order_relaxed)) {
+        size_t m = n;
+        if (deferred->loading[n]) {
+          // another thread is already decompressing this segment: rather
+          // than sitting idle, decompress one of the segments that follow,
+          // since these are likely to be needed next:
+          const size_t last = std::min (n + Thread::number_of_threads(), nsegments() - 1);
+          while (m < last && deferred->loading[m])
+            ++m;
+          if (deferred->loading[m]) {
+            deferred->loaded.wait (lock);
+            continue;
           }
         }
 
+        deferred->loading[m] = true;
+        lock.unlock();
+        try {
+          const int64_t offset = m * File::ParallelGZ::block_size;
+          const int64_t size = std::min<int64_t> (File::ParallelGZ::block_size, bytes_per_segment - offset);
+          deferred->reader.read (files[0].start + offset, addresses[m].get(), size);
+        }
+        catch (...) {
+          lock.lock();
+          deferred->loading[m] = false;
+          deferred->loaded.notify_all();
+          throw;
+        }
+        lock.lock();
+        segment_loaded[m].store (true, std::memory_order_release);
+        deferred->loaded.notify_all();
       }
     }
 
@@ -16,8 +16,12 @@
 #ifndef __image_io_gz_h__
 #define __image_io_gz_h__
 
+#include <mutex>
+#include <condition_variable>
+
 #include "image_io/base.h"
 #include "file/mmap.h"
+#include "file/parallel_gz.h"
 
 namespace MR
 {
@@ -38,13 +42,27 @@ namespace MR
           return lead_in.get();
         }
 
+        virtual void make_contiguous ();
+
       protected:
         int64_t  bytes_per_segment;
         size_t   lead_in_size;
         std::unique_ptr<uint8_t[]> lead_in;
 
+        // used when each segment is only decompressed when first accessed:
+        class Deferred {
+          public:
+            Deferred (const std::string& filename) : reader (filename) { }
+            File::ParallelGZ::Reader reader;
+            std::mutex mutex;
+            std::condition_variable loaded;
+            std::vector<bool> loading;
+        };
+        std::unique_ptr<Deferred> deferred;
+
         virtual void load (const Header&, size_t);
         virtual void unload (const Header&);
+        virtual void load_segment (size_t n) const;
     };
 
   }
@@ -13,22 +13,61 @@
  * 
  */
 
+#include <atomic>
 #include <memory>
 #include <vector>
 
 #include "image_io/scratch.h"
 #include "header.h"
+#include "file/config.h"
+#include "file/utils.h"
 
 namespace MR
 {
   namespace ImageIO
   {
 
+    namespace
+    {
+      // total size of the scratch buffers currently held in RAM:
+      std::atomic<size_t> total_size_in_ram (0);
+    }
+
+
+
     bool Scratch::is_file_backed () const { return false; }
 
+
+
+    //CONF option: ScratchMemoryLimit
+    //CONF default: 0 (no limit)
+    //CONF The maximum total amount of RAM (in MB) to be used for scratch
+    //CONF buffers (e.g. intermediate images used during registration, or
+    //CONF track mapping). Any scratch buffer that would exceed this limit is
+    //CONF instead stored in a temporary file within TmpFileDir, and paged
+    //CONF in and out of RAM by the operating system as required. This allows
+    //CONF processing that would otherwise run out of RAM to complete, at
+    //CONF the cost of disk access; for this to be effective, TmpFileDir must
+    //CONF reside on disk rather than in RAM (e.g. tmpfs).
     void Scratch::load (const Header& header, size_t buffer_size)
     {
       assert (buffer_size);
+
+      const size_t limit = size_t (File::Config::get_int ("ScratchMemoryLimit", 0)) << 20;
+      if (limit && total_size_in_ram + buffer_size > limit) {
+        filename = File::create_tempfile (buffer_size, "scratch");
+        INFO ("storing scratch buffer for image \"" + header.name() + "\" in file \"" + filename + "\"");
+        try {
+          mmap.reset (new File::MMap (filename, true, false));
+          addresses.push_back (std::unique_ptr<uint8_t[]> (mmap->address()));
+        } catch (...) {
+          mmap.reset();
+          File::unlink (filename);
+          throw;
+        }
+        return;
+      }
+
       DEBUG ("allocating scratch buffer for image \"" + header.name() + "\"...");
       try {
         addresses.push_back (std::unique_ptr<uint8_t[]> (new uint8_t [buffer_size]));
@@ -36,6 +75,8 @@ namespace MR
       } catch (...) {
         throw Exception ("Error allocating memory for scratch buffer");
       }
+      size_in_ram = buffer_size;
+      total_size_in_ram += size_in_ram;
     }
 
 
@@ -43,7 +84,16 @@ namespace MR
     {
       if (addresses.size()) {
         DEBUG ("deleting scratch buffer for image \"" + header.name() + "\"...");
-        addresses[0].reset();
+        if (mmap) {
+          addresses[0].release();
+          mmap.reset();
+          try { File::unlink (filename); }
+          catch (...) { }
+        }
+        else
+          addresses[0].reset();
+        total_size_in_ram -= size_in_ram;
+        size_in_ram = 0;
       }
     }
 
@@ -17,6 +17,7 @@
 #define __image_io_scratch_h__
 
 #include "image_io/base.h"
+#include "file/mmap.h"
 
 namespace MR
 {
@@ -24,14 +25,26 @@ namespace MR
   {
 
 
+    //! RAM buffers for scratch images
+    /*! Scratch buffers are normally allocated in RAM. If the
+     * ScratchMemoryLimit config file entry is set, and allocating a buffer in
+     * RAM would take the total size of all scratch buffers currently held in
+     * RAM beyond that limit, the buffer is instead stored in a temporary file
+     * that is memory-mapped, so that the operating system can page the
+     * least recently used parts of it out to disk as required. The
+     * temporary file is deleted when the image is closed. */
     class Scratch : public Base
     {
       public:
-        Scratch (const Header& header) : Base (header) { }
+        Scratch (const Header& header) : Base (header), size_in_ram (0) { }
 
         virtual bool is_file_backed () const;
 
       protected:
+        size_t size_in_ram;
+        std::string filename;
+        std::unique_ptr<File::MMap> mmap;
+
         virtual void load (const Header&, size_t);
         virtual void unload (const Header&);
     };
@@ -17,6 +17,7 @@
 #define __math_constrained_least_squares_h__
 
 #include <set>
+#include <algorithm>
 #include "math/math.h"
 
 #include <Eigen/Cholesky> 
@@ -112,13 +113,18 @@ namespace MR
                 B.noalias() = chol_HtH.template triangularView<Eigen::Lower>().transpose().template solve<Eigen::OnTheRight> (constraint_matrix);
                 for (ssize_t n = 0; n < B.rows(); ++n) 
                   B.row(n).normalize();
+
+                // precompute the inner products between all constraints, from
+                // which the system for any active set can be formed directly:
+                BBt.resize (B.rows(), B.rows());
+                BBt.template triangularView<Eigen::Lower>() = B * B.transpose();
               }
 
             size_t num_parameters () const { return H.cols(); }
             size_t num_measurements () const { return H.rows(); }
             size_t num_constraints () const { return B.rows(); }
 
-            matrix_type H, chol_HtH, B, b2d;
+            matrix_type H, chol_HtH, B, b2d, BBt;
             value_type lambda_min_norm, tol;
             size_t max_niter;
         };
@@ -144,30 +150,84 @@ namespace MR
               lambda (c.size()),
               lambda_prev (c.size()),
               l (lambda.size()),
-              active (lambda.size(), false) { }
+              active (lambda.size(), false),
+              active_index (lambda.size()) { }
 
-            size_t operator() (vector_type& x, const vector_type& b) 
+            size_t operator() (vector_type& x, const vector_type& b)
             {
-#ifdef MRTRIX_ICLS_DEBUG
-              std::ofstream l_stream ("l.txt");
-              std::ofstream n_stream ("n.txt");
-#endif
               // compute unconstrained solution:
               y_u = P.b2d.transpose() * b;
               // compute constraint violations for unconstrained solution:
               c_u = P.B * y_u;
 
+              return solve (x, false);
+            }
+
+            //! solve given the unconstrained solution and corresponding constraint values
+            /*! This is equivalent to the operator() above, but takes the
+             * unconstrained solution in the preconditioned domain \a
+             * y_unconstrained (i.e. \e b2d' * \e b) and the
+             * corresponding constraint values \a c_unconstrained (i.e. \e
+             * B * \e y_unconstrained) as inputs. This allows these to be
+             * computed for many voxels at once using matrix-matrix products.
+             *
+             * If \a warm_start is set, the solver is initialised with the
+             * current active set, which will be the set on which the previous
+             * solve terminated, unless it has since been set using
+             * set_active_set(). If this is close to the final active set (as
+             * is typically the case for neighbouring voxels), far fewer
+             * iterations will be required. */
+            template <class VectorType1, class VectorType2>
+              size_t operator() (vector_type& x, const VectorType1& y_unconstrained, const VectorType2& c_unconstrained, bool warm_start)
+              {
+                y_u = y_unconstrained;
+                c_u = c_unconstrained;
+                return solve (x, warm_start);
+              }
+
+            const std::vector<bool>& active_set () const { return active; }
+            void set_active_set (const std::vector<bool>& active_set) {
+              assert (active_set.size() == active.size());
+              active = active_set;
+            }
+
+            const Problem<value_type>& problem () const { return P; }
+
+          protected:
+            const Problem<value_type>& P;
+            matrix_type BtB, B;
+            vector_type y_u, c, c_u, lambda, lambda_prev, l;
+            std::vector<bool> active;
+            std::vector<size_t> active_index;
+
+
+            size_t solve (vector_type& x, bool warm_start)
+            {
+#ifdef MRTRIX_ICLS_DEBUG
+              std::ofstream l_stream ("l.txt");
+              std::ofstream n_stream ("n.txt");
+#endif
               // set all Lagrangian multipliers to zero:
               lambda.setZero();
               lambda_prev.setZero();
-              // set active set empty:
-              std::fill (active.begin(), active.end(), false);
 
-              // initial estimate of constraint values:
-              c = c_u;
               // initial estimate of solution:
               x = y_u;
 
+              if (warm_start && std::find (active.begin(), active.end(), true) != active.end()) {
+                // solve for the initial active set, and
+                // estimate constraint values at the solution:
+                update_multipliers (x);
+                lambda_prev = lambda;
+                c = P.B * x;
+              }
+              else {
+                // set active set empty:
+                std::fill (active.begin(), active.end(), false);
+                // initial estimate of constraint values:
+                c = c_u;
+              }
+
               size_t min_c_index;
               size_t niter = 0;
 
@@ -175,64 +235,8 @@ namespace MR
                 bool active_set_changed = !active[min_c_index];
                 active[min_c_index] = true;
 
-                while (1) {
-                  // form submatrix of active constraints:
-                  size_t num_active = 0;
-                  for (size_t n = 0; n < active.size(); ++n) {
-                    if (active[n]) {
-                      B.row (num_active) = P.B.row (n);
-                      l[num_active] = -c_u[n];
-                      ++num_active;
-                    }
-                  }
-                  auto B_active = B.topRows (num_active);
-                  auto l_active = l.head (num_active);
-
-                  BtB.resize (num_active, num_active);
-                  // solve for l in B*B'l = -c_u by Cholesky decomposition:
-                  BtB = B_active * B_active.transpose();
-                  BtB.diagonal().array() += P.lambda_min_norm;
-                  BtB.template selfadjointView<Eigen::Lower>().llt().solveInPlace (l_active);
-
-                  // update lambda values in full vector 
-                  // and identify worst offender if any lambda < 0
-                  // by projection from previous onto feasible 
-                  // subset (i.e. l>=0):
-                  value_type s_min = std::numeric_limits<value_type>::infinity();
-                  size_t s_min_index = 0;
-                  size_t a = 0;
-                  for (size_t n = 0; n < active.size(); ++n) {
-                    if (active[n]) {
-                      if (l_active[a] < 0.0) {
-                        value_type s = lambda_prev[n] / (lambda_prev[n] - l_active[a]);
-                        if (s < s_min) {
-                          s_min = s;
-                          s_min_index = n;
-                        }
-                      }
-                      lambda[n] = l_active[a];
-                      ++a;
-                    }
-                    else
-                      lambda[n] = 0.0;
-                  }
-
-                  // if no lambda < 0, proceed:
-                  if (!std::isfinite (s_min)) {
-                    // update solution vector:
-                    x = y_u + B_active.transpose() * l_active;
-                    break;
-                  }
-#ifdef MRTRIX_ICLS_DEBUG
-                l_stream << lambda << "\n";
-#endif
-
-                  // remove worst offending lambda from active set, 
-                  // and re-estimate remaining lambdas:
-                  if (active[s_min_index])
-                    active_set_changed = true;
-                  active[s_min_index] = false;
-                }
+                if (update_multipliers (x))
+                  active_set_changed = true;
 
                 // store feasible subset of lambdas:
                 lambda_prev = lambda;
@@ -246,7 +250,7 @@ namespace MR
 #endif
 
                 ++niter;
-                if (!active_set_changed || niter > P.max_niter) 
+                if (!active_set_changed || niter > P.max_niter)
                   break;
 
                 // compute constraint values at updated solution:
@@ -258,13 +262,75 @@ namespace MR
               return niter;
             }
 
-            const Problem<value_type>& problem () const { return P; }
 
-          protected:
-            const Problem<value_type>& P;
-            matrix_type BtB, B;
-            vector_type y_u, c, c_u, lambda, lambda_prev, l;
-            std::vector<bool> active;
+            // solve for the Lagrangian multipliers of the current active
+            // set, removing constraints from the active set until all
+            // multipliers are non-negative, and update the solution
+            // accordingly. Returns true if any constraints were removed:
+            bool update_multipliers (vector_type& x)
+            {
+              bool active_set_changed = false;
+              while (1) {
+                // identify active constraints:
+                size_t num_active = 0;
+                for (size_t n = 0; n < active.size(); ++n) {
+                  if (active[n]) {
+                    active_index[num_active] = n;
+                    l[num_active] = -c_u[n];
+                    ++num_active;
+                  }
+                }
+                auto l_active = l.head (num_active);
+
+                // form B*B' for the active constraints from the precomputed
+                // inner products, and solve for l in B*B'l = -c_u by Cholesky
+                // decomposition:
+                BtB.resize (num_active, num_active);
+                for (size_t j = 0; j < num_active; ++j)
+                  for (size_t i = j; i < num_active; ++i)
+                    BtB(i,j) = P.BBt (active_index[i], active_index[j]);
+                BtB.diagonal().array() += P.lambda_min_norm;
+                BtB.template selfadjointView<Eigen::Lower>().llt().solveInPlace (l_active);
+
+                // update lambda values in full vector
+                // and identify worst offender if any lambda < 0
+                // by projection from previous onto feasible
+                // subset (i.e. l>=0):
+                value_type s_min = std::numeric_limits<value_type>::infinity();
+                size_t s_min_index = 0;
+                size_t a = 0;
+                for (size_t n = 0; n < active.size(); ++n) {
+                  if (active[n]) {
+                    if (l_active[a] < 0.0) {
+                      value_type s = lambda_prev[n] / (lambda_prev[n] - l_active[a]);
+                      if (s < s_min) {
+                        s_min = s;
+                        s_min_index = n;
+                      }
+                    }
+                    lambda[n] = l_active[a];
+                    ++a;
+                  }
+                  else
+                    lambda[n] = 0.0;
+                }
+
+                // if no lambda < 0, proceed:
+                if (!std::isfinite (s_min)) {
+                  // update solution vector:
+                  for (size_t a = 0; a < num_active; ++a)
+                    B.row (a) = P.B.row (active_index[a]);
+                  x = y_u + B.topRows (num_active).transpose() * l_active;
+                  return active_set_changed;
+                }
+
+                // remove worst offending lambda from active set,
+                // and re-estimate remaining lambdas:
+                if (active[s_min_index])
+                  active_set_changed = true;
+                active[s_min_index] = false;
+              }
+            }
         };
 
 
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __math_inverse_iteration_h__
+#define __math_inverse_iteration_h__
+
+#include <vector>
+
+#include "types.h"
+
+namespace MR
+{
+  namespace Math
+  {
+
+    /** @addtogroup linalg
+      @{ */
+
+    //! eigenvectors of a symmetric tridiagonal matrix for selected eigenvalues, by inverse iteration
+    /*! The symmetric tridiagonal matrix is specified by its \a diagonal and
+     * \a subdiagonal, and the (previously computed) \a eigenvalues for which
+     * the eigenvectors are required. Each is obtained by solving the shifted
+     * tridiagonal system a few times, using an LU decomposition with partial
+     * pivoting, at a cost of O(N) per eigenvector rather than the O(N^3)
+     * needed to compute all eigenvectors. Eigenvectors for clustered
+     * eigenvalues are orthogonalised against each other.
+     *
+     * Combined with Eigen::Tridiagonalization and the eigenvalues-only
+     * variant of Eigen::SelfAdjointEigenSolver::computeFromTridiagonal(),
+     * this allows a few eigenvectors of a dense symmetric matrix to be
+     * obtained much faster than the full decomposition. */
+    template <class DiagonalType, class SubDiagonalType, class EigenvaluesType>
+      Eigen::MatrixXd tridiagonal_eigenvectors (const DiagonalType& diagonal, const SubDiagonalType& subdiagonal, const EigenvaluesType& eigenvalues)
+      {
+        const ssize_t N = diagonal.size();
+        const ssize_t num = eigenvalues.size();
+        Eigen::MatrixXd V (N, num);
+        if (N == 1) {
+          V.setOnes();
+          return V;
+        }
+
+        const double norm = diagonal.template cast<double>().cwiseAbs().maxCoeff() + 2.0 * subdiagonal.template cast<double>().cwiseAbs().maxCoeff();
+        const double tiny = std::numeric_limits<double>::epsilon() * std::max (norm, std::numeric_limits<double>::min());
+
+        Eigen::VectorXd d (N), dl (N-1), du (N-1), du2 (std::max (N-2, ssize_t (1))), b (N);
+        std::vector<bool> swapped (N-1);
+
+        for (ssize_t k = 0; k < num; ++k) {
+          // LU decomposition of (T - lambda I) with partial pivoting:
+          d = diagonal.template cast<double>().array() - double (eigenvalues[k]);
+          dl = subdiagonal.template cast<double>();
+          du = dl;
+          du2.setZero();
+          for (ssize_t i = 0; i < N-1; ++i) {
+            if (std::abs (d[i]) >= std::abs (dl[i])) {
+              if (d[i] == 0.0)
+                d[i] = tiny;
+              dl[i] /= d[i];
+              d[i+1] -= dl[i] * du[i];
+              swapped[i] = false;
+            }
+            else {
+              const double fact = d[i] / dl[i];
+              d[i] = dl[i];
+              dl[i] = fact;
+              const double temp = du[i];
+              du[i] = d[i+1];
+              d[i+1] = temp - fact * d[i+1];
+              if (i < N-2) {
+                du2[i] = du[i+1];
+                du[i+1] *= -fact;
+              }
+              swapped[i] = true;
+            }
+          }
+          if (d[N-1] == 0.0)
+            d[N-1] = tiny;
+
+          // starting vector with (almost certainly) non-zero components
+          // along every eigenvector:
+          for (ssize_t i = 0; i < N; ++i)
+            b[i] = 1.0 + 0.5 * std::sin (double (i+1));
+          // a few iterations suffice given an accurate eigenvalue:
+          for (size_t iter = 0; iter < 3; ++iter) {
+            for (ssize_t i = 0; i < N-1; ++i) {
+              if (swapped[i]) {
+                const double temp = b[i];
+                b[i] = b[i+1];
+                b[i+1] = temp - dl[i] * b[i];
+              }
+              else
+                b[i+1] -= dl[i] * b[i];
+            }
+            b[N-1] /= d[N-1];
+            b[N-2] = (b[N-2] - du[N-2] * b[N-1]) / d[N-2];
+            for (ssize_t i = N-3; i >= 0; --i)
+              b[i] = (b[i] - du[i] * b[i+1] - du2[i] * b[i+2]) / d[i];
+
+            // orthogonalise against eigenvectors of nearby eigenvalues:
+            for (ssize_t j = 0; j < k; ++j)
+              if (std::abs (double (eigenvalues[k]) - double (eigenvalues[j])) < 1.0e-3 * norm)
+                b -= V.col(j).dot (b) * V.col(j);
+            b.normalize();
+          }
+          V.col(k) = b;
+        }
+        return V;
+      }
+
+    /** @} */
+
+  }
+}
+
+#endif
+
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __math_lanczos_h__
+#define __math_lanczos_h__
+
+#include <Eigen/Eigenvalues>
+
+#include "types.h"
+#include "math/inverse_iteration.h"
+
+namespace MR
+{
+  namespace Math
+  {
+
+    /** @addtogroup linalg
+      @{ */
+
+    //! partial eigen-decomposition of a symmetric matrix using the Lanczos method
+    /*! Each step extends an orthonormal basis for the Krylov subspace
+     * generated by the matrix and the starting vector, at a cost of one
+     * matrix-vector product and a full reorthogonalisation against the
+     * previous basis vectors. The eigenvalues of the resulting tridiagonal
+     * matrix (the Ritz values) converge first to the eigenvalues at both
+     * ends of the spectrum, so that the largest eigenvalues and their
+     * eigenvectors can be obtained in far fewer steps than the size of the
+     * matrix. Once as many steps as the size of the matrix have been
+     * performed, the decomposition is exact.
+     *
+     * Typical usage:
+     * \code
+     * Math::Lanczos<float> lanczos (A.rows());
+     * lanczos.init (start);
+     * do {
+     *   lanczos.step (A, 10);
+     *   lanczos.solve();
+     * } while (!lanczos.complete() && lanczos.residual (lanczos.size()-1) > tolerance * lanczos.eigenvalues()[lanczos.size()-1]);
+     * \endcode */
+    template <typename ValueType>
+      class Lanczos
+      {
+        public:
+          typedef Eigen::Matrix<ValueType,Eigen::Dynamic,1> vector_type;
+          typedef Eigen::Matrix<ValueType,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+
+          Lanczos (ssize_t N) :
+            Q (N, 0),
+            alpha (N),
+            beta (N),
+            w (N),
+            coefs (N),
+            num (0) { }
+
+          //! start a new decomposition, using \a start as the initial vector
+          template <class VectorType>
+            void init (const VectorType& start) {
+              if (!Q.cols())
+                Q.resize (Q.rows(), 1);
+              Q.col(0) = start.template cast<ValueType>();
+              Q.col(0).normalize();
+              num = 0;
+            }
+
+          //! perform up to \a count further steps of the decomposition of \a A
+          /*! Only the lower triangular part of \a A is used. The same matrix
+           * must be passed to each call following init(). */
+          template <class MatrixType>
+            void step (const MatrixType& A, ssize_t count) {
+              const ssize_t N = Q.rows();
+              const ssize_t end = std::min (num + count, N);
+              // the basis is grown as needed, since typically only a small
+              // fraction of the N possible vectors are used:
+              if (Q.cols() < std::min (end+1, N))
+                Q.conservativeResize (N, std::min (std::max (end+1, 2*Q.cols()), N));
+              for (; num < end; ++num) {
+                w.noalias() = A.template selfadjointView<Eigen::Lower>() * Q.col (num);
+                alpha[num] = Q.col (num).dot (w);
+                // full reorthogonalisation, repeated once to compensate for
+                // the loss of orthogonality in the first pass:
+                for (size_t pass = 0; pass < 2; ++pass) {
+                  coefs.head (num+1).noalias() = Q.leftCols (num+1).transpose() * w;
+                  w.noalias() -= Q.leftCols (num+1) * coefs.head (num+1);
+                }
+                beta[num] = w.norm();
+                if (num+1 == N)
+                  continue;
+
+                if (beta[num] > std::numeric_limits<ValueType>::epsilon() * std::abs (alpha[num])) {
+                  Q.col (num+1) = w / beta[num];
+                }
+                else {
+                  // the Krylov subspace is invariant: the Ritz values found
+                  // so far are exact, and the decomposition continues in the
+                  // orthogonal complement:
+                  beta[num] = ValueType (0.0);
+                  Q.col (num+1) = next_basis_vector();
+                }
+              }
+            }
+
+          //! compute the Ritz values from the steps performed so far
+          /*! The eigenvectors of the tridiagonal matrix are only computed as
+           * needed by residual() and eigenvectors(), by inverse iteration. */
+          void solve () {
+            eig.computeFromTridiagonal (alpha.head (num), beta.head (num-1), Eigen::EigenvaluesOnly);
+          }
+
+          //! the number of steps performed so far
+          ssize_t size () const { return num; }
+
+          //! whether the decomposition is exact
+          bool complete () const { return num == Q.rows(); }
+
+          //! the Ritz values, in increasing order
+          const vector_type& eigenvalues () const { return eig.eigenvalues(); }
+
+          //! the norm of the residual of the Ritz pair \a n, which bounds the error on the Ritz value
+          ValueType residual (ssize_t n) const {
+            if (complete())
+              return ValueType (0.0);
+            return std::abs (beta[num-1] * tridiagonal_eigenvectors (alpha.head (num), beta.head (num-1), eigenvalues().segment (n, 1)) (num-1, 0));
+          }
+
+          //! the Ritz vectors \a first to \a first + \a count - 1
+          matrix_type eigenvectors (ssize_t first, ssize_t count) const {
+            return Q.leftCols (num) * tridiagonal_eigenvectors (alpha.head (num), beta.head (num-1), eigenvalues().segment (first, count)).template cast<ValueType>();
+          }
+
+        protected:
+          matrix_type Q;
+          vector_type alpha, beta, w, coefs;
+          ssize_t num;
+          Eigen::SelfAdjointEigenSolver<matrix_type> eig;
+
+          // the first coordinate axis not contained in the current basis,
+          // orthogonalised against it:
+          vector_type next_basis_vector () const {
+            vector_type v (Q.rows());
+            for (ssize_t i = 0; i < Q.rows(); ++i) {
+              v.setZero();
+              v[i] = ValueType (1.0);
+              for (size_t pass = 0; pass < 2; ++pass)
+                v -= Q.leftCols (num+1) * (Q.leftCols (num+1).transpose() * v);
+              if (v.norm() > ValueType (0.5))
+                break;
+            }
+            return v.normalized();
+          }
+      };
+
+    /** @} */
+
+  }
+}
+
+#endif
+
@@ -17,8 +17,7 @@
 
 #include "types.h"
 #include "math/least_squares.h"
-
-#define GLM_BATCH_SIZE 1024
+#include "math/stats/measurements.h"
 
 namespace MR
 {
@@ -132,6 +131,40 @@ namespace MR
                                                                                       const Eigen::Matrix<ValueType, Eigen::Dynamic, Eigen::Dynamic>& contrast) {
               return abs_effect_size (measurements, design, contrast).array() / stdev (measurements, design).array();
           }
+
+
+
+          //! Compute a matrix of the beta coefficients, one batch of elements at a time
+          inline Eigen::MatrixXf solve_betas (const MeasurementMatrix& measurements, const Eigen::MatrixXf& design) {
+            Eigen::MatrixXf result (design.cols(), measurements.rows());
+            for (size_t b = 0; b < measurements.num_blocks(); ++b)
+              result.middleCols (measurements.block_start (b), measurements.block_rows (b)) = solve_betas (Eigen::MatrixXf (measurements.block (b)), design);
+            return result;
+          }
+
+          //! Compute the effect of interest, one batch of elements at a time
+          inline Eigen::MatrixXf abs_effect_size (const MeasurementMatrix& measurements, const Eigen::MatrixXf& design, const Eigen::MatrixXf& contrast) {
+            Eigen::MatrixXf result (contrast.rows(), measurements.rows());
+            for (size_t b = 0; b < measurements.num_blocks(); ++b)
+              result.middleCols (measurements.block_start (b), measurements.block_rows (b)) = abs_effect_size (Eigen::MatrixXf (measurements.block (b)), design, contrast);
+            return result;
+          }
+
+          //! Compute the pooled standard deviation, one batch of elements at a time
+          inline Eigen::MatrixXf stdev (const MeasurementMatrix& measurements, const Eigen::MatrixXf& design) {
+            Eigen::MatrixXf result (1, measurements.rows());
+            for (size_t b = 0; b < measurements.num_blocks(); ++b)
+              result.middleCols (measurements.block_start (b), measurements.block_rows (b)) = stdev (Eigen::MatrixXf (measurements.block (b)), design);
+            return result;
+          }
+
+          //! Compute cohen's d, one batch of elements at a time
+          inline Eigen::MatrixXf std_effect_size (const MeasurementMatrix& measurements, const Eigen::MatrixXf& design, const Eigen::MatrixXf& contrast) {
+            Eigen::MatrixXf result (contrast.rows(), measurements.rows());
+            for (size_t b = 0; b < measurements.num_blocks(); ++b)
+              result.middleCols (measurements.block_start (b), measurements.block_rows (b)) = std_effect_size (Eigen::MatrixXf (measurements.block (b)), design, contrast);
+            return result;
+          }
           //! @}
       }
 
@@ -142,11 +175,11 @@ namespace MR
       {
         public:
           /*!
-          * @param measurements a matrix storing the measured data for each subject in a column //TODO
+          * @param measurements a matrix storing the measured data for each subject in a column
           * @param design the design matrix (unlike other packages a column of ones is NOT automatically added for correlation analysis)
           * @param contrast a matrix containing the contrast of interest.
           */
-          GLMTTest (const Eigen::MatrixXf& measurements,
+          GLMTTest (const MeasurementMatrix& measurements,
                     const Eigen::MatrixXf& design,
                     const Eigen::MatrixXf& contrast) :
             y (measurements),
@@ -165,32 +198,75 @@ namespace MR
           void operator() (const std::vector<size_t>& perm_labelling, std::vector<float>& stats,
                            float& max_stat, float& min_stat) const
           {
-            stats.resize (y.rows(), 0.0);
-            Eigen::MatrixXf tvalues, betas, residuals, SX, pinvSX;
-
-            SX.resize (X.rows(), X.cols());
-            pinvSX.resize (pinvX.rows(), pinvX.cols());
-            for (ssize_t i = 0; i < X.rows(); ++i) {
-              SX.row(i) = X.row (perm_labelling[i]);
-              pinvSX.col(i) = pinvX.col (perm_labelling[i]);
+            std::vector<std::vector<float>> block_stats (1);
+            std::vector<float> block_max_stat, block_min_stat;
+            (*this) (std::vector<std::vector<size_t>> (1, perm_labelling), block_stats, block_max_stat, block_min_stat);
+            std::swap (stats, block_stats[0]);
+            max_stat = std::max (max_stat, block_max_stat[0]);
+            min_stat = std::min (min_stat, block_min_stat[0]);
+          }
+
+          /*! Compute the t-statistics for a block of permutations at once
+          * Rather than permuting the data, the rows of the design matrix (and
+          * the corresponding columns of its pseudo-inverse) are shuffled for
+          * each permutation. The shuffled pseudo-inverses for the whole block
+          * are stacked side by side, so that the beta coefficients for all
+          * permutations are obtained from a single matrix product per batch
+          * of elements, and the data only need to be streamed through once
+          * per block rather than once per permutation.
+          * @param perm_labellings the set of vectors used to shuffle the rows in the design matrix
+          * @param stats the output t-statistics, one vector per permutation
+          * @param max_stat the maximum t-statistic for each permutation
+          * @param min_stat the minimum t-statistic for each permutation
+          */
+          void operator() (const std::vector<std::vector<size_t>>& perm_labellings, std::vector<std::vector<float>>& stats,
+                           std::vector<float>& max_stat, std::vector<float>& min_stat) const
+          {
+            const ssize_t num_perms = perm_labellings.size();
+            const ssize_t num_subjects = X.rows();
+            const ssize_t num_factors = X.cols();
+
+            stats.resize (num_perms);
+            for (auto& s : stats)
+              s.resize (y.rows());
+            max_stat.assign (num_perms, 0.0f);
+            min_stat.assign (num_perms, 0.0f);
+
+            // shuffled (and transposed) design matrix and pseudo-inverse for each permutation:
+            Eigen::MatrixXf pinvSX (num_subjects, num_perms * num_factors);
+            Eigen::MatrixXf SX (num_factors, num_perms * num_subjects);
+            for (ssize_t p = 0; p < num_perms; ++p) {
+              assert (perm_labellings[p].size() == size_t(num_subjects));
+              for (ssize_t i = 0; i < num_subjects; ++i) {
+                const size_t j = perm_labellings[p][i];
+                pinvSX.block (i, p*num_factors, 1, num_factors) = pinvX.col (j).transpose();
+                SX.col (p*num_subjects + i) = X.row (j).transpose();
+              }
             }
 
-            pinvSX.transposeInPlace();
-            SX.transposeInPlace();
-            for (ssize_t i = 0; i < y.rows(); i += GLM_BATCH_SIZE) {
-              Eigen::MatrixXf tmp = y.block (i, 0, std::min (GLM_BATCH_SIZE, (int)(y.rows()-i)), y.cols());
-              GLM::ttest (tvalues, SX, pinvSX, tmp, scaled_contrasts, betas, residuals);
-              for (ssize_t n = 0; n < tvalues.rows(); ++n) {
-                float val = tvalues(n,0);
-                if (std::isfinite (val)) {
-                  if (val > max_stat)
-                    max_stat = val;
-                  if (val < min_stat)
-                    min_stat = val;
-                } else {
-                  val = float(0.0);
+            Eigen::MatrixXf betas, residuals;
+            Eigen::VectorXf tvalues;
+            for (size_t b = 0; b < y.num_blocks(); ++b) {
+              const size_t i = y.block_start (b);
+              const auto tmp = y.block (b);
+              betas.noalias() = tmp * pinvSX;
+              for (ssize_t p = 0; p < num_perms; ++p) {
+                const auto perm_betas = betas.middleCols (p*num_factors, num_factors);
+                residuals = tmp;
+                residuals.noalias() -= perm_betas * SX.middleCols (p*num_subjects, num_subjects);
+                tvalues.noalias() = perm_betas * scaled_contrasts.col(0);
+                for (ssize_t n = 0; n < tvalues.size(); ++n) {
+                  float val = tvalues[n] / residuals.row(n).norm();
+                  if (std::isfinite (val)) {
+                    if (val > max_stat[p])
+                      max_stat[p] = val;
+                    if (val < min_stat[p])
+                      min_stat[p] = val;
+                  } else {
+                    val = float(0.0);
+                  }
+                  stats[p][i+n] = val;
                 }
-                stats[i+n] = val;
               }
             }
           }
@@ -199,7 +275,7 @@ namespace MR
           size_t num_elements () const { return y.rows(); }
 
         protected:
-          const Eigen::MatrixXf& y;
+          const MeasurementMatrix& y;
           Eigen::MatrixXf X, pinvX, scaled_contrasts;
       };
       //! @}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+#ifndef __math_stats_measurements_h__
+#define __math_stats_measurements_h__
+
+#include <memory>
+
+#include "types.h"
+#include "file/mmap.h"
+#include "file/utils.h"
+
+#define GLM_BATCH_SIZE 1024
+
+namespace MR
+{
+  namespace Math
+  {
+    namespace Stats
+    {
+
+      /** \addtogroup Statistics
+      @{ */
+      /*! A matrix of measurements, with one row per element and one column per subject.
+       * The matrix is stored in blocks of GLM_BATCH_SIZE consecutive elements,
+       * with each block held contiguously in column-major order, so that each
+       * batch of elements processed by the GLM can be accessed directly as an
+       * Eigen matrix.
+       *
+       * By default, the data are held in RAM. If \a out_of_core is set, the
+       * data are instead stored in a temporary file that is memory-mapped,
+       * so that the operating system can page the data in and out as
+       * required. The temporary file is deleted when the matrix is
+       * destroyed. */
+      class MeasurementMatrix
+      {
+        public:
+          typedef Eigen::Map<Eigen::MatrixXf> BlockType;
+          typedef Eigen::Map<const Eigen::MatrixXf> ConstBlockType;
+
+          MeasurementMatrix (size_t num_elements, size_t num_subjects, bool out_of_core = false) :
+              num_elements (num_elements),
+              num_subjects (num_subjects),
+              data (nullptr)
+          {
+            const size_t size = num_elements * num_subjects;
+            if (out_of_core) {
+              filename = File::create_tempfile (std::max (size, size_t(1)) * sizeof(float), "glm");
+              INFO ("storing " + str(num_elements) + " x " + str(num_subjects) + " measurement matrix in file \"" + filename + "\"");
+              try {
+                mmap.reset (new File::MMap (filename, true, false));
+              } catch (...) {
+                File::unlink (filename);
+                throw;
+              }
+              data = reinterpret_cast<float*> (mmap->address());
+            } else {
+              buffer.resize (size);
+              data = buffer.data();
+            }
+          }
+
+          ~MeasurementMatrix () {
+            if (mmap) {
+              mmap.reset();
+              try { File::unlink (filename); }
+              catch (...) { }
+            }
+          }
+
+          MeasurementMatrix (const MeasurementMatrix&) = delete;
+          MeasurementMatrix& operator= (const MeasurementMatrix&) = delete;
+
+          size_t rows () const { return num_elements; }
+          size_t cols () const { return num_subjects; }
+          bool out_of_core () const { return bool (mmap); }
+
+          size_t num_blocks () const { return (num_elements + GLM_BATCH_SIZE - 1) / GLM_BATCH_SIZE; }
+          size_t block_start (size_t b) const { return b * GLM_BATCH_SIZE; }
+          size_t block_rows (size_t b) const { return std::min (size_t(GLM_BATCH_SIZE), num_elements - block_start (b)); }
+
+          BlockType block (size_t b) {
+            return BlockType (data + block_start (b) * num_subjects, block_rows (b), num_subjects);
+          }
+          ConstBlockType block (size_t b) const {
+            return ConstBlockType (data + block_start (b) * num_subjects, block_rows (b), num_subjects);
+          }
+
+          float& operator() (size_t element, size_t subject) {
+            return data[index (element, subject)];
+          }
+          float operator() (size_t element, size_t subject) const {
+            return data[index (element, subject)];
+          }
+
+          bool allFinite () const {
+            for (size_t b = 0; b < num_blocks(); ++b)
+              if (!block (b).allFinite())
+                return false;
+            return true;
+          }
+
+        protected:
+          const size_t num_elements, num_subjects;
+          std::vector<float> buffer;
+          std::string filename;
+          std::unique_ptr<File::MMap> mmap;
+          float* data;
+
+          size_t index (size_t element, size_t subject) const {
+            assert (element < num_elements && subject < num_subjects);
+            const size_t b = element / GLM_BATCH_SIZE;
+            return block_start (b) * num_subjects + subject * block_rows (b) + (element - block_start (b));
+          }
+      };
+      //! @}
+
+    }
+  }
+}
+
+
+#endif
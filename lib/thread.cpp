@@ -46,6 +46,43 @@ namespace MR
 
 
 
+    //CONF option: ThreadQueueBackend
+    //CONF default: mutex
+    //CONF The mechanism used to pass items between the stages of
+    //CONF multi-threaded pipelines. The default (mutex) uses a single
+    //CONF queue shared by all threads; setting this to stealing gives
+    //CONF each thread its own queue, with idle threads taking items from
+    //CONF the queues of others. The latter can reduce contention when
+    //CONF running cheap processing stages over many threads.
+
+    bool queue_work_stealing ()
+    {
+      const std::string backend = lowercase (File::Config::get ("ThreadQueueBackend", "mutex"));
+      if (backend == "stealing")
+        return true;
+      if (backend != "mutex")
+        WARN ("unknown value \"" + backend + "\" for config file entry ThreadQueueBackend - using default (mutex)");
+      return false;
+    }
+
+
+
+    //CONF option: ThreadQueueAdaptiveBatching
+    //CONF default: 1 (true)
+    //CONF Whether multi-threaded pipelines that pass items in batches
+    //CONF should adjust the batch size as they run, growing batches when
+    //CONF threads are contending for access to the queue, and shrinking
+    //CONF them when downstream threads are left waiting for data. If
+    //CONF disabled, the batch size requested by the command is used
+    //CONF throughout.
+
+    bool adaptive_batch_size ()
+    {
+      return File::Config::get_bool ("ThreadQueueAdaptiveBatching", true);
+    }
+
+
+
 
 
     void (*__Backend::previous_print_func) (const std::string& msg) = nullptr;
@@ -242,6 +242,17 @@ namespace MR
      * the -nthreads command-line option */
     size_t number_of_threads ();
 
+    /*! whether Thread::Queue should distribute items over per-thread queues
+     * with work stealing, rather than a single queue protected by a mutex,
+     * as specified by the variable ThreadQueueBackend in the MRtrix
+     * configuration file. This is checked each time a queue is created. */
+    bool queue_work_stealing ();
+
+    /*! whether batched queues (see Thread::batch()) should adjust their batch
+     * size at runtime, as specified by the variable
+     * ThreadQueueAdaptiveBatching in the MRtrix configuration file. */
+    bool adaptive_batch_size ();
+
 
 
     //! used to request multiple threads of the corresponding functor
@@ -18,10 +18,13 @@
 #define __mrtrix_thread_queue_h__
 
 #include <stack>
+#include <deque>
+#include <atomic>
 #include <condition_variable>
 
 #include "memory.h"
 #include "thread.h"
+#include "timer.h"
 
 #define MRTRIX_QUEUE_DEFAULT_CAPACITY 128
 #define MRTRIX_QUEUE_DEFAULT_BATCH_SIZE 128
@@ -45,6 +48,14 @@ namespace MR
             size_t num;
         };
 
+      // the type actually sent through the queue for batched items:
+      template <class Item>
+        class __BatchItems : public std::vector<Item> { };
+
+      // number of items in each entry of the queue, for reporting:
+      template <class X> inline size_t __num_items (const X&) { return 1; }
+      template <class X> inline size_t __num_items (const __BatchItems<X>& batch) { return batch.size(); }
+
 
 
       // to handle batched / unbatched seamlessly:
@@ -129,6 +140,21 @@ namespace MR
      * be sent in batches to reduce the overhead of thread management (mutex
      * locking/unlocking, etc). 
      *
+     * With large numbers of threads, contention for the lock protecting the
+     * queue can become the limiting factor for cheap processing stages. Each
+     * queue can then instead distribute its items over a set of per-thread
+     * queues, with idle readers stealing items from their neighbours' queues.
+     * This backend is selected at runtime using the \c ThreadQueueBackend
+     * entry in the MRtrix configuration file (see
+     * Thread::queue_work_stealing()), and is otherwise transparent to the
+     * code using the queue.
+     *
+     * When the command is run with the \c -info option, each queue keeps
+     * track of how long its reader and writer threads spend blocked waiting
+     * on the queue, and of how full the queue is at each write. This is
+     * reported when the queue is destroyed, and can help to identify which
+     * stage of a pipeline is the bottleneck.
+     *
      * The simplest way to use this functionality is via the
      * Thread::run_queue() and associated Thread::multi() and Thread::batch()
      * functions. In complex situations, it may be necessary to use the
@@ -366,8 +392,15 @@ namespace MR
           capacity (buffer_size),
           writer_count (0),
           reader_count (0),
-          name (description) {
+          name (description),
+          num_items (0),
+          data_waiters (0),
+          space_waiters (0),
+          writer_index (0),
+          reader_index (0),
+          stats (App::log_level > 1 ? new Stats : nullptr) {
           assert (capacity > 0);
+          init_slots();
         }
 
         //! needed for Thread::run_queue()
@@ -378,12 +411,21 @@ namespace MR
           capacity (buffer_size),
           writer_count (0),
           reader_count (0),
-          name (description) {
+          name (description),
+          num_items (0),
+          data_waiters (0),
+          space_waiters (0),
+          writer_index (0),
+          reader_index (0),
+          stats (App::log_level > 1 ? new Stats : nullptr) {
           assert (capacity > 0);
+          init_slots();
         }
 
 
         ~Queue () {
+          if (stats)
+            stats->report (name, capacity);
           delete [] buffer;
         }
 
@@ -403,12 +445,8 @@ namespace MR
             //! Register a Writer object with the queue
             /*! The Writer object will register itself with the queue as a
              * writer. */
-            Writer (Queue<T>& queue) : Q (queue) {
-              Q.register_writer();
-            }
-            Writer (const Writer& W) : Q (W.Q) {
-              Q.register_writer();
-            }
+            Writer (Queue<T>& queue) : Q (queue), home (Q.register_writer()) { }
+            Writer (const Writer& W) : Q (W.Q), home (Q.register_writer()) { }
 
             //! This class is used to write items to the queue
             /*! Items cannot be written directly onto a Thread::Queue queue. An
@@ -429,14 +467,25 @@ namespace MR
                  *
                  * \note There should only be one Writer::Item object per Writer.
                  * */
-                Item (const Writer& writer) : Q (writer.Q), p (Q.get_item()) { }
+                Item (const Writer& writer) : Q (writer.Q), p (Q.get_item()), home (writer.home), next (writer.home), blocked (0.0) { }
                 //! Unregister the parent Writer from the queue
                 ~Item () {
+                  if (Q.stats)
+                    Q.stats->add_writer (lifetime.elapsed(), blocked);
                   Q.unregister_writer();
                 }
                 //! Push the item onto the queue
                 FORCE_INLINE bool write () {
-                  return Q.push (p);
+                  if (!Q.stats)
+                    return Q.push (p, home, next);
+                  Timer timer;
+                  const bool retval = Q.push (p, home, next);
+                  blocked += timer.elapsed();
+                  return retval;
+                }
+                //! Whether any readers are currently blocked waiting for items
+                FORCE_INLINE bool readers_waiting () const {
+                  return Q.data_waiters;
                 }
                 FORCE_INLINE T& operator*() const throw ()   {
                   return *p;
@@ -447,10 +496,15 @@ namespace MR
               private:
                 Queue<T>& Q;
                 T* p;
+                const size_t home;
+                size_t next;
+                Timer lifetime;
+                double blocked;
             };
 
           private:
             Queue<T>& Q;
+            const size_t home;
         };
 
 
@@ -470,12 +524,8 @@ namespace MR
             //! Register a Reader object with the queue.
             /*! The Reader object will register itself with the queue as a
              * reader. */
-            Reader (Queue<T>& queue) : Q (queue) {
-              Q.register_reader();
-            }
-            Reader (const Reader& reader) : Q (reader.Q) {
-              Q.register_reader();
-            }
+            Reader (Queue<T>& queue) : Q (queue), home (Q.register_reader()) { }
+            Reader (const Reader& reader) : Q (reader.Q), home (Q.register_reader()) { }
 
             //! This class is used to read items from the queue
             /*! Items cannot be read directly from a Thread::Queue queue. An
@@ -496,14 +546,21 @@ namespace MR
                  *
                  * \note There should only be one Reader::Item object per
                  * Reader. */
-                Item (const Reader& reader) : Q (reader.Q), p (nullptr) { }
+                Item (const Reader& reader) : Q (reader.Q), p (nullptr), home (reader.home), last (reader.home), blocked (0.0) { }
                 //! Unregister the parent Reader from the queue
                 ~Item () {
+                  if (Q.stats)
+                    Q.stats->add_reader (lifetime.elapsed(), blocked);
                   Q.unregister_reader();
                 }
                 //! Get next item from the queue
                 FORCE_INLINE bool read () {
-                  return Q.pop (p);
+                  if (!Q.stats)
+                    return Q.pop (p, home, last);
+                  Timer timer;
+                  const bool retval = Q.pop (p, home, last);
+                  blocked += timer.elapsed();
+                  return retval;
                 }
                 FORCE_INLINE T& operator*() const throw ()   {
                   return *p;
@@ -517,9 +574,14 @@ namespace MR
               private:
                 Queue<T>& Q;
                 T* p;
+                const size_t home;
+                size_t last;
+                Timer lifetime;
+                double blocked;
             };
           private:
             Queue<T>& Q;
+            const size_t home;
         };
 
         //! Print out a status report for debugging purposes
@@ -527,28 +589,127 @@ namespace MR
           std::lock_guard<std::mutex> lock (mutex);
           std::cerr << "Thread::Queue \"" + name + "\": "
                     << writer_count << " writer" << (writer_count > 1 ? "s" : "") << ", "
-                    << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " << size() << "\n";
+                    << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " 
+                    << (slots.size() ? size_t (std::max (num_items.load(), ptrdiff_t (0))) : size()) 
+                    << (slots.size() ? " (work stealing over " + str (slots.size()) + " queues)" : std::string()) << "\n";
         }
 
 
       private:
+        // per-thread queue used by the work-stealing backend:
+        class Slot {
+          public:
+            Slot () : count (0) { }
+            std::mutex mutex;
+            std::deque<T*> queue;
+            std::vector<T*> spare;
+            std::atomic<size_t> count;
+        };
+
         std::mutex mutex;
         std::condition_variable more_data, more_space;
         T** buffer;
         T** front;
         T** back;
         size_t capacity;
-        size_t writer_count, reader_count;
+        std::atomic<size_t> writer_count, reader_count;
         std::stack<T*,std::vector<T*> > item_stack;
         std::vector<std::unique_ptr<T>> items;
         std::string name;
 
+        std::vector<std::unique_ptr<Slot>> slots;
+        std::atomic<ptrdiff_t> num_items;
+        std::atomic<size_t> data_waiters, space_waiters;
+        size_t writer_index, reader_index;
+
+
+        // usage statistics, only collected when running with -info:
+        class Stats {
+          public:
+            Stats () : pushed (0), items (0), num_writers (0), num_readers (0),
+                writer_time (0.0), writer_blocked (0.0), reader_time (0.0), reader_blocked (0.0) {
+              for (auto& n : occupancy)
+                n = 0;
+            }
+
+            void push (const T& item, size_t queue_size, size_t capacity) {
+              ++pushed;
+              items += __num_items (item);
+              ++occupancy[std::min (queue_size * 10 / capacity, size_t (9))];
+            }
+
+            void add_writer (double elapsed, double blocked) {
+              std::lock_guard<std::mutex> lock (mutex);
+              ++num_writers;
+              writer_time += elapsed;
+              writer_blocked += blocked;
+            }
+
+            void add_reader (double elapsed, double blocked) {
+              std::lock_guard<std::mutex> lock (mutex);
+              ++num_readers;
+              reader_time += elapsed;
+              reader_blocked += blocked;
+            }
+
+            void report (const std::string& name, size_t capacity) {
+              const double elapsed = timer.elapsed();
+              if (!pushed)
+                return;
+              const size_t pos = name.find ("->");
+              const std::string writers = pos == std::string::npos ? "writers" : name.substr (0, pos);
+              const std::string readers = pos == std::string::npos ? "readers" : name.substr (pos+2);
+
+              std::string line = "queue \"" + name + "\": " + str (items) + " items";
+              if (items != pushed) 
+                line += " in " + str (pushed) + " batches (mean size " + str (double (items) / pushed, 3) + ")";
+              line += " over " + str (elapsed, 3) + " s (" + str (items / elapsed, 4) + " items/s)";
+              INFO (line);
+              INFO ("  " + stage (writers, num_writers, writer_time, writer_blocked));
+              INFO ("  " + stage (readers, num_readers, reader_time, reader_blocked));
+
+              line = "  occupancy (capacity " + str (capacity) + "):";
+              for (size_t n = 0; n < 10; ++n) {
+                if (occupancy[n]) 
+                  line += " [" + str (10*n) + "-" + str (10*(n+1)) + "%]: " + str (100.0 * occupancy[n] / pushed, 3) + "%";
+              }
+              INFO (line);
+            }
+
+            std::atomic<size_t> pushed, items;
+            std::atomic<size_t> occupancy[10];
+
+          private:
+            std::mutex mutex;
+            size_t num_writers, num_readers;
+            double writer_time, writer_blocked, reader_time, reader_blocked;
+            Timer timer;
+
+            static std::string stage (const std::string& label, size_t num, double time, double blocked) {
+              return label + " (" + str (num) + " thread" + (num > 1 ? "s" : "") + "): " 
+                + str (time > 0.0 ? 100.0 * (time - blocked) / time : 0.0, 3) + "% busy, " 
+                + str (time > 0.0 ? 100.0 * blocked / time : 0.0, 3) + "% blocked on queue";
+            }
+        };
+
+        std::unique_ptr<Stats> stats;
+
         Queue (const Queue&) = delete;
         Queue& operator= (const Queue&) = delete;
 
-        void register_writer ()   {
+        void init_slots () {
+          if (!queue_work_stealing())
+            return;
+          const size_t num_slots = std::max (number_of_threads(), size_t (1));
+          for (size_t n = 0; n < num_slots; ++n)
+            slots.push_back (std::unique_ptr<Slot> (new Slot));
+          DEBUG ("queue \"" + name + "\" using work stealing over " + str (num_slots) + " queues");
+        }
+
+        size_t register_writer ()   {
           std::lock_guard<std::mutex> lock (mutex);
           ++writer_count;
+          return slots.size() ? writer_index++ % slots.size() : 0;
         }
         void unregister_writer () {
           std::lock_guard<std::mutex> lock (mutex);
@@ -559,9 +720,10 @@ namespace MR
             more_data.notify_all();
           }
         }
-        void register_reader ()   {
+        size_t register_reader ()   {
           std::lock_guard<std::mutex> lock (mutex);
           ++reader_count;
+          return slots.size() ? reader_index++ % slots.size() : 0;
         }
         void unregister_reader () {
           std::lock_guard<std::mutex> lock (mutex);
@@ -590,12 +752,16 @@ namespace MR
           return item;
         }
 
-        FORCE_INLINE bool push (T*& item) {
+        FORCE_INLINE bool push (T*& item, size_t home, size_t& next) {
+          if (slots.size())
+            return push_stealing (item, home, next);
           std::unique_lock<std::mutex> lock (mutex);
           more_space.wait (lock, [this]{ return !(full() && reader_count); });
           if (!reader_count) return false;
           *back = item;
           back = inc (back);
+          if (stats) 
+            stats->push (*item, size(), capacity);
           if (item_stack.empty()) {
             item = new T;
             items.push_back (std::unique_ptr<T> (item));
@@ -608,12 +774,18 @@ namespace MR
           return true;
         }
 
-        FORCE_INLINE bool pop (T*& item) {
+        FORCE_INLINE bool pop (T*& item, size_t home, size_t& last) {
+          if (slots.size())
+            return pop_stealing (item, home, last);
           std::unique_lock<std::mutex> lock (mutex);
           if (item)
             item_stack.push (item);
           item = nullptr;
-          more_data.wait (lock, [this]{ return !(empty() && writer_count); });
+          if (empty() && writer_count) {
+            ++data_waiters;
+            more_data.wait (lock, [this]{ return !(empty() && writer_count); });
+            --data_waiters;
+          }
           if (empty() && !writer_count)
             return false;
           item = *front;
@@ -627,6 +799,100 @@ namespace MR
           if (p >= buffer + capacity) p = buffer;
           return p;
         }
+
+
+
+        // work-stealing backend: the shared mutex is only used to block
+        // when the queue is full or empty, and to allocate new items.
+        // Waiting threads register themselves in data_waiters /
+        // space_waiters before checking num_items, so that the thread
+        // modifying num_items is guaranteed to see them and notify.
+
+        bool push_stealing (T*& item, size_t home, size_t& next) {
+          if (num_items >= ptrdiff_t (capacity) || !reader_count) {
+            std::unique_lock<std::mutex> lock (mutex);
+            ++space_waiters;
+            more_space.wait (lock, [this]{ return !(num_items >= ptrdiff_t (capacity) && reader_count); });
+            --space_waiters;
+            if (!reader_count) return false;
+          }
+
+          // with a single reader, each writer sticks to its own queue so that 
+          // items are received in the order they were sent:
+          size_t n = home;
+          if (reader_count > 1) {
+            n = next;
+            if (++next >= slots.size()) 
+              next = 0;
+          }
+
+          T* recycled = nullptr;
+          {
+            Slot& slot (*slots[n]);
+            std::lock_guard<std::mutex> lock (slot.mutex);
+            slot.queue.push_back (item);
+            ++slot.count;
+            if (stats)
+              stats->push (*item, std::max (num_items.load(), ptrdiff_t (0)), capacity);
+            if (slot.spare.size()) {
+              recycled = slot.spare.back();
+              slot.spare.pop_back();
+            }
+          }
+          item = recycled ? recycled : get_item();
+
+          ++num_items;
+          if (data_waiters) {
+            std::lock_guard<std::mutex> lock (mutex);
+            more_data.notify_one();
+          }
+          return true;
+        }
+
+        bool pop_stealing (T*& item, size_t home, size_t& last) {
+          if (item) {
+            // hand item back to the queue it came from, for reuse by its writer:
+            Slot& slot (*slots[last]);
+            std::lock_guard<std::mutex> lock (slot.mutex);
+            slot.spare.push_back (item);
+          }
+          item = nullptr;
+
+          while (true) {
+            // own queue first, then steal from the others:
+            for (size_t k = 0, n = home; k < slots.size(); ++k) {
+              Slot& slot (*slots[n]);
+              if (slot.count) {
+                std::lock_guard<std::mutex> lock (slot.mutex);
+                if (slot.queue.size()) {
+                  item = slot.queue.front();
+                  slot.queue.pop_front();
+                  --slot.count;
+                  last = n;
+                  break;
+                }
+              }
+              if (++n >= slots.size())
+                n = 0;
+            }
+            if (item)
+              break;
+
+            std::unique_lock<std::mutex> lock (mutex);
+            if (num_items <= 0 && !writer_count)
+              return false;
+            ++data_waiters;
+            more_data.wait (lock, [this]{ return num_items > 0 || !writer_count; });
+            --data_waiters;
+          }
+
+          --num_items;
+          if (space_waiters) {
+            std::lock_guard<std::mutex> lock (mutex);
+            more_space.notify_one();
+          }
+          return true;
+        }
     };
 
 
@@ -636,29 +902,41 @@ namespace MR
 
      //* \cond skip
 
+    // The batch size passed to Thread::batch() is used as the initial batch
+    // size. Unless disabled using the ThreadQueueAdaptiveBatching config file
+    // entry, each writer then adjusts its own batch size as it runs: it is
+    // doubled if writing batches to the queue takes more than a tenth of the
+    // time taken to fill them (i.e. the writer is blocked by contention or
+    // by a full queue), and halved if readers were left waiting for data
+    // while the batch was being filled. 
     template <class T> class Queue<__Batch<T>>
     {
       private:
-        typedef std::vector<T> BatchType;
+        typedef __BatchItems<T> BatchType;
         typedef Queue<BatchType> BatchQueue;
 
       public:
         Queue (const __Batch<T>& item_type, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
           batch_queue (description, buffer_size),
-          batch_size (item_type.num) { }
+          batch_size (item_type.num),
+          adaptive (adaptive_batch_size()) { }
 
 
         class Writer
         {
           public:
             Writer (Queue<__Batch<T>>& queue) : 
-              batch_writer (queue.batch_queue), batch_size (queue.batch_size) { }
+              batch_writer (queue.batch_queue), batch_size (queue.batch_size), adaptive (queue.adaptive) { }
 
             class Item
             {
               public:
                 Item (const Writer& writer) : 
-                  batch_item (writer.batch_writer), batch_size (writer.batch_size), n (0) { 
+                  batch_item (writer.batch_writer), 
+                  batch_size (writer.batch_size), 
+                  max_batch_size (writer.adaptive ? 16*writer.batch_size : writer.batch_size),
+                  adaptive (writer.adaptive),
+                  n (0) { 
                     batch_item->resize (batch_size);
                 }
                 ~Item () {
@@ -669,7 +947,11 @@ namespace MR
                 }
                 FORCE_INLINE bool write () {
                   if (++n >= batch_size) {
-                    if (!batch_item.write()) 
+                    if (adaptive) {
+                      if (!write_adaptive())
+                        return false;
+                    }
+                    else if (!batch_item.write()) 
                       return false;
                     n = 0;
                     batch_item->resize (batch_size);
@@ -684,13 +966,32 @@ namespace MR
                 }
               private:
                 typename BatchQueue::Writer::Item batch_item;
-                const size_t batch_size;
+                size_t batch_size;
+                const size_t max_batch_size;
+                const bool adaptive;
                 size_t n;
+                Timer fill_timer;
+
+                bool write_adaptive () {
+                  const double fill_time = fill_timer.elapsed();
+                  const bool readers_starved = batch_item.readers_waiting();
+                  Timer write_timer;
+                  if (!batch_item.write())
+                    return false;
+                  const double write_time = write_timer.elapsed();
+                  if (write_time > 0.1 * fill_time) 
+                    batch_size = std::min (2*batch_size, max_batch_size);
+                  else if (readers_starved)
+                    batch_size = std::max (batch_size/2, size_t(1));
+                  fill_timer.start();
+                  return true;
+                }
             };
 
           private:
             typename BatchQueue::Writer batch_writer;
             const size_t batch_size;
+            const bool adaptive;
         };
 
 
@@ -737,6 +1038,7 @@ namespace MR
       private:
         BatchQueue batch_queue;
         const size_t batch_size;
+        const bool adaptive;
     };
 
 
@@ -829,7 +1131,10 @@ namespace MR
     //! used to request batched processing of items
     /*! This function is used in combination with Thread::run_queue to request
      * that the items \a object be processed in batches of \a number items 
-     * (defaults to MRTRIX_QUEUE_DEFAULT_BATCH_SIZE).
+     * (defaults to MRTRIX_QUEUE_DEFAULT_BATCH_SIZE). Unless adaptive batch
+     * sizing has been disabled (see Thread::adaptive_batch_size()), this is
+     * only the initial batch size, which each writer will then adjust to
+     * suit the relative cost of the pipeline stages.
      * \sa Thread::run_queue() */
     template <class Item>
       inline __Batch<Item> batch (const Item& object, size_t number = MRTRIX_QUEUE_DEFAULT_BATCH_SIZE) 
@@ -1003,9 +1308,11 @@ namespace MR
      * }
      * \endcode
      *
-     * By default, batches consist of MRTRIX_QUEUE_DEFAULT_BATCH_SIZE items
-     * (defined as 128). This can be set explicitly by providing the desired
-     * size as an additional argument to Thread::batch():
+     * By default, batches initially consist of MRTRIX_QUEUE_DEFAULT_BATCH_SIZE
+     * items (defined as 128), and are then grown or shrunk as required, based
+     * on how long the writers spend waiting on the queue and whether readers
+     * are left idle. The initial size can be set explicitly by providing the
+     * desired size as an additional argument to Thread::batch():
      *
      * \code 
      * ...
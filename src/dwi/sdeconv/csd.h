@@ -16,6 +16,9 @@
 #ifndef __dwi_sdeconv_csd_h__
 #define __dwi_sdeconv_csd_h__
 
+#include <algorithm>
+#include <iterator>
+
 #include "app.h"
 #include "header.h"
 #include "dwi/gradient.h"
@@ -30,6 +33,11 @@
 #define DEFAULT_CSD_THRESHOLD 0.0
 #define DEFAULT_CSD_NITER 50
 
+// the maximum number of directions that can be added to or removed from the
+// normal matrix before it is recomputed from scratch, to limit the
+// accumulation of round-off errors:
+#define CSD_MAX_NORMAL_UPDATES 1000
+
 namespace MR
 {
   namespace DWI
@@ -222,6 +230,9 @@ namespace MR
 
 
 
+        class Batch;
+
+
         CSD (const Shared& shared_data) :
           shared (shared_data),
           work (shared.Mt_M.rows(), shared.Mt_M.cols()),
@@ -232,7 +243,8 @@ namespace MR
           Mt_b (shared.HR_trans.cols()),
           llt (work.rows()),
           old_neg (shared.HR_trans.rows()),
-          computed_once (false) { }
+          computed_once (false),
+          num_updates (0) { }
 
         CSD (const CSD&) = default;
 
@@ -248,45 +260,180 @@ namespace MR
             Mt_b = shared.M.transpose() * DW_signals;
           }
 
+        //! set the DW signals, starting from the final state of the previous voxel
+        /*! The iteration is initialised using the set of negative directions
+         * (and the corresponding Cholesky factor) on which the previous voxel
+         * processed by this object terminated. For a neighbouring voxel, this
+         * will typically be close to its own final negative set, so that
+         * far fewer iterations are required. */
+        template <class VectorType>
+          void set_from_previous (const VectorType& DW_signals) {
+            if (!computed_once)
+              return set (DW_signals);
+            Mt_b = shared.M.transpose() * DW_signals;
+            F.noalias() = llt.solve (Mt_b);
+          }
+
         bool iterate() {
-          neg.clear();
-          HR_amps = shared.HR_trans * F;
-          for (ssize_t n = 0; n < HR_amps.size(); n++)
-            if (HR_amps[n] < shared.threshold)
-              neg.push_back (n);
-
-          if (computed_once && old_neg == neg)
-            if (old_neg == neg)
+          HR_amps.noalias() = shared.HR_trans * F;
+          return iterate (HR_amps);
+        }
+
+        //! as iterate(), given the amplitudes of the current FOD along the constraint directions
+        template <class VectorType>
+          bool iterate (const VectorType& amplitudes) {
+            neg.clear();
+            for (ssize_t n = 0; n < amplitudes.size(); n++)
+              if (amplitudes[n] < shared.threshold)
+                neg.push_back (n);
+
+            if (computed_once && old_neg == neg)
               return true;
 
+            if (!computed_once || !update_factorisation())
+              compute_factorisation();
+
+            F.noalias() = llt.solve (Mt_b);
+
+            computed_once = true;
+            std::swap (old_neg, neg);
+
+            return false;
+          }
+
+        const Eigen::VectorXd& FOD () const { return F; }
+
+
+        const Shared& shared;
+
+      protected:
+        Eigen::MatrixXd work, HR_T;
+        Eigen::VectorXd F, init_F, HR_amps, Mt_b;
+        Eigen::LLT<Eigen::MatrixXd> llt;
+        std::vector<int> neg, old_neg, added, removed;
+        bool computed_once;
+        size_t num_updates;
+
+        void compute_factorisation () {
           work.triangularView<Eigen::Lower>() = shared.Mt_M.triangularView<Eigen::Lower>();
 
           if (neg.size()) {
             for (size_t i = 0; i < neg.size(); i++)
               HR_T.row (i) = shared.HR_trans.row (neg[i]);
             auto HR_T_view = HR_T.topRows (neg.size());
-            work.triangularView<Eigen::Lower>() += HR_T_view.transpose() * HR_T_view; 
+            work.triangularView<Eigen::Lower>() += HR_T_view.transpose() * HR_T_view;
           }
 
-          F.noalias() = llt.compute (work.triangularView<Eigen::Lower>()).solve (Mt_b);
+          llt.compute (work.triangularView<Eigen::Lower>());
+          num_updates = 0;
+        }
+
+        // update the normal matrix for the previous negative set with the
+        // directions that have been added to or removed from it, and
+        // refactorise. Returns false if the normal matrix needs to be
+        // recomputed from scratch instead, either because this would be
+        // cheaper, or to limit the accumulation of round-off errors:
+        bool update_factorisation () {
+          added.clear();
+          removed.clear();
+          std::set_difference (neg.begin(), neg.end(), old_neg.begin(), old_neg.end(), std::back_inserter (added));
+          std::set_difference (old_neg.begin(), old_neg.end(), neg.begin(), neg.end(), std::back_inserter (removed));
+
+          const size_t num_changes = added.size() + removed.size();
+          if (num_changes >= neg.size() || num_updates + num_changes > CSD_MAX_NORMAL_UPDATES)
+            return false;
+
+          for (size_t i = 0; i < added.size(); i++)
+            HR_T.row (i) = shared.HR_trans.row (added[i]);
+          work.selfadjointView<Eigen::Lower>().rankUpdate (HR_T.topRows (added.size()).transpose(), 1.0);
+          for (size_t i = 0; i < removed.size(); i++)
+            HR_T.row (i) = shared.HR_trans.row (removed[i]);
+          work.selfadjointView<Eigen::Lower>().rankUpdate (HR_T.topRows (removed.size()).transpose(), -1.0);
+
+          llt.compute (work.triangularView<Eigen::Lower>());
+          num_updates += num_changes;
+          return true;
+        }
+    };
+
+
 
-          computed_once = true;
-          old_neg = neg;
 
-          return false;
+    //! perform CSD on a batch of voxels at once
+    /*! One CSD object is held for each position in the batch. The FOD
+     * amplitudes along the constraint directions are computed for all voxels
+     * still iterating using a single matrix product, and each voxel is
+     * initialised from the final state of the voxel processed at the same
+     * position in the previous batch. This is intended to be used to process
+     * successive rows of voxels within a slab, so that each voxel starts from
+     * the negative set of its neighbour in the previous row. */
+    class CSD::Batch
+    {
+      public:
+        Batch (const Shared& shared, size_t size) :
+          shared (shared),
+          engines (size, CSD (shared)),
+          in_use (size, false),
+          converged (size, false),
+          F (shared.nSH(), size),
+          HR_amps (shared.HR_trans.rows(), size) { }
+
+        size_t size () const { return engines.size(); }
+
+        //! set the DW signals for voxel \a n of the batch
+        template <class VectorType>
+          void set (size_t n, const VectorType& DW_signals) {
+            engines[n].set_from_previous (DW_signals);
+            in_use[n] = true;
+          }
+
+        //! exclude voxel \a n from processing in this batch
+        void clear (size_t n) { in_use[n] = false; }
+
+        bool is_set (size_t n) const { return in_use[n]; }
+
+        //! run the CSD iterations for all voxels set, and return the number that did not converge
+        size_t run () {
+          active.clear();
+          for (size_t n = 0; n < size(); ++n) {
+            converged[n] = !in_use[n];
+            if (in_use[n])
+              active.push_back (n);
+          }
+
+          for (size_t iter = 0; iter < shared.niter && active.size(); ++iter) {
+            for (size_t i = 0; i < active.size(); ++i)
+              F.col (i) = engines[active[i]].FOD();
+            HR_amps.leftCols (active.size()).noalias() = shared.HR_trans * F.leftCols (active.size());
+
+            size_t num_active = 0;
+            for (size_t i = 0; i < active.size(); ++i) {
+              if (engines[active[i]].iterate (HR_amps.col (i)))
+                converged[active[i]] = true;
+              else
+                active[num_active++] = active[i];
+            }
+            active.resize (num_active);
+          }
+
+          if (!shared.niter) {
+            std::fill (converged.begin(), converged.end(), true);
+            return 0;
+          }
+          return active.size();
         }
 
-        const Eigen::VectorXd& FOD () const { return F; }
+        bool has_converged (size_t n) const { return converged[n]; }
 
+        const Eigen::VectorXd& FOD (size_t n) const { return engines[n].FOD(); }
 
         const Shared& shared;
 
       protected:
-        Eigen::MatrixXd work, HR_T;
-        Eigen::VectorXd F, init_F, HR_amps, Mt_b;
-        Eigen::LLT<Eigen::MatrixXd> llt;
-        std::vector<int> neg, old_neg;
-        bool computed_once;
+        std::vector<CSD> engines;
+        std::vector<bool> in_use, converged;
+        std::vector<size_t> active;
+        Eigen::MatrixXd F, HR_amps;
     };
 
 
@@ -253,6 +253,8 @@ namespace MR
           size_t niter;
           const Shared& shared;
 
+          class Batch;
+
         private:
           Math::ICLS::Solver<double> solver;
 
@@ -261,6 +263,82 @@ namespace MR
 
 
 
+
+      //! perform MSMT-CSD on a batch of voxels at once
+      /*! One ICLS solver is held for each position in the batch. The
+       * unconstrained solutions and corresponding constraint values are
+       * computed for all voxels in the batch using matrix-matrix products,
+       * and each voxel is initialised from the final active set of the
+       * voxel processed at the same position in the previous batch. This is
+       * intended to be used to process successive rows of voxels within a
+       * slab, so that each voxel starts from the active set of its
+       * neighbour in the previous row. */
+      class MSMT_CSD::Batch
+      {
+        public:
+          Batch (const Shared& shared, size_t size) :
+            shared (shared),
+            solvers (size, Math::ICLS::Solver<double> (shared.problem)),
+            warm (size, false),
+            in_use (size, false),
+            niter (size, 0),
+            data (shared.problem.num_measurements(), size),
+            y_u (shared.problem.num_parameters(), size),
+            c_u (shared.problem.num_constraints(), size),
+            x (size, Eigen::VectorXd (shared.problem.num_parameters())) { }
+
+          size_t size () const { return solvers.size(); }
+
+          //! set the DW signals for voxel \a n of the batch
+          template <class VectorType>
+            void set (size_t n, const VectorType& DW_signals) {
+              data.col (n) = DW_signals;
+              in_use[n] = true;
+            }
+
+          //! exclude voxel \a n from processing in this batch
+          void clear (size_t n) { in_use[n] = false; }
+
+          bool is_set (size_t n) const { return in_use[n]; }
+
+          void run () {
+            // gather the data for the voxels in use:
+            index.clear();
+            for (size_t n = 0; n < size(); ++n) {
+              if (in_use[n]) {
+                if (index.size() != n)
+                  data.col (index.size()) = data.col (n);
+                index.push_back (n);
+              }
+            }
+            const size_t num = index.size();
+
+            // unconstrained solutions and constraint values for all voxels at once:
+            y_u.leftCols (num).noalias() = shared.problem.b2d.transpose() * data.leftCols (num);
+            c_u.leftCols (num).noalias() = shared.problem.B * y_u.leftCols (num);
+
+            for (size_t i = 0; i < num; ++i) {
+              const size_t n = index[i];
+              niter[n] = solvers[n] (x[n], y_u.col (i), c_u.col (i), warm[n]);
+              warm[n] = true;
+            }
+          }
+
+          const Eigen::VectorXd& output (size_t n) const { return x[n]; }
+          size_t num_iterations (size_t n) const { return niter[n]; }
+
+          const Shared& shared;
+
+        protected:
+          std::vector<Math::ICLS::Solver<double>> solvers;
+          std::vector<bool> warm, in_use;
+          std::vector<size_t> niter, index;
+          Eigen::MatrixXd data, y_u, c_u;
+          std::vector<Eigen::VectorXd> x;
+      };
+
+
+
     }
   }
 }
@@ -328,7 +328,7 @@ end_init:
 
           private:
             const Shared& S;
-            Interpolator<Image<float>>::type source;
+            CachedInterpolator source;
             float calibrate_ratio, half_log_prob0, last_half_log_probN, half_log_prob0_seed;
             size_t mean_sample_num, num_sample_runs, num_truncations;
             float max_truncation;
@@ -272,16 +272,8 @@ void WriterExtraction::clear()
 
 bool WriterExtraction::operator() (const Connectome::Streamline_nodepair& in) const
 {
-  if (exclusive) {
-    // Make sure that both nodes are within the list of nodes of interest;
-    //   if not, don't pass to any of the selectors
-    bool first_in_list = false, second_in_list = false;
-    for (std::vector<node_t>::const_iterator i = node_list.begin(); i != node_list.end(); ++i) {
-      if (*i == in.get_nodes().first)  first_in_list = true;
-      if (*i == in.get_nodes().second) second_in_list = true;
-    }
-    if (!first_in_list || !second_in_list) return true;
-  }
+  // If exclusive, don't pass to any of the selectors unless all nodes are of interest
+  if (exclusive && !in_node_list (in.get_nodes())) return true;
   for (size_t i = 0; i != file_count(); ++i) {
     if (selectors[i] (in.get_nodes()))
       (*writers[i]) (in);
@@ -293,16 +285,7 @@ bool WriterExtraction::operator() (const Connectome::Streamline_nodepair& in) co
 
 bool WriterExtraction::operator() (const Connectome::Streamline_nodelist& in) const
 {
-  if (exclusive) {
-    // Make sure _all_ nodes are within the list of nodes of interest;
-    //   if not, don't pass to any of the selectors
-    BitSet in_list (in.get_nodes().size());
-    for (std::vector<node_t>::const_iterator i = node_list.begin(); i != node_list.end(); ++i) {
-      for (size_t n = 0; n != in.get_nodes().size(); ++n)
-        if (*i == in.get_nodes()[n]) in_list[n] = true;
-    }
-    if (!in_list.full()) return true;
-  }
+  if (exclusive && !in_node_list (in.get_nodes())) return true;
   for (size_t i = 0; i != file_count(); ++i) {
     if (selectors[i] (in.get_nodes()))
       (*writers[i]) (in);
@@ -314,6 +297,52 @@ bool WriterExtraction::operator() (const Connectome::Streamline_nodelist& in) co
 
 
 
+bool WriterExtraction::select (const NodePair& nodes) const
+{
+  if (exclusive && !in_node_list (nodes)) return false;
+  for (size_t i = 0; i != file_count(); ++i) {
+    if (selectors[i] (nodes))
+      return true;
+  }
+  return false;
+}
+
+bool WriterExtraction::select (const std::vector<node_t>& nodes) const
+{
+  if (exclusive && !in_node_list (nodes)) return false;
+  for (size_t i = 0; i != file_count(); ++i) {
+    if (selectors[i] (nodes))
+      return true;
+  }
+  return false;
+}
+
+
+
+bool WriterExtraction::in_node_list (const NodePair& nodes) const
+{
+  // Make sure that both nodes are within the list of nodes of interest
+  bool first_in_list = false, second_in_list = false;
+  for (std::vector<node_t>::const_iterator i = node_list.begin(); i != node_list.end(); ++i) {
+    if (*i == nodes.first)  first_in_list = true;
+    if (*i == nodes.second) second_in_list = true;
+  }
+  return (first_in_list && second_in_list);
+}
+
+bool WriterExtraction::in_node_list (const std::vector<node_t>& nodes) const
+{
+  // Make sure _all_ nodes are within the list of nodes of interest
+  BitSet in_list (nodes.size());
+  for (std::vector<node_t>::const_iterator i = node_list.begin(); i != node_list.end(); ++i) {
+    for (size_t n = 0; n != nodes.size(); ++n)
+      if (*i == nodes[n]) in_list[n] = true;
+  }
+  return in_list.full();
+}
+
+
+
 
 
 
@@ -116,6 +116,10 @@ class WriterExtraction
     bool operator() (const Connectome::Streamline_nodepair&) const;
     bool operator() (const Connectome::Streamline_nodelist&) const;
 
+    // Whether a streamline assigned to these nodes will be written to any of the output files
+    bool select (const NodePair&) const;
+    bool select (const std::vector<node_t>&) const;
+
     size_t file_count() const { return writers.size(); }
 
 
@@ -128,6 +132,9 @@ class WriterExtraction
     std::vector< Tractography::WriterUnbuffered<float>* > writers;
     Tractography::Streamline<> empty_tck;
 
+    bool in_node_list (const NodePair&) const;
+    bool in_node_list (const std::vector<node_t>&) const;
+
 };
 
 
@@ -16,16 +16,19 @@
 #ifndef __dwi_tractography_file_h__
 #define __dwi_tractography_file_h__
 
+#include <atomic>
 #include <map>
 #include <vector>
 
 #include "app.h"
 #include "types.h"
 #include "memory.h"
+#include "thread.h"
 #include "file/config.h"
 #include "file/key_value.h"
 #include "file/ofstream.h"
 #include "dwi/tractography/file_base.h"
+#include "dwi/tractography/file_compressed.h"
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/streamline.h"
 
@@ -56,7 +59,208 @@ namespace MR
 
 
 
+      //! \cond skip
+      // Decodes the streamline data in chunks of the file, using multiple
+      // threads. Each thread reads a chunk of the file, skips to the first
+      // delimiter to find the first streamline starting within that chunk,
+      // and decodes all streamlines that start within it (reading past the
+      // end of the chunk if required). Chunks are decoded a batch at a time,
+      // and their streamlines returned in the order in which they appear in
+      // the file.
+      template <class ValueType>
+      class __ChunkDecoder__
+      {
+        public:
+          typedef Eigen::Matrix<ValueType,3,1> point_type;
+
+          __ChunkDecoder__ (const File::Entry& data, const DataType dtype, size_t num_threads) :
+              data (data),
+              dtype (dtype),
+              num_threads (std::max (num_threads, size_t(1))),
+              next_chunk (0),
+              current_chunk (0),
+              current_track (0),
+              end_of_data (false)
+          {
+            std::ifstream in (data.name.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+            if (!in)
+              throw Exception ("error opening tracks data file \"" + data.name + "\": " + strerror(errno));
+            num_points = (int64_t (in.tellg()) - data.start) / (3 * dtype.bytes());
+          }
+
+          //! fetch the next streamline in the file
+          bool operator() (Streamline<ValueType>& tck)
+          {
+            while (current_chunk >= chunks.size() || current_track >= chunks[current_chunk].tracks.size()) {
+              if (current_chunk < chunks.size() && chunks[current_chunk].end_of_data)
+                end_of_data = true;
+              if (end_of_data)
+                return false;
+              current_track = 0;
+              if (++current_chunk >= chunks.size())
+                decode_next();
+            }
+            tck = std::move (chunks[current_chunk].tracks[current_track++]);
+            return true;
+          }
+
+          //! the number of points read per chunk
+          static constexpr uint64_t chunk_size = 1048576;
+
+        private:
+          class Chunk {
+            public:
+              std::vector<Streamline<ValueType>> tracks;
+              bool end_of_data;
+          };
+
+          const File::Entry data;
+          const DataType dtype;
+          const size_t num_threads;
+          uint64_t num_points, next_chunk;
+          std::vector<Chunk> chunks;
+          size_t current_chunk, current_track;
+          bool end_of_data;
+
+          // decode the next num_threads chunks of the file concurrently:
+          void decode_next ()
+          {
+            const uint64_t first_chunk = next_chunk;
+            const uint64_t last_chunk = std::min (first_chunk + num_threads, (num_points + chunk_size - 1) / chunk_size);
+            chunks.clear();
+            current_chunk = current_track = 0;
+            if (first_chunk >= last_chunk) {
+              end_of_data = true;
+              return;
+            }
+            chunks.resize (last_chunk - first_chunk);
+            next_chunk = last_chunk;
+
+            std::atomic<size_t> counter (0);
+            Worker worker (*this, first_chunk, counter);
+            auto threads = Thread::run (Thread::multi (worker, chunks.size()), "track decoder");
+            threads.wait();
+          }
+
+
+          class Worker {
+            public:
+              Worker (__ChunkDecoder__& decoder, uint64_t first_chunk, std::atomic<size_t>& counter) :
+                D (decoder), first_chunk (first_chunk), counter (counter), buffer_start (0) { }
+              Worker (const Worker& that) :
+                D (that.D), first_chunk (that.first_chunk), counter (that.counter), buffer_start (0) { }
+
+              void execute () {
+                in.open (D.data.name.c_str(), std::ios::in | std::ios::binary);
+                if (!in)
+                  throw Exception ("error opening tracks data file \"" + D.data.name + "\": " + strerror(errno));
+                size_t n;
+                while ((n = counter++) < D.chunks.size())
+                  decode (first_chunk + n, D.chunks[n]);
+              }
+
+            private:
+              __ChunkDecoder__& D;
+              const uint64_t first_chunk;
+              std::atomic<size_t>& counter;
+              std::ifstream in;
+              std::vector<point_type> buffer;
+              uint64_t buffer_start;
+
+              void decode (const uint64_t chunk, Chunk& output)
+              {
+                output.end_of_data = false;
+                const uint64_t start = chunk * chunk_size;
+                const uint64_t end = std::min (start + chunk_size, D.num_points);
+                buffer.clear();
+
+                // the first streamline starting within this chunk follows
+                // the first delimiter at or after the last point of the
+                // previous chunk:
+                uint64_t n = start;
+                if (chunk) {
+                  for (n = start-1; n < D.num_points; ++n) {
+                    const point_type& p (point (n));
+                    if (std::isinf (p[0])) {
+                      output.end_of_data = true;
+                      return;
+                    }
+                    if (std::isnan (p[0]))
+                      break;
+                  }
+                  ++n;
+                }
+
+                Streamline<ValueType> tck;
+                while (n < end) {
+                  for (; n < D.num_points; ++n) {
+                    const point_type& p (point (n));
+                    if (std::isinf (p[0])) {
+                      output.end_of_data = true;
+                      return;
+                    }
+                    if (std::isnan (p[0]))
+                      break;
+                    tck.push_back (p);
+                  }
+                  if (n++ >= D.num_points) {
+                    // file is truncated: discard incomplete streamline
+                    output.end_of_data = true;
+                    return;
+                  }
+                  output.tracks.push_back (std::move (tck));
+                  tck.clear();
+                }
+              }
+
+              // access point n, reading the next block of the file if required:
+              FORCE_INLINE const point_type& point (const uint64_t n)
+              {
+                if (n < buffer_start || n >= buffer_start + buffer.size())
+                  load (n);
+                return buffer[n - buffer_start];
+              }
+
+              void load (const uint64_t from)
+              {
+                buffer_start = from;
+                buffer.resize (std::min (chunk_size, D.num_points - from));
+                in.seekg (D.data.start + from * 3 * D.dtype.bytes());
+                switch (D.dtype()) {
+                  case DataType::Float32LE: load<float> (false); break;
+                  case DataType::Float32BE: load<float> (true); break;
+                  case DataType::Float64LE: load<double> (false); break;
+                  case DataType::Float64BE: load<double> (true); break;
+                  default: assert (0); break;
+                }
+              }
+
+              // byte-swapping and conversion over the whole block at once:
+              template <typename T>
+                void load (const bool is_big_endian)
+                {
+                  std::vector<T> raw (3 * buffer.size());
+                  in.read (reinterpret_cast<char*> (&raw[0]), raw.size() * sizeof (T));
+                  if (!in.good())
+                    throw Exception ("error reading tracks data file \"" + D.data.name + "\"");
+                  if (is_big_endian != MRTRIX_IS_BIG_ENDIAN) {
+                    for (auto& v : raw)
+                      v = ByteOrder::swap (v);
+                  }
+                  for (size_t i = 0; i < buffer.size(); ++i)
+                    buffer[i] = point_type (raw[3*i], raw[3*i+1], raw[3*i+2]);
+                }
+          };
+      };
+      //! \endcond
+
+
+
       //! A class to read streamlines data
+      /*! Files with the .tckz suffix are read using the CompressedReader
+       * class. In this case, the streamline weights stored in the file are
+       * used unless a weights file is provided via the -tck_weights_in
+       * option. */
       template <class ValueType = float>
       class Reader : public __ReaderBase__, public ReaderInterface<ValueType>
       {
@@ -65,7 +269,10 @@ namespace MR
           //! open the \c file for reading and load header into \c properties
           Reader (const std::string& file, Properties& properties) :
             current_index (0) {
-              open (file, "tracks", properties);
+              if (is_compressed_tracks (file))
+                compressed.reset (new CompressedReader<ValueType> (file, properties));
+              else
+                open (file, "tracks", properties);
               auto opt = App::get_options ("tck_weights_in");
               if (opt.size()) {
                 weights_file.reset (new std::ifstream (str(opt[0][0]).c_str(), std::ios_base::in));
@@ -75,13 +282,61 @@ namespace MR
             }
 
 
+            //! decode the streamline data using multiple threads
+            /*! This reads the file in large chunks, which are decoded
+             * concurrently by \c num_threads threads; the streamlines are
+             * still returned in order by operator(), and their indices and
+             * weights are unaffected. This is worthwhile when the consumer of
+             * the streamlines is itself multi-threaded, and would otherwise
+             * be starved of data.
+             *
+             * \note this must be called before the first streamline is read;
+             * an Exception is thrown otherwise. */
+            void decode_in_parallel (size_t num_threads = Thread::number_of_threads())
+            {
+              if (current_index)
+                throw Exception ("parallel decoding of streamlines must be requested before the first streamline is read");
+              if (compressed)
+                compressed->decode_in_parallel (num_threads);
+              else if (in.is_open() && num_threads > 1)
+                decoder.reset (new __ChunkDecoder__<ValueType> (data, dtype, num_threads));
+            }
+
+
+            //! close the file, and release any decoding buffers
+            void close () {
+              in.close();
+              decoder.reset();
+              compressed.reset();
+            }
+
+
             //! fetch next track from file
             bool operator() (Streamline<ValueType>& tck) {
               tck.clear();
 
-              if (!in.is_open())
+              if (!in.is_open() && !compressed)
                 return false;
 
+              if (compressed || decoder) {
+                if (!(compressed ? (*compressed) (tck) : (*decoder) (tck))) {
+                  close();
+                  check_excess_weights();
+                  return false;
+                }
+                tck.index = current_index++;
+                if (weights_file) {
+                  (*weights_file) >> tck.weight;
+                  if (weights_file->fail()) {
+                    WARN ("Streamline weights file contains less entries than .tck file; only read " + str(current_index-1) + " streamlines");
+                    close();
+                    tck.clear();
+                    return false;
+                  }
+                }
+                return true;
+              }
+
               do {
                 auto p = get_next_point();
                 if (std::isinf (p[0])) {
@@ -127,9 +382,12 @@ namespace MR
         protected:
           using __ReaderBase__::in;
           using __ReaderBase__::dtype;
+          using __ReaderBase__::data;
 
           uint64_t current_index;
           std::unique_ptr<std::ifstream> weights_file;
+          std::unique_ptr<__ChunkDecoder__<ValueType>> decoder;
+          std::unique_ptr<CompressedReader<ValueType>> compressed;
 
           //! takes care of byte ordering issues
 
@@ -200,6 +458,11 @@ namespace MR
        * use cases where a very large number of track files are being written
        * at once. For most applications (where typically one track file is
        * written at a time), the Writer class is more appropriate.
+       *
+       * Files with the .tckz suffix are written using the CompressedWriter
+       * class, which does its own buffering. In this case, the streamline
+       * weights are stored within the file itself (as well as in any file
+       * specified using the -tck_weights_out option).
        * */
       template <class ValueType = float>
         class WriterUnbuffered : public __WriterBase__<ValueType>, public WriterInterface<ValueType>
@@ -217,47 +480,84 @@ namespace MR
           typedef Eigen::Matrix<ValueType,3,1> vector_type;
 
           //! create a new track file with the specified properties
+          //CONF option: TrackWriterIndex
+          //CONF default: 0 (false)
+          //CONF Whether to write an index of the streamline offsets alongside
+          //CONF any track file written (with the additional suffix .idx).
+          //CONF This allows commands that need random access to
+          //CONF the streamlines to open the file without first scanning it in
+          //CONF full.
           WriterUnbuffered (const std::string& file, const Properties& properties) :
-              __WriterBase__<ValueType> (file) {
-
-            if (!Path::has_suffix (name, ".tck"))
-              throw Exception ("output track files must use the .tck suffix");
+              __WriterBase__<ValueType> (file),
+              num_points (0) {
 
-            File::OFStream out;
-            try {
-              out.open (name, std::ios::out | std::ios::binary | std::ios::trunc);
-            } catch (Exception& e) {
-              throw Exception (e, "Unable to create output track file");
-            }
+            const bool is_compressed = is_compressed_tracks (name);
+            if (!is_compressed && !Path::has_suffix (name, ".tck"))
+              throw Exception ("output track files must use the .tck or " + std::string (compressed_tracks_suffix) + " suffix");
 
             const_cast<Properties&> (properties).set_timestamp();
             const_cast<Properties&> (properties).set_version_info();
 
-            create (out, properties, "tracks");
-            barrier_addr = out.tellp();
+            if (is_compressed) {
+              compressed.reset (new CompressedWriter<ValueType> (name, properties));
+            }
+            else {
+              File::OFStream out;
+              try {
+                out.open (name, std::ios::out | std::ios::binary | std::ios::trunc);
+              } catch (Exception& e) {
+                throw Exception (e, "Unable to create output track file");
+              }
 
-            vector_type x;
-            format_point (barrier(), x);
-            out.write (reinterpret_cast<char*> (&x[0]), sizeof (x));
-            if (!out.good())
-              throw Exception ("error writing tracks file \"" + name + "\": " + strerror (errno));
-            open_success = true;
+              create (out, properties, "tracks");
+              barrier_addr = out.tellp();
+
+              vector_type x;
+              format_point (barrier(), x);
+              out.write (reinterpret_cast<char*> (&x[0]), sizeof (x));
+              if (!out.good())
+                throw Exception ("error writing tracks file \"" + name + "\": " + strerror (errno));
+              open_success = true;
+
+              if (File::Config::get_bool ("TrackWriterIndex", false))
+                index_name = index_path (name);
+            }
 
             auto opt = App::get_options ("tck_weights_out");
             if (opt.size())
               set_weights_path (opt[0][0]);
           }
 
+          //! write the streamline index, if requested
+          ~WriterUnbuffered () {
+            if (index_name.size() && open_success) {
+              try {
+                index.push_back (num_points);
+                write_index (index_name, index);
+              }
+              catch (Exception& e) {
+                e.display();
+              }
+            }
+          }
+
           //! append track to file
           bool operator() (const Streamline<ValueType>& tck) {
+            // empty (rejected) tracks are passed on to the compressed
+            // writer, so that its total count is updated:
+            if (compressed)
+              (*compressed) (tck);
             if (tck.size()) {
-              // allocate buffer on the stack for performance:
-              NON_POD_VLA (buffer, vector_type, tck.size()+2);
-              for (size_t n = 0; n < tck.size(); ++n)
-                format_point (tck[n], buffer[n]);
-              format_point (delimiter(), buffer[tck.size()]);
-
-              commit (buffer, tck.size()+1);
+              if (!compressed) {
+                add_to_index (tck.size());
+                // allocate buffer on the stack for performance:
+                NON_POD_VLA (buffer, vector_type, tck.size()+2);
+                for (size_t n = 0; n < tck.size(); ++n)
+                  format_point (tck[n], buffer[n]);
+                format_point (delimiter(), buffer[tck.size()]);
+
+                commit (buffer, tck.size()+1);
+              }
 
               if (weights_name.size()) 
                 write_weights (str(tck.weight) + "\n");
@@ -279,8 +579,11 @@ namespace MR
           }
 
         protected:
-          std::string weights_name;
+          std::string weights_name, index_name;
           int64_t barrier_addr;
+          std::vector<uint64_t> index;
+          uint64_t num_points;
+          std::unique_ptr<CompressedWriter<ValueType>> compressed;
 
           //! indicates end of track and start of new track
           vector_type delimiter () const { return { ValueType(NaN), ValueType(NaN), ValueType(NaN) }; }
@@ -296,6 +599,13 @@ namespace MR
               dest = { BE(src[0]), BE(src[1]), BE(src[2]) };
           }
 
+          //! record the offset of the next streamline, of \c size points, in the index
+          void add_to_index (size_t size) {
+            if (index_name.size())
+              index.push_back (num_points);
+            num_points += size + 1;
+          }
+
           //! write track weights data to file
           void write_weights (const std::string& contents) {
             File::OFStream out (weights_name, std::ios::in | std::ios::out | std::ios::binary | std::ios::ate);
@@ -358,6 +668,8 @@ namespace MR
           using WriterUnbuffered<ValueType>::format_point;
           using WriterUnbuffered<ValueType>::weights_name;
           using WriterUnbuffered<ValueType>::write_weights;
+          using WriterUnbuffered<ValueType>::add_to_index;
+          using WriterUnbuffered<ValueType>::compressed;
           typedef typename WriterUnbuffered<ValueType>::vector_type vector_type;
 
           //! create new RAM-buffered track file with specified properties
@@ -374,7 +686,7 @@ namespace MR
           Writer (const std::string& file, const Properties& properties, size_t default_buffer_capacity = 16777216) :
             WriterUnbuffered<ValueType> (file, properties), 
             buffer_capacity (File::Config::get_int ("TrackWriterBufferSize", default_buffer_capacity) / sizeof (vector_type)),
-            buffer (new vector_type [buffer_capacity]),
+            buffer (compressed ? nullptr : new vector_type [buffer_capacity]),
             buffer_size (0) { }
 
           Writer (const Writer& W) = delete;
@@ -386,13 +698,27 @@ namespace MR
 
           //! append track to file
           bool operator() (const Streamline<ValueType>& tck) {
+            // empty (rejected) tracks are passed on to the compressed
+            // writer, so that its total count is updated:
+            if (compressed)
+              (*compressed) (tck);
             if (tck.size()) {
-              if (buffer_size + tck.size() + 2 > buffer_capacity)
-                commit ();
+              if (compressed) {
+                // only the weights are buffered here; buffer_capacity is
+                // expressed in points, and weights_buffer in bytes:
+                if (weights_buffer.size() > buffer_capacity * sizeof (vector_type))
+                  commit();
+              }
+              else {
+                if (buffer_size + tck.size() + 2 > buffer_capacity)
+                  commit ();
 
-              for (const auto& i : tck)
-                add_point (i);
-              add_point (delimiter());
+                add_to_index (tck.size());
+
+                for (const auto& i : tck)
+                  add_point (i);
+                add_point (delimiter());
+              }
 
               if (weights_name.size())
                 weights_buffer += str (tck.weight) + ' ';
@@ -23,6 +23,17 @@ namespace MR {
 
 
       void __ReaderBase__::open (const std::string& file, const std::string& type, Properties& properties)
+      {
+        data = read_header (file, type, properties);
+        in.open (data.name.c_str(), std::ios::in | std::ios::binary);
+        if (!in)
+          throw Exception ("error opening " + type  + " data file \"" + data.name + "\": " + strerror(errno));
+        in.seekg (data.start);
+      }
+
+
+
+      File::Entry __ReaderBase__::read_header (const std::string& file, const std::string& type, Properties& properties)
       {
         properties.clear();
         dtype = DataType::Undefined;
@@ -75,10 +86,68 @@ namespace MR {
         else
           fname = file;
 
-        in.open (fname.c_str(), std::ios::in | std::ios::binary);
-        if (!in)
-          throw Exception ("error opening " + type  + " data file \"" + fname + "\": " + strerror(errno));
-        in.seekg (offset);
+        return { fname, offset };
+      }
+
+
+
+
+
+      void write_index (const std::string& path, const std::vector<uint64_t>& offsets)
+      {
+        assert (offsets.size());
+        std::string header = "mrtrix track index\ncount: " + str (offsets.size()-1) + "\ndatatype: UInt64LE\nfile: . ";
+        // leave room for the offset itself, and align data to 8 bytes:
+        int64_t data_offset = header.size() + 25;
+        data_offset += (8 - (data_offset % 8)) % 8;
+        header += str (data_offset) + "\nEND\n";
+        header.resize (data_offset, '\0');
+
+        std::vector<uint64_t> data (offsets.size());
+        for (size_t n = 0; n < offsets.size(); ++n)
+          data[n] = ByteOrder::LE (offsets[n]);
+
+        File::OFStream out (path, std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write (header.c_str(), header.size());
+        out.write (reinterpret_cast<const char*> (&data[0]), data.size() * sizeof (uint64_t));
+        if (!out.good())
+          throw Exception ("error writing track index file \"" + path + "\": " + strerror (errno));
+      }
+
+
+
+      bool read_index (const std::string& path, std::vector<uint64_t>& offsets)
+      {
+        if (!Path::exists (path))
+          return false;
+
+        File::KeyValue kv (path, "mrtrix track index");
+        size_t count = 0;
+        int64_t data_offset = -1;
+        DataType dtype;
+        while (kv.next()) {
+          const std::string key = lowercase (kv.key());
+          if (key == "count") count = to<size_t> (kv.value());
+          else if (key == "datatype") dtype = DataType::parse (kv.value());
+          else if (key == "file") {
+            std::vector<std::string> V (split (kv.value(), " \t", true));
+            if (V.size() != 2 || V[0] != ".")
+              throw Exception ("invalid file specification in track index file \"" + path + "\"");
+            data_offset = to<int64_t> (V[1]);
+          }
+        }
+        if (dtype != DataType::UInt64LE || data_offset < 0)
+          throw Exception ("invalid track index file \"" + path + "\"");
+
+        offsets.resize (count+1);
+        std::ifstream in (path.c_str(), std::ios::in | std::ios::binary);
+        in.seekg (data_offset);
+        in.read (reinterpret_cast<char*> (&offsets[0]), offsets.size() * sizeof (uint64_t));
+        if (!in.good())
+          throw Exception ("error reading track index file \"" + path + "\"");
+        for (auto& n : offsets)
+          n = ByteOrder::LE (n);
+        return true;
       }
 
     }
@@ -18,8 +18,10 @@
 
 #include <iomanip>
 #include <map>
+#include <vector>
 
 #include "types.h"
+#include "file/entry.h"
 #include "file/key_value.h"
 #include "file/ofstream.h"
 #include "file/path.h"
@@ -39,6 +41,7 @@ namespace MR
       class __ReaderBase__
       {
         public:
+          __ReaderBase__ () : data ("") { }
           ~__ReaderBase__ () {
             if (in.is_open())
               in.close();
@@ -50,8 +53,12 @@ namespace MR
 
         protected:
 
+          //! parse the header of \c file into \c properties, and return the location of the data
+          File::Entry read_header (const std::string& file, const std::string& type, Properties& properties);
+
           std::ifstream  in;
           DataType  dtype;
+          File::Entry  data;
       };
 
 
@@ -85,13 +92,17 @@ namespace MR
               }
             }
 
-            void create (File::OFStream& out, const Properties& properties, const std::string& type) {
+            //! write the header, with any format-specific \c entries in addition to \c properties
+            void create (File::OFStream& out, const Properties& properties, const std::string& type,
+                const std::map<std::string, std::string>& entries = std::map<std::string, std::string>()) {
               out << "mrtrix " + type + "\nEND\n";
 
               for (const auto& i : properties) {
-                if ((i.first != "count") && (i.first != "total_count"))
+                if ((i.first != "count") && (i.first != "total_count") && !entries.count (i.first))
                   out << i.first << ": " << i.second << "\n";
               }
+              for (const auto& i : entries)
+                out << i.first << ": " << i.second << "\n";
 
               for (const auto& i : properties.comments) 
                 out << "comment: " << i << "\n";
@@ -145,6 +156,24 @@ namespace MR
       //! \endcond
 
 
+
+      //! the path of the index file that may accompany the track file \c path
+      /*! The index holds the offset of the first point of each streamline
+       * from the start of the track data (in points), followed by the offset
+       * of the end-of-data barrier. It is written alongside the track file
+       * by the Writer classes if the TrackWriterIndex config file entry is
+       * set, and used by the IndexedReader class to avoid having to scan the
+       * whole file. */
+      inline std::string index_path (const std::string& path) { return path + ".idx"; }
+
+      //! write the streamline offsets in \c offsets to the index file \c path
+      void write_index (const std::string& path, const std::vector<uint64_t>& offsets);
+
+      //! read the streamline offsets from the index file \c path into \c offsets
+      /*! returns false if no index file is present */
+      bool read_index (const std::string& path, std::vector<uint64_t>& offsets);
+
+
     }
   }
 }
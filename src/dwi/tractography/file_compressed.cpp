@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+
+#include <zlib.h>
+
+#include "dwi/tractography/file_compressed.h"
+#include "file/config.h"
+
+namespace MR {
+  namespace DWI {
+    namespace Tractography {
+      namespace Compressed {
+
+
+
+        //CONF option: TrackCompressedPrecision
+        //CONF default: 0.01
+        //CONF The precision to which the vertices of streamlines are stored
+        //CONF when writing compressed track files (.tckz), as a fraction of
+        //CONF the step size of the tracks (or of 1mm if the step size is not
+        //CONF known).
+        default_type vertex_quantum (const Properties& properties)
+        {
+          const default_type precision = File::Config::get_float ("TrackCompressedPrecision", 0.01f);
+          if (!(precision > 0.0))
+            throw Exception ("invalid value for config file entry TrackCompressedPrecision (must be positive)");
+
+          default_type step_size = NaN;
+          auto entry = properties.find ("output_step_size");
+          if (entry == properties.end())
+            entry = properties.find ("step_size");
+          if (entry != properties.end()) {
+            try {
+              step_size = to<default_type> (entry->second);
+            } catch (...) { }
+          }
+          if (!std::isfinite (step_size) || step_size <= 0.0) {
+            DEBUG ("step size not known for compressed track file - assuming 1mm");
+            step_size = 1.0;
+          }
+          return precision * step_size;
+        }
+
+
+
+        void deflate (const std::vector<uint8_t>& raw, std::vector<uint8_t>& compressed)
+        {
+          uLongf size = compressBound (raw.size());
+          compressed.resize (size);
+          if (compress2 (compressed.data(), &size, raw.data(), raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw Exception ("error compressing track data");
+          compressed.resize (size);
+        }
+
+
+
+        void inflate (const uint8_t* compressed, size_t size, std::vector<uint8_t>& raw)
+        {
+          uLongf raw_size = raw.size();
+          if (uncompress (raw.data(), &raw_size, compressed, size) != Z_OK || raw_size != raw.size())
+            throw Exception ("error uncompressing track data - file may be corrupt");
+        }
+
+
+
+      }
+    }
+  }
+}
@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __dwi_tractography_file_compressed_h__
+#define __dwi_tractography_file_compressed_h__
+
+#include <atomic>
+#include <fstream>
+#include <vector>
+
+#include "memory.h"
+#include "raw.h"
+#include "thread.h"
+#include "file/ofstream.h"
+#include "file/path.h"
+#include "dwi/tractography/file_base.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/streamline.h"
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+
+
+      /*! \defgroup compressed_tracks Compressed track file format
+       *
+       * Streamlines are stored in a container with the same text header as
+       * the standard .tck format (with first line "mrtrix compressed
+       * tracks"), followed by a sequence of independently decodable blocks.
+       * Within each block, the vertices of each streamline are quantised to
+       * a fixed precision (the 'vertex_quantum' header entry, in mm), and
+       * each vertex is stored as the difference between its quantised
+       * position and that predicted by linear extrapolation from the two
+       * previous vertices. Since streamlines are generally smooth with
+       * constant step size, these residuals are small integers, which are
+       * stored as variable-length integers and the whole block then
+       * compressed using zlib. The weight of each streamline is stored
+       * alongside its vertices, and optionally a scalar value per vertex
+       * (as would otherwise be stored in a separate .tsf file).
+       *
+       * Each block is preceded by three 32-bit little-endian integers: the
+       * size of the compressed data, the size of the data once uncompressed,
+       * and the number of streamlines in the block. A block header of zero
+       * compressed size marks the end of the data.
+       *
+       * @{ */
+
+      //! the suffix used to identify compressed track files
+      constexpr const char* compressed_tracks_suffix = ".tckz";
+
+      //! whether \c path refers to a compressed track file
+      inline bool is_compressed_tracks (const std::string& path) {
+        return Path::has_suffix (path, compressed_tracks_suffix);
+      }
+
+      //! \cond skip
+      namespace Compressed
+      {
+
+        constexpr size_t block_header_size = 3 * sizeof(uint32_t);
+
+        //! the quantisation step to use for the vertices of tracks with these properties
+        default_type vertex_quantum (const Properties& properties);
+
+        //! compress \c raw into \c compressed using zlib
+        void deflate (const std::vector<uint8_t>& raw, std::vector<uint8_t>& compressed);
+        //! uncompress \c size bytes at \c compressed into \c raw (already of the expected size)
+        void inflate (const uint8_t* compressed, size_t size, std::vector<uint8_t>& raw);
+
+
+
+        inline void put_varint (std::vector<uint8_t>& out, uint64_t value) {
+          while (value >= 0x80U) {
+            out.push_back (uint8_t (value) | 0x80U);
+            value >>= 7;
+          }
+          out.push_back (uint8_t (value));
+        }
+
+        inline void put_signed (std::vector<uint8_t>& out, int64_t value) {
+          put_varint (out, (uint64_t (value) << 1) ^ uint64_t (value >> 63));
+        }
+
+        inline void put_float (std::vector<uint8_t>& out, float value) {
+          const size_t pos = out.size();
+          out.resize (pos + sizeof (float));
+          Raw::store_LE (value, &out[pos]);
+        }
+
+
+        inline uint64_t get_varint (const uint8_t*& in, const uint8_t* end) {
+          uint64_t value = 0;
+          for (size_t shift = 0; shift < 64; shift += 7) {
+            if (in >= end)
+              break;
+            const uint8_t byte = *in++;
+            value |= uint64_t (byte & 0x7FU) << shift;
+            if (!(byte & 0x80U))
+              return value;
+          }
+          throw Exception ("corrupt data in compressed track file");
+        }
+
+        inline int64_t get_signed (const uint8_t*& in, const uint8_t* end) {
+          const uint64_t value = get_varint (in, end);
+          return int64_t (value >> 1) ^ -int64_t (value & 1U);
+        }
+
+        inline float get_float (const uint8_t*& in, const uint8_t* end) {
+          if (in + sizeof (float) > end)
+            throw Exception ("corrupt data in compressed track file");
+          const float value = Raw::fetch_LE<float> (in);
+          in += sizeof (float);
+          return value;
+        }
+
+
+
+        //! the decoded contents of a block
+        template <class ValueType>
+          class Block {
+            public:
+              std::vector<Streamline<ValueType>> tracks;
+              std::vector<std::vector<float>> scalars;
+              std::vector<uint8_t> compressed;
+              uint32_t raw_size, count;
+
+              void decode (const default_type quantum, const bool with_scalars)
+              {
+                std::vector<uint8_t> raw (raw_size);
+                inflate (compressed.data(), compressed.size(), raw);
+                compressed.clear();
+
+                tracks.resize (count);
+                if (with_scalars)
+                  scalars.resize (count);
+                const uint8_t* in = raw.data();
+                const uint8_t* const end = in + raw.size();
+                for (size_t n = 0; n < count; ++n) {
+                  Streamline<ValueType>& tck (tracks[n]);
+                  const size_t num_points = get_varint (in, end);
+                  if (num_points > size_t (end - in))
+                    throw Exception ("corrupt data in compressed track file");
+                  tck.resize (num_points);
+                  tck.weight = get_float (in, end);
+                  int64_t prev[3] = { 0, 0, 0 }, delta[3] = { 0, 0, 0 };
+                  for (size_t i = 0; i < num_points; ++i) {
+                    for (size_t axis = 0; axis < 3; ++axis) {
+                      const int64_t q = prev[axis] + delta[axis] + get_signed (in, end);
+                      delta[axis] = i ? q - prev[axis] : 0;
+                      prev[axis] = q;
+                      tck[i][axis] = ValueType (quantum * q);
+                    }
+                  }
+                  if (with_scalars) {
+                    scalars[n].resize (num_points);
+                    for (auto& s : scalars[n])
+                      s = get_float (in, end);
+                  }
+                }
+                if (in != end)
+                  throw Exception ("corrupt data in compressed track file");
+              }
+          };
+
+      }
+      //! \endcond
+
+
+
+
+
+      //! A class to read streamlines from a compressed track file
+      /*! Blocks are read from file sequentially, and decoded a batch at a
+       * time by multiple threads if requested using decode_in_parallel().
+       * The Reader class uses this class transparently for files with the
+       * .tckz suffix. */
+      template <class ValueType = float>
+      class CompressedReader : public __ReaderBase__
+      {
+        public:
+          //! open the \c file for reading and load header into \c properties
+          CompressedReader (const std::string& file, Properties& properties) :
+              num_threads (1),
+              current_block (0),
+              current_track (0),
+              end_of_data (false)
+          {
+            open (file, "compressed tracks", properties);
+            auto entry = properties.find ("vertex_quantum");
+            if (entry == properties.end())
+              throw Exception ("missing vertex quantisation in compressed track file \"" + file + "\"");
+            quantum = to<default_type> (entry->second);
+            properties.erase (entry);
+            entry = properties.find ("vertex_scalars");
+            with_scalars = entry != properties.end() && to<bool> (entry->second);
+            if (entry != properties.end())
+              properties.erase (entry);
+          }
+
+          //! decode the blocks using \c num_threads threads
+          void decode_in_parallel (size_t num_threads) {
+            this->num_threads = std::max (num_threads, size_t(1));
+          }
+
+          //! whether the file contains a scalar value for each vertex
+          bool has_scalars () const { return with_scalars; }
+
+          //! fetch next track from file
+          bool operator() (Streamline<ValueType>& tck) {
+            tck.clear();
+            if (!next())
+              return false;
+            tck = std::move (blocks[current_block].tracks[current_track++]);
+            return true;
+          }
+
+          //! fetch next track from file, along with its per-vertex scalars
+          bool operator() (Streamline<ValueType>& tck, std::vector<float>& scalars) {
+            if (!with_scalars)
+              throw Exception ("compressed track file does not contain any track scalars");
+            scalars.clear();
+            if (!next()) {
+              tck.clear();
+              return false;
+            }
+            scalars = std::move (blocks[current_block].scalars[current_track]);
+            tck = std::move (blocks[current_block].tracks[current_track++]);
+            return true;
+          }
+
+
+        protected:
+          using __ReaderBase__::in;
+
+          default_type quantum;
+          bool with_scalars;
+          size_t num_threads;
+          std::vector<Compressed::Block<ValueType>> blocks;
+          size_t current_block, current_track;
+          bool end_of_data;
+
+          // move on to the next streamline, decoding more blocks as needed:
+          bool next ()
+          {
+            while (current_block >= blocks.size() || current_track >= blocks[current_block].tracks.size()) {
+              current_track = 0;
+              if (++current_block >= blocks.size()) {
+                if (end_of_data)
+                  return false;
+                read_blocks();
+              }
+            }
+            return true;
+          }
+
+          void read_blocks ()
+          {
+            blocks.clear();
+            current_block = 0;
+            while (blocks.size() < num_threads) {
+              uint8_t header[Compressed::block_header_size];
+              in.read (reinterpret_cast<char*> (header), sizeof (header));
+              if (!in.good()) {
+                WARN ("end of data not found in compressed track file - file may be truncated");
+                break;
+              }
+              const uint32_t compressed_size = Raw::fetch_LE<uint32_t> (header);
+              if (!compressed_size)
+                break;
+              Compressed::Block<ValueType> block;
+              block.raw_size = Raw::fetch_LE<uint32_t> (header + sizeof(uint32_t));
+              block.count = Raw::fetch_LE<uint32_t> (header + 2*sizeof(uint32_t));
+              block.compressed.resize (compressed_size);
+              in.read (reinterpret_cast<char*> (block.compressed.data()), compressed_size);
+              if (!in.good()) {
+                WARN ("end of data not found in compressed track file - file may be truncated");
+                break;
+              }
+              blocks.push_back (std::move (block));
+            }
+
+            if (blocks.size() < num_threads) {
+              end_of_data = true;
+              in.close();
+            }
+
+            if (blocks.size() > 1) {
+              std::atomic<size_t> counter (0);
+              Decoder decoder (*this, counter);
+              auto threads = Thread::run (Thread::multi (decoder, blocks.size()), "compressed track decoder");
+              threads.wait();
+            }
+            else if (blocks.size())
+              blocks[0].decode (quantum, with_scalars);
+          }
+
+          class Decoder {
+            public:
+              Decoder (CompressedReader& reader, std::atomic<size_t>& counter) :
+                reader (reader), counter (counter) { }
+              void execute () {
+                size_t n;
+                while ((n = counter++) < reader.blocks.size())
+                  reader.blocks[n].decode (reader.quantum, reader.with_scalars);
+              }
+            private:
+              CompressedReader& reader;
+              std::atomic<size_t>& counter;
+          };
+
+          CompressedReader (const CompressedReader&) = delete;
+      };
+
+
+
+
+
+      //! A class to write streamlines to a compressed track file
+      /*! Streamlines are accumulated in RAM until the uncompressed size of
+       * the current block reaches block_size, at which point the block is
+       * compressed and committed to file. The file is kept valid after each
+       * block has been written. The Writer class uses this class
+       * transparently for files with the .tckz suffix.
+       *
+       * The precision of the stored vertices can be set in the config file
+       * using the TrackCompressedPrecision entry, as a fraction of the step
+       * size stored in \c properties. */
+      template <class ValueType = float>
+      class CompressedWriter : public __WriterBase__<ValueType>
+      {
+        public:
+          using __WriterBase__<ValueType>::count;
+          using __WriterBase__<ValueType>::total_count;
+          using __WriterBase__<ValueType>::name;
+          using __WriterBase__<ValueType>::create;
+          using __WriterBase__<ValueType>::verify_stream;
+          using __WriterBase__<ValueType>::update_counts;
+          using __WriterBase__<ValueType>::open_success;
+
+          //! the uncompressed size of each block in bytes
+          static constexpr size_t block_size = 1048576;
+
+          //! create a new compressed track file with the specified properties
+          /*! if \c with_scalars is set, a scalar value must be provided for
+           * each vertex of each streamline written. */
+          CompressedWriter (const std::string& file, const Properties& properties, bool with_scalars = false) :
+              __WriterBase__<ValueType> (file),
+              quantum (Compressed::vertex_quantum (properties)),
+              with_scalars (with_scalars),
+              block_count (0)
+          {
+            if (!is_compressed_tracks (name))
+              throw Exception ("output compressed track files must use the " + std::string (compressed_tracks_suffix) + " suffix");
+
+            File::OFStream out;
+            try {
+              out.open (name, std::ios::out | std::ios::binary | std::ios::trunc);
+            } catch (Exception& e) {
+              throw Exception (e, "Unable to create output track file");
+            }
+
+            // the format-specific entries are only needed in the file header:
+            std::map<std::string, std::string> entries;
+            // written at full precision so the reader decodes with exactly
+            // the quantum used by the encoder:
+            entries["vertex_quantum"] = str (quantum, std::numeric_limits<default_type>::max_digits10);
+            if (with_scalars)
+              entries["vertex_scalars"] = "1";
+            create (out, properties, "compressed tracks", entries);
+            end_addr = out.tellp();
+            const uint8_t end_marker[Compressed::block_header_size] = { 0 };
+            out.write (reinterpret_cast<const char*> (end_marker), sizeof (end_marker));
+            verify_stream (out);
+            open_success = true;
+          }
+
+          //! commits any remaining data to file
+          ~CompressedWriter () {
+            try {
+              commit();
+            }
+            catch (Exception& e) {
+              e.display();
+            }
+          }
+
+          //! append track to file
+          bool operator() (const Streamline<ValueType>& tck) {
+            if (with_scalars && tck.size())
+              throw Exception ("track scalars must be provided for output compressed track file \"" + name + "\"");
+            return append (tck, nullptr);
+          }
+
+          //! append track to file, along with a scalar value for each vertex
+          bool operator() (const Streamline<ValueType>& tck, const std::vector<float>& scalars) {
+            if (!with_scalars)
+              throw Exception ("output compressed track file \"" + name + "\" was not created to hold track scalars");
+            if (scalars.size() != tck.size())
+              throw Exception ("number of track scalars does not match number of vertices");
+            return append (tck, &scalars);
+          }
+
+
+        protected:
+          const default_type quantum;
+          const bool with_scalars;
+          int64_t end_addr;
+          std::vector<uint8_t> raw;
+          uint32_t block_count;
+
+          bool append (const Streamline<ValueType>& tck, const std::vector<float>* scalars)
+          {
+            if (tck.size()) {
+              Compressed::put_varint (raw, tck.size());
+              Compressed::put_float (raw, tck.weight);
+              int64_t prev[3] = { 0, 0, 0 }, delta[3] = { 0, 0, 0 };
+              for (size_t i = 0; i < tck.size(); ++i) {
+                for (size_t axis = 0; axis < 3; ++axis) {
+                  const int64_t q = std::llround (tck[i][axis] / quantum);
+                  Compressed::put_signed (raw, q - prev[axis] - delta[axis]);
+                  delta[axis] = i ? q - prev[axis] : 0;
+                  prev[axis] = q;
+                }
+              }
+              if (scalars) {
+                for (const auto s : *scalars)
+                  Compressed::put_float (raw, s);
+              }
+              ++block_count;
+              ++count;
+            }
+            ++total_count;
+            if (raw.size() >= block_size)
+              commit();
+            return true;
+          }
+
+          // compress the current block and append it to the file, moving
+          // the end marker past it. As for the standard format, the block
+          // header is only written over the previous end marker once the
+          // rest of the data are on disk.
+          void commit ()
+          {
+            if (!open_success || !block_count)
+              return;
+            std::vector<uint8_t> compressed;
+            Compressed::deflate (raw, compressed);
+
+            uint8_t header[Compressed::block_header_size];
+            Raw::store_LE (uint32_t (compressed.size()), header);
+            Raw::store_LE (uint32_t (raw.size()), header + sizeof(uint32_t));
+            Raw::store_LE (block_count, header + 2*sizeof(uint32_t));
+            const uint8_t end_marker[Compressed::block_header_size] = { 0 };
+
+            File::OFStream out (name, std::ios::in | std::ios::out | std::ios::binary);
+            out.seekp (end_addr + Compressed::block_header_size);
+            out.write (reinterpret_cast<const char*> (compressed.data()), compressed.size());
+            out.write (reinterpret_cast<const char*> (end_marker), sizeof (end_marker));
+            verify_stream (out);
+            out.seekp (end_addr);
+            out.write (reinterpret_cast<const char*> (header), sizeof (header));
+            verify_stream (out);
+            update_counts (out);
+
+            end_addr += Compressed::block_header_size + compressed.size();
+            raw.clear();
+            block_count = 0;
+          }
+
+          CompressedWriter (const CompressedWriter&) = delete;
+      };
+
+      //! @}
+
+
+    }
+  }
+}
+
+
+#endif
+
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __dwi_tractography_indexed_file_h__
+#define __dwi_tractography_indexed_file_h__
+
+#include <atomic>
+#include <fstream>
+#include <vector>
+
+#include "app.h"
+#include "memory.h"
+#include "raw.h"
+#include "thread.h"
+#include "file/mmap.h"
+#include "dwi/tractography/file.h"
+#include "dwi/tractography/file_base.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/streamline.h"
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+
+
+
+      //! A class to provide random access to the streamlines in a track file
+      /*! The track data are memory-mapped, and the offset of each streamline
+       * within the file is obtained from the accompanying index file (see
+       * index_path()) if present and consistent with the data, or otherwise
+       * by scanning the file for the delimiters between streamlines (using
+       * multiple threads). Any streamline can then be retrieved in constant
+       * time using load(), or, if the data are stored in native byte order
+       * and precision, accessed in place with no copy via view().
+       *
+       * All access methods are const and do not modify the state of the
+       * reader, so that a single IndexedReader can be used concurrently by
+       * multiple threads, for instance to process disjoint ranges of
+       * streamlines obtained via range(). The class also implements the
+       * ReaderInterface, to read the streamlines sequentially in place of
+       * the Reader class. As for the Reader class, streamline weights are
+       * read from the file provided via the -tck_weights_in option if
+       * present. */
+      template <class ValueType = float>
+      class IndexedReader : public __ReaderBase__, public ReaderInterface<ValueType>
+      {
+        public:
+          typedef Eigen::Matrix<ValueType,3,1> point_type;
+
+          //! a read-only view onto the points of a streamline in the mapped file
+          class View {
+            public:
+              View (const ValueType* data, size_t num_points, size_t index, float weight) :
+                data (data), num_points (num_points), index (index), weight (weight) { }
+
+              size_t size () const { return num_points; }
+              Eigen::Map<const point_type> operator[] (size_t n) const { return Eigen::Map<const point_type> (data + 3*n); }
+
+            private:
+              const ValueType* data;
+              size_t num_points;
+            public:
+              const size_t index;
+              const float weight;
+          };
+
+
+          //! sequential reader for a range of streamlines within the file
+          class Range : public ReaderInterface<ValueType> {
+            public:
+              Range (const IndexedReader& reader, size_t from, size_t to) :
+                reader (reader), current (from), to (std::min (to, reader.size())) { }
+
+              bool operator() (Streamline<ValueType>& tck) override {
+                if (current >= to) {
+                  tck.clear();
+                  return false;
+                }
+                reader.load (current++, tck);
+                return true;
+              }
+
+            private:
+              const IndexedReader& reader;
+              size_t current;
+              const size_t to;
+          };
+
+
+
+          //! open the \c file for reading and load header into \c properties
+          IndexedReader (const std::string& file, Properties& properties) :
+              current (0)
+          {
+            const File::Entry entry = read_header (file, "tracks", properties);
+            mmap.reset (new File::MMap (entry));
+            num_points = mmap->size() / (3 * dtype.bytes());
+
+            if (!load_index (index_path (file), properties))
+              build_index();
+            DEBUG ("indexed track file \"" + file + "\" contains " + str (size()) + " streamlines");
+
+            auto opt = App::get_options ("tck_weights_in");
+            if (opt.size())
+              load_weights (opt[0][0]);
+          }
+
+
+          //! the number of streamlines in the file
+          size_t size () const { return offsets.size() - 1; }
+
+          //! the number of points in streamline \c n
+          size_t num_points_in (size_t n) const { return offsets[n+1] - offsets[n] - 1; }
+
+          //! whether view() is supported, i.e. data are stored in native format
+          bool supports_views () const {
+            return dtype() == DataType::native (DataType::from<ValueType>())();
+          }
+
+          //! load streamline \c n into \c tck
+          void load (size_t n, Streamline<ValueType>& tck) const {
+            assert (n < size());
+            const size_t count = num_points_in (n);
+            tck.resize (count);
+            const uint8_t* data = mmap->address();
+            const size_t first = 3 * offsets[n];
+            switch (dtype()) {
+              case DataType::Float32LE: for (size_t i = 0; i < count; ++i) tck[i] = get<float> (data, first + 3*i, false); break;
+              case DataType::Float32BE: for (size_t i = 0; i < count; ++i) tck[i] = get<float> (data, first + 3*i, true); break;
+              case DataType::Float64LE: for (size_t i = 0; i < count; ++i) tck[i] = get<double> (data, first + 3*i, false); break;
+              case DataType::Float64BE: for (size_t i = 0; i < count; ++i) tck[i] = get<double> (data, first + 3*i, true); break;
+              default: assert (0); break;
+            }
+            tck.index = n;
+            tck.weight = weights.size() ? weights[n] : 1.0f;
+          }
+
+          //! access streamline \c n in place
+          /*! \note this is only possible if supports_views() returns true */
+          View view (size_t n) const {
+            assert (n < size());
+            if (!supports_views())
+              throw Exception ("cannot access streamlines in place: track file data are not in native format");
+            return View (reinterpret_cast<const ValueType*> (mmap->address()) + 3*offsets[n], num_points_in (n),
+                n, weights.size() ? weights[n] : 1.0f);
+          }
+
+          //! a sequential reader for streamlines [ \c from, \c to )
+          Range range (size_t from, size_t to) const { return Range (*this, from, to); }
+
+          //! fetch next track from file
+          bool operator() (Streamline<ValueType>& tck) override {
+            if (current >= size()) {
+              tck.clear();
+              return false;
+            }
+            load (current++, tck);
+            return true;
+          }
+
+
+        protected:
+          using __ReaderBase__::dtype;
+
+          std::unique_ptr<File::MMap> mmap;
+          std::vector<uint64_t> offsets;
+          std::vector<float> weights;
+          uint64_t num_points;
+          size_t current;
+
+          template <typename T>
+            static point_type get (const uint8_t* data, size_t i, bool is_big_endian) {
+              return { ValueType (Raw::fetch<T> (data, i, is_big_endian)),
+                       ValueType (Raw::fetch<T> (data, i+1, is_big_endian)),
+                       ValueType (Raw::fetch<T> (data, i+2, is_big_endian)) };
+            }
+
+          // first coordinate of point n, to check for delimiters:
+          default_type first_coord (uint64_t n) const {
+            const uint8_t* data = mmap->address();
+            switch (dtype()) {
+              case DataType::Float32LE: return Raw::fetch<float> (data, 3*n, false);
+              case DataType::Float32BE: return Raw::fetch<float> (data, 3*n, true);
+              case DataType::Float64LE: return Raw::fetch<double> (data, 3*n, false);
+              case DataType::Float64BE: return Raw::fetch<double> (data, 3*n, true);
+              default: assert (0); break;
+            }
+            return NaN;
+          }
+
+
+          bool load_index (const std::string& path, const Properties& properties)
+          {
+            try {
+              if (!read_index (path, offsets))
+                return false;
+              auto count = properties.find ("count");
+              if (count != properties.end() && to<size_t> (count->second) != size())
+                throw Exception ("number of streamlines does not match track file");
+              if (offsets.back() >= num_points || !std::isinf (first_coord (offsets.back())))
+                throw Exception ("end of data does not match track file");
+              for (size_t n = 1; n < offsets.size(); ++n) {
+                if (offsets[n] <= offsets[n-1] || !std::isnan (first_coord (offsets[n]-1)))
+                  throw Exception ("streamline offsets do not match track file");
+              }
+            }
+            catch (Exception& e) {
+              WARN ("ignoring invalid track index file \"" + path + "\": " + e[0]);
+              offsets.clear();
+              return false;
+            }
+            DEBUG ("loaded track index file \"" + path + "\"");
+            return true;
+          }
+
+
+          // scan for streamline delimiters using multiple threads, each
+          // processing chunks of the file in turn:
+          class Scanner {
+            public:
+              Scanner (const IndexedReader& reader, std::atomic<size_t>& next_chunk, std::vector<std::vector<uint64_t>>& delimiters) :
+                reader (reader), next_chunk (next_chunk), delimiters (delimiters) { }
+
+              void execute () {
+                size_t chunk;
+                while ((chunk = next_chunk++) < delimiters.size()) {
+                  const uint64_t end = std::min (reader.num_points, (chunk+1) * chunk_size);
+                  for (uint64_t n = chunk * chunk_size; n < end; ++n) {
+                    const default_type x = reader.first_coord (n);
+                    if (!std::isfinite (x)) {
+                      delimiters[chunk].push_back (n);
+                      if (std::isinf (x))
+                        break;
+                    }
+                  }
+                }
+              }
+
+              static constexpr uint64_t chunk_size = 1048576;
+
+            private:
+              const IndexedReader& reader;
+              std::atomic<size_t>& next_chunk;
+              std::vector<std::vector<uint64_t>>& delimiters;
+          };
+
+          void build_index ()
+          {
+            std::vector<std::vector<uint64_t>> delimiters ((num_points + Scanner::chunk_size - 1) / Scanner::chunk_size);
+            std::atomic<size_t> next_chunk (0);
+            Scanner scanner (*this, next_chunk, delimiters);
+            Thread::run (Thread::multi (scanner), "track file scanner");
+
+            offsets.assign (1, 0);
+            for (const auto& chunk : delimiters) {
+              for (const auto n : chunk) {
+                if (std::isinf (first_coord (n))) {
+                  offsets.back() = n;
+                  return;
+                }
+                offsets.push_back (n+1);
+              }
+            }
+            // no barrier: file is truncated, so ignore any incomplete streamline at the end
+            WARN ("end of data not found in track file \"" + mmap->name() + "\" - file may be truncated");
+          }
+
+
+          void load_weights (const std::string& path)
+          {
+            std::ifstream in (path.c_str(), std::ios_base::in);
+            if (!in.good())
+              throw Exception ("Unable to open streamlines weights file " + path);
+            weights.reserve (size());
+            float w;
+            while (weights.size() < size() && in >> w)
+              weights.push_back (w);
+            if (weights.size() < size())
+              throw Exception ("Streamline weights file contains less entries than .tck file");
+            if (in >> w)
+              WARN ("Streamline weights file contains more entries than .tck file");
+          }
+
+          IndexedReader (const IndexedReader&) = delete;
+      };
+
+
+
+    }
+  }
+}
+
+#endif
+
@@ -31,6 +31,10 @@ namespace MR {
 
 
 
+        // Source stage of the streamline mapping pipelines. The streamline
+        //   data are decoded from file by multiple threads (see
+        //   Reader::decode_in_parallel()), so that decoding does not limit
+        //   the throughput of the multi-threaded mapping stages.
         class TrackLoader
         {
 
@@ -38,7 +42,9 @@ namespace MR {
             TrackLoader (Reader<>& file, const size_t to_load = 0, const std::string& msg = "mapping tracks to image") :
               reader (file),
               tracks_to_load (to_load),
-              progress (msg.size() ? new ProgressBar (msg, tracks_to_load) : nullptr) { }
+              progress (msg.size() ? new ProgressBar (msg, tracks_to_load) : nullptr) {
+                reader.decode_in_parallel();
+              }
 
             virtual ~TrackLoader() { }
             virtual bool operator() (Streamline<>& out)
@@ -18,6 +18,7 @@
 
 
 #include "thread_queue.h"
+#include "timer.h"
 #include "dwi/directions/set.h"
 #include "dwi/tractography/streamline.h"
 #include "dwi/tractography/rng.h"
@@ -49,9 +50,20 @@ namespace MR
       {
 
 
-        // TODO Try having ACT as a template boolean; allow compiler to optimise out branch statements
+        // Tracking features that are fixed for the duration of the run, and
+        // are provided as a template parameter to Exec to allow the compiler
+        // to remove the corresponding tests from the inner tracking loop.
+        // Exec<Method>::run() selects the appropriate instantiation once the
+        // tracking parameters are known.
+        enum exec_feature_t {
+          EXEC_ACT       = 0x01, // anatomically-constrained tractography
+          EXEC_BACKTRACK = 0x02, // ACT with backtracking
+          EXEC_RK4       = 0x04, // 4th-order Runge-Kutta integration
+          EXEC_ROI       = 0x08  // mask, exclude or include regions, or -stop
+        };
+
 
-        template <class Method> class Exec {
+        template <class Method, int Features = 0> class Exec {
 
           public:
 
@@ -62,8 +74,10 @@ namespace MR
 
                 typename Method::Shared shared (diff_path, properties);
                 WriteKernel writer (shared, destination, properties);
-                Exec<Method> tracker (shared);
-                Thread::run_queue (Thread::multi (tracker), Thread::batch (GeneratedTrack(), TRACKING_BATCH_SIZE), writer);
+                StaticLauncher launcher (shared, writer);
+                Timer timer;
+                dispatch (shared, launcher);
+                shared.set_tracking_time (timer.elapsed());
 
               } else {
 
@@ -73,7 +87,6 @@ namespace MR
                   throw Exception ("Dynamic seeding requires setting the desired number of tracks using the -number option");
                 const size_t num_tracks = to<size_t>(max_num_tracks);
 
-                typedef Mapping::SetDixel SetDixel;
                 typedef Mapping::TrackMapperBase TckMapper;
                 typedef Seeding::WriteKernelDynamic Writer;
 
@@ -85,21 +98,16 @@ namespace MR
 
                 typename Method::Shared shared (diff_path, properties);
 
-                Writer       writer  (shared, destination, properties);
-                Exec<Method> tracker (shared);
+                Writer writer (shared, destination, properties);
 
                 TckMapper mapper (fod_data, dirs);
                 mapper.set_upsample_ratio (Mapping::determine_upsample_ratio (fod_data, properties, 0.25));
                 mapper.set_use_precise_mapping (true);
 
-                Thread::run_queue (
-                    Thread::multi (tracker), 
-                    Thread::batch (GeneratedTrack(), TRACKING_BATCH_SIZE),
-                    writer, 
-                    Thread::batch (Streamline<>(), TRACKING_BATCH_SIZE),
-                    Thread::multi (mapper), 
-                    Thread::batch (SetDixel(), TRACKING_BATCH_SIZE),
-                    *seeder);
+                DynamicLauncher launcher (shared, writer, mapper, *seeder);
+                Timer timer;
+                dispatch (shared, launcher);
+                shared.set_tracking_time (timer.elapsed());
 
               }
 
@@ -111,7 +119,12 @@ namespace MR
               S (shared),
               method (shared),
               track_excluded (false),
-              track_included (S.properties.include.size(), false) { }
+              track_included (S.properties.include.size(), false),
+              num_steps (0) { }
+
+            ~Exec () {
+              S.add_steps (num_steps);
+            }
 
 
             bool operator() (GeneratedTrack& item) {
@@ -127,40 +140,117 @@ namespace MR
 
           private:
 
+            static constexpr bool act = Features & EXEC_ACT;
+            static constexpr bool backtrack = Features & EXEC_BACKTRACK;
+            static constexpr bool rk4 = Features & EXEC_RK4;
+            static constexpr bool roi = Features & EXEC_ROI;
+
             const typename Method::Shared& S;
             Math::RNG thread_local_RNG;
             Method method;
             bool track_excluded;
             std::vector<bool> track_included;
+            size_t num_steps;
+
+
+
+            // functors to launch the tracking pipeline for a given set of features:
+            class StaticLauncher {
+              public:
+                StaticLauncher (const typename Method::Shared& shared, WriteKernel& writer) :
+                  shared (shared), writer (writer) { }
+                template <int F> void execute () {
+                  Exec<Method,F> tracker (shared);
+                  Thread::run_queue (Thread::multi (tracker), Thread::batch (GeneratedTrack(), TRACKING_BATCH_SIZE), writer);
+                }
+              private:
+                const typename Method::Shared& shared;
+                WriteKernel& writer;
+            };
+
+            class DynamicLauncher {
+              public:
+                DynamicLauncher (const typename Method::Shared& shared, Seeding::WriteKernelDynamic& writer, 
+                    Mapping::TrackMapperBase& mapper, Seeding::Dynamic& seeder) :
+                  shared (shared), writer (writer), mapper (mapper), seeder (seeder) { }
+                template <int F> void execute () {
+                  Exec<Method,F> tracker (shared);
+                  Thread::run_queue (
+                      Thread::multi (tracker), 
+                      Thread::batch (GeneratedTrack(), TRACKING_BATCH_SIZE),
+                      writer, 
+                      Thread::batch (Streamline<>(), TRACKING_BATCH_SIZE),
+                      Thread::multi (mapper), 
+                      Thread::batch (Mapping::SetDixel(), TRACKING_BATCH_SIZE),
+                      seeder);
+                }
+              private:
+                const typename Method::Shared& shared;
+                Seeding::WriteKernelDynamic& writer;
+                Mapping::TrackMapperBase& mapper;
+                Seeding::Dynamic& seeder;
+            };
+
+
+            template <class Launcher>
+              static void dispatch (const typename Method::Shared& shared, Launcher& launcher)
+              {
+                const bool use_roi = shared.properties.mask.size() || shared.properties.exclude.size() || 
+                    shared.properties.include.size() || shared.stop_on_all_include;
+                int features = (shared.rk4 ? EXEC_RK4 : 0) | (use_roi ? EXEC_ROI : 0);
+                if (shared.is_act())
+                  features |= shared.act().backtrack() ? EXEC_ACT | EXEC_BACKTRACK : EXEC_ACT;
+
+                switch (features) {
+                  case 0:                                            launcher.template execute<0>(); break;
+                  case EXEC_ROI:                                     launcher.template execute<EXEC_ROI>(); break;
+                  case EXEC_RK4:                                     launcher.template execute<EXEC_RK4>(); break;
+                  case EXEC_RK4 | EXEC_ROI:                          launcher.template execute<EXEC_RK4 | EXEC_ROI>(); break;
+                  case EXEC_ACT:                                     launcher.template execute<EXEC_ACT>(); break;
+                  case EXEC_ACT | EXEC_ROI:                          launcher.template execute<EXEC_ACT | EXEC_ROI>(); break;
+                  case EXEC_ACT | EXEC_RK4:                          launcher.template execute<EXEC_ACT | EXEC_RK4>(); break;
+                  case EXEC_ACT | EXEC_RK4 | EXEC_ROI:               launcher.template execute<EXEC_ACT | EXEC_RK4 | EXEC_ROI>(); break;
+                  case EXEC_ACT | EXEC_BACKTRACK:                    launcher.template execute<EXEC_ACT | EXEC_BACKTRACK>(); break;
+                  case EXEC_ACT | EXEC_BACKTRACK | EXEC_ROI:         launcher.template execute<EXEC_ACT | EXEC_BACKTRACK | EXEC_ROI>(); break;
+                  case EXEC_ACT | EXEC_BACKTRACK | EXEC_RK4:         launcher.template execute<EXEC_ACT | EXEC_BACKTRACK | EXEC_RK4>(); break;
+                  case EXEC_ACT | EXEC_BACKTRACK | EXEC_RK4 | EXEC_ROI: launcher.template execute<EXEC_ACT | EXEC_BACKTRACK | EXEC_RK4 | EXEC_ROI>(); break;
+                  default: assert (0);
+                }
+              }
+
 
 
             term_t iterate ()
             {
 
-              const term_t method_term = (S.rk4 ? next_rk4() : method.next());
+              const term_t method_term = (rk4 ? next_rk4() : method.next());
 
               if (method_term)
-                return (S.is_act() && method.act().sgm_depth) ? TERM_IN_SGM : method_term;
+                return (act && method.act().sgm_depth) ? TERM_IN_SGM : method_term;
 
-              if (S.is_act()) {
+              if (act) {
                 const term_t structural_term = method.act().check_structural (method.pos);
                 if (structural_term)
                   return structural_term;
               }
 
-              if (S.properties.mask.size() && !S.properties.mask.contains (method.pos))
-                return EXIT_MASK;
+              if (roi) {
+
+                if (S.properties.mask.size() && !S.properties.mask.contains (method.pos))
+                  return EXIT_MASK;
 
-              if (S.properties.exclude.contains (method.pos))
-                return ENTER_EXCLUDE;
+                if (S.properties.exclude.contains (method.pos))
+                  return ENTER_EXCLUDE;
 
-              // If backtracking is not enabled, add streamline to include regions as it is generated
-              // If it is enabled, this check can only be performed after the streamline is completed
-              if (!(S.is_act() && S.act().backtrack()))
-                S.properties.include.contains (method.pos, track_included);
+                // If backtracking is not enabled, add streamline to include regions as it is generated
+                // If it is enabled, this check can only be performed after the streamline is completed
+                if (!backtrack)
+                  S.properties.include.contains (method.pos, track_included);
 
-              if (S.stop_on_all_include && traversed_all_include_regions())
-                return TRAVERSE_ALL_INCLUDE;
+                if (S.stop_on_all_include && traversed_all_include_regions())
+                  return TRAVERSE_ALL_INCLUDE;
+
+              }
 
               return CONTINUE;
 
@@ -198,7 +288,7 @@ namespace MR
 
               }
 
-              if (S.is_act() && !unidirectional)
+              if (act && !unidirectional)
                 unidirectional = method.act().seed_is_unidirectional (method.pos, method.dir);
 
               S.properties.include.contains (method.pos, track_included);
@@ -228,7 +318,7 @@ namespace MR
 
               term_t termination = CONTINUE;
 
-              if (S.is_act() && S.act().backtrack()) {
+              if (backtrack) {
 
                 size_t revert_step = 1;
                 size_t max_size_at_backtrack = tck.size();
@@ -236,6 +326,7 @@ namespace MR
 
                 do {
                   termination = iterate();
+                  ++num_steps;
                   if (term_add_to_tck[termination])
                     tck.push_back (method.pos);
                   if (termination) {
@@ -266,6 +357,7 @@ namespace MR
 
                 do {
                   termination = iterate();
+                  ++num_steps;
                   if (term_add_to_tck[termination])
                     tck.push_back (method.pos);
                   if (!termination && tck.size() >= S.max_num_points)
@@ -297,7 +389,7 @@ namespace MR
                 }
               }
 
-              if (S.is_act() && (termination == ENTER_CGM) && S.act().crop_at_gmwmi())
+              if (act && (termination == ENTER_CGM) && S.act().crop_at_gmwmi())
                 S.act().crop_at_gmwmi (tck);
 
 #ifdef DEBUG_TERMINATIONS
@@ -313,7 +405,7 @@ namespace MR
             void apply_priors (term_t& termination)
             {
 
-              if (S.is_act()) {
+              if (act) {
 
                 switch (termination) {
 
@@ -378,14 +470,14 @@ namespace MR
                 return true;
               }
 
-              if (S.is_act()) {
+              if (act) {
 
                 if (!satisfy_wm_requirement (tck)) {
                   S.add_rejection (ACT_FAILED_WM_REQUIREMENT);
                   return true;
                 }
 
-                if (S.act().backtrack()) {
+                if (backtrack) {
                   for (const auto& i : tck) 
                     S.properties.include.contains (i, track_included);
                 }
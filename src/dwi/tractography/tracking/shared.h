@@ -17,6 +17,7 @@
 #define __dwi_tractography_tracking_shared_h__
 
 #include <vector>
+#include <atomic>
 
 #include "header.h"
 #include "image.h"
@@ -71,7 +72,9 @@ namespace MR
               rk4 (false),
               stop_on_all_include (false),
               implicit_max_num_attempts (properties.find ("max_num_attempts") == properties.end()),
-              downsampler ()
+              downsampler (),
+              num_steps (0),
+              tracking_time (0.0)
 #ifdef DEBUG_TERMINATIONS
             , debug_header (Header::open (properties.find ("act") == properties.end() ? diff_path : properties["act"])),
               transform (debug_header)
@@ -193,6 +196,10 @@ namespace MR
                   INFO ("  " + reject_type + ": " + str (rejections[i]));
               }
 
+              if (tracking_time > 0.0)
+                INFO ("Total number of tracking steps: " + str (num_steps) + " in " + str (tracking_time, 4) + " seconds ("
+                      + str (num_steps / tracking_time, 4) + " steps/s)");
+
 #ifdef DEBUG_TERMINATIONS
               for (size_t i = 0; i != TERMINATION_REASON_COUNT; ++i) {
                 delete debug_images[i];
@@ -264,6 +271,9 @@ namespace MR
             void add_termination (const term_t i)   const { ++terminations[i]; }
             void add_rejection   (const reject_t i) const { ++rejections[i]; }
 
+            void add_steps (const size_t n) const { num_steps += n; }
+            void set_tracking_time (const double seconds) { tracking_time = seconds; }
+
 
 #ifdef DEBUG_TERMINATIONS
             void add_termination (const term_t i, const Eigen::Vector3f& p) const
@@ -283,6 +293,8 @@ namespace MR
           private:
             mutable size_t terminations[TERMINATION_REASON_COUNT];
             mutable size_t rejections  [REJECTION_REASON_COUNT];
+            mutable std::atomic<uint64_t> num_steps;
+            double tracking_time;
 
             std::unique_ptr<ACT::ACT_Shared_additions> act_shared_additions;
 
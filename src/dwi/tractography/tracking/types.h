@@ -17,6 +17,9 @@
 #define __dwi_tractography_tracking_types_h__
 
 
+#include <array>
+#include <limits>
+
 #include "image.h"
 #include "interp/linear.h"
 
@@ -53,6 +56,69 @@ namespace MR
 
 
 
+        // Linear interpolation of all volumes of a 4D image at once, keeping
+        //   the values of the 8 voxels surrounding the last few cells visited,
+        //   since successive samples along a streamline (and the candidate
+        //   paths considered within a step) mostly fall within the same cells.
+        //   Interpolation then reduces to a single (vectorised) matrix-vector
+        //   product. The image must have been loaded using with_direct_io (3).
+        class CachedInterpolator : public Interpolator<Image<float>>::type {
+          public:
+            typedef Interpolator<Image<float>>::type base_type;
+
+            CachedInterpolator (const Image<float>& parent) :
+              base_type (parent),
+              next (0)
+            {
+              for (auto& entry : cache) {
+                entry.cell.fill (std::numeric_limits<ssize_t>::min());
+                entry.corners.resize (size(3), 8);
+              }
+            }
+
+            //! interpolate all volumes at the current position into \a values
+            template <class VectorType>
+              void get_values (VectorType& values)
+              {
+                const std::array<ssize_t,3> cell { { ssize_t (std::floor (P[0])), ssize_t (std::floor (P[1])), ssize_t (std::floor (P[2])) } };
+                values.noalias() = corners (cell) * factors;
+              }
+
+          private:
+            class Entry {
+              public:
+                std::array<ssize_t,3> cell;
+                Eigen::Matrix<float, Eigen::Dynamic, 8> corners;
+            };
+            std::array<Entry,8> cache;
+            size_t next;
+
+            const Eigen::Matrix<float, Eigen::Dynamic, 8>& corners (const std::array<ssize_t,3>& cell)
+            {
+              for (const auto& entry : cache)
+                if (entry.cell == cell)
+                  return entry.corners;
+
+              Entry& entry (cache[next]);
+              next = (next + 1) % cache.size();
+              entry.cell = cell;
+              size_t i = 0;
+              for (ssize_t z = 0; z < 2; ++z) {
+                index(2) = clamp (cell[2] + z, size (2));
+                for (ssize_t y = 0; y < 2; ++y) {
+                  index(1) = clamp (cell[1] + y, size (1));
+                  for (ssize_t x = 0; x < 2; ++x) {
+                    index(0) = clamp (cell[0] + x, size (0));
+                    entry.corners.col (i++) = Image<float>::row (3);
+                  }
+                }
+              }
+              return entry.corners;
+            }
+        };
+
+
+
       }
     }
   }
@@ -27,6 +27,7 @@ namespace MR
 
     const char* linear_metric_choices[] = { "diff", "ncc", nullptr };
     const char* linear_robust_estimator_choices[] = { "l1", "l2", "lp", nullptr };
+    const char* linear_sampling_choices[] = { "full", "stratified", "gradient", nullptr };
 
     // define parameters of initialisation methods used for both, rigid and affine registration
     void parse_general_init_options (Registration::Linear& registration) {
@@ -176,6 +177,16 @@ namespace MR
                                   "Default: l2")
         + Argument ("type").type_choice (linear_robust_estimator_choices)
 
+      + Option ("rigid_sampling", "the set of midway image voxels over which the metric is evaluated. Valid choices are: "
+                                  "full (all voxels), "
+                                  "stratified (a fixed random subset, drawn uniformly within blocks of 4x4x4 voxels), "
+                                  "gradient (a fixed random subset, drawn preferentially where the image gradient magnitude is high). "
+                                  "Default: full")
+        + Argument ("type").type_choice (linear_sampling_choices)
+
+      + Option ("rigid_sampling.density", "the fraction of voxels to sample for stratified or gradient sampling. (Default: 0.1)")
+        + Argument ("value").type_float (0.0001, 1.0)
+
       // + Option ("rigid_loop_density", "density of gradient descent 1 (batch) to 0.0 (max stochastic) (Default: 1.0)")
       //   + Argument ("num").type_sequence_float () // TODO
 
@@ -244,6 +255,16 @@ namespace MR
                                   "Default: l2")
         + Argument ("type").type_choice (linear_robust_estimator_choices)
 
+      + Option ("affine_sampling", "the set of midway image voxels over which the metric is evaluated. Valid choices are: "
+                                  "full (all voxels), "
+                                  "stratified (a fixed random subset, drawn uniformly within blocks of 4x4x4 voxels), "
+                                  "gradient (a fixed random subset, drawn preferentially where the image gradient magnitude is high). "
+                                  "Default: full")
+        + Argument ("type").type_choice (linear_sampling_choices)
+
+      + Option ("affine_sampling.density", "the fraction of voxels to sample for stratified or gradient sampling. (Default: 0.1)")
+        + Argument ("value").type_float (0.0001, 1.0)
+
       // + Option ("affine_loop_density", "density of gradient descent 1 (batch) to 0.0 (max stochastic) (Default: 1.0)")
       //   + Argument ("num").type_sequence_float () // TODO
 
@@ -52,6 +52,7 @@ namespace MR
 
     enum LinearMetricType {Diff, NCC};
     enum LinearRobustMetricEstimatorType {L1, L2, LP, None};
+    enum LinearSamplingType {Full, Stratified, GradientWeighted};
 
     class Linear
     {
@@ -72,6 +73,8 @@ namespace MR
           init_translation_type (Transform::Init::mass),
           init_rotation_type (Transform::Init::none),
           robust_estimate (false),
+          sampling_type (Full),
+          sampling_density (0.1),
           do_reorientation (false),
           fod_lmax (3),
           //CONF option: reg_bbgd
@@ -136,6 +139,13 @@ namespace MR
           init_rotation_type = type;
         }
 
+        void set_sampling (LinearSamplingType type, default_type density) {
+          if (density <= 0.0 || density > 1.0)
+            throw Exception ("sampling density must be between 0.0 and 1.0");
+          sampling_type = type;
+          sampling_density = density;
+        }
+
         void use_robust_estimate (bool use) {
           robust_estimate = use;
         }
@@ -229,6 +239,15 @@ namespace MR
             else if (loop_density.size() != scale_factor.size())
               throw Exception ("the loop density level needs to be defined for each multi-resolution level");
 
+            if (sampling_type != Full) {
+              for (auto d : loop_density) {
+                if (d < 1.0) {
+                  WARN ("loop density is ignored when a sampling scheme other than full is used; the sampling density applies instead");
+                  break;
+                }
+              }
+            }
+
             if (init_translation_type == Transform::Init::mass)
               Transform::Init::initialise_using_image_mass (im1_image, im2_image, im1_mask, im2_mask, transform, init);
             else if (init_translation_type == Transform::Init::geometric)
@@ -321,6 +340,15 @@ namespace MR
 
               ParamType parameters (transform, im1_smoothed, im2_smoothed, midway_resized, im1_mask, im2_mask);
               parameters.loop_density = loop_density[level];
+              if (sampling_type == Stratified) {
+                INFO ("using stratified sampling, density " + str(sampling_density));
+                parameters.sample_set = std::make_shared<Metric::SampleSet> (parameters.midway_image, sampling_density);
+              }
+              else if (sampling_type == GradientWeighted) {
+                INFO ("using gradient magnitude weighted sampling, density " + str(sampling_density));
+                parameters.sample_set = std::make_shared<Metric::SampleSet> (parameters.midway_image, sampling_density,
+                    Metric::gradient_magnitude_weights (parameters));
+              }
               // if (robust_estimate)
               //   INFO ("using robust estimate");
               // parameters.robust_estimate = robust_estimate; // TODO
@@ -463,6 +491,8 @@ namespace MR
         std::streambuf* log_stream;
         Transform::Init::InitType init_translation_type, init_rotation_type;
         bool robust_estimate;
+        LinearSamplingType sampling_type;
+        default_type sampling_density;
         bool do_reorientation;
         Eigen::MatrixXd aPSF_directions;
         std::vector<int> fod_lmax;
@@ -60,10 +60,11 @@ namespace MR
           }
 
 
+          template <class UpdateFieldType>
           void operator() (const Im1ImageType& im1_image,
                            const Im2ImageType& im2_image,
-                           Image<default_type>& im1_update,
-                           Image<default_type>& im2_update) {
+                           UpdateFieldType& im1_update,
+                           UpdateFieldType& im2_update) {
 
             if (im1_image.index(0) == 0 || im1_image.index(0) == im1_image.size(0) - 1 ||
                 im1_image.index(1) == 0 || im1_image.index(1) == im1_image.size(1) - 1 ||
@@ -112,7 +113,7 @@ namespace MR
               im1_update.row(3).setZero();
               im2_update.row(3).setZero();
             } else {
-              im1_update.row(3) = speed * grad.array() / denominator;
+              im1_update.row(3) = (speed * grad.array() / denominator).template cast<typename UpdateFieldType::value_type>();
               im2_update.row(3) = -im1_update.row(3);
             }
           }
@@ -60,10 +60,11 @@ namespace MR
           }
 
 
+          template <class UpdateFieldType>
           void operator() (Im1ImageType& im1_image,
                            Im2ImageType& im2_image,
-                           Image<default_type>& im1_update,
-                           Image<default_type>& im2_update) {
+                           UpdateFieldType& im1_update,
+                           UpdateFieldType& im2_update) {
 
             if (im1_image.index(0) == 0 || im1_image.index(0) == im1_image.size(0) - 1 ||
                 im1_image.index(1) == 0 || im1_image.index(1) == im1_image.size(1) - 1 ||
@@ -122,8 +123,8 @@ namespace MR
               }
             }
             total_update = total_update / im1_image.size(3);
-            im1_update.row(3) = total_update;
-            im2_update.row(3) = -total_update;
+            im1_update.row(3) = total_update.template cast<typename UpdateFieldType::value_type>();
+            im2_update.row(3) = -total_update.template cast<typename UpdateFieldType::value_type>();
           }
 
 
@@ -174,7 +174,12 @@ namespace MR
                   Eigen::Matrix<default_type, Eigen::Dynamic, 1>& gradient,
                   const Eigen::Matrix<default_type, Eigen::Dynamic, 1>& x) {
 
-                if (params.loop_density < 1.0){
+                if (params.sample_set) {
+                  DEBUG("evaluating metric over " + str(params.sample_set->size()) + " precomputed samples");
+                  ThreadKernel<MetricType, ParamType> kernel (metric, params, cost, gradient);
+                  params.sample_set->run (kernel, params.midway_image);
+                }
+                else if (params.loop_density < 1.0){
                   DEBUG("stochastic gradient descent, density: " + str(params.loop_density));
                   if (params.robust_estimate){
                     throw Exception ("TODO robust estimate not implemented");
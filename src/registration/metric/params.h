@@ -19,6 +19,7 @@
 #include "image.h"
 #include "interp/linear.h"
 #include "interp/nearest.h"
+#include "registration/metric/sample_set.h"
 
 namespace MR
 {
@@ -122,6 +123,7 @@ namespace MR
           MR::copy_ptr<Im1MaskInterpolatorType> im1_mask_interp;
           MR::copy_ptr<Im2MaskInterpolatorType> im2_mask_interp;
           default_type loop_density;
+          std::shared_ptr<SampleSet> sample_set;
           bool robust_estimate;
           Eigen::Vector3 control_point_exent;
           Eigen::Matrix<default_type, Eigen::Dynamic, Eigen::Dynamic> control_points;
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __registration_metric_sample_set_h__
+#define __registration_metric_sample_set_h__
+
+#include <atomic>
+#include <numeric>
+#include <random>
+
+#include "header.h"
+#include "image_helpers.h"
+#include "transform.h"
+#include "thread.h"
+#include "math/rng.h"
+#include "algo/iterator.h"
+#include "algo/loop.h"
+#include "algo/threaded_loop.h"
+#include "interp/linear.h"
+
+// the edge length (in voxels) of the cubic blocks used for stratification:
+#define SAMPLE_SET_STRATUM_SIZE 4
+// the number of samples processed in one go by each thread:
+#define SAMPLE_SET_BLOCK_SIZE 4096
+
+namespace MR
+{
+  namespace Registration
+  {
+    namespace Metric
+    {
+
+      //! a fixed subset of voxels of the midway image over which to evaluate a metric
+      /*! The samples are drawn once (per multi-resolution level), so that the
+       * cost function seen by the optimiser does not change from one iteration
+       * to the next. The midway image is divided into blocks of
+       * SAMPLE_SET_STRATUM_SIZE^3 voxels, and the requested fraction of
+       * voxels is drawn from within each block: either uniformly
+       * (stratified sampling), or with a probability proportional to a
+       * per-voxel weight such as the image gradient magnitude.
+       *
+       * The voxel positions are stored as a structure of arrays, sorted
+       * along a Morton (Z-order) curve so that consecutive samples access
+       * neighbouring memory locations in the input images. */
+      class SampleSet {
+        public:
+          //! draw samples uniformly within each stratum
+          SampleSet (const Header& midway, default_type density) {
+            generate (midway, density, nullptr);
+          }
+
+          //! draw samples within each stratum with probability proportional to \a weights
+          /*! \a weights holds one non-negative value per voxel of \a midway,
+           * with the first axis varying fastest. */
+          SampleSet (const Header& midway, default_type density, const std::vector<float>& weights) {
+            assert (weights.size() == size_t (midway.size(0) * midway.size(1) * midway.size(2)));
+            generate (midway, density, &weights);
+          }
+
+          size_t size () const { return x.size(); }
+
+          //! run \a kernel over all samples, using multiple threads
+          /*! \a kernel is copied once per thread, and invoked with an
+           * Iterator positioned at each sample in turn, in the same way as
+           * by ThreadedLoop::run(). */
+          template <class KernelType>
+            void run (KernelType& kernel, const Header& midway) const {
+              std::atomic<size_t> next (0);
+              Runner<KernelType> runner = { *this, next, kernel, Iterator (midway) };
+              const size_t nthreads = std::min (Thread::number_of_threads(), (size() + SAMPLE_SET_BLOCK_SIZE - 1) / SAMPLE_SET_BLOCK_SIZE);
+              if (nthreads > 1) {
+                auto threads = Thread::run (Thread::multi (runner, nthreads), "sample set evaluation");
+                threads.wait();
+              }
+              else
+                runner.execute();
+            }
+
+          //! the voxel indices of the samples
+          std::vector<uint16_t> x, y, z;
+
+        protected:
+          template <class KernelType>
+            struct Runner {
+              const SampleSet& samples;
+              std::atomic<size_t>& next;
+              KernelType kernel;
+              Iterator iter;
+              void execute () {
+                size_t start;
+                while ((start = SAMPLE_SET_BLOCK_SIZE * next++) < samples.size()) {
+                  const size_t end = std::min (start + SAMPLE_SET_BLOCK_SIZE, samples.size());
+                  for (size_t n = start; n < end; ++n) {
+                    iter.index(0) = samples.x[n];
+                    iter.index(1) = samples.y[n];
+                    iter.index(2) = samples.z[n];
+                    kernel (iter);
+                  }
+                }
+              }
+            };
+
+          void generate (const Header& midway, default_type density, const std::vector<float>* weights) {
+            if (midway.size(0) > std::numeric_limits<uint16_t>::max() ||
+                midway.size(1) > std::numeric_limits<uint16_t>::max() ||
+                midway.size(2) > std::numeric_limits<uint16_t>::max())
+              throw Exception ("image dimensions too large for sparse sampling");
+
+            Math::RNG rng;
+            std::uniform_real_distribution<default_type> uniform;
+            std::vector<size_t> voxels;
+            std::vector<uint64_t> code;
+
+            for (ssize_t k0 = 0; k0 < midway.size(2); k0 += SAMPLE_SET_STRATUM_SIZE) {
+              for (ssize_t j0 = 0; j0 < midway.size(1); j0 += SAMPLE_SET_STRATUM_SIZE) {
+                for (ssize_t i0 = 0; i0 < midway.size(0); i0 += SAMPLE_SET_STRATUM_SIZE) {
+                  voxels.clear();
+                  for (ssize_t k = k0; k < std::min (k0 + SAMPLE_SET_STRATUM_SIZE, midway.size(2)); ++k)
+                    for (ssize_t j = j0; j < std::min (j0 + SAMPLE_SET_STRATUM_SIZE, midway.size(1)); ++j)
+                      for (ssize_t i = i0; i < std::min (i0 + SAMPLE_SET_STRATUM_SIZE, midway.size(0)); ++i)
+                        voxels.push_back (i + midway.size(0) * (j + midway.size(1) * k));
+
+                  // expected number of samples in this stratum:
+                  const default_type expected = density * voxels.size();
+                  default_type total_weight = 0.0;
+                  if (weights)
+                    for (auto v : voxels)
+                      total_weight += (*weights)[v];
+
+                  if (total_weight > 0.0) {
+                    // Poisson sampling: include each voxel with probability
+                    // proportional to its weight
+                    for (auto v : voxels) {
+                      if (uniform (rng) < expected * (*weights)[v] / total_weight)
+                        add (v, midway, code);
+                    }
+                  }
+                  else {
+                    // draw the expected number of voxels without replacement,
+                    // rounding the fractional part up or down at random:
+                    size_t num = std::floor (expected);
+                    if (uniform (rng) < expected - num)
+                      ++num;
+                    num = std::min (num, voxels.size());
+                    for (size_t n = 0; n < num; ++n) {
+                      std::uniform_int_distribution<size_t> pick (n, voxels.size() - 1);
+                      std::swap (voxels[n], voxels[pick (rng)]);
+                      add (voxels[n], midway, code);
+                    }
+                  }
+                }
+              }
+            }
+
+            // sort along Morton curve:
+            std::vector<size_t> order (code.size());
+            std::iota (order.begin(), order.end(), 0);
+            std::sort (order.begin(), order.end(), [&] (size_t a, size_t b) { return code[a] < code[b]; });
+            std::vector<uint16_t> sorted (order.size());
+            for (auto* axis : { &x, &y, &z }) {
+              for (size_t n = 0; n < order.size(); ++n)
+                sorted[n] = (*axis)[order[n]];
+              axis->swap (sorted);
+            }
+
+            DEBUG ("sample set: " + str(size()) + " samples (" + str (100.0 * size() / default_type (voxel_count (midway, 0, 3))) + "% of midway image)");
+          }
+
+          void add (size_t voxel, const Header& midway, std::vector<uint64_t>& code) {
+            const uint16_t i = voxel % midway.size(0);
+            voxel /= midway.size(0);
+            const uint16_t j = voxel % midway.size(1);
+            const uint16_t k = voxel / midway.size(1);
+            x.push_back (i);
+            y.push_back (j);
+            z.push_back (k);
+            code.push_back (spread (i) | (spread (j) << 1) | (spread (k) << 2));
+          }
+
+          // insert two zero bits between each of the 16 bits of the input:
+          static uint64_t spread (uint64_t v) {
+            v = (v | (v << 16)) & 0x0000FF0000FFULL;
+            v = (v | (v << 8))  & 0x00F00F00F00FULL;
+            v = (v | (v << 4))  & 0x0C30C30C30C3ULL;
+            v = (v | (v << 2))  & 0x249249249249ULL;
+            return v;
+          }
+      };
+
+
+
+
+      //! \cond skip
+      namespace {
+        template <class ParamType>
+          class GradientMagnitudeKernel {
+            public:
+              GradientMagnitudeKernel (const ParamType& params, std::vector<float>& weights) :
+                params (params),
+                transform (params.midway_image),
+                nx (params.midway_image.size(0)),
+                ny (params.midway_image.size(1)),
+                weights (weights),
+                im1 (params.im1_image),
+                im2 (params.im2_image) { }
+
+              void operator() (const Iterator& iter) {
+                const Eigen::Vector3 voxel (iter.index(0), iter.index(1), iter.index(2));
+                weights[iter.index(0) + nx * (iter.index(1) + ny * iter.index(2))] =
+                  gradient_magnitude (im1, voxel, false) + gradient_magnitude (im2, voxel, true);
+              }
+
+            protected:
+              const ParamType& params;
+              const MR::Transform transform;
+              const ssize_t nx, ny;
+              std::vector<float>& weights;
+              Interp::Linear<decltype(params.im1_image)> im1;
+              Interp::Linear<decltype(params.im2_image)> im2;
+
+              template <class InterpType>
+                default_type gradient_magnitude (InterpType& interp, const Eigen::Vector3& voxel, bool half_inverse) {
+                  Eigen::Vector3 grad;
+                  for (size_t axis = 0; axis < 3; ++axis) {
+                    default_type value[2];
+                    for (size_t n = 0; n < 2; ++n) {
+                      Eigen::Vector3 point (voxel);
+                      point[axis] += n ? 1.0 : -1.0;
+                      const Eigen::Vector3 midway_point = transform.voxel2scanner * point;
+                      Eigen::Vector3 image_point;
+                      if (half_inverse)
+                        params.transformation.transform_half_inverse (image_point, midway_point);
+                      else
+                        params.transformation.transform_half (image_point, midway_point);
+                      interp.scanner (image_point);
+                      if (!interp)
+                        return 0.0;
+                      value[n] = interp.value();
+                    }
+                    grad[axis] = 0.5 * (value[1] - value[0]);
+                  }
+                  return grad.norm();
+                }
+          };
+      }
+      //! \endcond
+
+
+
+      //! compute the sum of the gradient magnitudes of both images at each voxel of the midway image
+      /*! The gradients are estimated by central differences over the first
+       * volume of each image, at the current transformation. The result is
+       * suitable for use as sampling weights in SampleSet. */
+      template <class ParamType>
+        std::vector<float> gradient_magnitude_weights (const ParamType& params) {
+          std::vector<float> weights (voxel_count (params.midway_image, 0, 3), 0.0f);
+          GradientMagnitudeKernel<ParamType> kernel (params, weights);
+          ThreadedLoop (params.midway_image, 0, 3).run (kernel);
+          return weights;
+        }
+
+    }
+  }
+}
+
+#endif
@@ -51,10 +51,12 @@ namespace MR
                              "for all multi-resolution levels, or a single value for each level. (Default: 50)")
         + Argument ("num").type_sequence_int ()
 
-      + Option ("nl_update_smooth", "regularise the gradient update field with Gaussian smoothing (standard deviation in voxel units, Default 2.0 x voxel_size)")
+      + Option ("nl_update_smooth", "regularise the gradient update field with Gaussian smoothing (standard deviation in voxel units, Default 2.0 x voxel_size). "
+                                    "Values above the SmoothRecursiveThreshold config file entry (default 3 voxels) use a recursive approximation to the Gaussian.")
         + Argument ("stdev").type_float ()
 
-      + Option ("nl_disp_smooth", "regularise the displacement field with Gaussian smoothing (standard deviation in voxel units, Default 1.0 x voxel_size)")
+      + Option ("nl_disp_smooth", "regularise the displacement field with Gaussian smoothing (standard deviation in voxel units, Default 1.0 x voxel_size). "
+                                  "Values above the SmoothRecursiveThreshold config file entry (default 3 voxels) use a recursive approximation to the Gaussian.")
         + Argument ("stdev").type_float ()
 
       + Option ("nl_grad_step", "the gradient step size for non-linear registration (Default: 0.5)")
@@ -62,7 +64,10 @@ namespace MR
 
       + Option ("nl_lmax", "explicitly set the lmax to be used per scale factor in non-linear FOD registration. By default FOD registration will "
                            "use lmax 0,2,4 with default scale factors 0.25,0.5,1.0 respectively. Note that no reorientation will be performed with lmax = 0.")
-      + Argument ("num").type_sequence_int ();
+      + Argument ("num").type_sequence_int ()
+
+      + Option ("nl_float", "store and process all non-linear warp and update fields in single precision. This roughly halves the memory "
+                            "required for non-linear registration, at the cost of a small loss of precision in the estimated warps.");
 
   }
 }
@@ -40,10 +40,17 @@ namespace MR
     extern const App::OptionGroup nonlinear_options;
 
 
+    //! non-linear symmetric diffeomorphic registration
+    /*! All warp and update fields are stored and processed with
+     * FieldValueType precision. Using float roughly halves the memory
+     * footprint and bandwidth of the registration, at the expense of a
+     * negligible loss in accuracy of the final warps. */
+    template <typename FieldValueType = default_type>
     class NonLinear
     {
 
       public:
+        typedef Image<FieldValueType> FieldType;
 
         NonLinear ():
           is_initialised (false),
@@ -152,19 +159,23 @@ namespace MR
               field_header.ndim() = 4;
               field_header.size(3) = 3;
 
-              im1_to_mid_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im2_to_mid_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im1_update = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im2_update = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im1_update_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im2_update_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
+              im1_to_mid_new = std::make_shared<FieldType>(FieldType::scratch (field_header));
+              im2_to_mid_new = std::make_shared<FieldType>(FieldType::scratch (field_header));
+              im1_update = std::make_shared<FieldType>(FieldType::scratch (field_header));
+              im2_update = std::make_shared<FieldType>(FieldType::scratch (field_header));
+              im1_update_new = std::make_shared<FieldType>(FieldType::scratch (field_header));
+              im2_update_new = std::make_shared<FieldType>(FieldType::scratch (field_header));
+
+              // a single deformation field is used to warp both images in turn,
+              // since it is cheap to recompute from the displacement field:
+              FieldType deform_field = FieldType::scratch (field_header);
 
               if (!is_initialised) {
                 if (level == 0) {
-                  im1_to_mid = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-                  im2_to_mid = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-                  mid_to_im1 = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-                  mid_to_im2 = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
+                  im1_to_mid = std::make_shared<FieldType>(FieldType::scratch (field_header));
+                  im2_to_mid = std::make_shared<FieldType>(FieldType::scratch (field_header));
+                  mid_to_im1 = std::make_shared<FieldType>(FieldType::scratch (field_header));
+                  mid_to_im2 = std::make_shared<FieldType>(FieldType::scratch (field_header));
                 } else {
                   DEBUG ("Upsampling fields");
                   {
@@ -189,56 +200,26 @@ namespace MR
                   smooth_filter.set_stdev (update_smoothing_mm);
                   smooth_filter (*im1_update, *im1_update);
                   smooth_filter (*im2_update, *im2_update);
-                }
-
-                Image<default_type> im1_deform_field = Image<default_type>::scratch (field_header);
-                Image<default_type> im2_deform_field = Image<default_type>::scratch (field_header);
 
-                if (iteration > 1) {
                   DEBUG ("updating displacement field field");
                   Warp::update_displacement_scaling_and_squaring (*im1_to_mid, *im1_update, *im1_to_mid_new, grad_step_altered);
                   Warp::update_displacement_scaling_and_squaring (*im2_to_mid, *im2_update, *im2_to_mid_new, grad_step_altered);
 
                   DEBUG ("smoothing displacement field");
-                  Filter::Smooth smooth_filter (*im1_to_mid_new);
                   smooth_filter.set_stdev (disp_smoothing_mm);
                   smooth_filter.set_zero_boundary (true);
                   smooth_filter (*im1_to_mid_new, *im1_to_mid_new);
                   smooth_filter (*im2_to_mid_new, *im2_to_mid_new);
-
-                  Registration::Warp::compose_linear_displacement (im1_to_mid_linear, *im1_to_mid_new, im1_deform_field);
-                  Registration::Warp::compose_linear_displacement (im2_to_mid_linear, *im2_to_mid_new, im2_deform_field);
-                } else {
-                  Registration::Warp::compose_linear_displacement (im1_to_mid_linear, *im1_to_mid, im1_deform_field);
-                  Registration::Warp::compose_linear_displacement (im2_to_mid_linear, *im2_to_mid, im2_deform_field);
-                }
-
-                DEBUG ("warping input images");
-                {
-                  LogLevelLatch level (0);
-                  Filter::warp<Interp::Linear> (im1_smoothed, im1_warped, im1_deform_field, 0.0);
-                  Filter::warp<Interp::Linear> (im2_smoothed, im2_warped, im2_deform_field, 0.0);
-                }
-
-                if (do_reorientation && fod_lmax[level]) {
-                  DEBUG ("Reorienting FODs");
-                  Registration::Transform::reorient_warp (im1_warped, im1_deform_field, aPSF_directions);
-                  Registration::Transform::reorient_warp (im2_warped, im2_deform_field, aPSF_directions);
                 }
 
-                DEBUG ("warping mask images");
+                DEBUG ("warping input and mask images");
                 Im1MaskType im1_mask_warped;
-                if (im1_mask.valid()) {
-                  im1_mask_warped = Im1MaskType::scratch (midway_image_header_resized);
-                  LogLevelLatch level (0);
-                  Filter::warp<Interp::Linear> (im1_mask, im1_mask_warped, im1_deform_field, 0.0);
-                }
+                Registration::Warp::compose_linear_displacement (im1_to_mid_linear, iteration > 1 ? *im1_to_mid_new : *im1_to_mid, deform_field);
+                warp_image (im1_smoothed, im1_warped, im1_mask, im1_mask_warped, deform_field, midway_image_header_resized, do_reorientation && fod_lmax[level]);
+
                 Im1MaskType im2_mask_warped;
-                if (im2_mask.valid()) {
-                  im2_mask_warped = Im1MaskType::scratch (midway_image_header_resized);
-                  LogLevelLatch level (0);
-                  Filter::warp<Interp::Linear> (im2_mask, im2_mask_warped, im2_deform_field, 0.0);
-                }
+                Registration::Warp::compose_linear_displacement (im2_to_mid_linear, iteration > 1 ? *im2_to_mid_new : *im2_to_mid, deform_field);
+                warp_image (im2_smoothed, im2_warped, im2_mask, im2_mask_warped, deform_field, midway_image_header_resized, do_reorientation && fod_lmax[level]);
 
                 DEBUG ("evaluating metric and computing update field");
                 default_type cost_new = 0.0;
@@ -308,22 +289,22 @@ namespace MR
             field_header.ndim() = 4;
             field_header.size(3) = 3;
 
-            im1_to_mid = std::make_shared<Image<default_type>> (Image<default_type>::scratch (field_header));
+            im1_to_mid = std::make_shared<FieldType> (FieldType::scratch (field_header));
             input_warps.index(4) = 0;
             threaded_copy (input_warps, *im1_to_mid, 0, 4);
             Registration::Warp::deformation2displacement (*im1_to_mid, *im1_to_mid);
 
-            mid_to_im1 = std::make_shared<Image<default_type>> (Image<default_type>::scratch (field_header));
+            mid_to_im1 = std::make_shared<FieldType> (FieldType::scratch (field_header));
             input_warps.index(4) = 1;
             threaded_copy (input_warps, *mid_to_im1, 0, 4);
             Registration::Warp::deformation2displacement (*mid_to_im1, *mid_to_im1);
 
-            im2_to_mid = std::make_shared<Image<default_type>> (Image<default_type>::scratch (field_header));
+            im2_to_mid = std::make_shared<FieldType> (FieldType::scratch (field_header));
             input_warps.index(4) = 2;
             threaded_copy (input_warps, *im2_to_mid, 0, 4);
             Registration::Warp::deformation2displacement (*im2_to_mid, *im2_to_mid);
 
-            mid_to_im2 = std::make_shared<Image<default_type>> (Image<default_type>::scratch (field_header));
+            mid_to_im2 = std::make_shared<FieldType> (FieldType::scratch (field_header));
             input_warps.index(4) = 3;
             threaded_copy (input_warps, *mid_to_im2, 0, 4);
             Registration::Warp::deformation2displacement (*mid_to_im2, *mid_to_im2);
@@ -375,19 +356,19 @@ namespace MR
             fod_lmax = lmax;
           }
 
-          std::shared_ptr<Image<default_type> > get_im1_to_mid() {
+          std::shared_ptr<FieldType> get_im1_to_mid() {
             return im1_to_mid;
           }
 
-          std::shared_ptr<Image<default_type> > get_im2_to_mid() {
+          std::shared_ptr<FieldType> get_im2_to_mid() {
             return im2_to_mid;
           }
 
-          std::shared_ptr<Image<default_type> > get_mid_to_im1() {
+          std::shared_ptr<FieldType> get_mid_to_im1() {
             return mid_to_im1;
           }
 
-          std::shared_ptr<Image<default_type> > get_mid_to_im2() {
+          std::shared_ptr<FieldType> get_mid_to_im2() {
             return mid_to_im2;
           }
 
@@ -449,14 +430,32 @@ namespace MR
 
         protected:
 
-          std::shared_ptr<Image<default_type> > reslice (Image<default_type>& image, Header& header) {
-            std::shared_ptr<Image<default_type> > temp = std::make_shared<Image<default_type> > (Image<default_type>::scratch (header));
+          std::shared_ptr<FieldType> reslice (FieldType& image, Header& header) {
+            std::shared_ptr<FieldType> temp = std::make_shared<FieldType> (FieldType::scratch (header));
             Filter::reslice<Interp::Linear> (image, *temp);
             return temp;
           }
 
-          bool has_negative_jacobians (Image<default_type>& field) {
-            Adapter::Jacobian<Image<default_type> > jacobian (field);
+          template <class ImageType, class MaskType, class MaskWarpedType>
+          void warp_image (ImageType& image, Image<default_type>& image_warped, MaskType& mask, MaskWarpedType& mask_warped,
+                           FieldType& deform_field, const Header& mask_header, const bool reorient) {
+            {
+              LogLevelLatch level (0);
+              Filter::warp<Interp::Linear> (image, image_warped, deform_field, 0.0);
+            }
+            if (reorient) {
+              DEBUG ("Reorienting FODs");
+              Registration::Transform::reorient_warp (image_warped, deform_field, aPSF_directions);
+            }
+            if (mask.valid()) {
+              mask_warped = MaskWarpedType::scratch (mask_header);
+              LogLevelLatch level (0);
+              Filter::warp<Interp::Linear> (mask, mask_warped, deform_field, 0.0);
+            }
+          }
+
+          bool has_negative_jacobians (FieldType& field) {
+            Adapter::Jacobian<FieldType> jacobian (field);
             for (auto i = Loop (0,3) (jacobian); i; ++i) {
               if (jacobian.value().determinant() < 0.0)
                 return true;
@@ -481,17 +480,17 @@ namespace MR
           Header midway_image_header;
 
           // Internally the warp is stored as a displacement field to enable easy smoothing near the boundaries
-          std::shared_ptr<Image<default_type> > im1_to_mid_new;
-          std::shared_ptr<Image<default_type> > im2_to_mid_new;
-          std::shared_ptr<Image<default_type> > im1_to_mid;
-          std::shared_ptr<Image<default_type> > im2_to_mid;
-          std::shared_ptr<Image<default_type> > mid_to_im1;
-          std::shared_ptr<Image<default_type> > mid_to_im2;
-
-          std::shared_ptr<Image<default_type> > im1_update;
-          std::shared_ptr<Image<default_type> > im2_update;
-          std::shared_ptr<Image<default_type> > im1_update_new;
-          std::shared_ptr<Image<default_type> > im2_update_new;
+          std::shared_ptr<FieldType> im1_to_mid_new;
+          std::shared_ptr<FieldType> im2_to_mid_new;
+          std::shared_ptr<FieldType> im1_to_mid;
+          std::shared_ptr<FieldType> im2_to_mid;
+          std::shared_ptr<FieldType> mid_to_im1;
+          std::shared_ptr<FieldType> mid_to_im2;
+
+          std::shared_ptr<FieldType> im1_update;
+          std::shared_ptr<FieldType> im2_update;
+          std::shared_ptr<FieldType> im1_update_new;
+          std::shared_ptr<FieldType> im2_update_new;
 
     };
   }
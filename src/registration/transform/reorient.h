@@ -113,11 +113,11 @@ namespace MR
 
 
 
-      template <class FODImageType>
+      template <class FODImageType, class WarpType>
       class NonLinearKernel {
 
         public:
-          NonLinearKernel (const ssize_t n_SH, Image<default_type>& warp, const Eigen::MatrixXd& directions, const bool modulate) :
+          NonLinearKernel (const ssize_t n_SH, WarpType& warp, const Eigen::MatrixXd& directions, const bool modulate) :
                            n_SH (n_SH),
                            jacobian_adapter (warp),
                            directions (directions),
@@ -152,7 +152,7 @@ namespace MR
           }
           protected:
             const ssize_t n_SH;
-            Adapter::Jacobian<Image<default_type> > jacobian_adapter;
+            Adapter::Jacobian<WarpType> jacobian_adapter;
             const Eigen::MatrixXd& directions;
             const bool modulate;
             const Eigen::MatrixXd FOD_to_aPSF_transform;
@@ -160,29 +160,29 @@ namespace MR
       };
 
 
-      template <class FODImageType>
+      template <class FODImageType, class WarpType>
       void reorient_warp (const std::string progress_message,
                           FODImageType& fod_image,
-                          Image<default_type>& warp,
+                          WarpType& warp,
                           const Eigen::MatrixXd& directions,
                           const bool modulate = false)
       {
         assert (directions.cols() > directions.rows());
         check_dimensions (fod_image, warp, 0, 3);
         ThreadedLoop (progress_message, fod_image, 0, 3)
-            .run (NonLinearKernel<FODImageType>(fod_image.size(3), warp, directions, modulate), fod_image);
+            .run (NonLinearKernel<FODImageType, WarpType>(fod_image.size(3), warp, directions, modulate), fod_image);
       }
 
-      template <class FODImageType>
+      template <class FODImageType, class WarpType>
       void reorient_warp (FODImageType& fod_image,
-                          Image<default_type>& warp,
+                          WarpType& warp,
                           const Eigen::MatrixXd& directions,
                           const bool modulate = false)
       {
         assert (directions.cols() > directions.rows());
         check_dimensions (fod_image, warp, 0, 3);
         ThreadedLoop (fod_image, 0, 3)
-            .run (NonLinearKernel<FODImageType>(fod_image.size(3), warp, directions, modulate), fod_image);
+            .run (NonLinearKernel<FODImageType, WarpType>(fod_image.size(3), warp, directions, modulate), fod_image);
       }
 
 
@@ -42,8 +42,21 @@
 #include "registration/transform/initialiser.h"
 #include "registration/transform/rigid.h"
 #include "progressbar.h"
+#include "timer.h"
+#include "thread.h"
+#include "algo/loop.h"
+#include "algo/iterator.h"
 #include "file/config.h"
 
+// the maximum number of levels in the coarse-to-fine search:
+#define ROTATION_SEARCH_MAX_LEVELS 3
+// the minimum size (in voxels) of the midway image at the coarsest level:
+#define ROTATION_SEARCH_MIN_LEVEL_SIZE 8
+// the fraction of candidates retained from one level to the next:
+#define ROTATION_SEARCH_REDUCTION 4
+// the minimum number of candidates retained from one level to the next:
+#define ROTATION_SEARCH_MIN_RETAINED 16
+
 namespace MR
 {
   namespace Registration
@@ -132,31 +145,17 @@ namespace MR
 
               std::string what = global_search? "global" : "local";
               size_t iterations = global_search? global_search_iterations : (rot_angles.size() * local_search_directions);
-              ProgressBar progress ("performing " + what + " search for best rotation", iterations);
-              overlap_it.resize (iterations);
-              cost_it.resize (iterations);
-              trafo_it.reserve (iterations);
 
               if (!global_search) {
                 gen_uniform_rotation_axes (local_search_directions, 180.0); // full sphere
                 az_el_to_cartesian();
               }
 
-              size_t iteration (0);
-              ssize_t cnt (0);
-              Eigen::Matrix<default_type, Eigen::Dynamic, 1> gradient (local_trafo.size());
-              Eigen::VectorXd cost = Eigen::VectorXd::Zero(1,1);
-              transform_type T;
-              {
-                ParamType parameters = get_parameters ();
-                Metric::ThreadKernel<MetricType, ParamType> kernel (metric, parameters, cost, gradient, &cnt);
-                ThreadedLoop (parameters.midway_image, 0, 3).run (kernel);
-                assert (cnt > 0);
-                overlap_it[0] = cnt;
-                cost_it[0] = cost(0) / static_cast<default_type>(cnt);
-                T = parameters.transformation.get_transform();
-                trafo_it.push_back (T);
-              }
+              // generate all candidate transformations up front, the first
+              // being the initial transformation:
+              trafo_it.clear();
+              trafo_it.reserve (iterations);
+              trafo_it.push_back (local_trafo.get_transform());
 
               transform_type Tc2, To, R0;
               Tc2.setIdentity();
@@ -165,9 +164,7 @@ namespace MR
               To.translation() = offset;
               Tc2.translation() = centre - 0.5 * offset;
 
-
-              while ( ++iteration < iterations ) {
-                ++progress;
+              for (size_t iteration = 1; iteration < iterations; ++iteration) {
                 if (global_search) {
                   gen_random_quaternion ();
                 }
@@ -175,56 +172,58 @@ namespace MR
                   gen_local_quaternion ();
                 }
                 R0.linear() = quat.matrix();
-                transform_type T = Tc2 * To * R0 * Tc2.inverse();
-                local_trafo.set_transform<decltype(T)>(T);
-                ParamType parameters = get_parameters ();
-                // parameters.transformation.set_transform<decltype(T)>(T);
-                cost.fill(0);
-                cnt = 0;
-                Metric::ThreadKernel<MetricType, ParamType> kernel (metric, parameters, cost, gradient, &cnt);
-                ThreadedLoop (parameters.midway_image, 0, 3).run (kernel);
-                DEBUG ("rotation search: iteration " + str(iteration) + " cost: " + str(cost) + " cnt: " + str(cnt));
-                // write_images ( "im1_" + str(iteration) + ".mif", "im2_" + str(iteration) + ".mif");
-                overlap_it[iteration] = cnt;
-                cost_it[iteration] = cost(0) / static_cast<default_type>(cnt);
-                trafo_it.push_back (T);
+                trafo_it.push_back (Tc2 * To * R0 * Tc2.inverse());
               }
-              // if (debug) {
-              //   save_matrix(cost_it, "/tmp/cost_before.txt");
-              //   save_matrix(overlap_it, "/tmp/overlap.txt");
-              // }
-              //  best trafo := lowest cost per voxel with at least mean overlap
+
+              // coarse-to-fine: evaluate all candidates on a coarse version of
+              // the midway image, and only carry the most promising ones over
+              // to the next (finer) level:
+              std::vector<default_type> scales (1, image_scale_factor);
               {
-                auto max_ = Eigen::MatrixXd::Constant(cost_it.rows(), 1, std::numeric_limits<default_type>::max());
-                default_type mean_overlap = static_cast<default_type>(overlap_it.sum()) / static_cast<default_type>(iterations);
-                // reject solutions with less than mean overlap by setting cost to max
-                cost_it = (overlap_it.array() > mean_overlap).select(cost_it, max_);
-                std::ptrdiff_t i;
-                min_cost = cost_it.minCoeff(&i);
-                T = trafo_it[i];
-                best_trafo = T;
+                const Header midway (get_resized_header (get_midway_header (local_trafo), image_scale_factor));
+                ssize_t min_size = std::min (midway.size(0), std::min (midway.size(1), midway.size(2)));
+                while (scales.size() < ROTATION_SEARCH_MAX_LEVELS && (min_size /= 2) >= ROTATION_SEARCH_MIN_LEVEL_SIZE)
+                  scales.insert (scales.begin(), 0.5 * scales.front());
               }
-              // if (debug) {
-              //   save_matrix(cost_it, "/tmp/cost_after.txt");
-              //   Eigen::VectorXd t(2);
-              //   t(0) = cost_it(0);
-              //   t(1) = min_cost;
-              //   save_matrix(t, "/tmp/cost_mass_chosen.txt");
-              //   save_matrix(centre, "/tmp/centre.txt");
-              //   parameters.transformation.set_transform (best_trafo);
-              //   write_images ( "/tmp/im1_best.mif", "/tmp/im2_best.mif");
-              // }
+              size_t total_evaluations = 0;
+              for (size_t level = 0, n = iterations; level < scales.size(); ++level, n = num_retained (n))
+                total_evaluations += n;
+
+              ProgressBar progress ("performing " + what + " search for best rotation", total_evaluations);
+              std::vector<size_t> candidates (iterations);
+              for (size_t n = 0; n < iterations; ++n)
+                candidates[n] = n;
+
+              for (size_t level = 0; level < scales.size(); ++level) {
+                Timer timer;
+                evaluate (candidates, scales[level], progress);
+                std::vector<size_t> ranked = rank (candidates);
+                INFO ("rotation search level " + str(level) + " (scale " + str(scales[level]) + "): "
+                    + str(candidates.size()) + " candidates evaluated in " + str(timer.elapsed()) + " s");
+                if (level + 1 < scales.size()) {
+                  // retain the best candidates, in their original order:
+                  ranked.resize (num_retained (candidates.size()));
+                  std::sort (ranked.begin(), ranked.end());
+                  candidates.swap (ranked);
+                }
+                else
+                  best_trafo = trafo_it[ranked[0]];
+              }
+              min_cost = cost_it.minCoeff();
+
+              local_trafo.set_transform<transform_type> (best_trafo);
+              midway_image_header = get_midway_header (local_trafo);
               input_trafo.set_transform<transform_type> (best_trafo);
 
             };
 
           private:
-            ParamType get_parameters () {
+            Header get_midway_header (const Registration::Transform::Rigid& trafo) const {
               // create resized midway image
               std::vector<Eigen::Transform<default_type, 3, Eigen::Projective> > init_transforms;
               {
-                Eigen::Transform<default_type, 3, Eigen::Projective> init_trafo_1 = local_trafo.get_transform_half_inverse();
-                Eigen::Transform<default_type, 3, Eigen::Projective> init_trafo_2 = local_trafo.get_transform_half();
+                Eigen::Transform<default_type, 3, Eigen::Projective> init_trafo_1 = trafo.get_transform_half_inverse();
+                Eigen::Transform<default_type, 3, Eigen::Projective> init_trafo_2 = trafo.get_transform_half();
                 init_transforms.push_back (init_trafo_1);
                 init_transforms.push_back (init_trafo_2);
               }
@@ -233,15 +232,94 @@ namespace MR
               std::vector<Header> headers;
               headers.push_back (Header (im1));
               headers.push_back (Header (im2));
-              midway_image_header = compute_minimum_average_header (headers, subsample, padding, init_transforms);
+              return compute_minimum_average_header (headers, subsample, padding, init_transforms);
+            }
 
-              Filter::Resize midway_resize_filter (midway_image_header);
-              midway_resize_filter.set_scale_factor (image_scale_factor);
-              midway_resized_header = Header (midway_resize_filter);
+            static Header get_resized_header (const Header& header, default_type scale) {
+              Filter::Resize midway_resize_filter (header);
+              midway_resize_filter.set_scale_factor (scale);
+              return Header (midway_resize_filter);
+            }
+
+            // the number of candidates carried over from one level to the next:
+            static size_t num_retained (size_t num_candidates) {
+              return std::min (num_candidates, std::max<size_t> (ROTATION_SEARCH_MIN_RETAINED, num_candidates / ROTATION_SEARCH_REDUCTION));
+            }
+
+            // evaluate the cost function for each of the candidates (indices
+            // into trafo_it) on the midway image at the given scale, storing
+            // the results in cost_it & overlap_it. Each candidate is evaluated
+            // within a single thread, with different candidates evaluated
+            // concurrently:
+            void evaluate (const std::vector<size_t>& candidates, default_type scale, ProgressBar& progress) {
+              overlap_it.resize (candidates.size());
+              cost_it.resize (candidates.size());
+
+              std::atomic<size_t> next (0);
+              std::mutex mutex;
+              struct {
+                ExhaustiveRotationSearch& search;
+                const std::vector<size_t>& candidates;
+                default_type scale;
+                std::atomic<size_t>& next;
+                std::mutex& mutex;
+                ProgressBar& progress;
+                void execute () {
+                  size_t n;
+                  while ((n = next++) < candidates.size()) {
+                    transform_type T = search.trafo_it[candidates[n]];
+                    Registration::Transform::Rigid trafo;
+                    trafo.set_centre_without_transform_update (search.centre);
+                    trafo.set_translation (search.offset);
+                    trafo.set_transform<transform_type> (T);
+
+                    Header midway (get_resized_header (search.get_midway_header (trafo), scale));
+                    ParamType parameters (trafo, search.im1, search.im2, midway, search.mask1, search.mask2);
+                    parameters.loop_density = 1.0;
+
+                    Eigen::VectorXd cost = Eigen::VectorXd::Zero (1);
+                    Eigen::VectorXd gradient = Eigen::VectorXd::Zero (trafo.size());
+                    ssize_t cnt = 0;
+                    {
+                      Metric::ThreadKernel<MetricType, ParamType> kernel (search.metric, parameters, cost, gradient, &cnt);
+                      Iterator iter (parameters.midway_image);
+                      for (auto l = Loop (0, 3) (iter); l; ++l)
+                        kernel (iter);
+                    }
+                    DEBUG ("rotation search: candidate " + str(candidates[n]) + " scale: " + str(scale) + " cost: " + str(cost) + " cnt: " + str(cnt));
+                    search.overlap_it[n] = cnt;
+                    search.cost_it[n] = cost(0) / static_cast<default_type>(cnt);
+
+                    std::lock_guard<std::mutex> lock (mutex);
+                    ++progress;
+                  }
+                }
+              } evaluator = { *this, candidates, scale, next, mutex, progress };
+
+              const size_t nthreads = std::min (Thread::number_of_threads(), candidates.size());
+              if (nthreads > 1) {
+                auto threads = Thread::run (Thread::multi (evaluator, nthreads), "rotation search");
+                threads.wait();
+              }
+              else
+                evaluator.execute();
+            }
 
-              ParamType parameters (local_trafo, im1, im2, midway_resized_header, mask1, mask2);
-              parameters.loop_density = 1.0;
-              return parameters;
+            // rank the candidates most recently evaluated: lowest cost per
+            // voxel first, with candidates of less than mean overlap ranked last.
+            // Returns the indices (into trafo_it) of the candidates in order:
+            std::vector<size_t> rank (const std::vector<size_t>& candidates) {
+              auto max_ = Eigen::MatrixXd::Constant(cost_it.rows(), 1, std::numeric_limits<default_type>::max());
+              default_type mean_overlap = static_cast<default_type>(overlap_it.sum()) / static_cast<default_type>(candidates.size());
+              // reject solutions with less than mean overlap by setting cost to max
+              cost_it = (overlap_it.array() > mean_overlap).select(cost_it, max_);
+              std::vector<size_t> order (candidates.size());
+              for (size_t n = 0; n < order.size(); ++n)
+                order[n] = n;
+              std::stable_sort (order.begin(), order.end(), [&] (size_t a, size_t b) { return cost_it[a] < cost_it[b]; });
+              for (auto& n : order)
+                n = candidates[n];
+              return order;
             }
 
             // gen_random_quaternion generates random quaternion (rotation around random direction
@@ -299,7 +377,6 @@ namespace MR
               ++idx_dir;
             }
             Image<default_type> im1, im2, mask1, mask2, midway_image, midway_resized;
-            Header midway_resized_header;
             MetricType metric;
             Registration::Transform::Base& input_trafo;
             Registration::Transform::Init::LinearInitialisationParams& init_options;
@@ -38,7 +38,8 @@ namespace MR
 
             template <class InputDeformationFieldType, class OutputDeformationFieldType>
             void operator() (InputDeformationFieldType& deform_input, OutputDeformationFieldType& deform_output) {
-              deform_output.row(3) = transform * deform_input.row(3).colwise().homogeneous();
+              Eigen::Vector3 position = deform_input.row(3).template cast<default_type>();
+              deform_output.row(3) = (transform * position).template cast<typename OutputDeformationFieldType::value_type>();
             }
 
           protected:
@@ -56,7 +57,8 @@ namespace MR
             template <class DisplacementFieldType, class DeformationFieldType>
             void operator() (DisplacementFieldType& disp_input, DeformationFieldType& deform_output) {
               Eigen::Vector3 voxel (disp_input.index(0), disp_input.index(1), disp_input.index(2));
-              deform_output.row(3) = linear_transform * (image_transform.voxel2scanner * voxel + disp_input.row(3));
+              Eigen::Vector3 displacement = disp_input.row(3).template cast<default_type>();
+              deform_output.row(3) = (linear_transform * (image_transform.voxel2scanner * voxel + displacement)).template cast<typename DeformationFieldType::value_type>();
             }
 
           protected:
@@ -64,29 +66,53 @@ namespace MR
             MR::Transform image_transform;
         };
 
+        // compose two displacement fields, with the first field scaled by
+        // input_scale and the second by step, without forming either scaled
+        // field explicitly:
+        template <class FieldType>
         class ComposeDispKernel {
           public:
-            ComposeDispKernel (Image<default_type>& disp_input1, Image<default_type>& disp_input2, default_type step) :
-                               disp1_transform (disp_input1), disp2_interp (disp_input2), step (step) {}
+            ComposeDispKernel (FieldType& disp_input1, FieldType& disp_input2, default_type step, default_type input_scale = 1.0) :
+                               disp1_transform (disp_input1), disp2_interp (disp_input2), step (step), input_scale (input_scale) {}
 
-            void operator() (Image<default_type>& disp_input1, Image<default_type>& disp_output) {
+            void operator() (FieldType& disp_input1, FieldType& disp_output) {
               Eigen::Vector3 voxel ((default_type)disp_input1.index(0), (default_type)disp_input1.index(1), (default_type)disp_input1.index(2));
               Eigen::Vector3 voxel_position = disp1_transform.voxel2scanner * voxel;
-              Eigen::Vector3 original_position = voxel_position + disp_input1.row(3);
+              Eigen::Vector3 displacement1 = disp_input1.row(3).template cast<default_type>() * input_scale;
+              Eigen::Vector3 original_position = voxel_position + displacement1;
               disp2_interp.scanner (original_position);
               if (!disp2_interp) {
-                disp_output.row(3) = disp_input1.row(3);
+                disp_output.row(3) = displacement1.cast<typename FieldType::value_type>();
               } else {
-                Eigen::Vector3 displacement (disp2_interp.row(3).array() * step);
+                Eigen::Vector3 displacement (disp2_interp.row(3).template cast<default_type>() * step);
                 Eigen::Vector3 new_position = displacement + original_position;
-                disp_output.row(3) = new_position - voxel_position;
+                disp_output.row(3) = (new_position - voxel_position).cast<typename FieldType::value_type>();
               }
             }
 
           protected:
             MR::Transform disp1_transform;
-            Interp::Linear<Image<default_type> > disp2_interp;
-            default_type step;
+            Interp::Linear<FieldType> disp2_interp;
+            const default_type step, input_scale;
+        };
+
+
+        // find the largest displacement in a field, with the per-thread
+        // maxima combined on destruction:
+        class MaxNormKernel {
+          public:
+            MaxNormKernel (default_type& overall_max_norm) : max_norm (0.0), overall_max_norm (overall_max_norm) { }
+            MaxNormKernel (const MaxNormKernel& that) : max_norm (0.0), overall_max_norm (that.overall_max_norm) { }
+            ~MaxNormKernel () { overall_max_norm = std::max (overall_max_norm, max_norm); }
+
+            template <class FieldType>
+            void operator() (FieldType& field) {
+              max_norm = std::max (max_norm, default_type (field.row(3).norm()));
+            }
+
+          protected:
+            default_type max_norm;
+            default_type& overall_max_norm;
         };
 
 
@@ -100,27 +126,28 @@ namespace MR
               out_of_bounds *= NaN;
             }
 
-            void operator() (Image<default_type>& deform) {
+            template <class OutputDeformationFieldType>
+            void operator() (OutputDeformationFieldType& deform) {
               Eigen::Vector3 voxel ((default_type)deform.index(0), (default_type)deform.index(1), (default_type)deform.index(2));
               Eigen::Vector3 position = linear1 * voxel;
               deform1_interp.scanner (position);
               if (!deform1_interp) {
-                  deform.row(3) = out_of_bounds;
+                  deform.row(3) = out_of_bounds.cast<typename OutputDeformationFieldType::value_type>();
                 } else {
-                  Eigen::Vector3 position2 = deform1_interp.row(3);
+                  Eigen::Vector3 position2 = deform1_interp.row(3).template cast<default_type>();
                   deform2_interp.scanner (position2);
                   if (!deform2_interp) {
-                    deform.row(3) = out_of_bounds;
+                    deform.row(3) = out_of_bounds.cast<typename OutputDeformationFieldType::value_type>();
                   } else {
-                    Eigen::Vector3 position3 = deform2_interp.row(3);
-                    deform.row(3) = linear2 * position3;
+                    Eigen::Vector3 position3 = deform2_interp.row(3).template cast<default_type>();
+                    deform.row(3) = (linear2 * position3).template cast<typename OutputDeformationFieldType::value_type>();
                   }
                }
             }
 
           protected:
             const transform_type linear1;
-            Interp::Linear<DeformationField2Type> deform1_interp;
+            Interp::Linear<DeformationField1Type> deform1_interp;
             Interp::Linear<DeformationField2Type> deform2_interp;
             const transform_type linear2;
             Eigen::Vector3 out_of_bounds;
@@ -144,69 +171,45 @@ namespace MR
       }
 
       // Compose two displacement fields and output a displacement field. The input and output can be the same image.
-      FORCE_INLINE  void update_displacement (Image<default_type>& input, Image<default_type>& update, Image<default_type>& output, default_type step = 1.0)
+      template <class FieldType>
+      FORCE_INLINE  void update_displacement (FieldType& input, FieldType& update, FieldType& output, default_type step = 1.0, default_type input_scale = 1.0)
       {
         check_dimensions (input, output, 0, 3);
-        ThreadedLoop (input, 0, 3).run (ComposeDispKernel (input, update, step), input, output);
+        ThreadedLoop (input, 0, 3).run (ComposeDispKernel<FieldType> (input, update, step, input_scale), input, output);
       }
 
       // Compose two displacement fields and output a displacement field using scaling and squaring.  The input and output can be the same image.
-      FORCE_INLINE  void update_displacement_scaling_and_squaring (Image<default_type>& input, Image<default_type>& update, Image<default_type>& output, const default_type step = 1.0)
+      template <class FieldType>
+      FORCE_INLINE  void update_displacement_scaling_and_squaring (FieldType& input, FieldType& update, FieldType& output, const default_type step = 1.0)
       {
         check_dimensions (input, output, 0, 3);
 
         default_type max_norm = 0.0;
-        auto max_norm_func = [&max_norm](Image<default_type>& update) {
-          default_type norm = update.row(3).norm();
-          if (norm > max_norm)
-            max_norm = norm;
-        };
-        ThreadedLoop (update).run (max_norm_func, update);
+        ThreadedLoop (update, 0, 3).run (MaxNormKernel (max_norm), update);
         default_type min_vox_size = static_cast<default_type> (std::min (input.spacing(0), std::min (input.spacing(1), input.spacing(2))));
 
         // if the maximum update is larger than half a voxel, perform scaling and squaring to ensure the displacement field remains diffeomorphic
+        size_t num_squarings = 0;
+        if (max_norm * step >= min_vox_size / 2.0)
+          num_squarings = std::ceil (std::log2 ((max_norm * step) / (min_vox_size / 2.0)));
 
-        default_type scale_factor = 1.0;
-        if (max_norm * step < min_vox_size / 2.0) {
+        if (!num_squarings) {
           update_displacement (input, update, output, step);
         } else {
-          scale_factor = std::pow (2, std::ceil (std::log ((max_norm * step) / (min_vox_size / 2.0)) / std::log (2.0)));
+          // apply the step size and scale factor at once, as part of the first squaring:
+          default_type scaled_step = step / std::pow (2.0, num_squarings);
 
-          std::shared_ptr<Image<default_type>> scaled_update = std::make_shared<Image<default_type> >(Image<default_type>::scratch (update));
-          std::shared_ptr<Image<default_type>> composed = std::make_shared<Image<default_type> >(Image<default_type>::scratch (update));
-
-          // Scaling
-          default_type scaled_step = step / scale_factor; // apply the step size and scale factor at once
-          ThreadedLoop (update).run (
-                [&scaled_step](Image<default_type>& update, Image<default_type>& scaled_update) {
-                  scaled_update.row(3) = update.row(3) * scaled_step;
-                }, update, *scaled_update);
-
-//          CONSOLE ("composing " + str(std::log2 (scale_factor)) + "times");
+          FieldType scaled_update = FieldType::scratch (update);
+          FieldType composed = FieldType::scratch (update);
 
           // Squaring
-          for (size_t i = 0; i < std::log2 (scale_factor); ++i) {
-            update_displacement (*scaled_update, *scaled_update, *composed);
+          update_displacement (update, update, scaled_update, scaled_step, scaled_step);
+          for (size_t i = 1; i < num_squarings; ++i) {
+            update_displacement (scaled_update, scaled_update, composed);
             std::swap (scaled_update, composed);
           }
-//          save (*scaled_update, std::string("composed_update.mif"), false);
-//          Adapter::Jacobian<Image<default_type> > jacobian (*scaled_update);
-//          Header header (*scaled_update);
-//          header.ndim() = 3;
-//          bool is_neg = false;
-//          auto jacobian_det = Image<default_type>::scratch (header);
-//          Eigen::MatrixXd ident = Eigen::MatrixXd::Identity (3,3);
-//          for (auto i = Loop (0,3) (jacobian, jacobian_det); i; ++i) {
-//            auto jac_matrix = ident + jacobian.value();
-//            jacobian_det.value() = jac_matrix.determinant();
-//            if (jacobian_det.value() < 0.0)
-//              is_neg = true;
-//          }
-//          save (jacobian_det, std::string("jacobian.mif"), false);
-//          if (is_neg)
-//            throw Exception ("negative jacobians in update");
-
-          update_displacement (input, *scaled_update, output);
+
+          update_displacement (input, scaled_update, output);
         }
       }
 
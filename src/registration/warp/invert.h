@@ -32,23 +32,32 @@ namespace MR
       namespace {
 
 
+      // estimate the inverse of a displacement field by fixed-point
+      // iteration. The inverse is read & written either as a displacement
+      // field, or (if output_deformation is set) as a deformation field,
+      // which avoids having to convert the input field first:
+      template <class FieldType>
       class DisplacementThreadKernel {
 
         public:
-          DisplacementThreadKernel (Image<default_type> & displacement,
-                        Image<default_type> & displacement_inverse,
+          DisplacementThreadKernel (FieldType& displacement,
+                        FieldType& displacement_inverse,
                         const size_t max_iter,
-                        const default_type error_tol) :
+                        const default_type error_tol,
+                        const bool output_deformation = false) :
                           displacement (displacement),
                           transform (displacement_inverse),
                           max_iter (max_iter),
-                          error_tolerance (error_tol) {}
+                          error_tolerance (error_tol),
+                          output_deformation (output_deformation) {}
 
-          void operator() (Image<default_type>& displacement_inverse)
+          void operator() (FieldType& displacement_inverse)
           {
             Eigen::Vector3 voxel ((default_type)displacement_inverse.index(0), (default_type)displacement_inverse.index(1), (default_type)displacement_inverse.index(2));
             Eigen::Vector3 truth = transform.voxel2scanner * voxel;
-            Eigen::Vector3 current = truth + displacement_inverse.row(3);
+            Eigen::Vector3 current = displacement_inverse.row(3).template cast<default_type>();
+            if (!output_deformation)
+              current += truth;
 
             size_t iter = 0;
             default_type error = std::numeric_limits<default_type>::max();
@@ -56,7 +65,9 @@ namespace MR
               error = update (current, truth);
               ++iter;
             }
-            displacement_inverse.row(3) = current - truth;
+            if (!output_deformation)
+              current -= truth;
+            displacement_inverse.row(3) = current.cast<typename FieldType::value_type>();
           }
 
         private:
@@ -64,23 +75,25 @@ namespace MR
           default_type update (Eigen::Vector3& current, const Eigen::Vector3& truth)
           {
             displacement.scanner (current);
-            Eigen::Vector3 discrepancy = truth - (current + displacement.row(3));
+            Eigen::Vector3 discrepancy = truth - (current + displacement.row(3).template cast<default_type>());
             current += discrepancy;
             return discrepancy.dot (discrepancy);
           }
 
-          Interp::Linear<Image<default_type> > displacement;
+          Interp::Linear<FieldType> displacement;
           MR::Transform transform;
           const size_t max_iter;
           default_type error_tolerance;
+          const bool output_deformation;
       };
 
 
+        template <class FieldType>
         class DeformationThreadKernel {
 
           public:
-            DeformationThreadKernel (Image<default_type> & deform,
-                          Image<default_type> & inv_deform,
+            DeformationThreadKernel (FieldType& deform,
+                          FieldType& inv_deform,
                           const size_t max_iter,
                           const default_type error_tol) :
                             deform (deform),
@@ -88,11 +101,11 @@ namespace MR
                             max_iter (max_iter),
                             error_tolerance (error_tol) {}
 
-            void operator() (Image<default_type>& inv_deform)
+            void operator() (FieldType& inv_deform)
             {
               Eigen::Vector3 voxel ((default_type)inv_deform.index(0), (default_type)inv_deform.index(1), (default_type)inv_deform.index(2));
               Eigen::Vector3 truth = transform.voxel2scanner * voxel;
-              Eigen::Vector3 current = inv_deform.row(3);
+              Eigen::Vector3 current = inv_deform.row(3).template cast<default_type>();
 
               size_t iter = 0;
               default_type error = std::numeric_limits<default_type>::max();
@@ -100,7 +113,7 @@ namespace MR
                 error = update (current, truth);
                 ++iter;
               }
-              inv_deform.row(3) = current;
+              inv_deform.row(3) = current.cast<typename FieldType::value_type>();
             }
 
           private:
@@ -108,12 +121,12 @@ namespace MR
             default_type update (Eigen::Vector3& current, const Eigen::Vector3& truth)
             {
               deform.scanner (current);
-              Eigen::Vector3 discrepancy = truth - deform.row(3);
+              Eigen::Vector3 discrepancy = truth - deform.row(3).template cast<default_type>();
               current += discrepancy;
               return discrepancy.dot (discrepancy);
             }
 
-            Interp::Linear<Image<default_type> > deform;
+            Interp::Linear<FieldType> deform;
             MR::Transform transform;
             const size_t max_iter;
             default_type error_tolerance;
@@ -127,7 +140,8 @@ namespace MR
           /*! Estimate the inverse of a deformation field
            * Note that the output inv_warp can be passed as either a zero field or an initial estimate
            */
-          FORCE_INLINE void invert_deformation (Image<default_type>& deform_field, Image<default_type>& inv_deform_field, bool is_initialised = false, size_t max_iter = 50, default_type error_tolerance = 0.0001)
+          template <class FieldType>
+          FORCE_INLINE void invert_deformation (FieldType& deform_field, FieldType& inv_deform_field, bool is_initialised = false, size_t max_iter = 50, default_type error_tolerance = 0.0001)
           {
             check_dimensions (deform_field, inv_deform_field);
             error_tolerance *= (deform_field.spacing(0) + deform_field.spacing(1) + deform_field.spacing(2)) / 3;
@@ -136,31 +150,37 @@ namespace MR
               displacement2deformation (inv_deform_field, inv_deform_field);
 
             ThreadedLoop ("inverting warp field...", inv_deform_field, 0, 3)
-              .run (DeformationThreadKernel (deform_field, inv_deform_field, max_iter, error_tolerance), inv_deform_field);
+              .run (DeformationThreadKernel<FieldType> (deform_field, inv_deform_field, max_iter, error_tolerance), inv_deform_field);
           }
 
           /*! Estimate the inverse of a displacement field, output the inverse as a deformation field
            * Note that the output inv_warp can be passed as either a zero field or an initial estimate (as a deformation field)
            */
-          FORCE_INLINE void invert_displacement_deformation (Image<default_type>& disp, Image<default_type>& inv_deform, bool is_initialised = false, size_t max_iter = 50, default_type error_tolerance = 0.0001)
+          template <class FieldType>
+          FORCE_INLINE void invert_displacement_deformation (FieldType& disp, FieldType& inv_deform, bool is_initialised = false, size_t max_iter = 50, default_type error_tolerance = 0.0001)
           {
-            auto deform_field = Image<default_type>::scratch (disp);
-            Warp::displacement2deformation (disp, deform_field);
+            check_dimensions (disp, inv_deform);
+            error_tolerance *= (disp.spacing(0) + disp.spacing(1) + disp.spacing(2)) / 3;
 
-            invert_deformation (deform_field, inv_deform, is_initialised, max_iter, error_tolerance);
-         }
+            if (!is_initialised)
+              displacement2deformation (inv_deform, inv_deform);
+
+            ThreadedLoop ("inverting displacement field...", inv_deform, 0, 3)
+              .run (DisplacementThreadKernel<FieldType> (disp, inv_deform, max_iter, error_tolerance, true), inv_deform);
+          }
 
 
           /*! Estimate the inverse of a displacement field
            * Note that the output inv_warp can be passed as either a zero field or an initial estimate
            */
-          FORCE_INLINE void invert_displacement (Image<default_type>& disp_field, Image<default_type>& inv_disp_field, size_t max_iter = 50, default_type error_tolerance = 0.0001)
+          template <class FieldType>
+          FORCE_INLINE void invert_displacement (FieldType& disp_field, FieldType& inv_disp_field, size_t max_iter = 50, default_type error_tolerance = 0.0001)
           {
             check_dimensions (disp_field, inv_disp_field);
             error_tolerance *= (disp_field.spacing(0) + disp_field.spacing(1) + disp_field.spacing(2)) / 3;
 
             ThreadedLoop ("inverting displacement field...", inv_disp_field, 0, 3)
-              .run (DisplacementThreadKernel (disp_field, inv_disp_field, max_iter, error_tolerance), inv_disp_field);
+              .run (DisplacementThreadKernel<FieldType> (disp_field, inv_disp_field, max_iter, error_tolerance), inv_disp_field);
           }
 
 
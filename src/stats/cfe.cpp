@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+
+#include "stats/cfe.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "file/key_value.h"
+#include "file/ofstream.h"
+
+namespace MR
+{
+  namespace Stats
+  {
+    namespace CFE
+    {
+
+
+
+      namespace {
+
+        template <typename T>
+          void write_LE (File::OFStream& out, const std::vector<T>& data)
+          {
+            std::vector<T> buffer (data.size());
+            for (size_t n = 0; n < data.size(); ++n)
+              buffer[n] = ByteOrder::LE (data[n]);
+            out.write (reinterpret_cast<const char*> (buffer.data()), buffer.size() * sizeof (T));
+          }
+
+        template <typename T>
+          void read_LE (std::ifstream& in, std::vector<T>& data, size_t size)
+          {
+            data.resize (size);
+            in.read (reinterpret_cast<char*> (data.data()), size * sizeof (T));
+            for (auto& v : data)
+              v = ByteOrder::LE (v);
+          }
+
+      }
+
+
+
+      void ConnectivityMatrix::save (const std::string& path, const std::vector<uint32_t>& fixel_TDI,
+                                     const std::map<std::string, std::string>& keyval) const
+      {
+        assert (fixel_TDI.size() == size());
+        std::string header = "mrtrix fixel connectivity\n";
+        for (const auto& entry : keyval)
+          header += entry.first + ": " + entry.second + "\n";
+        header += "num_fixels: " + str (size()) + "\nnum_entries: " + str (num_entries()) + "\nfile: . ";
+        // leave room for the offset itself, and align data to 8 bytes:
+        int64_t data_offset = header.size() + 25;
+        data_offset += (8 - (data_offset % 8)) % 8;
+        header += str (data_offset) + "\nEND\n";
+        header.resize (data_offset, '\0');
+
+        File::OFStream out (path, std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write (header.c_str(), header.size());
+        write_LE (out, offsets);
+        write_LE (out, fixel_TDI);
+        write_LE (out, columns);
+        write_LE (out, values);
+        if (!out.good())
+          throw Exception ("error writing fixel connectivity file \"" + path + "\": " + strerror (errno));
+      }
+
+
+
+      void ConnectivityMatrix::load (const std::string& path, std::vector<uint32_t>& fixel_TDI,
+                                     std::map<std::string, std::string>& keyval)
+      {
+        keyval.clear();
+        size_t num_fixels = 0, num_entries = 0;
+        int64_t data_offset = -1;
+        File::KeyValue kv (path, "mrtrix fixel connectivity");
+        while (kv.next()) {
+          const std::string key = lowercase (kv.key());
+          if (key == "num_fixels")
+            num_fixels = to<size_t> (kv.value());
+          else if (key == "num_entries")
+            num_entries = to<size_t> (kv.value());
+          else if (key == "file") {
+            const auto entries = split (kv.value(), " ", true);
+            if (entries.size() != 2 || entries[0] != ".")
+              throw Exception ("invalid file specification in fixel connectivity file \"" + path + "\"");
+            data_offset = to<int64_t> (entries[1]);
+          }
+          else
+            keyval[kv.key()] = kv.value();
+        }
+        if (data_offset < 0)
+          throw Exception ("missing file specification in fixel connectivity file \"" + path + "\"");
+
+        std::ifstream in (path.c_str(), std::ios::in | std::ios::binary);
+        in.seekg (data_offset);
+        read_LE (in, offsets, num_fixels+1);
+        read_LE (in, fixel_TDI, num_fixels);
+        read_LE (in, columns, num_entries);
+        read_LE (in, values, num_entries);
+        if (!in.good())
+          throw Exception ("error reading fixel connectivity file \"" + path + "\" - file may be truncated");
+        if (offsets.front() != 0 || offsets.back() != num_entries || !std::is_sorted (offsets.begin(), offsets.end()))
+          throw Exception ("invalid row offsets in fixel connectivity file \"" + path + "\"");
+        for (const auto c : columns)
+          if (c >= num_fixels)
+            throw Exception ("invalid column index in fixel connectivity file \"" + path + "\"");
+      }
+
+
+
+
+
+
+      ConnectivityBuilder::Run ConnectivityBuilder::merge (const Run& a, const Run& b)
+      {
+        Run result;
+        result.reserve (a.size() + b.size());
+        auto i = a.begin(), j = b.begin();
+        while (i != a.end() && j != b.end()) {
+          if (i->key < j->key)
+            result.push_back (*i++);
+          else if (j->key < i->key)
+            result.push_back (*j++);
+          else {
+            result.push_back ({ i->key, i->count + j->count });
+            ++i; ++j;
+          }
+        }
+        result.insert (result.end(), i, a.end());
+        result.insert (result.end(), j, b.end());
+        return result;
+      }
+
+
+
+      void ConnectivityBuilder::add (Run&& counts)
+      {
+        Run run (std::move (counts));
+        if (run.empty())
+          return;
+        while (true) {
+          Run other;
+          {
+            std::lock_guard<std::mutex> lock (mutex);
+            auto similar = std::find_if (runs.begin(), runs.end(), [&] (const Run& r) { return r.size() <= 2 * run.size(); });
+            if (similar == runs.end()) {
+              runs.push_back (std::move (run));
+              return;
+            }
+            other = std::move (*similar);
+            runs.erase (similar);
+          }
+          // merging is done without holding the lock, so that other
+          // threads can add their own runs concurrently:
+          run = merge (other, run);
+        }
+      }
+
+
+
+      void ConnectivityBuilder::add_TDI (const std::vector<uint32_t>& TDI)
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        for (size_t n = 0; n < TDI.size(); ++n)
+          fixel_TDI[n] += TDI[n];
+      }
+
+
+
+      void ConnectivityBuilder::finalise (ConnectivityMatrix& matrix, std::vector<uint32_t>& TDI)
+      {
+        const size_t num_fixels = fixel_TDI.size();
+        size_t total = 0;
+        for (const auto& run : runs)
+          total += run.size();
+
+        matrix = ConnectivityMatrix (num_fixels);
+        matrix.columns.reserve (total);
+        matrix.values.reserve (total);
+
+        // k-way merge of the (few) runs from each thread, straight into CSR:
+        std::vector<Run::const_iterator> next;
+        for (const auto& run : runs)
+          next.push_back (run.begin());
+        uint64_t row = 0;
+        while (true) {
+          uint64_t key = std::numeric_limits<uint64_t>::max();
+          for (size_t n = 0; n < runs.size(); ++n)
+            if (next[n] != runs[n].end() && next[n]->key < key)
+              key = next[n]->key;
+          if (key == std::numeric_limits<uint64_t>::max())
+            break;
+          uint32_t count = 0;
+          for (size_t n = 0; n < runs.size(); ++n)
+            if (next[n] != runs[n].end() && next[n]->key == key)
+              count += (next[n]++)->count;
+          for (; row < (key >> 32); ++row)
+            matrix.next_row();
+          matrix.push_back (uint32_t (key), value_type (count));
+        }
+        for (; row < num_fixels; ++row)
+          matrix.next_row();
+
+        runs.clear();
+        TDI.swap (fixel_TDI);
+        fixel_TDI.clear();
+      }
+
+
+
+
+
+
+      TrackProcessor::~TrackProcessor ()
+      {
+        flush();
+        if (fixel_TDI.size())
+          builder.add_TDI (fixel_TDI);
+      }
+
+
+
+      void TrackProcessor::flush ()
+      {
+        if (pairs.empty())
+          return;
+        std::sort (pairs.begin(), pairs.end());
+        ConnectivityBuilder::Run run;
+        for (const auto key : pairs) {
+          if (run.size() && run.back().key == key)
+            ++run.back().count;
+          else
+            run.push_back ({ key, 1 });
+        }
+        pairs.clear();
+        builder.add (std::move (run));
+      }
+
+
+
+    }
+  }
+}
+
@@ -15,6 +15,10 @@
 #ifndef __stats_cfe_h__
 #define __stats_cfe_h__
 
+#include <map>
+#include <mutex>
+#include <vector>
+
 #include "math/math.h"
 #include "image.h"
 #include "dwi/tractography/mapping/mapper.h"
@@ -34,10 +38,80 @@ namespace MR
       @{ */
 
 
-      class connectivity {
+      //! fixel-fixel connectivity, stored in compressed sparse row format
+      /*! The entries of row \c n are found at positions offsets[n] to
+       * offsets[n+1] (exclusive) of \c columns and \c values, sorted by
+       * column index. */
+      class ConnectivityMatrix {
+        public:
+          ConnectivityMatrix () { }
+          ConnectivityMatrix (size_t num_fixels) : offsets (1, 0) { offsets.reserve (num_fixels+1); }
+
+          //! the number of rows (i.e. fixels)
+          size_t size () const { return offsets.size() - 1; }
+          //! the total number of non-zero entries
+          size_t num_entries () const { return columns.size(); }
+
+          //! append an entry to the last row
+          void push_back (uint32_t column, value_type value) {
+            columns.push_back (column);
+            values.push_back (value);
+          }
+          //! terminate the last row, and start a new one
+          void next_row () { offsets.push_back (columns.size()); }
+
+          //! save the matrix, along with the fixel TDI and \c keyval entries
+          void save (const std::string& path, const std::vector<uint32_t>& fixel_TDI,
+                     const std::map<std::string, std::string>& keyval) const;
+          //! load a matrix written using save(), and the corresponding fixel TDI and \c keyval entries
+          void load (const std::string& path, std::vector<uint32_t>& fixel_TDI,
+                     std::map<std::string, std::string>& keyval);
+
+          std::vector<uint64_t> offsets;
+          std::vector<uint32_t> columns;
+          std::vector<value_type> values;
+      };
+
+
+
+
+      /**
+       * Gather the fixel-fixel streamline counts computed by each
+       * TrackProcessor thread, and merge them into a single CSR matrix.
+       * Each run of counts is merged as soon as it is added with any
+       * held run of similar or smaller size (outside of the lock), so that
+       * the runs held at any one time have geometrically increasing sizes.
+       * This keeps the memory used close to that of the final matrix,
+       * rather than up to one copy per thread.
+       */
+      class ConnectivityBuilder {
         public:
-          connectivity () : value (0.0) { }
-          value_type value;
+          //! the number of streamlines shared by a pair of fixels (encoded as row * 2^32 + column)
+          class Element {
+            public:
+              uint64_t key;
+              uint32_t count;
+              bool operator< (const Element& that) const { return key < that.key; }
+          };
+          typedef std::vector<Element> Run;
+
+          ConnectivityBuilder (size_t num_fixels) : fixel_TDI (num_fixels, 0) { }
+
+          //! add a sorted run of counts, merging it with those already held
+          void add (Run&& counts);
+          //! add the fixel TDI computed by one thread
+          void add_TDI (const std::vector<uint32_t>& TDI);
+
+          //! merge the remaining runs into \c matrix, and the TDI into \c TDI
+          void finalise (ConnectivityMatrix& matrix, std::vector<uint32_t>& TDI);
+
+          //! merge the sorted runs \c a and \c b, summing the counts of elements present in both
+          static Run merge (const Run& a, const Run& b);
+
+        private:
+          std::vector<Run> runs;
+          std::vector<uint32_t> fixel_TDI;
+          std::mutex mutex;
       };
 
 
@@ -45,26 +119,38 @@ namespace MR
 
       /**
        * Process each track by converting each streamline to a set of dixels, and map these to fixels.
+       * Each thread accumulates the pairs of fixels traversed by its streamlines
+       * in a local buffer, which is periodically sorted, reduced to a
+       * list of counts, and passed on to the ConnectivityBuilder.
        */
       class TrackProcessor {
 
         public:
           TrackProcessor (Image<int32_t>& fixel_indexer,
                           const std::vector<Eigen::Matrix<value_type, 3, 1> >& fixel_directions,
-                          std::vector<uint16_t>& fixel_TDI,
-                          std::vector<std::map<int32_t, connectivity> >& connectivity_matrix,
+                          ConnectivityBuilder& builder,
                           value_type angular_threshold):
                           fixel_indexer (fixel_indexer) ,
                           fixel_directions (fixel_directions),
-                          fixel_TDI (fixel_TDI),
-                          connectivity_matrix (connectivity_matrix) {
+                          builder (builder) {
             angular_threshold_dp = cos (angular_threshold * (Math::pi/180.0));
           }
 
+          TrackProcessor (const TrackProcessor& that) :
+              fixel_indexer (that.fixel_indexer),
+              fixel_directions (that.fixel_directions),
+              builder (that.builder),
+              angular_threshold_dp (that.angular_threshold_dp) { }
+
+          ~TrackProcessor ();
+
           bool operator () (SetVoxelDir& in)
           {
+            if (fixel_TDI.empty())
+              fixel_TDI.assign (fixel_directions.size(), 0);
+
             // For each voxel tract tangent, assign to a fixel
-            std::vector<int32_t> tract_fixel_indices;
+            tract_fixel_indices.clear();
             for (SetVoxelDir::const_iterator i = in.begin(); i != in.end(); ++i) {
               assign_pos_of (*i).to (fixel_indexer);
               fixel_indexer.index(3) = 0;
@@ -92,11 +178,15 @@ namespace MR
 
             try {
               for (size_t i = 0; i < tract_fixel_indices.size(); i++) {
+                const uint64_t fixel_i = tract_fixel_indices[i];
                 for (size_t j = i + 1; j < tract_fixel_indices.size(); j++) {
-                  connectivity_matrix[tract_fixel_indices[i]][tract_fixel_indices[j]].value++;
-                  connectivity_matrix[tract_fixel_indices[j]][tract_fixel_indices[i]].value++;
+                  const uint64_t fixel_j = tract_fixel_indices[j];
+                  pairs.push_back ((fixel_i << 32) | fixel_j);
+                  pairs.push_back ((fixel_j << 32) | fixel_i);
                 }
               }
+              if (pairs.size() >= buffer_size)
+                flush();
               return true;
             } catch (...) {
               throw Exception ("Error assigning memory for CFE connectivity matrix");
@@ -104,12 +194,21 @@ namespace MR
             }
           }
 
+          //! the number of fixel pairs to accumulate before sorting & reducing them
+          static constexpr size_t buffer_size = 1 << 22;
+
         private:
           Image<int32_t> fixel_indexer;
           const std::vector<Eigen::Vector3f>& fixel_directions;
-          std::vector<uint16_t>& fixel_TDI;
-          std::vector<std::map<int32_t, connectivity> >& connectivity_matrix;
+          ConnectivityBuilder& builder;
           value_type angular_threshold_dp;
+
+          // local to each thread:
+          std::vector<int32_t> tract_fixel_indices;
+          std::vector<uint64_t> pairs;
+          std::vector<uint32_t> fixel_TDI;
+
+          void flush ();
       };
 
 
@@ -117,9 +216,9 @@ namespace MR
 
       class Enhancer {
         public:
-          Enhancer (const std::vector<std::map<int32_t, connectivity> >& connectivity_map,
+          Enhancer (const ConnectivityMatrix& connectivity_matrix,
                     const value_type dh, const value_type E, const value_type H) :
-                    connectivity_map (connectivity_map), dh (dh), E (E), H (H) { }
+                    connectivity_matrix (connectivity_matrix), dh (dh), E (E), H (H) { }
 
           value_type operator() (const value_type max_stat, const std::vector<value_type>& stats,
                                  std::vector<value_type>& enhanced_stats) const
@@ -127,13 +226,16 @@ namespace MR
             enhanced_stats.resize (stats.size());
             std::fill (enhanced_stats.begin(), enhanced_stats.end(), 0.0);
             value_type max_enhanced_stat = 0.0;
-            for (size_t fixel = 0; fixel < connectivity_map.size(); ++fixel) {
-              std::map<int32_t, connectivity>::const_iterator connected_fixel;
+            const uint32_t* const columns = connectivity_matrix.columns.data();
+            const value_type* const values = connectivity_matrix.values.data();
+            for (size_t fixel = 0; fixel < connectivity_matrix.size(); ++fixel) {
+              const uint64_t row_start = connectivity_matrix.offsets[fixel];
+              const uint64_t row_end = connectivity_matrix.offsets[fixel+1];
               for (value_type h = this->dh; h < stats[fixel]; h +=  this->dh) {
                 value_type extent = 0.0;
-                for (connected_fixel = connectivity_map[fixel].begin(); connected_fixel != connectivity_map[fixel].end(); ++connected_fixel)
-                  if (stats[connected_fixel->first] > h)
-                    extent += connected_fixel->second.value;
+                for (uint64_t n = row_start; n < row_end; ++n)
+                  if (stats[columns[n]] > h)
+                    extent += values[n];
                 enhanced_stats[fixel] += std::pow (extent, E) * std::pow (h, H);
               }
               if (enhanced_stats[fixel] > max_enhanced_stat)
@@ -144,7 +246,7 @@ namespace MR
           }
 
         protected:
-          const std::vector<std::map<int32_t, connectivity> >& connectivity_map;
+          const ConnectivityMatrix& connectivity_matrix;
           const value_type dh, E, H;
       };
 
@@ -31,14 +31,39 @@ namespace MR
 
       typedef float value_type;
 
+      //! the maximum number of permutations processed together by each thread
+      /*! Statistics calculators evaluate a whole block of permutations in a
+       * single pass through the data; larger blocks make better use of the
+       * cache, at the expense of memory for the intermediate statistics. */
+      constexpr size_t max_permutation_block_size = 16;
+
+      //! the largest block of permutations that fits within a given memory budget
+      /*! The per-permutation statistics for each block need to be held in
+       * memory by each thread; if \a memory_budget (in bytes) is non-zero, the
+       * block size is reduced as required to keep the memory used for these
+       * within the budget across all threads. */
+      inline size_t permutation_block_size (size_t num_elements, size_t memory_budget)
+      {
+        if (!memory_budget)
+          return max_permutation_block_size;
+        const size_t per_permutation = Thread::number_of_threads() * num_elements * sizeof(value_type);
+        const size_t block_size = memory_budget / std::max (per_permutation, size_t(1));
+        if (!block_size)
+          WARN ("memory budget too small to hold the statistics for a single permutation per thread; "
+                "consider increasing the budget or reducing the number of threads");
+        return std::max (size_t(1), std::min (max_permutation_block_size, block_size));
+      }
+
 
 
       class PermutationStack {
         public:
-          PermutationStack (size_t num_permutations, size_t num_samples, std::string msg, bool include_default = true) :
+          PermutationStack (size_t num_permutations, size_t num_samples, std::string msg, bool include_default = true,
+                            size_t max_block_size = max_permutation_block_size) :
             num_permutations (num_permutations),
             current_permutation (0),
-            progress (msg, num_permutations) {
+            progress (msg, num_permutations),
+            block_size (std::max (size_t(1), std::min (max_block_size, num_permutations / (4 * Thread::number_of_threads())))) {
               Math::Stats::generate_permutations (num_permutations, num_samples, permutations, include_default);
             }
 
@@ -49,6 +74,19 @@ namespace MR
               ++progress;
             return index;
           }
+
+          //! obtain the indices of the next block of permutations to process
+          /*! returns false once all permutations have been processed */
+          bool next_block (std::vector<size_t>& indices) {
+            std::lock_guard<std::mutex> lock (permutation_mutex);
+            indices.clear();
+            while (indices.size() < block_size && current_permutation < num_permutations) {
+              indices.push_back (current_permutation++);
+              ++progress;
+            }
+            return indices.size();
+          }
+
           const std::vector<size_t>& permutation (size_t index) const {
             return permutations[index];
           }
@@ -58,6 +96,7 @@ namespace MR
         protected:
           size_t current_permutation;
           ProgressBar progress;
+          const size_t block_size;
           std::vector <std::vector<size_t> > permutations;
           std::mutex permutation_mutex;
       };
@@ -75,7 +114,7 @@ namespace MR
                             perm_stack (permutation_stack), stats_calculator (stats_calculator),
                             enhancer (enhancer), global_enhanced_sum (global_enhanced_sum),
                             global_enhanced_count (global_enhanced_count), enhanced_sum (global_enhanced_sum.size(), 0.0),
-                            enhanced_count (global_enhanced_sum.size(), 0.0), stats (global_enhanced_sum.size()),
+                            enhanced_count (global_enhanced_sum.size(), 0.0),
                             enhanced_stats (global_enhanced_sum.size()), mutex (new std::mutex()) {}
 
             ~PreProcessor ()
@@ -89,18 +128,26 @@ namespace MR
 
             void execute ()
             {
-              size_t index;
-              while (( index = perm_stack.next() ) < perm_stack.num_permutations)
-                process_permutation (index);
+              std::vector<size_t> indices;
+              while (perm_stack.next_block (indices))
+                process_block (indices);
             }
 
           protected:
 
-            void process_permutation (size_t index)
+            void process_block (const std::vector<size_t>& indices)
             {
-              value_type max_stat = 0.0, min_stat = 0.0;
-              stats_calculator (perm_stack.permutation (index), stats, max_stat, min_stat);
-              enhancer (max_stat, stats, enhanced_stats);
+              labellings.clear();
+              for (auto index : indices)
+                labellings.push_back (perm_stack.permutation (index));
+              stats_calculator (labellings, stats, max_stat, min_stat);
+              for (size_t n = 0; n < indices.size(); ++n)
+                process_permutation (stats[n], max_stat[n]);
+            }
+
+            void process_permutation (const std::vector<value_type>& perm_stats, value_type perm_max_stat)
+            {
+              enhancer (perm_max_stat, perm_stats, enhanced_stats);
               for (size_t i = 0; i < enhanced_stats.size(); ++i) {
                 if (enhanced_stats[i] > 0.0) {
                   enhanced_sum[i] += enhanced_stats[i];
@@ -116,7 +163,9 @@ namespace MR
             std::vector<size_t>& global_enhanced_count;
             std::vector<double> enhanced_sum;
             std::vector<size_t> enhanced_count;
-            std::vector<value_type> stats;
+            std::vector<std::vector<size_t>> labellings;
+            std::vector<std::vector<value_type>> stats;
+            std::vector<value_type> max_stat, min_stat;
             std::vector<value_type> enhanced_stats;
             std::shared_ptr<std::mutex> mutex;
         };
@@ -136,38 +185,48 @@ namespace MR
                            perm_stack (permutation_stack), stats_calculator (stats_calculator),
                            enhancer (enhancer), empirical_enhanced_statistics (empirical_enhanced_statistics),
                            default_enhanced_statistics (default_enhanced_statistics), default_enhanced_statistics_neg (default_enhanced_statistics_neg),
-                           statistics (stats_calculator.num_elements()), enhanced_statistics (stats_calculator.num_elements()),
+                           enhanced_statistics (stats_calculator.num_elements()),
                            uncorrected_pvalue_counter (stats_calculator.num_elements(), 0),
                            perm_dist_pos (perm_dist_pos), perm_dist_neg (perm_dist_neg),
                            global_uncorrected_pvalue_counter (global_uncorrected_pvalue_counter),
-                           global_uncorrected_pvalue_counter_neg (global_uncorrected_pvalue_counter_neg) {
+                           global_uncorrected_pvalue_counter_neg (global_uncorrected_pvalue_counter_neg),
+                           mutex (new std::mutex()) {
                              if (global_uncorrected_pvalue_counter_neg)
                                uncorrected_pvalue_counter_neg.reset (new std::vector<size_t>(stats_calculator.num_elements(), 0));
               }
 
 
               ~Processor () {
+                std::lock_guard<std::mutex> lock (*mutex);
                 for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
                   global_uncorrected_pvalue_counter[i] += uncorrected_pvalue_counter[i];
                   if (global_uncorrected_pvalue_counter_neg)
-                    (*global_uncorrected_pvalue_counter_neg)[i] = (*uncorrected_pvalue_counter_neg)[i];
+                    (*global_uncorrected_pvalue_counter_neg)[i] += (*uncorrected_pvalue_counter_neg)[i];
                 }
               }
 
               void execute ()
               {
-                size_t index;
-                while (( index = perm_stack.next() ) < perm_stack.num_permutations)
-                    process_permutation (index);
+                std::vector<size_t> indices;
+                while (perm_stack.next_block (indices))
+                  process_block (indices);
               }
 
 
             protected:
 
-              void process_permutation (size_t index)
+              void process_block (const std::vector<size_t>& indices)
+              {
+                labellings.clear();
+                for (auto index : indices)
+                  labellings.push_back (perm_stack.permutation (index));
+                stats_calculator (labellings, block_statistics, block_max_stat, block_min_stat);
+                for (size_t n = 0; n < indices.size(); ++n)
+                  process_permutation (indices[n], block_statistics[n], block_max_stat[n], block_min_stat[n]);
+              }
+
+              void process_permutation (size_t index, std::vector<value_type>& statistics, value_type max_stat, value_type min_stat)
               {
-                value_type max_stat = 0.0, min_stat = 0.0;
-                stats_calculator (perm_stack.permutation (index), statistics, max_stat, min_stat);
                 perm_dist_pos(index) = enhancer (max_stat, statistics, enhanced_statistics);
 
                 if (empirical_enhanced_statistics) {
@@ -214,7 +273,9 @@ namespace MR
               std::shared_ptr<std::vector<double> > empirical_enhanced_statistics;
               const std::vector<value_type>& default_enhanced_statistics;
               const std::shared_ptr<std::vector<value_type> > default_enhanced_statistics_neg;
-              std::vector<value_type> statistics;
+              std::vector<std::vector<size_t>> labellings;
+              std::vector<std::vector<value_type>> block_statistics;
+              std::vector<value_type> block_max_stat, block_min_stat;
               std::vector<value_type> enhanced_statistics;
               std::vector<size_t> uncorrected_pvalue_counter;
               std::shared_ptr<std::vector<size_t> > uncorrected_pvalue_counter_neg;
@@ -222,18 +283,21 @@ namespace MR
               std::shared_ptr<Eigen::Matrix<value_type, Eigen::Dynamic, 1> > perm_dist_neg;
               std::vector<size_t>& global_uncorrected_pvalue_counter;
               std::shared_ptr<std::vector<size_t> > global_uncorrected_pvalue_counter_neg;
+              std::shared_ptr<std::mutex> mutex;
         };
 
 
         // Precompute the empircal test statistic for non-stationarity adjustment
         template <class StatsType, class EnhancementType>
           inline void precompute_empirical_stat (const StatsType& stats_calculator, const EnhancementType& enhancer,
-                                                 size_t num_permutations, std::vector<double>& empirical_statistic)
+                                                 size_t num_permutations, std::vector<double>& empirical_statistic,
+                                                 size_t memory_budget = 0)
           {
             std::vector<size_t> global_enhanced_count (empirical_statistic.size(), 0);
             PermutationStack preprocessor_permutations (num_permutations,
                                                         stats_calculator.num_subjects(),
-                                                        "precomputing empirical statistic for non-stationarity adjustment...", false);
+                                                        "precomputing empirical statistic for non-stationarity adjustment...", false,
+                                                        permutation_block_size (stats_calculator.num_elements(), memory_budget));
             {
               PreProcessor<StatsType, EnhancementType> preprocessor (preprocessor_permutations, stats_calculator, enhancer,
                                                                      empirical_statistic, global_enhanced_count);
@@ -291,7 +355,8 @@ namespace MR
                                         const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistic,
                                         const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
                                         Eigen::Matrix<value_type, Eigen::Dynamic, 1>& perm_dist_pos, std::shared_ptr<Eigen::Matrix<value_type, Eigen::Dynamic, 1> >& perm_dist_neg,
-                                        std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg)
+                                        std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg,
+                                        size_t memory_budget = 0)
           {
 
             std::vector<size_t> global_uncorrected_pvalue_count (stats_calculator.num_elements(), 0);
@@ -302,7 +367,8 @@ namespace MR
             {
               PermutationStack permutations (num_permutations,
                                              stats_calculator.num_subjects(),
-                                             "running " + str(num_permutations) + " permutations...");
+                                             "running " + str(num_permutations) + " permutations...", true,
+                                             permutation_block_size (stats_calculator.num_elements(), memory_budget));
 
               Processor<StatsType, EnhancementType> processor (permutations, stats_calculator, enhancer,
                                                                empirical_enhanced_statistic,
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "timer.h"
+#include "math/inverse_iteration.h"
+#include "math/lanczos.h"
+#include "math/rng.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  DESCRIPTION
+  + "benchmark the speed and accuracy of the partial eigen-decompositions used in dwidenoise against the full decomposition"
+
+  + "This generates random matrices consisting of a low-rank signal component plus "
+    "Gaussian noise, as encountered in dwidenoise, and computes the eigen-decomposition "
+    "of their Gram matrix in single precision using: the full solver; tridiagonalisation, "
+    "followed by the computation of all eigenvalues and of the signal eigenvectors only "
+    "by inverse iteration; and the truncated Lanczos solver. The Lanczos iterations are stopped once the eigenvalues "
+    "of the signal component and the largest noise eigenvalue have converged to the "
+    "tolerance specified. The average time taken by each solver is reported, along with "
+    "the maximum relative error in these eigenvalues, and in the projection of the first "
+    "column onto the signal subspace, relative to a double precision reference.";
+
+  OPTIONS
+  + Option ("size", "the number of rows and columns of the random matrices (default: 150,343).")
+    + Argument ("rows,cols").type_sequence_int()
+
+  + Option ("rank", "the rank of the signal component (default: 10).")
+    + Argument ("num").type_integer (1)
+
+  + Option ("noise", "the standard deviation of the noise, relative to the smallest signal singular value (default: 0.1).")
+    + Argument ("value").type_float (0.0)
+
+  + Option ("tolerance", "the relative tolerance on the Lanczos Ritz values (default: 1e-3).")
+    + Argument ("value").type_float (0.0, 1.0)
+
+  + Option ("trials", "the number of random matrices to process (default: 100).")
+    + Argument ("num").type_integer (1);
+}
+
+
+
+void run ()
+{
+  std::vector<int> size = { 150, 343 };
+  auto opt = get_options ("size");
+  if (opt.size()) {
+    size = parse_ints (opt[0][0]);
+    if (size.size() != 2)
+      throw Exception ("-size option expects two values");
+  }
+  const ssize_t m = size[0], n = size[1], r = std::min (m, n);
+  const ssize_t rank = get_option_value ("rank", 10);
+  const double noise = get_option_value ("noise", 0.1);
+  const double tolerance = get_option_value ("tolerance", 1.0e-3);
+  const size_t trials = get_option_value ("trials", 100);
+  if (rank >= r)
+    throw Exception ("rank of signal component must be smaller than the matrix dimensions");
+
+  Math::RNG rng (0);
+  std::normal_distribution<double> normal;
+  auto random_matrix = [&] (ssize_t rows, ssize_t cols) {
+    Eigen::MatrixXd M (rows, cols);
+    for (ssize_t j = 0; j < cols; ++j)
+      for (ssize_t i = 0; i < rows; ++i)
+        M(i,j) = normal (rng);
+    return M;
+  };
+
+  const Eigen::VectorXf start = random_matrix (r, 1).cast<float>();
+  Math::Lanczos<float> lanczos (r);
+  Eigen::Tridiagonalization<Eigen::MatrixXf> tridiagonal;
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eigenvalues;
+  // timings and errors for the full, inverse iteration and Lanczos decompositions respectively:
+  double time[3] = { 0.0, 0.0, 0.0 }, value_error[3] = { 0.0, 0.0, 0.0 }, projection_error[3] = { 0.0, 0.0, 0.0 };
+  size_t steps = 0;
+
+  auto update_errors = [&] (size_t solver, const Eigen::VectorXd& values, const Eigen::MatrixXd& vectors,
+      const Eigen::VectorXd& reference_values, const Eigen::VectorXd& reference_projection, const Eigen::VectorXd& x) {
+    // the signal eigenvalues, and the largest noise eigenvalue:
+    for (ssize_t i = 0; i <= rank; ++i)
+      value_error[solver] = std::max (value_error[solver],
+          std::abs (values[values.size()-1-i] - reference_values[r-1-i]) / reference_values[r-1-i]);
+    projection_error[solver] = std::max (projection_error[solver],
+        (vectors * (vectors.transpose() * x) - reference_projection).norm() / reference_projection.norm());
+  };
+
+  for (size_t trial = 0; trial < trials; ++trial) {
+    // signal with singular values decaying from 10 to 1, plus noise:
+    Eigen::VectorXd singular_values (rank);
+    for (ssize_t i = 0; i < rank; ++i)
+      singular_values[i] = std::pow (10.0, 1.0 - i / double (std::max (rank-1, ssize_t (1))));
+    const Eigen::MatrixXd X = random_matrix (m, rank).householderQr().householderQ() * Eigen::MatrixXd::Identity (m, rank)
+      * singular_values.asDiagonal() * (random_matrix (n, rank).householderQr().householderQ() * Eigen::MatrixXd::Identity (n, rank)).transpose()
+      * std::sqrt (double (n)) + noise * random_matrix (m, n);
+    const Eigen::MatrixXd G = m <= n ? Eigen::MatrixXd (X * X.transpose()) : Eigen::MatrixXd (X.transpose() * X);
+    const Eigen::VectorXd x = G.col (0);
+
+    // double precision reference:
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> reference (G);
+    const Eigen::MatrixXd V = reference.eigenvectors().rightCols (rank);
+    const Eigen::VectorXd projection = V * (V.transpose() * x);
+
+    // full decomposition, in single precision as in dwidenoise:
+    const Eigen::MatrixXf Gf = G.cast<float>();
+    Timer timer;
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> full (Gf);
+    time[0] += timer.elapsed();
+    update_errors (0, full.eigenvalues().cast<double>(), full.eigenvectors().rightCols (rank).cast<double>(),
+        reference.eigenvalues(), projection, x);
+
+    // eigenvalues, and signal eigenvectors by inverse iteration:
+    timer.start();
+    tridiagonal.compute (Gf);
+    eigenvalues.computeFromTridiagonal (tridiagonal.diagonal(), tridiagonal.subDiagonal(), Eigen::EigenvaluesOnly);
+    Eigen::MatrixXf Vi = Math::tridiagonal_eigenvectors (tridiagonal.diagonal(), tridiagonal.subDiagonal(),
+        eigenvalues.eigenvalues().tail (rank)).cast<float>();
+    Vi.applyOnTheLeft (tridiagonal.matrixQ());
+    time[1] += timer.elapsed();
+    update_errors (1, eigenvalues.eigenvalues().cast<double>(), Vi.cast<double>(), reference.eigenvalues(), projection, x);
+
+    // truncated decomposition:
+    timer.start();
+    lanczos.init (start);
+    lanczos.step (Gf, rank+1);
+    while (true) {
+      lanczos.solve();
+      ssize_t converged = 0;
+      while (converged <= rank && lanczos.residual (lanczos.size()-1-converged) <= tolerance * lanczos.eigenvalues()[lanczos.size()-1-converged])
+        ++converged;
+      if (converged > rank || lanczos.complete())
+        break;
+      lanczos.step (Gf, 8);
+    }
+    const Eigen::MatrixXf Vl = lanczos.eigenvectors (lanczos.size()-rank, rank);
+    time[2] += timer.elapsed();
+    steps += lanczos.size();
+    update_errors (2, lanczos.eigenvalues().cast<double>(), Vl.cast<double>(), reference.eigenvalues(), projection, x);
+  }
+
+  std::cout << "solver\ttime (ms)\teigenvalue error\tprojection error\n";
+  const char* names[] = { "full", "inverse iteration", "lanczos" };
+  for (size_t solver = 0; solver < 3; ++solver)
+    std::cout << names[solver] << "\t" << 1000.0 * time[solver] / trials << "\t"
+      << value_error[solver] << "\t" << projection_error[solver] << "\n";
+  std::cout << "mean number of Lanczos steps: " << double (steps) / trials << "\n";
+}
+
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "timer.h"
+#include "thread_queue.h"
+#include "file/config.h"
+
+using namespace MR;
+using namespace App;
+
+const char* backends[] = { "mutex", "stealing", nullptr };
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  DESCRIPTION
+  + "benchmark the throughput of the Thread::Queue backends"
+
+  + "This runs a source -> multi-threaded pipe -> sink pipeline using "
+    "Thread::run_queue(), for increasing numbers of pipe threads up to "
+    "the number of threads requested, and reports the number of items "
+    "processed per second for each of the queue backends.";
+
+  OPTIONS
+  + Option ("items", "the number of items to send through the pipeline (default: 1000000).")
+    + Argument ("num").type_integer (1)
+
+  + Option ("work", "the number of arithmetic operations to perform per item in the pipe stage (default: 100).")
+    + Argument ("num").type_integer (0)
+
+  + Option ("batch", "send items through the queues in batches of the size specified.")
+    + Argument ("size").type_integer (1)
+
+  + Option ("fixed", "disable adaptive batch sizing (only relevant with -batch).")
+
+  + Option ("backend", "only benchmark the queue backend specified (options are: mutex, stealing).")
+    + Argument ("name").type_choice (backends);
+}
+
+
+
+class Source {
+  public:
+    Source (size_t num) : count (0), num (num) { }
+    bool operator() (size_t& item) {
+      if (count >= num)
+        return false;
+      item = count++;
+      return true;
+    }
+  private:
+    size_t count;
+    const size_t num;
+};
+
+
+class Pipe {
+  public:
+    Pipe (size_t work) : work (work) { }
+    bool operator() (const size_t& in, size_t& out) {
+      size_t x = in;
+      for (size_t n = 0; n < work; ++n)
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      out = x;
+      return true;
+    }
+  private:
+    const size_t work;
+};
+
+
+class Sink {
+  public:
+    Sink (size_t& count) : count (count) { }
+    bool operator() (const size_t&) {
+      ++count;
+      return true;
+    }
+  private:
+    size_t& count;
+};
+
+
+
+template <class ItemType>
+  double items_per_second (const ItemType& item_type, size_t num_items, size_t work, size_t nthreads)
+  {
+    size_t received = 0;
+    Source source (num_items);
+    Pipe pipe (work);
+    Sink sink (received);
+
+    Timer timer;
+    Thread::run_queue (source, item_type, Thread::multi (pipe, nthreads), item_type, sink);
+    const double elapsed = timer.elapsed();
+
+    if (received != num_items)
+      throw Exception ("queue error: " + str(received) + " items received out of " + str(num_items) + " sent");
+    return num_items / elapsed;
+  }
+
+
+
+void run ()
+{
+  const size_t num_items = get_option_value ("items", 1000000);
+  const size_t work = get_option_value ("work", 100);
+  const size_t batch_size = get_option_value ("batch", 0);
+  auto opt = get_options ("backend");
+  if (get_options ("fixed").size())
+    File::Config::set_bool ("ThreadQueueAdaptiveBatching", false);
+
+  std::vector<size_t> thread_counts;
+  for (size_t n = 1; n < Thread::number_of_threads(); n *= 2)
+    thread_counts.push_back (n);
+  thread_counts.push_back (std::max (Thread::number_of_threads(), size_t(1)));
+
+  std::cout << "backend\tthreads\titems/s\n";
+  for (size_t b = 0; backends[b]; ++b) {
+    if (opt.size() && size_t (opt[0][0]) != b)
+      continue;
+    File::Config::set ("ThreadQueueBackend", backends[b]);
+    for (auto nthreads : thread_counts) {
+      const double rate = batch_size ?
+        items_per_second (Thread::batch (size_t(), batch_size), num_items, work, nthreads) :
+        items_per_second (size_t(), num_items, work, nthreads);
+      std::cout << backends[b] << "\t" << nthreads << "\t" << rate << "\n";
+    }
+  }
+}
+
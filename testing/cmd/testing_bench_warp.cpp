@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "timer.h"
+#include "image.h"
+#include "transform.h"
+#include "algo/loop.h"
+#include "algo/threaded_loop.h"
+#include "interp/linear.h"
+#include "registration/warp/compose.h"
+#include "registration/warp/invert.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  DESCRIPTION
+  + "benchmark the speed and accuracy of the warp field operations used in non-linear registration"
+
+  + "This generates a smooth synthetic displacement field and update field, "
+    "then updates the displacement by scaling and squaring and inverts the result, "
+    "as done at each iteration of mrregister's non-linear registration. This is "
+    "performed using both double and single precision fields, and the time taken "
+    "by each operation is reported, along with the inverse-consistency error of each "
+    "and the maximum difference between the single and double precision results. "
+    "An error is raised if this difference exceeds the tolerance specified.";
+
+  OPTIONS
+  + Option ("size", "the number of voxels along each axis of the synthetic fields (default: 64).")
+    + Argument ("num").type_integer (8)
+
+  + Option ("magnitude", "the maximum magnitude of the synthetic displacement, in voxels (default: 2).")
+    + Argument ("value").type_float (0.0)
+
+  + Option ("tolerance", "the maximum allowed difference between the single and double precision "
+                         "warps, in voxels (default: 0.01).")
+    + Argument ("value").type_float (0.0);
+}
+
+
+
+// smooth displacement field that vanishes at the image boundary, as
+// enforced on the displacement fields during registration:
+template <class FieldType>
+  void synthetic_field (FieldType& field, default_type magnitude, default_type phase)
+  {
+    const default_type scale = magnitude * field.spacing(0);
+    for (auto l = Loop (field, 0, 3) (field); l; ++l) {
+      default_type envelope = scale;
+      for (size_t axis = 0; axis < 3; ++axis)
+        envelope *= std::sin (Math::pi * field.index(axis) / (field.size(axis) - 1));
+      for (size_t n = 0; n < 3; ++n) {
+        field.index(3) = n;
+        const size_t axis = (n + 1) % 3;
+        field.value() = envelope * std::sin (2.0 * Math::pi * field.index(axis) / (field.size(axis) - 1) + phase * (n + 1));
+      }
+    }
+  }
+
+
+
+// root-mean-square and maximum of |inverse(x) + forward(x + inverse(x))|:
+template <class FieldType>
+  std::pair<default_type,default_type> inverse_consistency (FieldType& forward, FieldType& inverse)
+  {
+    const MR::Transform transform (inverse);
+    Interp::Linear<FieldType> interp (forward);
+    default_type sum = 0.0, max = 0.0;
+    size_t count = 0;
+    for (auto l = Loop (inverse, 0, 3) (inverse); l; ++l) {
+      const Eigen::Vector3 voxel (inverse.index(0), inverse.index(1), inverse.index(2));
+      const Eigen::Vector3 inv = inverse.row(3).template cast<default_type>();
+      interp.scanner (transform.voxel2scanner * voxel + inv);
+      if (!interp || !inv.allFinite())
+        continue;
+      const default_type error = (inv + interp.row(3).template cast<default_type>()).norm();
+      sum += error * error;
+      max = std::max (max, error);
+      ++count;
+    }
+    return { std::sqrt (sum / count), max };
+  }
+
+
+
+template <class FieldType1, class FieldType2>
+  default_type max_difference (FieldType1& a, FieldType2& b)
+  {
+    default_type max = 0.0;
+    for (auto l = Loop (a) (a, b); l; ++l)
+      max = std::max (max, std::abs (default_type (a.value()) - default_type (b.value())));
+    return max;
+  }
+
+
+
+template <typename ValueType>
+  std::pair<Image<ValueType>,Image<ValueType>> run_pipeline (const Header& header, default_type magnitude, default_type step)
+  {
+    auto disp = Image<ValueType>::scratch (header);
+    auto update = Image<ValueType>::scratch (header);
+    auto disp_new = Image<ValueType>::scratch (header);
+    auto inverse = Image<ValueType>::scratch (header);
+    synthetic_field (disp, magnitude, 0.3);
+    synthetic_field (update, magnitude, 1.1);
+
+    Timer timer;
+    Registration::Warp::update_displacement_scaling_and_squaring (disp, update, disp_new, step);
+    const double update_time = timer.elapsed();
+
+    timer.start();
+    Registration::Warp::invert_displacement (disp_new, inverse);
+    const double invert_time = timer.elapsed();
+
+    auto error = inverse_consistency (disp_new, inverse);
+    std::cout << (std::is_same<ValueType,float>::value ? "float" : "double") << "\t"
+      << update_time << "\t" << invert_time << "\t"
+      << error.first / header.spacing(0) << "\t" << error.second / header.spacing(0) << "\n";
+
+    return { disp_new, inverse };
+  }
+
+
+
+void run ()
+{
+  const size_t size = get_option_value ("size", 64);
+  const default_type magnitude = get_option_value ("magnitude", 2.0);
+  const default_type tolerance = get_option_value ("tolerance", 0.01);
+
+  Header header;
+  header.ndim() = 4;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    header.size(axis) = size;
+    header.spacing(axis) = 2.0;
+  }
+  header.size(3) = 3;
+  header.spacing(3) = 1.0;
+  header.transform().setIdentity();
+
+  std::cout << "precision\tupdate (s)\tinvert (s)\tinverse rms error (vox)\tinverse max error (vox)\n";
+  auto result_double = run_pipeline<default_type> (header, magnitude, 1.0);
+  auto result_float = run_pipeline<float> (header, magnitude, 1.0);
+
+  const default_type update_diff = max_difference (result_double.first, result_float.first) / header.spacing(0);
+  const default_type inverse_diff = max_difference (result_double.second, result_float.second) / header.spacing(0);
+  std::cout << "max difference between single & double precision: update " << update_diff
+    << ", inverse " << inverse_diff << " voxels\n";
+
+  if (update_diff > tolerance || inverse_diff > tolerance)
+    throw Exception ("difference between single and double precision warps exceeds tolerance");
+}
+